@@ -0,0 +1,96 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  MOEServer decode throughput with slot_num one-token requests
+                per step for the same layer, submitted one at a time (each
+                runs alone, in place) or all at once (gathered into one
+                forward and scattered back)
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import time
+import ctypes
+import multiprocessing as mp
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 64
+hidden_size = 2048
+intermediate_size = 1408
+stride = 16
+group_min_len = 10
+group_max_len = 1024
+gate_type = 30 # ggml_type::GGML_TYPE_BF16
+up_type = 30 # ggml_type::GGML_TYPE_BF16
+down_type = 30 # ggml_type::GGML_TYPE_BF16
+hidden_type = 30 # ggml_type::GGML_TYPE_BF16
+n_routed_experts = 6
+layer_num = 4
+slot_num = 32
+warm_up_iter = 20
+test_iter = 200
+
+def server_main(shm_name, ready):
+    CPUInfer = cpuinfer_ext.CPUInfer(64)
+    server = cpuinfer_ext.moe.MOEServer(cpuinfer_ext.moe.MOEServerConfig(shm_name, slot_num, 1, n_routed_experts, hidden_size, hidden_type))
+    projs = []
+    moes = []
+    for _ in range(layer_num):
+        gate_proj = torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.bfloat16).contiguous()
+        up_proj = torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.bfloat16).contiguous()
+        down_proj = torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.bfloat16).contiguous()
+        config = cpuinfer_ext.moe.MOEConfig(expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len, gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), gate_type, up_type, down_type, hidden_type)
+        moe = cpuinfer_ext.moe.MOE(config)
+        server.add_layer(moe)
+        projs.append((gate_proj, up_proj, down_proj))
+        moes.append(moe)
+    ready.set()
+    server.run(CPUInfer)
+
+def step(client, slots, layer, batched):
+    if batched:
+        for slot in slots:
+            client.submit(slot, layer, 1)
+        for slot in slots:
+            client.wait(slot)
+    else:
+        for slot in slots:
+            client.submit(slot, layer, 1)
+            client.wait(slot)
+
+def bench_moe_server(client, batched):
+    slots = [client.acquire() for _ in range(slot_num)]
+    for slot in slots:
+        # request contents do not matter for timing, only valid ids do
+        ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts]])
+        torch.frombuffer((ctypes.c_uint8 * (ids.numel() * 8)).from_address(client.expert_ids(slot)), dtype=torch.int64).copy_(ids.view(-1))
+    for i in range(warm_up_iter):
+        step(client, slots, i % layer_num, batched)
+    start = time.perf_counter()
+    for i in range(test_iter):
+        step(client, slots, i % layer_num, batched)
+    end = time.perf_counter()
+    total_time = end - start
+    for slot in slots:
+        client.release(slot)
+    print('batched' if batched else 'one at a time')
+    print('Time(s): ', total_time)
+    print('Iteration: ', test_iter)
+    print('Time(us) per iteration: ', total_time / test_iter * 1000000)
+    print('Tokens/s: ', slot_num * test_iter / total_time)
+    print('')
+
+if __name__ == "__main__":
+    shm_name = "ktransformers_bench_moe_server_%d" % os.getpid()
+    ctx = mp.get_context("spawn")
+    ready = ctx.Event()
+    server = ctx.Process(target=server_main, args=(shm_name, ready))
+    server.start()
+    ready.wait()
+    client = cpuinfer_ext.moe.MOEClient(shm_name)
+    bench_moe_server(client, False)
+    bench_moe_server(client, True)
+    client.shutdown()
+    server.join()
@@ -0,0 +1,107 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  Activation-sparse down_proj of MOE.forward_one: accuracy
+                against the dense path, time, and down_proj bytes read.
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 160
+hidden_size = 5120
+intermediate_size = 1536
+stride = 16
+group_min_len = 10
+group_max_len = 1024
+n_routed_experts = 6
+layer_num = 10
+qlen = 1
+CPUInfer = cpuinfer_ext.CPUInfer(64)
+warm_up_iter = 1000
+test_iter = 10000
+
+def bench_moe_sparse(quant_mode: str, threshold: float, keep: float):
+    with torch.inference_mode(mode=True):
+        hidden_type = 30 # ggml_type::GGML_TYPE_BF16
+        # real weights are needed for the accuracy numbers, so only the types
+        # torch can produce directly
+        if quant_mode == "fp16":
+            proj_type = 1 # ggml_type::GGML_TYPE_F16
+            proj_dtype = torch.float16
+            bytes_per_elem = 2.000000
+        elif quant_mode == "bf16":
+            proj_type = 30 # ggml_type::GGML_TYPE_BF16
+            proj_dtype = torch.bfloat16
+            bytes_per_elem = 2.000000
+        else:
+            assert(False)
+        gate_type = up_type = down_type = proj_type
+
+        dense_moes = []
+        sparse_moes = []
+        projs = []
+        for _ in range(layer_num):
+            # scaled so that the intermediate activations are O(1)
+            gate_proj = (torch.randn((expert_num, intermediate_size, hidden_size)) / hidden_size ** 0.5).to(proj_dtype).contiguous()
+            up_proj = (torch.randn((expert_num, intermediate_size, hidden_size)) / hidden_size ** 0.5).to(proj_dtype).contiguous()
+            down_proj = (torch.randn((expert_num, hidden_size, intermediate_size)) / intermediate_size ** 0.5).to(proj_dtype).contiguous()
+            config = cpuinfer_ext.moe.MOEConfig(expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len, gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), gate_type, up_type, down_type, hidden_type)
+            dense_moes.append(cpuinfer_ext.moe.MOE(config))
+            config.down_sparse_threshold = threshold
+            config.down_sparse_keep = keep
+            sparse_moes.append(cpuinfer_ext.moe.MOE(config))
+            projs.append((gate_proj, up_proj, down_proj))
+        expert_ids = torch.stack([torch.stack([torch.randperm(expert_num, dtype=torch.int64)[:n_routed_experts] for _ in range(qlen)]) for _ in range(layer_num)]).contiguous()
+        weights = torch.rand((layer_num, qlen, n_routed_experts), dtype=torch.float32).contiguous()
+        input = torch.randn((layer_num, qlen, hidden_size), dtype=torch.bfloat16).contiguous()
+        dense_output = torch.empty((layer_num, qlen, hidden_size), dtype=torch.bfloat16).contiguous()
+        sparse_output = torch.empty((layer_num, qlen, hidden_size), dtype=torch.bfloat16).contiguous()
+
+        def run(moes, output, iters):
+            start = time.perf_counter()
+            for i in range(iters):
+                CPUInfer.submit(
+                    moes[i % layer_num].forward(
+                        qlen,
+                        n_routed_experts,
+                        expert_ids[i % layer_num].data_ptr(),
+                        weights[i % layer_num].data_ptr(),
+                        input[i % layer_num].data_ptr(),
+                        output[i % layer_num].data_ptr()
+                    )
+                )
+                CPUInfer.sync()
+            return time.perf_counter() - start
+
+        run(dense_moes, dense_output, warm_up_iter)
+        run(sparse_moes, sparse_output, warm_up_iter)
+        for moe in sparse_moes:
+            moe.down_sparse_stats()
+        dense_time = run(dense_moes, dense_output, test_iter)
+        sparse_time = run(sparse_moes, sparse_output, test_iter)
+
+        kept, total = 0, 0
+        for moe in sparse_moes:
+            layer_kept, layer_total = moe.down_sparse_stats()
+            kept += layer_kept
+            total += layer_total
+        kept_fraction = kept / total
+        diff = torch.mean(torch.abs(sparse_output.float() - dense_output.float())) / torch.mean(torch.abs(dense_output.float()))
+        # gate and up are always read in full, down only for the kept groups
+        dense_bytes = hidden_size * intermediate_size * 3 * n_routed_experts * bytes_per_elem
+        sparse_bytes = hidden_size * intermediate_size * (2 + kept_fraction) * n_routed_experts * bytes_per_elem
+        print('Quant mode: ', quant_mode, ' threshold: ', threshold, ' keep: ', keep)
+        print('Kept down_proj groups: ', kept_fraction)
+        print('Relative error: ', diff.item())
+        print('Time(us) per iteration, dense: ', dense_time / test_iter * 1000000, ' sparse: ', sparse_time / test_iter * 1000000)
+        print('Bytes read per iteration, dense: ', dense_bytes, ' sparse: ', sparse_bytes)
+        print('Bandwidth, dense: ', dense_bytes * test_iter / dense_time / 1000 / 1000 / 1000, 'GB/s, sparse: ', sparse_bytes * test_iter / sparse_time / 1000 / 1000 / 1000, 'GB/s')
+        print('')
+
+for quant_mode in ["fp16", "bf16"]:
+    bench_moe_sparse(quant_mode, 0.01, 1.0)
+    bench_moe_sparse(quant_mode, 0.05, 1.0)
+    bench_moe_sparse(quant_mode, 0.0, 0.5)
@@ -0,0 +1,96 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  Decode latency under a concurrent prefill load, with and
+                without priority scheduling.
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 160
+hidden_size = 5120
+intermediate_size = 1536
+stride = 16
+# (group_min_len, group_max_len): token by token through forward_one, every
+# token is a preemption point; and the config KExpertsCPU ships, where
+# prefill runs forward_many on 1024-token chunks and only the chunk
+# boundaries are preemption points (forward_many needs a Release build)
+group_lens = [(8192, 8192), (10, 1024)]
+n_routed_experts = 6
+prefill_len = 4096
+CPUInfer = cpuinfer_ext.CPUInfer(64)
+warm_up_iter = 100
+test_iter = 1000
+
+def bench_priority(decode_priority: int, group_min_len: int, group_max_len: int):
+    with torch.inference_mode(mode=True):
+        hidden_type = 30 # ggml_type::GGML_TYPE_BF16
+        gate_type = 8 # ggml_type::GGML_TYPE_Q8_0
+        up_type = 8 # ggml_type::GGML_TYPE_Q8_0
+        down_type = 8 # ggml_type::GGML_TYPE_Q8_0
+
+        moes = []
+        projs = []
+        for _ in range(2):
+            gate_proj = torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32).contiguous()
+            up_proj = torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32).contiguous()
+            down_proj = torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.float32).contiguous()
+            config = cpuinfer_ext.moe.MOEConfig(expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len, gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), gate_type, up_type, down_type, hidden_type)
+            moes.append(cpuinfer_ext.moe.MOE(config))
+            projs.append((gate_proj, up_proj, down_proj))
+        prefill_moe, decode_moe = moes
+
+        def make_inputs(qlen):
+            expert_ids = torch.stack([torch.randperm(expert_num, dtype=torch.int64)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+            weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+            input = torch.randn((qlen, hidden_size), dtype=torch.bfloat16).contiguous()
+            output = torch.empty((qlen, hidden_size), dtype=torch.bfloat16).contiguous()
+            return expert_ids, weights, input, output
+
+        prefill = make_inputs(prefill_len)
+        decode = make_inputs(1)
+
+        def submit(moe, qlen, tensors, priority):
+            expert_ids, weights, input, output = tensors
+            CPUInfer.submit(
+                moe.forward(
+                    qlen,
+                    n_routed_experts,
+                    expert_ids.data_ptr(),
+                    weights.data_ptr(),
+                    input.data_ptr(),
+                    output.data_ptr()
+                ),
+                priority=priority
+            )
+
+        event = CPUInfer.create_event()
+        latencies = []
+        for i in range(warm_up_iter + test_iter):
+            # keep a prefill queued or running behind every decode step
+            if i % 64 == 0:
+                submit(prefill_moe, prefill_len, prefill, 0)
+            start = time.perf_counter()
+            submit(decode_moe, 1, decode, decode_priority)
+            CPUInfer.record_event(event, priority=decode_priority)
+            while not CPUInfer.query_event(event):
+                pass
+            if i >= warm_up_iter:
+                latencies.append(time.perf_counter() - start)
+        CPUInfer.sync()
+
+        latencies = torch.tensor(latencies) * 1000000
+        print('Decode priority: ', decode_priority)
+        print('group_min_len: ', group_min_len, 'group_max_len: ', group_max_len)
+        print('Iteration: ', test_iter)
+        print('p50 latency(us): ', torch.quantile(latencies, 0.5).item())
+        print('p99 latency(us): ', torch.quantile(latencies, 0.99).item())
+        print('')
+
+for group_min_len, group_max_len in group_lens:
+    bench_priority(0, group_min_len, group_max_len)
+    bench_priority(1, group_min_len, group_max_len)
+
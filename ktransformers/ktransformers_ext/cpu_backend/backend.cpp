@@ -122,6 +122,11 @@ void Backend::do_work_stealing_job_numa_aware(
 
         thread_state_[threads_on_each_numa_node[numa_node_id][0]].curr->store(0, std::memory_order_relaxed);
         thread_state_[threads_on_each_numa_node[numa_node_id][0]].end = base + (0 < remain);
+        // thread 0 runs its share below, the first thread of the other nodes
+        // has to be woken up like the rest
+        if (threads_on_each_numa_node[numa_node_id][0] != 0) {
+            thread_state_[threads_on_each_numa_node[numa_node_id][0]].status->store(ThreadStatus::WORKING, std::memory_order_release);
+        }
         for (int i = 1; i < n_threads_cur_numa_node; ++i) {
             thread_state_[threads_on_each_numa_node[numa_node_id][i]].curr->store(
                 thread_state_[threads_on_each_numa_node[numa_node_id][i - 1]].end,
@@ -55,6 +55,18 @@ class Backend {
     #endif
     static thread_local int thread_local_id;
 
+    // Called by operators between the jobs of a long task (e.g. the tokens
+    // or chunks of a prefill), where no job is running and no scratch
+    // buffer is live. Runs the queued tasks of higher priority first.
+    void preempt_point() {
+        if (preempt_hook_ != nullptr) {
+            preempt_hook_();
+        }
+    }
+    void set_preempt_hook(std::function<void()> hook) {
+        preempt_hook_ = hook;
+    }
+
   private:
     int thread_num_;
     int max_thread_num_;
@@ -62,6 +74,7 @@ class Backend {
     std::function<void(int)> init_func_;
     std::function<void(int)> compute_func_;
     std::function<void(int)> finalize_func_;
+    std::function<void()> preempt_hook_;
     std::vector<std::thread> workers_;
 
     void process_tasks(int);
@@ -11,10 +11,17 @@
  #define CPUINFER_CPUINFER_H
  
  #include <atomic>
+ #include <cassert>
+ #include <cstdio>
+ #include <cstdlib>
  #include <condition_variable>
+ #include <deque>
+ #include <exception>
  #include <functional>
  #include <mutex>
  #include <queue>
+ #include <stdexcept>
+ #include <string>
  #include <thread>
  #include <vector>
  #ifdef KTRANSFORMERS_USE_CUDA
@@ -31,59 +38,277 @@
  #include "../vendors/vendor.h"
  
  #include "llama.cpp/ggml-impl.h"
+ #include "llamafile/sgemm.h"
  
+ // Work is submitted to streams. Each stream has its own task queue and its
+ // own Backend, so tasks of different streams run concurrently on disjoint
+ // thread sets while tasks of one stream keep their order. Stream 0 is the
+ // default stream and gets the threads not given to the other streams.
+ // Events order work across streams: wait_event makes a stream wait until
+ // the tasks submitted to another stream before record_event are done.
+ //
+ // An operator object must not be used from two streams at once, and the
+ // operators that share shared_mem_buffer (Linear, MLP, MOE) must all stay
+ // on one stream.
  class CPUInfer {
     public:
-     CPUInfer(int thread_num) {
-         backend_ = new Backend(thread_num - 1);
+     CPUInfer(int thread_num) : CPUInfer(thread_num, std::vector<int>()) {}
+ 
+     // stream_thread_nums[i] is the thread count of stream i + 1. Throws
+     // std::invalid_argument if a stream gets no thread or fewer than 2 are
+     // left for the default stream.
+     CPUInfer(int thread_num, std::vector<int> stream_thread_nums) {
+         int default_thread_num = thread_num;
+         for (int n : stream_thread_nums) {
+             if (n <= 0) {
+                 throw std::invalid_argument(
+                     "[CPUInfer] stream thread count " + std::to_string(n) +
+                     " must be positive");
+             }
+             default_thread_num -= n;
+         }
+         if (default_thread_num < 2) {
+             throw std::invalid_argument(
+                 "[CPUInfer] " + std::to_string(default_thread_num) +
+                 " threads left for the default stream, need at least 2");
+         }
+         backend_ = new Backend(default_thread_num - 1);
          task_queue_ = new TaskQueue();
+         streams_.push_back({backend_, task_queue_});
+         for (int n : stream_thread_nums) {
+             streams_.push_back({new Backend(n), new TaskQueue()});
+         }
+         for (auto& stream : streams_) {
+             TaskQueue* task_queue = stream.task_queue;
+             stream.backend->set_preempt_hook(
+                 [task_queue]() { task_queue->run_preempting(); });
+         }
          for (int i = 0; i < (1 << 16); ++i) {
              ggml_table_f32_f16[i] = GGML_COMPUTE_FP16_TO_FP32(i);
          }
+         // Once per process, so a later CPUInfer keeps a level picked with
+         // set_isa.
+         static std::once_flag isa_once;
+         std::call_once(isa_once, llamafile_isa_init);
      }
  
      ~CPUInfer() {
-         delete backend_;
-         delete task_queue_;
+         // queues first, their workers may still run tasks on the backends
+         for (auto& stream : streams_) {
+             delete stream.task_queue;
+         }
+         for (auto& stream : streams_) {
+             delete stream.backend;
+         }
      }
  
      template <typename Func, typename Obj, typename... Args>
      void enqueue(Func f, Obj* obj, Args... args) {
-         task_queue_->enqueue([=]() {
-             std::invoke(f, *obj, args..., backend_);
-         });
+         Stream& stream = streams_[submit_stream_];
+         Backend* backend = stream.backend;
+         stream.task_queue->enqueue([=]() {
+             std::invoke(f, *obj, args..., backend);
+         }, submit_priority_);
      }
  
-     void submit(std::pair<intptr_t, intptr_t> params) {
+     // Higher priority tasks run first and preempt lower priority ones at
+     // their Backend::preempt_point, e.g. decode (1) over prefill (0).
+     void submit(std::pair<intptr_t, intptr_t> params, int stream = 0,
+                 int priority = 0) {
+         check_stream_(stream);
          void (*func)(void*) = (void (*)(void*))params.first;
          void* args = (void*)params.second;
          *((CPUInfer**)args) = this;
+         submit_stream_ = stream;
+         submit_priority_ = priority;
          func(args);
+         submit_stream_ = 0;
+         submit_priority_ = 0;
+     }
+ 
+     // stream < 0 waits for all streams. Rethrows the first exception a
+     // task of those streams threw since their last sync.
+     void sync(int stream = -1) {
+         if (stream >= 0) {
+             check_stream_(stream);
+         }
+         std::exception_ptr error;
+         {
+             std::lock_guard<std::mutex> lock(host_sync_mutex_);
+             std::swap(error, host_sync_error_);
+         }
+         auto sync_one = [&error](TaskQueue* task_queue) {
+             try {
+                 task_queue->sync();
+             } catch (...) {
+                 if (!error) {
+                     error = std::current_exception();
+                 }
+             }
+         };
+         if (stream >= 0) {
+             sync_one(streams_[stream].task_queue);
+         } else {
+             for (auto& s : streams_) {
+                 sync_one(s.task_queue);
+             }
+         }
+         if (error) {
+             std::rethrow_exception(error);
+         }
+     }
+ 
+     int get_stream_num() { return streams_.size(); }
+ 
+     int create_event() {
+         events_.emplace_back();
+         return events_.size() - 1;
      }
  
-     void sync() {
-         task_queue_->sync();
+     // The event is set once the tasks submitted to stream so far are done.
+     // Like all tasks, it is only ordered after tasks of the same or higher
+     // priority.
+     void record_event(int event, int stream = 0, int priority = 0) {
+         check_event_(event);
+         check_stream_(stream);
+         Event* ev = &events_[event];
+         uint64_t generation = ev->recorded.fetch_add(1) + 1;
+         ev->stream = stream;
+         ev->priority = priority;
+         streams_[stream].task_queue->enqueue([ev, generation]() {
+             // records on different streams may complete out of order
+             uint64_t done = ev->done.load(std::memory_order_acquire);
+             while (done < generation &&
+                    !ev->done.compare_exchange_weak(done, generation,
+                                                    std::memory_order_acq_rel)) {
+             }
+         }, priority);
      }
  
-     void submit_with_cuda_stream(intptr_t user_cuda_stream, std::pair<intptr_t, intptr_t> params) {
+     bool query_event(int event) {
+         check_event_(event);
+         Event& ev = events_[event];
+         return ev.done.load(std::memory_order_acquire) >=
+                ev.recorded.load(std::memory_order_acquire);
+     }
+ 
+     // Tasks of the same or lower priority submitted to stream afterwards
+     // start once the last record_event of event so far is done; with no
+     // record pending, the wait is a no-op. A waiting stream still runs
+     // queued tasks of higher priority.
+     //
+     // Throws std::invalid_argument if that record is on the same stream at
+     // a lower priority: the wait would be scheduled before the record and
+     // never return.
+     void wait_event(int event, int stream = 0, int priority = 0) {
+         check_event_(event);
+         check_stream_(stream);
+         Event* ev = &events_[event];
+         uint64_t generation = ev->recorded.load(std::memory_order_acquire);
+         if (ev->done.load(std::memory_order_acquire) >= generation) {
+             return;
+         }
+         if (ev->stream == stream && ev->priority < priority) {
+             throw std::invalid_argument(
+                 "wait_event would run before the record_event it waits for "
+                 "on the same stream; record at the priority of the wait or "
+                 "higher");
+         }
+         TaskQueue* task_queue = streams_[stream].task_queue;
+         task_queue->enqueue([ev, generation, task_queue]() {
+             while (ev->done.load(std::memory_order_acquire) < generation) {
+                 task_queue->run_preempting();
+                 std::this_thread::yield();
+             }
+         }, priority);
+     }
+ 
+     void submit_with_cuda_stream(intptr_t user_cuda_stream, std::pair<intptr_t, intptr_t> params, int stream = 0, int priority = 0) {
+         check_stream_(stream);
          void (*func)(void*) = (void (*)(void*))params.first;
          void* args = (void*)params.second;
          *((CPUInfer**)args) = this;
-         cudaLaunchHostFunc((cudaStream_t)user_cuda_stream, (cudaHostFn_t)func, args);
+         HostTask* task = new HostTask{func, args, stream, priority};
+         cudaLaunchHostFunc((cudaStream_t)user_cuda_stream, (cudaHostFn_t)&submit_, task);
+     }
+ 
+     static void submit_(void* host_task_ptr) {
+         HostTask* task = (HostTask*)host_task_ptr;
+         submit_stream_ = task->stream;
+         submit_priority_ = task->priority;
+         task->func(task->args);
+         submit_stream_ = 0;
+         submit_priority_ = 0;
+         delete task;
      }
  
-     static void sync_(void* cpu_infer_ptr) {
-         CPUInfer* cpuinfer = (CPUInfer*)cpu_infer_ptr;
-         cpuinfer->sync();
+     // Runs on a CUDA thread, which must not throw; the error is reported
+     // by the next sync() instead.
+     static void sync_(void* host_task_ptr) {
+         HostTask* task = (HostTask*)host_task_ptr;
+         CPUInfer* cpuinfer = (CPUInfer*)task->args;
+         try {
+             cpuinfer->sync(task->stream);
+         } catch (...) {
+             std::lock_guard<std::mutex> lock(cpuinfer->host_sync_mutex_);
+             cpuinfer->host_sync_error_ = std::current_exception();
+         }
+         delete task;
      }
  
-     void sync_with_cuda_stream(intptr_t user_cuda_stream) {
-         cudaLaunchHostFunc((cudaStream_t)user_cuda_stream, (cudaHostFn_t)&sync_, (void*)this);
+     void sync_with_cuda_stream(intptr_t user_cuda_stream, int stream = -1) {
+         if (stream >= 0) {
+             check_stream_(stream);
+         }
+         HostTask* task = new HostTask{nullptr, (void*)this, stream, 0};
+         cudaLaunchHostFunc((cudaStream_t)user_cuda_stream, (cudaHostFn_t)&sync_, task);
      }
  
     public:
      Backend* backend_;
      TaskQueue* task_queue_;
+ 
+    private:
+     struct Stream {
+         Backend* backend;
+         TaskQueue* task_queue;
+     };
+     // recorded counts record_event calls, done is the latest one finished.
+     // stream and priority are those of the latest record_event.
+     struct Event {
+         std::atomic<uint64_t> recorded{0};
+         std::atomic<uint64_t> done{0};
+         int stream = 0;
+         int priority = 0;
+     };
+     struct HostTask {
+         void (*func)(void*);
+         void* args;
+         int stream;
+         int priority;
+     };
+     // Throw std::out_of_range for ids that were never created.
+     void check_stream_(int stream) {
+         if (stream < 0 || stream >= (int)streams_.size()) {
+             throw std::out_of_range("[CPUInfer] stream " +
+                                     std::to_string(stream) + " out of range");
+         }
+     }
+ 
+     void check_event_(int event) {
+         if (event < 0 || event >= (int)events_.size()) {
+             throw std::out_of_range("[CPUInfer] event " +
+                                     std::to_string(event) + " out of range");
+         }
+     }
+     std::vector<Stream> streams_;  // [0] is {backend_, task_queue_}
+     std::deque<Event> events_;
+     std::mutex host_sync_mutex_;
+     std::exception_ptr host_sync_error_;  // from sync_with_cuda_stream
+     // Stream and priority of the submit call running on this thread, read
+     // by enqueue.
+     static inline thread_local int submit_stream_ = 0;
+     static inline thread_local int submit_priority_ = 0;
  };
  
  #endif
\ No newline at end of file
@@ -10,6 +10,7 @@
 #include "task_queue.h"
 
 TaskQueue::TaskQueue() {
+    running_priority = 0;
     worker = std::thread(&TaskQueue::processTasks, this);
     sync_flag.store(true, std::memory_order_seq_cst);
     exit_flag.store(false, std::memory_order_seq_cst);
@@ -27,10 +28,10 @@ TaskQueue::~TaskQueue() {
     }
 }
 
-void TaskQueue::enqueue(std::function<void()> task) {
+void TaskQueue::enqueue(std::function<void()> task, int priority) {
     {
         mutex.lock();
-        tasks.push(task);
+        tasks.push({priority, next_seq++, task});
         sync_flag.store(false, std::memory_order_seq_cst);
         mutex.unlock();
     }
@@ -40,22 +41,68 @@ void TaskQueue::enqueue(std::function<void()> task) {
 void TaskQueue::sync() {
     while (!sync_flag.load(std::memory_order_seq_cst))
         ;
+    std::exception_ptr e;
+    {
+        mutex.lock();
+        std::swap(e, error);
+        mutex.unlock();
+    }
+    if (e) {
+        std::rethrow_exception(e);
+    }
+}
+
+void TaskQueue::run_(Task& task) {
+    try {
+        task.func();
+    } catch (...) {
+        mutex.lock();
+        if (!error) {
+            error = std::current_exception();
+        }
+        mutex.unlock();
+    }
+}
+
+void TaskQueue::run_preempting() {
+    if (std::this_thread::get_id() != worker.get_id()) {
+        return;
+    }
+    while (true) {
+        Task task;
+        {
+            mutex.lock();
+            if (tasks.empty() || tasks.top().priority <= running_priority) {
+                mutex.unlock();
+                return;
+            }
+            task = tasks.top();
+            tasks.pop();
+            mutex.unlock();
+        }
+        // sync_flag stays false, the preempted task is still running
+        int preempted_priority = running_priority;
+        running_priority = task.priority;
+        run_(task);
+        running_priority = preempted_priority;
+    }
 }
 
 void TaskQueue::processTasks() {
     while (true) {
-        std::function<void()> task;
+        Task task;
         {
             mutex.lock();
             cv.wait(mutex, [this]() { return !tasks.empty() || exit_flag.load(std::memory_order_seq_cst); });
             if (exit_flag.load(std::memory_order_seq_cst) && tasks.empty()) {
                 return;
             }
-            task = tasks.front();
+            task = tasks.top();
             tasks.pop();
             mutex.unlock();
         }
-        task();
+        running_priority = task.priority;
+        run_(task);
         {
             mutex.lock();
             if (tasks.empty()) {
@@ -12,6 +12,8 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <cstdint>
+#include <exception>
 #include <functional>
 #include <mutex>
 #include <queue>
@@ -116,23 +118,49 @@ class custom_condition_variable {
     }
 };
 
+// Tasks run in priority order, FIFO among equal priorities. A running task
+// can let higher priority tasks run before it continues by calling
+// run_preempting() from the worker thread (see Backend::preempt_point).
+// An exception thrown by a task is kept and rethrown by the next sync();
+// later tasks still run.
 class TaskQueue {
    public:
     TaskQueue();
     ~TaskQueue();
 
-    void enqueue(std::function<void()>);
+    void enqueue(std::function<void()>, int priority = 0);
 
     void sync();
 
+    // Runs queued tasks with a priority above the running one, on the
+    // worker thread only; a no-op anywhere else.
+    void run_preempting();
+
    private:
+    struct Task {
+        int priority;
+        uint64_t seq;
+        std::function<void()> func;
+        bool operator<(const Task& other) const {
+            // std::priority_queue pops the largest element first
+            if (priority != other.priority) {
+                return priority < other.priority;
+            }
+            return seq > other.seq;
+        }
+    };
+
     void processTasks();
+    void run_(Task& task);
 
-    std::queue<std::function<void()>> tasks;
+    std::priority_queue<Task> tasks;
+    uint64_t next_seq = 0;
+    int running_priority;  // only touched by the worker thread
     custom_mutex mutex;
     custom_condition_variable cv;
     std::thread worker;
     std::atomic<bool> sync_flag;
     std::atomic<bool> exit_flag;
+    std::exception_ptr error;  // first exception since the last sync, under mutex
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,160 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  CPUInfer streams: a KVCache written on one stream is read on
+                another after record_event/wait_event, and the Python
+                CPUInfer rebuilds its backend without dropping queued work;
+                waits that could never be satisfied, unknown stream and
+                event ids and bad thread partitions are refused
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+sys.path.append(os.path.dirname(__file__) + '/../../..')
+import cpuinfer_ext
+import torch
+
+layer_num = 1
+kv_head_num = 8
+q_head_num = 8
+head_dim = 128
+block_len = 128
+anchor_num = 1
+max_block_num = 64
+seq_len = max_block_num * block_len
+validation_iter = 8
+
+def make_kvcache():
+    config = cpuinfer_ext.kvcache.KVCacheConfig(
+        layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+        cpuinfer_ext.kvcache.AnchorType.DYNAMIC, cpuinfer_ext.kvcache.ggml_type.FP16,
+        cpuinfer_ext.kvcache.RetrievalType.LAYER,
+        1, 1, 0, max_block_num, 1, 8,
+    )
+    return cpuinfer_ext.kvcache.KVCache(config)
+
+def write_task(kvcache, k, v, block_table, past):
+    return kvcache.update_kvcache_fp16(
+        k.data_ptr(), v.data_ptr(), 0, block_table.data_ptr(), 1,
+        max_block_num, past.data_ptr(), seq_len,
+    )
+
+def read_task(kvcache, k_out, v_out, block_table, cache_seqlens):
+    return kvcache.get_kvcache_fp16(
+        k_out.data_ptr(), v_out.data_ptr(), 0, block_table.data_ptr(), 1,
+        max_block_num, cache_seqlens.data_ptr(),
+    )
+
+with torch.inference_mode(mode=True):
+    block_table = torch.arange(max_block_num, dtype=torch.int32).view(1, -1).contiguous()
+    cache_seqlens = torch.tensor([seq_len], dtype=torch.int32)
+
+    # stream 1 (the producer) owns 3 threads, the default stream the rest
+    CPUInfer = cpuinfer_ext.CPUInfer(8, [3])
+    assert CPUInfer.get_stream_num() == 2
+    kvcache = make_kvcache()
+    event = CPUInfer.create_event()
+    assert CPUInfer.query_event(event), "a new event is set"
+    for i in range(validation_iter):
+        k = torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        v = torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        k_out = torch.zeros((1, seq_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        v_out = torch.zeros((1, seq_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        past = torch.zeros((1,), dtype=torch.int32)
+        CPUInfer.submit(write_task(kvcache, k, v, block_table, past), 1)
+        CPUInfer.record_event(event, 1)
+        # the consumer stream only starts reading once the write is done
+        CPUInfer.wait_event(event, 0)
+        CPUInfer.submit(read_task(kvcache, k_out, v_out, block_table, cache_seqlens), 0)
+        CPUInfer.sync(0)
+        assert CPUInfer.query_event(event)
+        assert torch.equal(k_out[0], k) and torch.equal(v_out[0], v), "read overtook the write"
+        CPUInfer.sync(1)
+    print('two-stream record_event/wait_event ordering holds')
+
+    # a wait that would be scheduled before its record on the same stream
+    # is refused instead of spinning on the worker forever
+    k = torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    v = torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    past = torch.zeros((1,), dtype=torch.int32)
+    CPUInfer.submit(write_task(kvcache, k, v, block_table, past), 0, 0)
+    CPUInfer.record_event(event, 0, 0)
+    try:
+        CPUInfer.wait_event(event, 0, 1)
+        assert False, "expected ValueError"
+    except ValueError:
+        pass
+    # the same inversion across streams, or a record at the priority of the
+    # wait, is fine
+    CPUInfer.wait_event(event, 1, 1)
+    CPUInfer.record_event(event, 0, 1)
+    CPUInfer.wait_event(event, 0, 1)
+    CPUInfer.sync()
+    assert CPUInfer.query_event(event)
+    # with no record pending, a wait is a no-op at any priority
+    CPUInfer.wait_event(event, 0, 1)
+    CPUInfer.sync()
+    print('priority inversions on one stream are refused')
+
+    # stream and event ids that do not exist, and partitions that leave a
+    # stream without threads, are refused in every build
+    for call in [
+        lambda: CPUInfer.submit(write_task(kvcache, k, v, block_table, past), 2),
+        lambda: CPUInfer.record_event(event, -1),
+        lambda: CPUInfer.wait_event(event, 2),
+        lambda: CPUInfer.query_event(event + 1),
+        lambda: CPUInfer.sync(2),
+    ]:
+        try:
+            call()
+            assert False, "expected IndexError"
+        except IndexError:
+            pass
+    for stream_threads in [[0], [-1, 2], [3]]:
+        try:
+            cpuinfer_ext.CPUInfer(4, stream_threads)
+            assert False, "expected ValueError"
+        except ValueError:
+            pass
+    print('unknown streams, events and partitions are refused')
+    del kvcache, CPUInfer
+
+    # The Python CPUInfer shares one backend; growing it must drain the old
+    # one and keep stream and event ids.
+    from ktransformers.operators.cpuinfer import CPUInfer as PyCPUInfer
+    first = PyCPUInfer(6, {"attn": 2})
+    kvcache = make_kvcache()
+    event = first.create_event()
+    attn_id = PyCPUInfer.stream_ids["attn"]
+    k = torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    v = torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    past = torch.zeros((1,), dtype=torch.int32)
+    first.submit(write_task(kvcache, k, v, block_table, past), "attn")
+    # rebuilds while the write may still be queued
+    second = PyCPUInfer(8, {"moe": 2})
+    assert PyCPUInfer.cur_backend_thread_num == 8
+    assert PyCPUInfer.stream_ids["attn"] == attn_id and "moe" in PyCPUInfer.stream_ids
+    assert PyCPUInfer.cpuinfer.get_stream_num() == 3
+    k_out = torch.zeros((1, seq_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    v_out = torch.zeros((1, seq_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    second.submit(read_task(kvcache, k_out, v_out, block_table, cache_seqlens), "moe")
+    second.sync()
+    assert torch.equal(k_out[0], k) and torch.equal(v_out[0], v), "queued write lost in the rebuild"
+    # events created before the rebuild still work
+    second.record_event(event, "attn")
+    second.wait_event(event, "moe")
+    second.sync()
+    assert second.query_event(event)
+    # smaller requests reuse the backend
+    backend = PyCPUInfer.cpuinfer
+    PyCPUInfer(4, {"attn": 1})
+    assert PyCPUInfer.cpuinfer is backend
+    # and a request that starves the default stream is refused untouched
+    try:
+        PyCPUInfer(8, {"big": 5})
+        assert False, "expected ValueError"
+    except ValueError:
+        pass
+    assert PyCPUInfer.cpuinfer is backend and "big" not in PyCPUInfer.stream_ids
+    print('CPUInfer rebuild keeps queued work, streams and events')
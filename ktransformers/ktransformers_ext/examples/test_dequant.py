@@ -0,0 +1,65 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved. 
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+sys.path.append(os.path.dirname(__file__) + '/../../..')
+import cpuinfer_ext
+import torch
+
+n = 1024 * 1024 + 32 * 7 # not a multiple of chunk_len
+chunk_len = 16384
+CPUInfer = cpuinfer_ext.CPUInfer(48)
+
+def make_q8_0(n):
+    # block_q8_0: fp16 scale followed by 32 int8 quants
+    qs = torch.randint(-127, 128, (n // 32, 32), dtype=torch.int8)
+    d = (torch.rand((n // 32, 1)) / 100).to(torch.float16)
+    blocks = torch.cat([d.view(torch.int8), qs], dim=1).contiguous()
+    ref = qs.to(torch.float32) * d.to(torch.float32)
+    return blocks, ref.flatten()
+
+with torch.inference_mode(mode=True):
+    q8_0, q8_0_ref = make_q8_0(n)
+    f16 = torch.randn(n, dtype=torch.float16)
+    cases = [
+        (8, q8_0, q8_0_ref, torch.float32, 0),  # ggml_type::GGML_TYPE_Q8_0 -> F32
+        (8, q8_0, q8_0_ref, torch.bfloat16, 30), # ggml_type::GGML_TYPE_Q8_0 -> BF16
+        (1, f16, f16.to(torch.float32), torch.float32, 0), # ggml_type::GGML_TYPE_F16 -> F32
+        (1, f16, f16.to(torch.float32), torch.float16, 1), # ggml_type::GGML_TYPE_F16 -> F16
+    ]
+    for src_type, src, ref, dtype, dst_type in cases:
+        config = cpuinfer_ext.gguf.DequantConfig(src_type, dst_type, chunk_len)
+        dequant = cpuinfer_ext.gguf.Dequant(config)
+        output = torch.empty(n, dtype=dtype).contiguous()
+        start = time.perf_counter()
+        CPUInfer.submit(dequant.forward(n, src.data_ptr(), output.data_ptr()))
+        CPUInfer.sync()
+        end = time.perf_counter()
+        diff = torch.mean(torch.abs(output.to(torch.float32) - ref)) / torch.mean(torch.abs(ref))
+        print('src_type', src_type, 'dst_type', dst_type, 'diff = ', diff, 'time = ', end - start)
+        assert(diff < 0.01)
+
+    # an unsupported destination raises instead of exiting the process
+    try:
+        cpuinfer_ext.gguf.Dequant(cpuinfer_ext.gguf.DequantConfig(8, 8, chunk_len)) # Q8_0 -> Q8_0
+        assert False, "expected ValueError"
+    except ValueError as e:
+        print('rejected:', e)
+
+    # the loader's entry point shares one CPUInfer and checks the data size
+    from ktransformers.util.custom_gguf import dequantize_cpu_native
+    output = torch.empty(n, dtype=torch.float32)
+    assert dequantize_cpu_native(q8_0.numpy(), 8, output)
+    assert torch.mean(torch.abs(output - q8_0_ref)) / torch.mean(torch.abs(q8_0_ref)) < 0.01
+    for short in [q8_0[:-1].numpy(), q8_0.numpy().reshape(-1)[:-1]]:
+        try:
+            dequantize_cpu_native(short, 8, output)
+            assert False, "expected ValueError"
+        except ValueError as e:
+            print('rejected:', e)
@@ -0,0 +1,109 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  KExpertsHybrid with hot_device="cpu" against a torch MoE
+                reference: hot and cold partial outputs merged by routing
+                weight, before and after rebalance() reloads the hot slots
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+sys.path.append(os.path.dirname(__file__) + '/../../..')
+import cpuinfer_ext
+import numpy as np
+import torch
+from transformers import PretrainedConfig
+
+expert_num = 16
+hidden_size = 256
+intermediate_size = 128
+n_routed_experts = 4
+hot_experts = [0, 1, 2, 3]
+qlens = [1, 12] # per-token and grouped CPU paths
+key = "blk.0"
+validation_iter = 3
+
+def act_fn(x):
+    return x / (1.0 + torch.exp(-x))
+
+def moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj):
+    output = torch.zeros((input.shape[0], hidden_size), dtype=torch.float32)
+    for i in range(input.shape[0]):
+        for j in range(expert_ids.shape[1]):
+            e = expert_ids[i, j]
+            x = input[i:i+1].float()
+            y = (act_fn(x @ gate_proj[e].float().t()) * (x @ up_proj[e].float().t())) @ down_proj[e].float().t()
+            output[i] += y[0] * weights[i, j]
+    return output
+
+if not torch.cuda.is_available():
+    # KExpertsCPU keeps its decode buffers in pinned memory
+    print('KExpertsHybrid needs a CUDA runtime for pinned buffers, skipping')
+    sys.exit(0)
+
+from ktransformers.operators.experts import KExpertsHybrid
+from ktransformers.util.custom_gguf import GGUFLoader
+
+class Loader:
+    # the part of GGUFLoader that KExpertsHybrid uses, over F16 experts in
+    # memory instead of a GGUF file
+    load_expert_tensor = GGUFLoader.load_expert_tensor
+
+    def __init__(self, shapes):
+        self.tensor_info = {
+            f"{key}.ffn_{name}_exps.weight": {"shape": list(shape[::-1]), "ggml_type": 1} # ggml_type::GGML_TYPE_F16
+            for name, shape in shapes.items()
+        }
+
+def check(hybrid, projs, tag, expert_pool=None):
+    for qlen in qlens:
+        for i in range(validation_iter):
+            pool = torch.tensor(expert_pool) if expert_pool is not None else torch.arange(expert_num)
+            expert_ids = torch.stack([pool[torch.randperm(len(pool))[:n_routed_experts]] for _ in range(qlen)]).contiguous()
+            weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+            input = (torch.randn((qlen, hidden_size), dtype=torch.float32) / 10).contiguous()
+            output = hybrid.forward(input, expert_ids, weights)
+            t_output = moe_torch(input, expert_ids, weights, *projs)
+            diff = torch.mean(torch.abs(output.float() - t_output)) / torch.mean(torch.abs(t_output))
+            print(tag, 'qlen', qlen, 'diff = ', diff)
+            assert diff < 0.02
+
+with torch.inference_mode(mode=True):
+    gate_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    up_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    down_proj = (torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    projs = (gate_proj, up_proj, down_proj)
+    loader = Loader({"gate": gate_proj.shape, "up": up_proj.shape, "down": down_proj.shape})
+    config = PretrainedConfig(
+        hidden_act="silu", hidden_size=hidden_size, moe_intermediate_size=intermediate_size,
+        num_experts_per_tok=n_routed_experts,
+    )
+    hybrid = KExpertsHybrid(key, loader, config, expert_num, out_device="cpu", hot_device="cpu", hot_experts=hot_experts)
+    # the raw F16 bytes, as GGUFLoader.load_gguf_tensor returns them
+    w = {name: proj.numpy().view(np.uint8).reshape(-1) for name, proj in zip(["gate", "up", "down"], projs)}
+    w.update({"gate_type": 1, "up_type": 1, "down_type": 1})
+    hybrid.load(w)
+    assert hybrid.hot_experts == hot_experts
+
+    # mixed routes, and tokens routed only to hot or only to cold experts
+    check(hybrid, projs, 'mixed')
+    check(hybrid, projs, 'all hot', hot_experts)
+    check(hybrid, projs, 'all cold', list(range(4, expert_num)))
+
+    # route only to experts 0, 1, 8 and 9: 0 and 1 stay in their slots,
+    # 2 and 3 are evicted for 8 and 9
+    hybrid.expert_counts.zero_()
+    check(hybrid, projs, 'skewed', [0, 1, 8, 9])
+    slots_before = {e: hybrid.hot_experts.index(e) for e in [0, 1]}
+    hybrid.rebalance()
+    assert sorted(hybrid.hot_experts) == [0, 1, 8, 9], hybrid.hot_experts
+    assert {e: hybrid.hot_experts.index(e) for e in [0, 1]} == slots_before, "resident hot expert reloaded"
+    assert hybrid.expert_counts.sum() == 0
+    for slot, e in enumerate(hybrid.hot_experts):
+        assert hybrid.hot_slot[e] == slot
+        assert torch.equal(hybrid.gate[slot], gate_proj[e].float()), "slot holds the wrong expert"
+    assert (hybrid.hot_slot >= 0).sum() == len(hot_experts)
+    check(hybrid, projs, 'rebalanced')
+    check(hybrid, projs, 'rebalanced all hot', [0, 1, 8, 9])
+    print('KExpertsHybrid matches torch before and after a rebalance')
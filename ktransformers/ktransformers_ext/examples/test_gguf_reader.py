@@ -0,0 +1,114 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  GGUF Reader: aligned and unaligned byte ranges, read with
+                direct_io on and off, match numpy.memmap of the same file;
+                a missing file, a range past the end and a file truncated
+                under the reader raise instead of exiting
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys, tempfile
+sys.path.append(os.path.dirname(__file__) + '/../build')
+sys.path.append(os.path.dirname(__file__) + '/../../..')
+import cpuinfer_ext
+import numpy as np
+
+alignment = 4096 # Reader's O_DIRECT alignment
+chunk_size = 64 * 1024
+file_size = 3 * 1024 * 1024 + 123 # not a multiple of the alignment
+io_thread_num = 4
+# (offset, size): aligned, unaligned on either side, across many chunks, up
+# to the unaligned end of the file, and empty
+ranges = [
+    (0, alignment),
+    (alignment * 3, chunk_size * 2),
+    (17, 1000),
+    (alignment - 5, 10),
+    (12345, chunk_size * 5 + 77),
+    (file_size - 4000, 4000),
+    (file_size - 1, 1),
+    (0, file_size),
+    (100, 0),
+]
+
+def aligned_buffer(size, shift):
+    # a destination `shift` bytes past an aligned address, so both the
+    # direct pread and the bounce-buffer paths are taken
+    raw = np.empty(size + 2 * alignment, dtype=np.uint8)
+    start = (-raw.ctypes.data) % alignment + shift
+    return raw[start:start + size]
+
+def read(reader, offset, size, shift):
+    dst = aligned_buffer(size, shift)
+    reader.wait(reader.submit(offset, size, dst.ctypes.data))
+    return dst
+
+def make_reader(path, direct_io):
+    return cpuinfer_ext.gguf.Reader(cpuinfer_ext.gguf.ReaderConfig(path, io_thread_num, chunk_size, direct_io))
+
+# on the examples' file system rather than /tmp, which is often tmpfs
+# without O_DIRECT
+with tempfile.TemporaryDirectory(dir=os.path.dirname(os.path.abspath(__file__))) as tmp:
+    path = os.path.join(tmp, 'data.bin')
+    with open(path, 'wb') as fh:
+        fh.write(np.random.randint(0, 256, file_size, dtype=np.uint8).tobytes())
+    expected = np.memmap(path, dtype=np.uint8, mode='r')
+
+    for direct_io in [False, True]:
+        reader = make_reader(path, direct_io)
+        for offset, size in ranges:
+            for shift in [0, 3]:
+                data = read(reader, offset, size, shift)
+                assert np.array_equal(data, expected[offset:offset + size]), (direct_io, offset, size, shift)
+        # all ranges in flight at once, waited in reverse order
+        dsts = [aligned_buffer(size, 0) for _, size in ranges]
+        tickets = [reader.submit(offset, size, dst.ctypes.data) for (offset, size), dst in zip(ranges, dsts)]
+        for ticket in reversed(tickets):
+            reader.wait(ticket)
+        for (offset, size), dst in zip(ranges, dsts):
+            assert np.array_equal(dst, expected[offset:offset + size]), (direct_io, offset, size)
+
+        # a range past the end is refused before any read
+        for offset, size in [(file_size - 10, 11), (file_size, 1), (-1, 10)]:
+            try:
+                reader.submit(offset, size, aligned_buffer(max(size, 1), 0).ctypes.data)
+                assert False, "expected IndexError"
+            except IndexError:
+                pass
+        print('direct_io', direct_io, 'ranges match numpy.memmap')
+        del reader
+
+    # a file that cannot be opened raises, and GGUFLoader falls back to its
+    # memmap for it
+    missing = os.path.join(tmp, 'missing.bin')
+    try:
+        make_reader(missing, False)
+        assert False, "expected RuntimeError"
+    except RuntimeError as e:
+        print('missing file:', e)
+    from ktransformers.util.custom_gguf import GGUFLoader
+    loader = GGUFLoader.__new__(GGUFLoader)
+    loader.readers = {}
+    assert loader.get_reader(missing) is None
+
+    # a read that hits EOF because the file shrank is reported by wait
+    del expected
+    for direct_io in [False, True]:
+        with open(path, 'wb') as fh:
+            fh.write(np.random.randint(0, 256, file_size, dtype=np.uint8).tobytes())
+        reader = make_reader(path, direct_io)
+        os.truncate(path, file_size // 2)
+        dst = aligned_buffer(chunk_size, 0)
+        ticket = reader.submit(file_size - chunk_size, chunk_size, dst.ctypes.data)
+        try:
+            reader.wait(ticket)
+            assert False, "expected RuntimeError"
+        except RuntimeError as e:
+            print('direct_io', direct_io, 'truncated file:', e)
+        # the reader stays usable for the part that is left
+        data = read(reader, 0, 1000, 3)
+        with open(path, 'rb') as fh:
+            assert data.tobytes() == fh.read(1000)
+        del reader
+    print('reader errors raise instead of exiting')
@@ -0,0 +1,55 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  : Check that every llamafile kernel level the host can run
+               produces the same Linear output.
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved. 
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+input_size = 4096
+output_size = 2048
+stride = 32
+group_max_len = 1024
+proj_type = 1 # ggml_type::GGML_TYPE_F16
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+qlen = 30
+CPUInfer = cpuinfer_ext.CPUInfer(48)
+validation_iter = 10
+
+with torch.inference_mode(mode=True):
+    print('default level:', cpuinfer_ext.get_isa())
+    proj = torch.randn((output_size, input_size), dtype=torch.float16).contiguous()
+    config = cpuinfer_ext.linear.LinearConfig(input_size, output_size, stride, group_max_len, proj.data_ptr(), proj_type, hidden_type)
+    linear = cpuinfer_ext.linear.Linear(config)
+
+    for level in cpuinfer_ext.isa_levels():
+        assert(cpuinfer_ext.set_isa(level))
+        # a later CPUInfer must not reset the level
+        cpuinfer_ext.CPUInfer(4)
+        assert(cpuinfer_ext.get_isa() == level)
+        print('level:', cpuinfer_ext.get_isa())
+        for i in range(validation_iter):
+            input = torch.randn((qlen, input_size), dtype=torch.float16).contiguous()
+            output = torch.empty((qlen, output_size), dtype=torch.float16).contiguous()
+            input = input / 100
+
+            CPUInfer.submit(
+                linear.forward(
+                    qlen,
+                    input.data_ptr(),
+                    output.data_ptr()
+                )
+            )
+            CPUInfer.sync()
+
+            t_output = torch.mm(input.float(), proj.t().float()).to(torch.float16)
+
+            diff = torch.mean(torch.abs(output - t_output)) / torch.mean(torch.abs(t_output))
+            print('diff = ', diff)
+            assert(diff < 0.001)
@@ -0,0 +1,149 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  Importance-driven KVCache eviction (drop and merge) against a
+                torch reference that keeps the recent tokens plus the heaviest
+                older ones per kv head
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 2
+kv_head_num = 2
+q_head_num = 8
+n_gqa = q_head_num // kv_head_num
+head_dim = 128
+block_len = 32
+anchor_num = 1
+max_block_num = 8
+seq_len = 200
+budget = 96 # not a multiple of block_len, so the last kept block is partial
+recent_len = 40
+CPUInfer = cpuinfer_ext.CPUInfer(4)
+
+def kept_torch(score):
+    # score: [seq_len - recent_len], distinct, so the top set is unique
+    heavy = torch.topk(score, budget - recent_len).indices.sort().values
+    return torch.cat([heavy, torch.arange(seq_len - recent_len, seq_len)])
+
+def merged_v_torch(v, imp, kept):
+    # v: [seq_len, head_dim], imp: [seq_len] group importance; every evicted
+    # value folds into the next kept token, weighted by importance
+    v_out = v[kept].float().clone()
+    w = imp[kept].float().clone()
+    next = 0
+    for t in range(seq_len - recent_len):
+        while kept[next] < t:
+            next += 1
+        if kept[next] == t:
+            continue
+        v_out[next] = (v_out[next] * w[next] + v[t].float() * imp[t]) / (w[next] + imp[t])
+        w[next] += imp[t]
+    return v_out
+
+def attn_torch(q, k, v):
+    # q: [q_head_num, head_dim], k/v: [len, kv_head_num, head_dim]
+    out = torch.empty((q_head_num, head_dim))
+    for h in range(q_head_num):
+        score = k[:, h // n_gqa, :].float() @ q[h].float() / head_dim ** 0.5
+        out[h] = torch.softmax(score, dim=0) @ v[:, h // n_gqa, :].float()
+    return out
+
+def rel_diff(a, b):
+    return torch.mean(torch.abs(a.float() - b.float())) / torch.mean(torch.abs(b.float()))
+
+with torch.inference_mode(mode=True):
+    config = cpuinfer_ext.kvcache.KVCacheConfig(
+        layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+        cpuinfer_ext.kvcache.AnchorType.DYNAMIC, cpuinfer_ext.kvcache.ggml_type.FP16,
+        cpuinfer_ext.kvcache.RetrievalType.LAYER,
+        1, 1, 0, max_block_num, 1, 4,
+    )
+    block_table = torch.arange(max_block_num, dtype=torch.int32).view(1, -1).contiguous()
+    for merge in [False, True]:
+        kvcache = cpuinfer_ext.kvcache.KVCache(config)
+        k = [torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16) for _ in range(layer_num)]
+        v = [torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16) for _ in range(layer_num)]
+        # small integers are exact in fp16, and a permutation per kv head
+        # keeps the group sums distinct
+        group_imp = [torch.stack([torch.randperm(seq_len).float() + 1 for _ in range(kv_head_num)], dim=1)
+                     for _ in range(layer_num)]
+        for layer_idx in range(layer_num):
+            zero = torch.zeros((1,), dtype=torch.int32)
+            CPUInfer.submit(
+                kvcache.update_kvcache_fp16(
+                    k[layer_idx].contiguous().data_ptr(), v[layer_idx].contiguous().data_ptr(),
+                    layer_idx, block_table.data_ptr(), 1, max_block_num, zero.data_ptr(), seq_len,
+                )
+            )
+            CPUInfer.sync()
+            importance = torch.zeros((1, max_block_num * block_len, q_head_num), dtype=torch.float16)
+            importance[0, :seq_len] = group_imp[layer_idx].repeat_interleave(n_gqa, dim=1).to(torch.float16)
+            importance = importance.contiguous()
+            CPUInfer.submit(
+                kvcache.update_importance(
+                    importance.data_ptr(), layer_idx, block_table.data_ptr(), 1,
+                    max_block_num, zero.data_ptr(), seq_len,
+                )
+            )
+            CPUInfer.sync()
+
+        cache_seqlens = torch.tensor([seq_len], dtype=torch.int32)
+        CPUInfer.submit(
+            kvcache.evict(block_table.data_ptr(), cache_seqlens.data_ptr(), 0, max_block_num, budget, recent_len, merge)
+        )
+        CPUInfer.sync()
+        assert cache_seqlens.item() == budget
+
+        for layer_idx in range(layer_num):
+            k_out = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+            v_out = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+            read_len = torch.tensor([seq_len], dtype=torch.int32)
+            CPUInfer.submit(
+                kvcache.get_kvcache_fp16(
+                    k_out.data_ptr(), v_out.data_ptr(), layer_idx, block_table.data_ptr(),
+                    1, max_block_num, read_len.data_ptr(),
+                )
+            )
+            CPUInfer.sync()
+            # everything past the budget is dropped
+            assert torch.all(k_out[0, budget:seq_len] == 0) and torch.all(v_out[0, budget:seq_len] == 0)
+
+            k_ref = torch.empty((budget, kv_head_num, head_dim), dtype=torch.float16)
+            v_ref = torch.empty((budget, kv_head_num, head_dim), dtype=torch.float16)
+            for head_id in range(kv_head_num):
+                imp = group_imp[layer_idx][:, head_id] * n_gqa
+                kept = kept_torch(imp[:seq_len - recent_len])
+                # keys are moved, never averaged
+                k_ref[:, head_id] = k[layer_idx][kept, head_id]
+                if merge:
+                    v_ref[:, head_id] = merged_v_torch(v[layer_idx][:, head_id], imp, kept).to(torch.float16)
+                else:
+                    v_ref[:, head_id] = v[layer_idx][kept, head_id]
+            assert torch.equal(k_out[0, :budget], k_ref)
+            v_diff = rel_diff(v_out[0, :budget], v_ref)
+            print('merge', merge, 'layer', layer_idx, 'v diff = ', v_diff)
+            if merge:
+                assert v_diff < 0.001
+            else:
+                assert torch.equal(v_out[0, :budget], v_ref)
+
+            # decoding goes on over the compacted cache
+            q = (torch.randn((1, 1, q_head_num, head_dim)) / 4).to(torch.float16).contiguous()
+            output = torch.empty((1, 1, q_head_num, head_dim), dtype=torch.float16).contiguous()
+            attn_lse = torch.empty((1, 1, q_head_num), dtype=torch.float32).contiguous()
+            CPUInfer.submit(
+                kvcache.attn(
+                    q.data_ptr(), output.data_ptr(), attn_lse.data_ptr(),
+                    layer_idx, 0, 1, 1, max_block_num, block_table.data_ptr(),
+                    cache_seqlens.data_ptr(), -1, -1, -1,
+                )
+            )
+            CPUInfer.sync()
+            diff = rel_diff(output.view(q_head_num, head_dim), attn_torch(q.view(q_head_num, head_dim), k_ref, v_ref))
+            print('merge', merge, 'layer', layer_idx, 'attn diff = ', diff)
+            assert diff < 0.01
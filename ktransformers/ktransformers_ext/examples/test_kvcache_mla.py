@@ -0,0 +1,76 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  MLA latent KVCache (one shared latent + rope head) against a
+                torch reference of absorbed multi-latent attention
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 2
+q_head_num = 16
+kv_lora_rank = 128
+rope_dim = 32
+head_dim = kv_lora_rank + rope_dim
+block_len = 32
+anchor_num = 1
+max_block_num = 16
+seqlens = [1, 31, 32, 200] # inside, at the end of and across blocks
+CPUInfer = cpuinfer_ext.CPUInfer(4)
+validation_iter = 2
+
+def mla_torch(q, kv):
+    # q: [q_head_num, head_dim] absorbed and pre-scaled, kv: [len, head_dim]
+    prob = torch.softmax(q.float() @ kv.float().t(), dim=-1)
+    out = torch.zeros((q_head_num, head_dim))
+    out[:, :kv_lora_rank] = prob @ kv[:, :kv_lora_rank].float()
+    return out
+
+with torch.inference_mode(mode=True):
+    config = cpuinfer_ext.kvcache.KVCacheConfig(
+        layer_num, 1, q_head_num, head_dim, block_len, anchor_num,
+        cpuinfer_ext.kvcache.AnchorType.DYNAMIC, cpuinfer_ext.kvcache.ggml_type.FP16,
+        cpuinfer_ext.kvcache.RetrievalType.LAYER,
+        1, 1, 0, max_block_num, 1, 4, 0, 1, 0, 0, kv_lora_rank,
+    )
+    block_table = torch.arange(max_block_num, dtype=torch.int32).view(1, -1).contiguous()
+    for seq_len in seqlens:
+        kvcache = cpuinfer_ext.kvcache.KVCache(config)
+        kvs = []
+        for layer_idx in range(layer_num):
+            kv = (torch.randn((seq_len, 1, head_dim)) / 4).to(torch.float16).contiguous()
+            kvs.append(kv)
+            zero = torch.zeros((1,), dtype=torch.int32)
+            # MLA keeps no V cache; the latent part of K is read as V
+            CPUInfer.submit(
+                kvcache.update_kvcache_fp16(
+                    kv.data_ptr(), kv.data_ptr(), layer_idx, block_table.data_ptr(),
+                    1, max_block_num, zero.data_ptr(), seq_len,
+                )
+            )
+            CPUInfer.sync()
+
+        cache_seqlens = torch.tensor([seq_len], dtype=torch.int32)
+        for i in range(validation_iter):
+            layer_idx = i % layer_num
+            q = (torch.randn((1, 1, q_head_num, head_dim)) / head_dim ** 0.5).to(torch.float16).contiguous()
+            output = torch.empty((1, 1, q_head_num, head_dim), dtype=torch.float16).contiguous()
+            attn_lse = torch.empty((1, 1, q_head_num), dtype=torch.float32).contiguous()
+            CPUInfer.submit(
+                kvcache.attn(
+                    q.data_ptr(), output.data_ptr(), attn_lse.data_ptr(),
+                    layer_idx, 0, 1, 1, max_block_num, block_table.data_ptr(),
+                    cache_seqlens.data_ptr(), -1, -1, -1,
+                )
+            )
+            CPUInfer.sync()
+            t_output = mla_torch(q.view(q_head_num, head_dim), kvs[layer_idx].view(seq_len, head_dim))
+            output = output.view(q_head_num, head_dim).float()
+            assert torch.all(output[:, kv_lora_rank:] == 0), "rope part of the output must be zero"
+            diff = torch.mean(torch.abs(output - t_output)) / torch.mean(torch.abs(t_output))
+            print('seq_len', seq_len, 'layer', layer_idx, 'diff = ', diff)
+            assert diff < 0.01
@@ -0,0 +1,116 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  NUMA-placed KVCache: blocks live on their owner node and
+                the node-bucketed write and attention tasks still match a
+                torch reference
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys, ctypes, ctypes.util
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 2
+q_head_num = 8
+head_dim = 128
+block_len = 64 # one fp16 block is 16KB, so it holds whole pages to move
+anchor_num = 1
+max_block_num = 8
+batch_size = 2
+# (kv_head_num, seq_lens): heads split over the nodes, and a single head
+# whose blocks are spread round-robin
+cases = [(8, [300, 129]), (1, [200, 64])]
+CPUInfer = cpuinfer_ext.CPUInfer(8)
+
+def page_nodes_of(libnuma, addr, size):
+    # nodes of the whole pages in [addr, addr + size), as move_pages reports
+    page = os.sysconf('SC_PAGE_SIZE')
+    begin = (addr + page - 1) // page * page
+    pages = list(range(begin, (addr + size) // page * page, page))
+    if not pages:
+        return []
+    ptrs = (ctypes.c_void_p * len(pages))(*pages)
+    status = (ctypes.c_int * len(pages))()
+    assert libnuma.move_pages(0, len(pages), ptrs, None, status, 0) == 0
+    return list(status)
+
+def attn_torch(q, k, v, kv_head_num):
+    # q: [q_head_num, head_dim], k/v: [len, kv_head_num, head_dim]
+    n_gqa = q_head_num // kv_head_num
+    out = torch.empty((q_head_num, head_dim))
+    for h in range(q_head_num):
+        score = k[:, h // n_gqa, :].float() @ q[h].float() / head_dim ** 0.5
+        out[h] = torch.softmax(score, dim=0) @ v[:, h // n_gqa, :].float()
+    return out
+
+# blocks are only placed by a build with USE_NUMA, which CMake takes from
+# the same environment variable
+libnuma = None
+if 'USE_NUMA' in os.environ and ctypes.util.find_library('numa'):
+    libnuma = ctypes.CDLL(ctypes.util.find_library('numa'))
+numa_nodes = libnuma.numa_num_configured_nodes() if libnuma is not None else 1
+print('numa nodes', numa_nodes)
+
+with torch.inference_mode(mode=True):
+    for kv_head_num, seq_lens in cases:
+        config = cpuinfer_ext.kvcache.KVCacheConfig(
+            layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+            cpuinfer_ext.kvcache.AnchorType.DYNAMIC, cpuinfer_ext.kvcache.ggml_type.FP16,
+            cpuinfer_ext.kvcache.RetrievalType.LAYER,
+            1, 1, 0, batch_size * max_block_num, batch_size, 8,
+        )
+        kvcache = cpuinfer_ext.kvcache.KVCache(config)
+        block_table = torch.arange(batch_size * max_block_num, dtype=torch.int32).view(batch_size, -1).contiguous()
+
+        if numa_nodes > 1:
+            for head_id in range(kv_head_num):
+                for block_idx in range(batch_size * max_block_num):
+                    if kv_head_num >= numa_nodes:
+                        owner = head_id * numa_nodes // kv_head_num
+                    else:
+                        owner = block_idx % numa_nodes
+                    for is_k in [True, False]:
+                        view = kvcache.block_view(0, head_id, block_idx, is_k)
+                        nodes = page_nodes_of(libnuma, view.__array_interface__['data'][0], view.nbytes)
+                        assert all(node == owner for node in nodes), (head_id, block_idx, nodes)
+        else:
+            print('no NUMA build or single node, placement not checked')
+
+        # prefill in two chunks per request, through the node-bucketed writes
+        ks = [[torch.randn((s, kv_head_num, head_dim), dtype=torch.float16) for s in seq_lens] for _ in range(layer_num)]
+        vs = [[torch.randn((s, kv_head_num, head_dim), dtype=torch.float16) for s in seq_lens] for _ in range(layer_num)]
+        for layer_idx in range(layer_num):
+            for b, seq_len in enumerate(seq_lens):
+                for begin, end in [(0, seq_len // 2), (seq_len // 2, seq_len)]:
+                    past = torch.tensor([begin], dtype=torch.int32)
+                    CPUInfer.submit(
+                        kvcache.update_kvcache_fp16(
+                            ks[layer_idx][b][begin:end].contiguous().data_ptr(),
+                            vs[layer_idx][b][begin:end].contiguous().data_ptr(),
+                            layer_idx, block_table[b].contiguous().data_ptr(), 1,
+                            max_block_num, past.data_ptr(), end - begin,
+                        )
+                    )
+                    CPUInfer.sync()
+
+        # one decode step of the whole batch
+        cache_seqlens = torch.tensor(seq_lens, dtype=torch.int32)
+        for layer_idx in range(layer_num):
+            q = (torch.randn((batch_size, 1, q_head_num, head_dim)) / 4).to(torch.float16).contiguous()
+            output = torch.empty((batch_size, 1, q_head_num, head_dim), dtype=torch.float16).contiguous()
+            attn_lse = torch.empty((batch_size, 1, q_head_num), dtype=torch.float32).contiguous()
+            CPUInfer.submit(
+                kvcache.attn(
+                    q.data_ptr(), output.data_ptr(), attn_lse.data_ptr(),
+                    layer_idx, 0, batch_size, 1, max_block_num, block_table.data_ptr(),
+                    cache_seqlens.data_ptr(), -1, -1, -1,
+                )
+            )
+            CPUInfer.sync()
+            for b in range(batch_size):
+                t_output = attn_torch(q[b, 0], ks[layer_idx][b], vs[layer_idx][b], kv_head_num)
+                diff = torch.mean(torch.abs(output[b, 0].float() - t_output)) / torch.mean(torch.abs(t_output))
+                print('kv_head_num', kv_head_num, 'layer', layer_idx, 'batch', b, 'diff = ', diff)
+                assert diff < 0.01
@@ -0,0 +1,110 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  QHEAD (per query head) block retrieval against a torch
+                reference that selects blocks per head from block-mean anchors
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 1
+kv_head_num = 2
+q_head_num = 8
+n_gqa = q_head_num // kv_head_num
+head_dim = 128
+block_len = 32
+anchor_num = 1
+max_block_num = 16
+full_block_num = 10
+seq_len = full_block_num * block_len + 5 # the partial last block is always read
+init_block_num = 1
+local_block_num = 2
+pick_block_num = 1
+CPUInfer = cpuinfer_ext.CPUInfer(4)
+validation_iter = 4
+
+def attn_torch(q, k, v, blocks_per_head):
+    out = torch.empty((q_head_num, head_dim))
+    for h in range(q_head_num):
+        idx = torch.cat([torch.arange(b * block_len, min((b + 1) * block_len, seq_len)) for b in blocks_per_head[h]])
+        kh = k[idx, h // n_gqa, :].float()
+        vh = v[idx, h // n_gqa, :].float()
+        score = kh @ q[h].float() / head_dim ** 0.5
+        out[h] = torch.softmax(score, dim=0) @ vh
+    return out
+
+def select_torch(q, k):
+    # BLOCK_MEAN anchors: similarity of head h to block b is q_h . mean(K_b)
+    middle = list(range(init_block_num, full_block_num - local_block_num))
+    tail = list(range(full_block_num - local_block_num, full_block_num + 1))
+    blocks_per_head = []
+    for h in range(q_head_num):
+        sim = [torch.dot(q[h].float(), k[b * block_len:(b + 1) * block_len, h // n_gqa, :].float().mean(0)) for b in middle]
+        top = sorted(range(len(middle)), key=lambda i: -sim[i])[:pick_block_num]
+        blocks_per_head.append(list(range(init_block_num)) + [middle[i] for i in top] + tail)
+    return blocks_per_head
+
+with torch.inference_mode(mode=True):
+    config = cpuinfer_ext.kvcache.KVCacheConfig(
+        layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+        cpuinfer_ext.kvcache.AnchorType.BLOCK_MEAN, cpuinfer_ext.kvcache.ggml_type.FP16,
+        cpuinfer_ext.kvcache.RetrievalType.QHEAD,
+        1, 1, 0, max_block_num, 1, 4,
+    )
+    block_table = torch.arange(max_block_num, dtype=torch.int32).view(1, -1).contiguous()
+    cache_seqlens = torch.tensor([seq_len], dtype=torch.int32)
+    seqlens_zero = torch.zeros((1,), dtype=torch.int32)
+
+    for i in range(validation_iter):
+        kvcache = cpuinfer_ext.kvcache.KVCache(config)
+        # every head of a kv group gets its own needle block among the
+        # middle blocks, so the heads of one group select different blocks
+        directions = torch.nn.functional.normalize(torch.randn((q_head_num, head_dim)), dim=-1)
+        k = torch.randn((seq_len, kv_head_num, head_dim))
+        needles = []
+        for h in range(q_head_num):
+            b = init_block_num + (h % n_gqa + i) % (full_block_num - local_block_num - init_block_num)
+            k[b * block_len:(b + 1) * block_len, h // n_gqa, :] += 3 * directions[h]
+            needles.append(b)
+        k = k.to(torch.float16).contiguous()
+        v = torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        CPUInfer.submit(
+            kvcache.update_kvcache_fp16(
+                k.data_ptr(), v.data_ptr(), 0, block_table.data_ptr(), 1,
+                max_block_num, seqlens_zero.data_ptr(), seq_len,
+            )
+        )
+        CPUInfer.sync()
+        CPUInfer.submit(
+            kvcache.calc_anchor_all_layers(block_table.data_ptr(), cache_seqlens.data_ptr(), 1, max_block_num)
+        )
+        CPUInfer.sync()
+
+        q = (directions / 2 + torch.randn((q_head_num, head_dim)) / 50).to(torch.float16)
+        blocks_per_head = select_torch(q, k)
+        for h in range(q_head_num):
+            assert needles[h] in blocks_per_head[h]
+
+        for pick, reference_blocks in [
+            (-1, [list(range(full_block_num + 1))] * q_head_num), # no retrieval
+            (pick_block_num, blocks_per_head),
+        ]:
+            input = q.view(1, 1, q_head_num, head_dim).contiguous()
+            output = torch.empty((1, 1, q_head_num, head_dim), dtype=torch.float16).contiguous()
+            attn_lse = torch.empty((1, 1, q_head_num), dtype=torch.float32).contiguous()
+            CPUInfer.submit(
+                kvcache.attn(
+                    input.data_ptr(), output.data_ptr(), attn_lse.data_ptr(),
+                    0, 0, 1, 1, max_block_num, block_table.data_ptr(),
+                    cache_seqlens.data_ptr(), pick, init_block_num, local_block_num,
+                )
+            )
+            CPUInfer.sync()
+            t_output = attn_torch(q, k, v, reference_blocks)
+            diff = torch.mean(torch.abs(output.view(q_head_num, head_dim).float() - t_output)) / torch.mean(torch.abs(t_output))
+            print('pick_block_num', pick, 'diff = ', diff)
+            assert diff < 0.01
@@ -0,0 +1,100 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  Quantized KVCache with per_token / per_channel K and V:
+                multi-token writes read back, and attention against torch
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 1
+kv_head_num = 2
+q_head_num = 8
+head_dim = 128
+block_len = 64
+anchor_num = 1
+max_block_num = 8
+# writes of one token, of a partial per_channel group, and across blocks
+chunks = [1, 7, 40, 64, 100, 88]
+seq_len = sum(chunks)
+CPUInfer = cpuinfer_ext.CPUInfer(4)
+PER_TOKEN, PER_CHANNEL = 0, 1
+
+def attn_torch(q, k, v):
+    # q: [q_head_num, head_dim], k/v: [seq_len, kv_head_num, head_dim]
+    n_gqa = q_head_num // kv_head_num
+    out = torch.empty((q_head_num, head_dim))
+    for h in range(q_head_num):
+        score = k[:, h // n_gqa, :].float() @ q[h].float() / head_dim ** 0.5
+        out[h] = torch.softmax(score, dim=0) @ v[:, h // n_gqa, :].float()
+    return out
+
+def rel_diff(a, b):
+    return torch.mean(torch.abs(a.float() - b.float())) / torch.mean(torch.abs(b.float()))
+
+with torch.inference_mode(mode=True):
+    cases = [
+        (cpuinfer_ext.kvcache.ggml_type.Q8_0, 0.02, 0.02),
+        (cpuinfer_ext.kvcache.ggml_type.Q4_0, 0.15, 0.1),
+    ]
+    for kv_type, read_tol, attn_tol in cases:
+        for k_quant_type in [PER_TOKEN, PER_CHANNEL]:
+            for v_quant_type in [PER_TOKEN, PER_CHANNEL]:
+                config = cpuinfer_ext.kvcache.KVCacheConfig(
+                    layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+                    cpuinfer_ext.kvcache.AnchorType.DYNAMIC, kv_type,
+                    cpuinfer_ext.kvcache.RetrievalType.LAYER,
+                    1, 1, 0, max_block_num, 1, 4, k_quant_type, v_quant_type,
+                )
+                kvcache = cpuinfer_ext.kvcache.KVCache(config)
+                block_table = torch.arange(max_block_num, dtype=torch.int32).view(1, -1).contiguous()
+
+                k = torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16)
+                v = torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16)
+                begin = 0
+                for q_len in chunks:
+                    past = torch.tensor([begin], dtype=torch.int32)
+                    CPUInfer.submit(
+                        kvcache.update_kvcache_fp16(
+                            k[begin:begin + q_len].contiguous().data_ptr(),
+                            v[begin:begin + q_len].contiguous().data_ptr(),
+                            0, block_table.data_ptr(), 1, max_block_num,
+                            past.data_ptr(), q_len,
+                        )
+                    )
+                    CPUInfer.sync()
+                    begin += q_len
+
+                cache_seqlens = torch.tensor([seq_len], dtype=torch.int32)
+                k_out = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+                v_out = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+                CPUInfer.submit(
+                    kvcache.get_kvcache_fp16(
+                        k_out.data_ptr(), v_out.data_ptr(), 0, block_table.data_ptr(),
+                        1, max_block_num, cache_seqlens.data_ptr(),
+                    )
+                )
+                CPUInfer.sync()
+                k_diff = rel_diff(k_out[0, :seq_len], k)
+                v_diff = rel_diff(v_out[0, :seq_len], v)
+
+                q = (torch.randn((1, 1, q_head_num, head_dim)) / 4).to(torch.float16).contiguous()
+                output = torch.empty((1, 1, q_head_num, head_dim), dtype=torch.float16).contiguous()
+                attn_lse = torch.empty((1, 1, q_head_num), dtype=torch.float32).contiguous()
+                CPUInfer.submit(
+                    kvcache.attn(
+                        q.data_ptr(), output.data_ptr(), attn_lse.data_ptr(),
+                        0, 0, 1, 1, max_block_num, block_table.data_ptr(),
+                        cache_seqlens.data_ptr(), -1, -1, -1,
+                    )
+                )
+                CPUInfer.sync()
+                attn_diff = rel_diff(output.view(q_head_num, head_dim), attn_torch(q.view(q_head_num, head_dim), k, v))
+                print('kv_type', kv_type, 'k_quant_type', k_quant_type, 'v_quant_type', v_quant_type,
+                      'k diff', k_diff, 'v diff', v_diff, 'attn diff', attn_diff)
+                assert k_diff < read_tol and v_diff < read_tol
+                assert attn_diff < attn_tol
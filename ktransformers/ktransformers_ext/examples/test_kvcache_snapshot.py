@@ -0,0 +1,198 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  Copy-on-write background snapshot of a KVCache that is
+                rewritten while the snapshot runs: the file matches a
+                synchronous dump and loads back the original tokens, and a
+                failed snapshot is reported while the previous file is kept
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys, tempfile, signal, resource
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 2
+kv_head_num = 2
+q_head_num = 8
+n_gqa = q_head_num // kv_head_num
+head_dim = 128
+block_len = 32
+anchor_num = 1
+max_block_num = 8
+seq_len = 200
+CPUInfer = cpuinfer_ext.CPUInfer(4)
+
+def attn_torch(q, k, v):
+    # q: [q_head_num, head_dim], k/v: [len, kv_head_num, head_dim]
+    out = torch.empty((q_head_num, head_dim))
+    for h in range(q_head_num):
+        score = k[:, h // n_gqa, :].float() @ q[h].float() / head_dim ** 0.5
+        out[h] = torch.softmax(score, dim=0) @ v[:, h // n_gqa, :].float()
+    return out
+
+def read_back(kvcache, layer_idx, block_table, length):
+    k_out = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    v_out = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    read_len = torch.tensor([length], dtype=torch.int32)
+    CPUInfer.submit(
+        kvcache.get_kvcache_fp16(
+            k_out.data_ptr(), v_out.data_ptr(), layer_idx, block_table.data_ptr(),
+            1, max_block_num, read_len.data_ptr(),
+        )
+    )
+    CPUInfer.sync()
+    return k_out[0, :length], v_out[0, :length]
+
+def write(kvcache, k, v, block_table):
+    for layer_idx in range(layer_num):
+        zero = torch.zeros((1,), dtype=torch.int32)
+        CPUInfer.submit(
+            kvcache.update_kvcache_fp16(
+                k[layer_idx].contiguous().data_ptr(), v[layer_idx].contiguous().data_ptr(),
+                layer_idx, block_table.data_ptr(), 1, max_block_num, zero.data_ptr(), seq_len,
+            )
+        )
+        CPUInfer.sync()
+
+with torch.inference_mode(mode=True), tempfile.TemporaryDirectory() as tmp:
+    for kv_type in [cpuinfer_ext.kvcache.ggml_type.FP16, cpuinfer_ext.kvcache.ggml_type.Q8_0]:
+        config = cpuinfer_ext.kvcache.KVCacheConfig(
+            layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+            cpuinfer_ext.kvcache.AnchorType.DYNAMIC, kv_type,
+            cpuinfer_ext.kvcache.RetrievalType.LAYER,
+            1, 1, 0, max_block_num, 1, 4,
+        )
+        kvcache = cpuinfer_ext.kvcache.KVCache(config)
+        # physical blocks in reverse, so the file order differs from memory
+        block_table = torch.arange(max_block_num - 1, -1, -1, dtype=torch.int32).view(1, -1).contiguous()
+        k = [torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16) for _ in range(layer_num)]
+        v = [torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16) for _ in range(layer_num)]
+        write(kvcache, k, v, block_table)
+        cache_seqlens = torch.tensor([seq_len], dtype=torch.int32)
+        CPUInfer.submit(kvcache.calc_anchor_all_layers(block_table.data_ptr(), cache_seqlens.data_ptr(), 1, max_block_num))
+        CPUInfer.sync()
+        kv_before = [read_back(kvcache, l, block_table, seq_len) for l in range(layer_num)]
+
+        dump_path = os.path.join(tmp, 'dump.bin')
+        snapshot_path = os.path.join(tmp, 'snapshot.bin')
+        CPUInfer.submit(kvcache.dump_kvcache(block_table.data_ptr(), seq_len, dump_path))
+        CPUInfer.sync()
+        # returns once the block table is captured; the blocks are written
+        # at the lowest I/O priority while the cache keeps changing
+        CPUInfer.submit(kvcache.snapshot_kvcache(block_table.data_ptr(), seq_len, snapshot_path, 7))
+        CPUInfer.sync()
+        k_new = [torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16) for _ in range(layer_num)]
+        v_new = [torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16) for _ in range(layer_num)]
+        write(kvcache, k_new, v_new, block_table)
+        CPUInfer.submit(kvcache.calc_anchor_all_layers(block_table.data_ptr(), cache_seqlens.data_ptr(), 1, max_block_num))
+        CPUInfer.sync()
+        CPUInfer.submit(kvcache.truncate(block_table.data_ptr(), cache_seqlens.data_ptr(), 0, max_block_num, seq_len // 2))
+        CPUInfer.sync()
+        kvcache.wait_snapshot()
+        assert not os.path.exists(snapshot_path + '.tmp')
+
+        # the snapshot is the cache as it was when it was taken
+        with open(dump_path, 'rb') as f_dump, open(snapshot_path, 'rb') as f_snapshot:
+            assert f_dump.read() == f_snapshot.read(), "snapshot differs from a synchronous dump"
+        # while the live cache holds the rewrites
+        k_live, _ = read_back(kvcache, 0, block_table, seq_len // 2)
+        assert not torch.equal(k_live, kv_before[0][0][:seq_len // 2])
+
+        # load_kvcache places the blocks at physical 0, 1, ...
+        loaded = cpuinfer_ext.kvcache.KVCache(config)
+        CPUInfer.submit(loaded.load_kvcache(snapshot_path))
+        CPUInfer.sync()
+        identity = torch.arange(max_block_num, dtype=torch.int32).view(1, -1).contiguous()
+        for layer_idx in range(layer_num):
+            k_out, v_out = read_back(loaded, layer_idx, identity, seq_len)
+            assert torch.equal(k_out, kv_before[layer_idx][0]) and torch.equal(v_out, kv_before[layer_idx][1])
+
+            q = (torch.randn((1, 1, q_head_num, head_dim)) / 4).to(torch.float16).contiguous()
+            output = torch.empty((1, 1, q_head_num, head_dim), dtype=torch.float16).contiguous()
+            attn_lse = torch.empty((1, 1, q_head_num), dtype=torch.float32).contiguous()
+            loaded_seqlens = torch.tensor([seq_len], dtype=torch.int32)
+            CPUInfer.submit(
+                loaded.attn(
+                    q.data_ptr(), output.data_ptr(), attn_lse.data_ptr(),
+                    layer_idx, 0, 1, 1, max_block_num, identity.data_ptr(),
+                    loaded_seqlens.data_ptr(), -1, -1, -1,
+                )
+            )
+            CPUInfer.sync()
+            t_output = attn_torch(q.view(q_head_num, head_dim), k[layer_idx], v[layer_idx])
+            diff = torch.mean(torch.abs(output.view(q_head_num, head_dim).float() - t_output)) / torch.mean(torch.abs(t_output))
+            print('kv_type', kv_type, 'layer', layer_idx, 'diff = ', diff)
+            assert diff < (0.01 if kv_type == cpuinfer_ext.kvcache.ggml_type.FP16 else 0.03)
+
+# a snapshot that cannot be written is reported by wait_snapshot, while the
+# previous file stays as it was and no temporary file is left behind
+with torch.inference_mode(mode=True), tempfile.TemporaryDirectory() as tmp:
+    config = cpuinfer_ext.kvcache.KVCacheConfig(
+        layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+        cpuinfer_ext.kvcache.AnchorType.DYNAMIC, cpuinfer_ext.kvcache.ggml_type.FP16,
+        cpuinfer_ext.kvcache.RetrievalType.LAYER,
+        1, 1, 0, max_block_num, 1, 4,
+    )
+    kvcache = cpuinfer_ext.kvcache.KVCache(config)
+    block_table = torch.arange(max_block_num, dtype=torch.int32).view(1, -1).contiguous()
+    k = [torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16) for _ in range(layer_num)]
+    v = [torch.randn((seq_len, kv_head_num, head_dim), dtype=torch.float16) for _ in range(layer_num)]
+    write(kvcache, k, v, block_table)
+    snapshot_path = os.path.join(tmp, 'snapshot.bin')
+    CPUInfer.submit(kvcache.snapshot_kvcache(block_table.data_ptr(), seq_len, snapshot_path, 7))
+    CPUInfer.sync()
+    kvcache.wait_snapshot()
+    with open(snapshot_path, 'rb') as fh:
+        good = fh.read()
+
+    # writes past RLIMIT_FSIZE fail with EFBIG once SIGXFSZ is ignored
+    write(kvcache, [x + 1 for x in k], [x + 1 for x in v], block_table)
+    old_handler = signal.signal(signal.SIGXFSZ, signal.SIG_IGN)
+    old_limit = resource.getrlimit(resource.RLIMIT_FSIZE)
+    resource.setrlimit(resource.RLIMIT_FSIZE, (len(good) // 2, old_limit[1]))
+    try:
+        CPUInfer.submit(kvcache.snapshot_kvcache(block_table.data_ptr(), seq_len, snapshot_path, 7))
+        CPUInfer.sync()
+        try:
+            kvcache.wait_snapshot()
+            assert False, "short write not reported"
+        except RuntimeError as e:
+            print('short write:', e)
+    finally:
+        resource.setrlimit(resource.RLIMIT_FSIZE, old_limit)
+        signal.signal(signal.SIGXFSZ, old_handler)
+    with open(snapshot_path, 'rb') as fh:
+        assert fh.read() == good, "previous snapshot replaced by a partial one"
+    assert not os.path.exists(snapshot_path + '.tmp')
+    # the error is reported once
+    kvcache.wait_snapshot()
+
+    # an unopenable file is reported by the next snapshot_kvcache too
+    missing_path = os.path.join(tmp, 'missing', 'snapshot.bin')
+    CPUInfer.submit(kvcache.snapshot_kvcache(block_table.data_ptr(), seq_len, missing_path, 7))
+    CPUInfer.sync()
+    CPUInfer.submit(kvcache.snapshot_kvcache(block_table.data_ptr(), seq_len, snapshot_path, 7))
+    try:
+        CPUInfer.sync()
+        assert False, "open failure not reported"
+    except RuntimeError as e:
+        print('open failure:', e)
+    kvcache.wait_snapshot()
+
+    # MLA caches are rejected up front
+    mla_config = cpuinfer_ext.kvcache.KVCacheConfig(
+        layer_num, 1, q_head_num, 160, block_len, anchor_num,
+        cpuinfer_ext.kvcache.AnchorType.DYNAMIC, cpuinfer_ext.kvcache.ggml_type.FP16,
+        cpuinfer_ext.kvcache.RetrievalType.LAYER,
+        1, 1, 0, max_block_num, 1, 4, 0, 1, 0, 0, 128,
+    )
+    mla = cpuinfer_ext.kvcache.KVCache(mla_config)
+    CPUInfer.submit(mla.snapshot_kvcache(block_table.data_ptr(), seq_len, snapshot_path, 7))
+    try:
+        CPUInfer.sync()
+        assert False, "MLA snapshot not rejected"
+    except ValueError as e:
+        print('MLA:', e)
+    print('failed snapshots are reported and keep the previous file')
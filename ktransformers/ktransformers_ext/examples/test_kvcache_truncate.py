@@ -0,0 +1,144 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  Speculative decoding on KVCache: draft-tree attention with
+                tree_mask, then truncate back to the accepted prefix, against
+                a torch reference
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 2
+kv_head_num = 2
+q_head_num = 8
+n_gqa = q_head_num // kv_head_num
+head_dim = 128
+block_len = 32
+anchor_num = 1
+max_block_num = 8
+past_len = 60 # the draft crosses into the next block
+# draft tree: 0 is the root, 1 and 2 its children, 3 under 1, 4 under 2
+parents = [-1, 0, 0, 1, 2]
+draft_len = len(parents)
+accepted = 2 # tokens 0 and 1 are accepted
+CPUInfer = cpuinfer_ext.CPUInfer(4)
+
+def tree_mask_torch():
+    mask = torch.zeros((draft_len, draft_len), dtype=torch.uint8)
+    for t in range(draft_len):
+        s = t
+        while s != -1:
+            mask[t, s] = 1
+            s = parents[s]
+    return mask
+
+def attn_torch(q, k, v, visible):
+    # q: [q_head_num, head_dim], k/v: [len, kv_head_num, head_dim], visible: [len] bool
+    out = torch.empty((q_head_num, head_dim))
+    for h in range(q_head_num):
+        score = k[visible, h // n_gqa, :].float() @ q[h].float() / head_dim ** 0.5
+        out[h] = torch.softmax(score, dim=0) @ v[visible, h // n_gqa, :].float()
+    return out
+
+def rel_diff(a, b):
+    return torch.mean(torch.abs(a.float() - b.float())) / torch.mean(torch.abs(b.float()))
+
+with torch.inference_mode(mode=True):
+    for kv_type, tol in [(cpuinfer_ext.kvcache.ggml_type.FP16, 0.01), (cpuinfer_ext.kvcache.ggml_type.Q8_0, 0.03)]:
+        config = cpuinfer_ext.kvcache.KVCacheConfig(
+            layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+            cpuinfer_ext.kvcache.AnchorType.DYNAMIC, kv_type,
+            cpuinfer_ext.kvcache.RetrievalType.LAYER,
+            1, 1, 0, max_block_num, 1, 4,
+        )
+        kvcache = cpuinfer_ext.kvcache.KVCache(config)
+        block_table = torch.arange(max_block_num, dtype=torch.int32).view(1, -1).contiguous()
+        total = past_len + draft_len
+        k = [torch.randn((total + 1, kv_head_num, head_dim), dtype=torch.float16) for _ in range(layer_num)]
+        v = [torch.randn((total + 1, kv_head_num, head_dim), dtype=torch.float16) for _ in range(layer_num)]
+        for layer_idx in range(layer_num):
+            zero = torch.zeros((1,), dtype=torch.int32)
+            CPUInfer.submit(
+                kvcache.update_kvcache_fp16(
+                    k[layer_idx][:past_len].contiguous().data_ptr(),
+                    v[layer_idx][:past_len].contiguous().data_ptr(),
+                    layer_idx, block_table.data_ptr(), 1, max_block_num,
+                    zero.data_ptr(), past_len,
+                )
+            )
+            CPUInfer.sync()
+
+        # verify the draft tree in every layer
+        mask = tree_mask_torch()
+        cu_seqlens_q = torch.tensor([0, draft_len], dtype=torch.int32)
+        for layer_idx in range(layer_num):
+            q = (torch.randn((draft_len, q_head_num, head_dim)) / 4).to(torch.float16).contiguous()
+            output = torch.empty((draft_len, q_head_num, head_dim), dtype=torch.float16).contiguous()
+            attn_lse = torch.empty((draft_len, q_head_num), dtype=torch.float32).contiguous()
+            cache_seqlens = torch.tensor([past_len], dtype=torch.int32)
+            CPUInfer.submit(
+                kvcache.attn_with_kvcache_varlen(
+                    q.data_ptr(),
+                    k[layer_idx][past_len:total].contiguous().data_ptr(),
+                    v[layer_idx][past_len:total].contiguous().data_ptr(),
+                    output.data_ptr(), attn_lse.data_ptr(), layer_idx, 1,
+                    cu_seqlens_q.data_ptr(), max_block_num, block_table.data_ptr(),
+                    cache_seqlens.data_ptr(), mask.contiguous().data_ptr(),
+                )
+            )
+            CPUInfer.sync()
+            assert cache_seqlens.item() == total
+            for t in range(draft_len):
+                visible = torch.cat([torch.ones(past_len, dtype=torch.bool), mask[t].bool()])
+                diff = rel_diff(output[t], attn_torch(q[t], k[layer_idx][:total], v[layer_idx][:total], visible))
+                print('kv_type', kv_type, 'layer', layer_idx, 'draft token', t, 'diff = ', diff)
+                assert diff < tol
+
+        # roll back the rejected draft tokens in all layers
+        new_len = past_len + accepted
+        cache_seqlens = torch.tensor([total], dtype=torch.int32)
+        CPUInfer.submit(kvcache.truncate(block_table.data_ptr(), cache_seqlens.data_ptr(), 0, max_block_num, new_len))
+        CPUInfer.sync()
+        assert cache_seqlens.item() == new_len
+
+        for layer_idx in range(layer_num):
+            k_out = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+            v_out = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+            read_len = torch.tensor([total], dtype=torch.int32)
+            CPUInfer.submit(
+                kvcache.get_kvcache_fp16(
+                    k_out.data_ptr(), v_out.data_ptr(), layer_idx, block_table.data_ptr(),
+                    1, max_block_num, read_len.data_ptr(),
+                )
+            )
+            CPUInfer.sync()
+            # dropped tokens read back as zeros, kept ones as written
+            assert torch.all(k_out[0, new_len:total] == 0) and torch.all(v_out[0, new_len:total] == 0)
+            assert rel_diff(k_out[0, :new_len], k[layer_idx][:new_len]) < tol
+            assert rel_diff(v_out[0, :new_len], v[layer_idx][:new_len]) < tol
+
+            # the next token sees the accepted prefix only
+            q = (torch.randn((1, q_head_num, head_dim)) / 4).to(torch.float16).contiguous()
+            k_next = k[layer_idx][total:total + 1].contiguous()
+            v_next = v[layer_idx][total:total + 1].contiguous()
+            output = torch.empty((1, q_head_num, head_dim), dtype=torch.float16).contiguous()
+            attn_lse = torch.empty((1, q_head_num), dtype=torch.float32).contiguous()
+            next_seqlens = torch.tensor([new_len], dtype=torch.int32)
+            cu_seqlens_q = torch.tensor([0, 1], dtype=torch.int32)
+            CPUInfer.submit(
+                kvcache.attn_with_kvcache_varlen(
+                    q.data_ptr(), k_next.data_ptr(), v_next.data_ptr(), output.data_ptr(),
+                    attn_lse.data_ptr(), layer_idx, 1, cu_seqlens_q.data_ptr(),
+                    max_block_num, block_table.data_ptr(), next_seqlens.data_ptr(), 0,
+                )
+            )
+            CPUInfer.sync()
+            k_ref = torch.cat([k[layer_idx][:new_len], k_next])
+            v_ref = torch.cat([v[layer_idx][:new_len], v_next])
+            diff = rel_diff(output[0], attn_torch(q[0], k_ref, v_ref, torch.ones(new_len + 1, dtype=torch.bool)))
+            print('kv_type', kv_type, 'layer', layer_idx, 'after truncate diff = ', diff)
+            assert diff < tol
@@ -0,0 +1,115 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  attn_with_kvcache_varlen on a ragged batch (decode and
+                prefill requests in one call) against a causal torch reference,
+                and the rejection of window caches
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 1
+kv_head_num = 2
+q_head_num = 8
+n_gqa = q_head_num // kv_head_num
+head_dim = 128
+block_len = 32
+anchor_num = 1
+blocks_per_request = 8
+# (cached tokens, new tokens): a decode step, a prefill chunk on top of a
+# partial block, and a prefill from scratch longer than one block
+requests = [(100, 1), (70, 40), (0, 33)]
+batch_size = len(requests)
+max_block_num = blocks_per_request
+CPUInfer = cpuinfer_ext.CPUInfer(4)
+
+def causal_torch(q, k, v, past_len):
+    # q: [q_len, q_head_num, head_dim], k/v: [past_len + q_len, kv_head_num, head_dim]
+    out = torch.empty(q.shape)
+    for t in range(q.shape[0]):
+        for h in range(q_head_num):
+            kh = k[:past_len + t + 1, h // n_gqa, :].float()
+            score = kh @ q[t, h].float() / head_dim ** 0.5
+            out[t, h] = torch.softmax(score, dim=0) @ v[:past_len + t + 1, h // n_gqa, :].float()
+    return out
+
+with torch.inference_mode(mode=True):
+    for kv_type, tol in [(cpuinfer_ext.kvcache.ggml_type.FP16, 0.01), (cpuinfer_ext.kvcache.ggml_type.Q8_0, 0.03)]:
+        config = cpuinfer_ext.kvcache.KVCacheConfig(
+            layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+            cpuinfer_ext.kvcache.AnchorType.DYNAMIC, kv_type,
+            cpuinfer_ext.kvcache.RetrievalType.LAYER,
+            1, 1, 0, batch_size * blocks_per_request, batch_size, 4,
+        )
+        kvcache = cpuinfer_ext.kvcache.KVCache(config)
+        # every request owns its own physical blocks
+        block_table = torch.arange(batch_size * blocks_per_request, dtype=torch.int32).view(batch_size, -1).contiguous()
+
+        ks, vs = [], []
+        for b, (past_len, q_len) in enumerate(requests):
+            k = torch.randn((past_len + q_len, kv_head_num, head_dim), dtype=torch.float16)
+            v = torch.randn((past_len + q_len, kv_head_num, head_dim), dtype=torch.float16)
+            ks.append(k)
+            vs.append(v)
+            if past_len > 0:
+                zero = torch.zeros((1,), dtype=torch.int32)
+                CPUInfer.submit(
+                    kvcache.update_kvcache_fp16(
+                        k[:past_len].contiguous().data_ptr(), v[:past_len].contiguous().data_ptr(),
+                        0, block_table[b].contiguous().data_ptr(), 1, max_block_num,
+                        zero.data_ptr(), past_len,
+                    )
+                )
+                CPUInfer.sync()
+
+        cu_seqlens_q = torch.tensor([0] + [sum(q for _, q in requests[:b + 1]) for b in range(batch_size)], dtype=torch.int32)
+        total_q = int(cu_seqlens_q[-1])
+        q = (torch.randn((total_q, q_head_num, head_dim)) / 4).to(torch.float16).contiguous()
+        k_new = torch.cat([ks[b][p:] for b, (p, _) in enumerate(requests)]).contiguous()
+        v_new = torch.cat([vs[b][p:] for b, (p, _) in enumerate(requests)]).contiguous()
+        cache_seqlens = torch.tensor([p for p, _ in requests], dtype=torch.int32)
+        output = torch.empty((total_q, q_head_num, head_dim), dtype=torch.float16).contiguous()
+        attn_lse = torch.empty((total_q, q_head_num), dtype=torch.float32).contiguous()
+        CPUInfer.submit(
+            kvcache.attn_with_kvcache_varlen(
+                q.data_ptr(), k_new.data_ptr(), v_new.data_ptr(), output.data_ptr(),
+                attn_lse.data_ptr(), 0, batch_size, cu_seqlens_q.data_ptr(),
+                max_block_num, block_table.data_ptr(), cache_seqlens.data_ptr(), 0,
+            )
+        )
+        CPUInfer.sync()
+        assert cache_seqlens.tolist() == [p + n for p, n in requests]
+
+        for b, (past_len, q_len) in enumerate(requests):
+            begin, end = int(cu_seqlens_q[b]), int(cu_seqlens_q[b + 1])
+            t_output = causal_torch(q[begin:end], ks[b], vs[b], past_len)
+            diff = torch.mean(torch.abs(output[begin:end].float() - t_output)) / torch.mean(torch.abs(t_output))
+            print('kv_type', kv_type, 'request', b, 'past', past_len, 'q_len', q_len, 'diff = ', diff)
+            assert diff < tol
+
+    # window caches are rejected instead of attending the wrong ring slots
+    window_config = cpuinfer_ext.kvcache.KVCacheConfig(
+        layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+        cpuinfer_ext.kvcache.AnchorType.DYNAMIC, cpuinfer_ext.kvcache.ggml_type.FP16,
+        cpuinfer_ext.kvcache.RetrievalType.LAYER,
+        1, 1, 0, batch_size * blocks_per_request, batch_size, 4, 0, 1,
+        1, 3, 0, 0.0,
+    )
+    window = cpuinfer_ext.kvcache.KVCache(window_config)
+    cache_seqlens = torch.tensor([p for p, _ in requests], dtype=torch.int32)
+    CPUInfer.submit(
+        window.attn_with_kvcache_varlen(
+            q.data_ptr(), k_new.data_ptr(), v_new.data_ptr(), output.data_ptr(),
+            attn_lse.data_ptr(), 0, batch_size, cu_seqlens_q.data_ptr(),
+            max_block_num, block_table.data_ptr(), cache_seqlens.data_ptr(), 0,
+        )
+    )
+    try:
+        CPUInfer.sync()
+        assert False, "window cache not rejected"
+    except ValueError as e:
+        print('window:', e)
@@ -0,0 +1,112 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  Zero-copy block views and the bulk multi-layer gather of an
+                fp16 KVCache against the tokens written
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 3
+kv_head_num = 2
+q_head_num = 8
+head_dim = 128
+block_len = 32
+anchor_num = 1
+max_block_num = 4
+batch_size = 2
+seq_lens = [100, 37]
+CPUInfer = cpuinfer_ext.CPUInfer(4)
+
+with torch.inference_mode(mode=True):
+    config = cpuinfer_ext.kvcache.KVCacheConfig(
+        layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+        cpuinfer_ext.kvcache.AnchorType.DYNAMIC, cpuinfer_ext.kvcache.ggml_type.FP16,
+        cpuinfer_ext.kvcache.RetrievalType.LAYER,
+        1, 1, 0, batch_size * max_block_num, batch_size, 4,
+    )
+    kvcache = cpuinfer_ext.kvcache.KVCache(config)
+    # interleave the requests' blocks so logical and physical order differ
+    block_table = torch.arange(batch_size * max_block_num, dtype=torch.int32).view(max_block_num, batch_size).t().contiguous()
+
+    k = [[torch.randn((s, kv_head_num, head_dim), dtype=torch.float16) for s in seq_lens] for _ in range(layer_num)]
+    v = [[torch.randn((s, kv_head_num, head_dim), dtype=torch.float16) for s in seq_lens] for _ in range(layer_num)]
+    for layer_idx in range(layer_num):
+        for b, seq_len in enumerate(seq_lens):
+            zero = torch.zeros((1,), dtype=torch.int32)
+            CPUInfer.submit(
+                kvcache.update_kvcache_fp16(
+                    k[layer_idx][b].contiguous().data_ptr(), v[layer_idx][b].contiguous().data_ptr(),
+                    layer_idx, block_table[b].contiguous().data_ptr(), 1, max_block_num,
+                    zero.data_ptr(), seq_len,
+                )
+            )
+            CPUInfer.sync()
+
+    # every block view shows the tokens written to it, V through strides
+    for layer_idx in range(layer_num):
+        for b, seq_len in enumerate(seq_lens):
+            for block_id in range((seq_len + block_len - 1) // block_len):
+                block_idx = int(block_table[b, block_id])
+                begin, end = block_id * block_len, min((block_id + 1) * block_len, seq_len)
+                for head_id in range(kv_head_num):
+                    for is_k, ref in [(True, k), (False, v)]:
+                        view = kvcache.block_view(layer_idx, head_id, block_idx, is_k)
+                        assert view.shape == (block_len, head_dim)
+                        block = torch.from_numpy(view.copy())
+                        assert torch.equal(block[:end - begin], ref[layer_idx][b][begin:end, head_id])
+
+    # views are read-only and follow later writes to their block
+    view = kvcache.block_view(0, 0, int(block_table[1, 1]), True)
+    assert not view.flags.writeable
+    try:
+        view[0, 0] = 1
+        assert False, "writing through a block view must fail"
+    except ValueError:
+        pass
+    k_next = torch.randn((1, kv_head_num, head_dim), dtype=torch.float16)
+    v_next = torch.randn((1, kv_head_num, head_dim), dtype=torch.float16)
+    past = torch.tensor([seq_lens[1]], dtype=torch.int32)
+    CPUInfer.submit(
+        kvcache.update_kvcache_fp16(
+            k_next.data_ptr(), v_next.data_ptr(), 0, block_table[1].contiguous().data_ptr(),
+            1, max_block_num, past.data_ptr(), 1,
+        )
+    )
+    CPUInfer.sync()
+    assert torch.equal(torch.from_numpy(view[seq_lens[1] - block_len].copy()), k_next[0, 0])
+
+    # out-of-range indices raise instead of reading past the cache
+    for layer_id, head_id, block_idx in [
+        (layer_num, 0, 0), (-1, 0, 0), (0, kv_head_num, 0), (0, 0, batch_size * max_block_num), (0, 0, -1),
+    ]:
+        for is_k in [True, False]:
+            try:
+                kvcache.block_view(layer_id, head_id, block_idx, is_k)
+                assert False, "out-of-range block_view must raise"
+            except IndexError:
+                pass
+
+    # gather layers [1, 3), untouched by the write above, in one pass
+    layer_begin, layer_end = 1, layer_num
+    cache_seqlens = torch.tensor(seq_lens, dtype=torch.int32)
+    shape = (layer_end - layer_begin, batch_size, max_block_num * block_len, kv_head_num, head_dim)
+    k_out = torch.zeros(shape, dtype=torch.float16).contiguous()
+    v_out = torch.zeros(shape, dtype=torch.float16).contiguous()
+    CPUInfer.submit(
+        kvcache.gather_kvcache_fp16(
+            k_out.data_ptr(), v_out.data_ptr(), layer_begin, layer_end, block_table.data_ptr(),
+            batch_size, max_block_num, cache_seqlens.data_ptr(),
+        )
+    )
+    CPUInfer.sync()
+    for i, layer_idx in enumerate(range(layer_begin, layer_end)):
+        for b, seq_len in enumerate(seq_lens):
+            assert torch.equal(k_out[i, b, :seq_len], k[layer_idx][b])
+            assert torch.equal(v_out[i, b, :seq_len], v[layer_idx][b])
+            assert torch.all(k_out[i, b, seq_len:] == 0)
+    print('block views and gather match')
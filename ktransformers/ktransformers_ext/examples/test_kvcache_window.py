@@ -0,0 +1,101 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  KVCache sink + sliding window attention against a torch
+                reference, with and without re-rotating the sinks
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 1
+kv_head_num = 2
+q_head_num = 8
+head_dim = 128
+block_len = 32
+anchor_num = 1
+sink_block_num = 1
+window_block_num = 3
+max_block_num = sink_block_num + window_block_num # the ring needs no more
+rope_theta = 10000.0
+seqlens = [20, 3 * block_len + 7, 11 * block_len + 5]
+CPUInfer = cpuinfer_ext.CPUInfer(4)
+
+def rope(x, pos):
+    # rotate_half layout, x: [len, heads, head_dim], pos: [len]
+    inv_freq = rope_theta ** (-torch.arange(0, head_dim, 2, dtype=torch.float64) / head_dim)
+    angle = pos.to(torch.float64)[:, None] * inv_freq[None, :]
+    cos = torch.cat([angle.cos(), angle.cos()], dim=-1)[:, None, :].float()
+    sin = torch.cat([angle.sin(), angle.sin()], dim=-1)[:, None, :].float()
+    x1, x2 = x[..., :head_dim // 2], x[..., head_dim // 2:]
+    return x * cos + torch.cat([-x2, x1], dim=-1) * sin
+
+def window_torch(q_raw, k_raw, v, seq_len, rerotate):
+    block_num = (seq_len + block_len - 1) // block_len
+    first = max(sink_block_num, block_num - window_block_num)
+    sink_len = min(seq_len, sink_block_num * block_len)
+    shift = (first - sink_block_num) * block_len if rerotate else 0
+    sink_pos = torch.arange(sink_len) + shift
+    window_pos = torch.arange(first * block_len, seq_len) if block_num > sink_block_num else torch.arange(0)
+    k = torch.cat([rope(k_raw[:sink_len], sink_pos), rope(k_raw[window_pos], window_pos)])
+    vv = torch.cat([v[:sink_len], v[window_pos]]).float()
+    q = rope(q_raw, torch.tensor([seq_len - 1]))[0]
+    n_gqa = q_head_num // kv_head_num
+    out = torch.empty((q_head_num, head_dim))
+    for h in range(q_head_num):
+        score = k[:, h // n_gqa, :] @ q[h] / head_dim ** 0.5
+        out[h] = torch.softmax(score, dim=0) @ vv[:, h // n_gqa, :]
+    return out
+
+with torch.inference_mode(mode=True):
+    for kv_type, tol in [(cpuinfer_ext.kvcache.ggml_type.FP16, 0.01), (cpuinfer_ext.kvcache.ggml_type.Q8_0, 0.03)]:
+        for theta in [0.0, rope_theta]:
+            config = cpuinfer_ext.kvcache.KVCacheConfig(
+                layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
+                cpuinfer_ext.kvcache.AnchorType.DYNAMIC, kv_type,
+                cpuinfer_ext.kvcache.RetrievalType.LAYER,
+                1, 1, 0, max_block_num, 1, 4, 0, 1,
+                sink_block_num, window_block_num, 0, theta,
+            )
+            block_table = torch.arange(max_block_num, dtype=torch.int32).view(1, -1).contiguous()
+            for seq_len in seqlens:
+                kvcache = cpuinfer_ext.kvcache.KVCache(config)
+                k_raw = torch.randn((seq_len, kv_head_num, head_dim))
+                v = torch.randn((seq_len, kv_head_num, head_dim)).to(torch.float16)
+                # the cache holds keys rotated at the position they were written
+                k = rope(k_raw, torch.arange(seq_len)).to(torch.float16)
+                # one block per call, so no two tokens of a call share a ring slot
+                for begin in range(0, seq_len, block_len):
+                    q_len = min(block_len, seq_len - begin)
+                    past = torch.tensor([begin], dtype=torch.int32)
+                    CPUInfer.submit(
+                        kvcache.update_kvcache_fp16(
+                            k[begin:begin + q_len].contiguous().data_ptr(),
+                            v[begin:begin + q_len].contiguous().data_ptr(),
+                            0, block_table.data_ptr(), 1, max_block_num,
+                            past.data_ptr(), q_len,
+                        )
+                    )
+                    CPUInfer.sync()
+
+                q_raw = torch.randn((1, q_head_num, head_dim)) / 4
+                input = rope(q_raw, torch.tensor([seq_len - 1])).to(torch.float16).contiguous()
+                output = torch.empty((1, 1, q_head_num, head_dim), dtype=torch.float16).contiguous()
+                attn_lse = torch.empty((1, 1, q_head_num), dtype=torch.float32).contiguous()
+                cache_seqlens = torch.tensor([seq_len], dtype=torch.int32)
+                CPUInfer.submit(
+                    kvcache.attn(
+                        input.data_ptr(), output.data_ptr(), attn_lse.data_ptr(),
+                        0, 0, 1, 1, max_block_num, block_table.data_ptr(),
+                        cache_seqlens.data_ptr(), -1, -1, -1,
+                    )
+                )
+                CPUInfer.sync()
+
+                t_output = window_torch(q_raw, k_raw, v, seq_len, theta > 0)
+                diff = torch.mean(torch.abs(output.view(q_head_num, head_dim).float() - t_output)) / torch.mean(torch.abs(t_output))
+                print('kv_type', kv_type, 'rope_theta', theta, 'seq_len', seq_len, 'diff = ', diff)
+                assert diff < tol
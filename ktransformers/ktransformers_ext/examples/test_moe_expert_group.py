@@ -0,0 +1,161 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  MOE experts sharded over several local processes, for
+                decode and prefill lengths, a request a peer rejects and
+                transport setup errors
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import multiprocessing as mp
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+# usage: test_moe_expert_group.py [shm|tcp]
+transport_type = sys.argv[1] if len(sys.argv) > 1 else "shm"
+world_size = 3
+base_port = 29650
+expert_num = 24
+hidden_size = 1024
+intermediate_size = 512
+stride = 32
+group_min_len = 10
+group_max_len = 1024
+gate_type = 1 # ggml_type::GGML_TYPE_F16
+up_type = 1 # ggml_type::GGML_TYPE_F16
+down_type = 1 # ggml_type::GGML_TYPE_F16
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+n_routed_experts = 6
+qlens = [4, 16] # 16 >= group_min_len goes through MOE.forward_many
+max_qlen = max(qlens)
+layer_num = 4
+validation_iter = 50
+
+def act_fn(x):
+    return x / (1.0 + torch.exp(-x))
+
+def mlp_torch(input, gate_proj, up_proj, down_proj):
+    gate_buf = torch.mm(input, gate_proj.t())
+    up_buf = torch.mm(input, up_proj.t())
+    intermediate = act_fn(gate_buf) * up_buf
+    ret = torch.mm(intermediate, down_proj.t())
+    return ret
+
+def moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj):
+    output = torch.zeros((input.shape[0], hidden_size), dtype=torch.float32)
+    for i in range(input.shape[0]):
+        for j in range(expert_ids.shape[1]):
+            e = expert_ids[i, j]
+            y = mlp_torch(input[i:i+1].float(), gate_proj[e].float(), up_proj[e].float(), down_proj[e].float())
+            output[i] += y[0] * weights[i, j]
+    return output.to(torch.float16)
+
+def make_weights():
+    # Same seed in every process; each rank then keeps its own slice.
+    torch.manual_seed(0)
+    layers = []
+    for _ in range(layer_num):
+        gate_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        up_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        down_proj = (torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        layers.append((gate_proj, up_proj, down_proj))
+    return layers
+
+def rank_main(rank, shm_name, result):
+    if transport_type == "tcp":
+        transport = cpuinfer_ext.moe.TCPTransport(rank, ["127.0.0.1"] * world_size, base_port)
+    else:
+        transport = cpuinfer_ext.moe.ShmTransport(shm_name, rank, world_size)
+    CPUInfer = cpuinfer_ext.CPUInfer(4)
+    layers = make_weights()
+    group_config = cpuinfer_ext.moe.MOEExpertGroupConfig(expert_num, n_routed_experts, hidden_size, hidden_type, max_qlen)
+    group = cpuinfer_ext.moe.MOEExpertGroup(group_config, transport)
+    local_projs = []
+    # rank 0 registers one layer more than its peers, which reject it
+    for gate_proj, up_proj, down_proj in layers + (layers[:1] if rank == 0 else []):
+        # expert e lives on rank e % world_size
+        local = (gate_proj[rank::world_size].contiguous(), up_proj[rank::world_size].contiguous(), down_proj[rank::world_size].contiguous())
+        config = cpuinfer_ext.moe.MOEConfig(local[0].shape[0], n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len, local[0].data_ptr(), local[1].data_ptr(), local[2].data_ptr(), gate_type, up_type, down_type, hidden_type)
+        group.add_layer(cpuinfer_ext.moe.MOE(config))
+        local_projs.append(local)
+
+    if rank != 0:
+        group.serve(CPUInfer)
+        return
+
+    def forward(layer, qlen):
+        expert_ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+        weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+        input = (torch.randn((qlen, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        output = torch.empty((qlen, hidden_size), dtype=torch.float16).contiguous()
+        CPUInfer.submit(
+            group.forward(
+                layer,
+                qlen,
+                n_routed_experts,
+                expert_ids.data_ptr(),
+                weights.data_ptr(),
+                input.data_ptr(),
+                output.data_ptr()
+            )
+        )
+        CPUInfer.sync()
+        return expert_ids, weights, input, output
+
+    def diff_to_torch(layer, expert_ids, weights, input, output):
+        gate_proj, up_proj, down_proj = layers[layer]
+        t_output = moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj)
+        return (torch.mean(torch.abs(output.float() - t_output.float())) / torch.mean(torch.abs(t_output.float()))).item()
+
+    torch.manual_seed(100)
+    max_diff = 0
+    for i in range(validation_iter):
+        layer = i % layer_num
+        qlen = qlens[i % len(qlens)]
+        expert_ids, weights, input, output = forward(layer, qlen)
+        max_diff = max(max_diff, diff_to_torch(layer, expert_ids, weights, input, output))
+
+    # a request rank 0 itself cannot run is refused before anything is sent
+    try:
+        group.forward(0, max_qlen + 1, n_routed_experts, 0, 0, 0, 0)
+        assert False, "qlen past max_qlen accepted"
+    except ValueError:
+        pass
+
+    # the peers fail the extra layer, which sync raises, and the group keeps
+    # working
+    try:
+        forward(layer_num, max_qlen)
+        assert False, "rejected request not reported"
+    except RuntimeError as e:
+        print('rejected:', e)
+    max_diff = max(max_diff, diff_to_torch(1, *forward(1, max_qlen)))
+    group.shutdown()
+    print(transport_type, 'max diff = ', max_diff)
+    result.put(max_diff)
+
+def check_transport_errors():
+    # setup failures raise instead of exiting the process
+    for make in [lambda: cpuinfer_ext.moe.TCPTransport(1, ["no-such-host.invalid", "127.0.0.1"], base_port),
+                 lambda: cpuinfer_ext.moe.ShmTransport("not/a/valid/shm/name", 0, world_size)]:
+        try:
+            make()
+            assert False, "transport setup error not raised"
+        except RuntimeError as e:
+            print('transport error:', e)
+
+if __name__ == "__main__":
+    check_transport_errors()
+    shm_name = "ktransformers_test_moe_expert_group_%d" % os.getpid()
+    ctx = mp.get_context("spawn")
+    result = ctx.Queue()
+    ranks = [ctx.Process(target=rank_main, args=(rank, shm_name, result)) for rank in range(world_size)]
+    for p in ranks:
+        p.start()
+    max_diff = result.get()
+    for p in ranks:
+        p.join()
+    assert all(p.exitcode == 0 for p in ranks)
+    assert max_diff < 0.01, max_diff
@@ -0,0 +1,135 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  expert_parallel MOE: whole experts placed per NUMA node,
+                rebalanced by routed load, with forward checked against torch
+                before and after the migration
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys, ctypes, ctypes.util
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 16
+hidden_size = 1024
+intermediate_size = 512
+stride = 32
+group_min_len = 10
+group_max_len = 24
+gate_type = 1 # ggml_type::GGML_TYPE_F16
+up_type = 1 # ggml_type::GGML_TYPE_F16
+down_type = 1 # ggml_type::GGML_TYPE_F16
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+n_routed_experts = 4
+qlens = [1, 4, 30] # per-token path, then grouped
+hot_experts = 5 # most routes go to experts [0, hot_experts)
+CPUInfer = cpuinfer_ext.CPUInfer(8)
+
+def act_fn(x):
+    return x / (1.0 + torch.exp(-x))
+
+def mlp_torch(input, gate_proj, up_proj, down_proj):
+    gate_buf = torch.mm(input, gate_proj.t())
+    up_buf = torch.mm(input, up_proj.t())
+    intermediate = act_fn(gate_buf) * up_buf
+    ret = torch.mm(intermediate, down_proj.t())
+    return ret
+
+def moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj):
+    output = torch.zeros((input.shape[0], hidden_size), dtype=torch.float32)
+    for i in range(input.shape[0]):
+        for j in range(expert_ids.shape[1]):
+            e = expert_ids[i, j]
+            y = mlp_torch(input[i:i+1].float(), gate_proj[e].float(), up_proj[e].float(), down_proj[e].float())
+            output[i] += y[0] * weights[i, j]
+    return output.to(torch.float16)
+
+def rebalance_torch(load, nodes, n_numa_nodes):
+    # longest processing time first onto the least loaded node with room,
+    # the current node winning ties, as MOE::rebalance_experts does
+    capacity = (expert_num + n_numa_nodes - 1) // n_numa_nodes
+    order = sorted(range(expert_num), key=lambda e: -load[e])
+    node_load = [0] * n_numa_nodes
+    node_experts = [0] * n_numa_nodes
+    new_nodes = [0] * expert_num
+    for e in order:
+        best = -1
+        for node in range(n_numa_nodes):
+            if node_experts[node] >= capacity:
+                continue
+            if best < 0 or node_load[node] < node_load[best] or (node_load[node] == node_load[best] and node == nodes[e]):
+                best = node
+        new_nodes[e] = best
+        node_load[best] += load[e]
+        node_experts[best] += 1
+    return new_nodes
+
+def skewed_ids(qlen):
+    ids = []
+    for _ in range(qlen):
+        hot = torch.randperm(hot_experts)[:n_routed_experts - 1]
+        cold = torch.randperm(expert_num - hot_experts)[:1] + hot_experts
+        ids.append(torch.cat([hot, cold]))
+    return torch.stack(ids).contiguous()
+
+def forward_and_check(moe, expert_ids, tag):
+    qlen = expert_ids.shape[0]
+    weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+    input = (torch.randn((qlen, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    output = torch.empty((qlen, hidden_size), dtype=torch.float16).contiguous()
+    CPUInfer.submit(
+        moe.forward(qlen, n_routed_experts, expert_ids.data_ptr(), weights.data_ptr(), input.data_ptr(), output.data_ptr())
+    )
+    CPUInfer.sync()
+    t_output = moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj)
+    diff = torch.mean(torch.abs(output.float() - t_output.float())) / torch.mean(torch.abs(t_output.float()))
+    print(tag, 'qlen', qlen, 'diff = ', diff)
+    assert diff < 0.01
+
+# experts are only placed by a build with USE_NUMA, which CMake takes from
+# the same environment variable
+n_numa_nodes = 0
+if 'USE_NUMA' in os.environ and ctypes.util.find_library('numa'):
+    n_numa_nodes = ctypes.CDLL(ctypes.util.find_library('numa')).numa_num_configured_nodes()
+
+with torch.inference_mode(mode=True):
+    gate_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    up_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    down_proj = (torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    config = cpuinfer_ext.moe.MOEConfig(
+        expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len,
+        gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), gate_type, up_type, down_type, hidden_type,
+        False, "", True,
+    )
+    moe = cpuinfer_ext.moe.MOE(config)
+
+    nodes = moe.expert_nodes()
+    if n_numa_nodes == 0:
+        # without NUMA expert_parallel places nothing, and rebalancing is a no-op
+        assert nodes == []
+    else:
+        assert nodes == [e % n_numa_nodes for e in range(expert_num)], nodes
+
+    load = [0] * expert_num
+    for qlen in qlens:
+        expert_ids = skewed_ids(qlen)
+        for e in expert_ids.view(-1).tolist():
+            load[e] += 1
+        forward_and_check(moe, expert_ids, 'before rebalance')
+
+    moe.rebalance_experts()
+    new_nodes = moe.expert_nodes()
+    if n_numa_nodes == 0:
+        assert new_nodes == []
+    else:
+        assert new_nodes == rebalance_torch(load, nodes, n_numa_nodes), new_nodes
+        capacity = (expert_num + n_numa_nodes - 1) // n_numa_nodes
+        assert all(new_nodes.count(node) <= capacity for node in range(n_numa_nodes))
+        node_load = [sum(load[e] for e in range(expert_num) if new_nodes[e] == node) for node in range(n_numa_nodes)]
+        print('node load after rebalance', node_load)
+
+    # migrated experts compute the same results
+    for qlen in qlens:
+        forward_and_check(moe, skewed_ids(qlen), 'after rebalance')
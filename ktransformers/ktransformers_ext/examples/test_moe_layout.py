@@ -0,0 +1,151 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  MOE layout_path cache: a valid file is mapped without
+                touching the caller's memory policy, while stale, truncated,
+                corrupt and unwritable caches fall back to a rebuild, with
+                forward checked against torch
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys, struct, tempfile, ctypes, ctypes.util
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 8
+hidden_size = 1024
+intermediate_size = 512
+group_min_len = 10
+group_max_len = 1024
+gate_type = 1 # ggml_type::GGML_TYPE_F16
+up_type = 1 # ggml_type::GGML_TYPE_F16
+down_type = 1 # ggml_type::GGML_TYPE_F16
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+n_routed_experts = 4
+qlen = 3
+header_format = '<8sIiiiiiiiiQ' # MOE's LayoutHeader
+MPOL_PREFERRED = 1
+CPUInfer = cpuinfer_ext.CPUInfer(8)
+
+def act_fn(x):
+    return x / (1.0 + torch.exp(-x))
+
+def mlp_torch(input, gate_proj, up_proj, down_proj):
+    gate_buf = torch.mm(input, gate_proj.t())
+    up_buf = torch.mm(input, up_proj.t())
+    intermediate = act_fn(gate_buf) * up_buf
+    ret = torch.mm(intermediate, down_proj.t())
+    return ret
+
+def moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj):
+    output = torch.zeros((input.shape[0], hidden_size), dtype=torch.float32)
+    for i in range(input.shape[0]):
+        for j in range(expert_ids.shape[1]):
+            e = expert_ids[i, j]
+            y = mlp_torch(input[i:i+1].float(), gate_proj[e].float(), up_proj[e].float(), down_proj[e].float())
+            output[i] += y[0] * weights[i, j]
+    return output.to(torch.float16)
+
+def make_projs():
+    gate_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    up_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    down_proj = (torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    return gate_proj, up_proj, down_proj
+
+def make_moe(projs, stride, layout_path):
+    gate_proj, up_proj, down_proj = projs
+    config = cpuinfer_ext.moe.MOEConfig(
+        expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len,
+        gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), gate_type, up_type, down_type, hidden_type,
+    )
+    config.layout_path = layout_path
+    return cpuinfer_ext.moe.MOE(config)
+
+def check_forward(moe, projs, tag):
+    expert_ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+    weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+    input = (torch.randn((qlen, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    output = torch.empty((qlen, hidden_size), dtype=torch.float16).contiguous()
+    CPUInfer.submit(
+        moe.forward(qlen, n_routed_experts, expert_ids.data_ptr(), weights.data_ptr(), input.data_ptr(), output.data_ptr())
+    )
+    CPUInfer.sync()
+    t_output = moe_torch(input, expert_ids, weights, *projs)
+    diff = torch.mean(torch.abs(output.float() - t_output.float())) / torch.mean(torch.abs(t_output.float()))
+    print(tag, 'diff = ', diff)
+    assert diff < 0.01
+
+def header(layout_path):
+    with open(layout_path, 'rb') as fh:
+        return struct.unpack(header_format, fh.read(struct.calcsize(header_format)))
+
+def mempolicy_mode():
+    mode = ctypes.c_int()
+    assert libnuma.get_mempolicy(ctypes.byref(mode), None, ctypes.c_ulong(0), None, ctypes.c_ulong(0)) == 0
+    return mode.value
+
+# layout_path is only used by a build with USE_NUMA, which CMake takes from
+# the same environment variable
+if 'USE_NUMA' not in os.environ or not ctypes.util.find_library('numa'):
+    print('layout_path needs a USE_NUMA build, skipping')
+    sys.exit(0)
+libnuma = ctypes.CDLL(ctypes.util.find_library('numa'))
+n_numa_nodes = libnuma.numa_num_configured_nodes()
+
+with torch.inference_mode(mode=True), tempfile.TemporaryDirectory() as tmp:
+    layout_path = os.path.join(tmp, 'blk.0.layout')
+    projs = make_projs()
+    built = make_moe(projs, 32, layout_path)
+    check_forward(built, projs, 'built')
+    magic, version, nodes, experts, hidden, intermediate, stride, gate, up, down, fingerprint = header(layout_path)
+    assert magic == b'KTNUMALY' and version == 1
+    assert (nodes, experts, hidden, intermediate, stride) == (n_numa_nodes, expert_num, hidden_size, intermediate_size, 32)
+    assert (gate, up, down) == (gate_type, up_type, down_type)
+    assert not os.path.exists(layout_path + '.tmp')
+    inode = os.stat(layout_path).st_ino
+
+    # a valid cache is mapped, not rewritten, and the thread's memory
+    # policy is the one it had before
+    libnuma.numa_set_preferred(0)
+    mapped = make_moe(projs, 32, layout_path)
+    assert mempolicy_mode() == MPOL_PREFERRED, "memory policy not restored"
+    libnuma.numa_set_localalloc()
+    assert os.stat(layout_path).st_ino == inode
+    check_forward(mapped, projs, 'mapped')
+    # nothing may map the file rewritten or damaged below
+    del built, mapped
+
+    # different weights and a different stride make the cache stale
+    new_projs = make_projs()
+    rebuilt = make_moe(new_projs, 32, layout_path)
+    assert os.stat(layout_path).st_ino != inode
+    assert header(layout_path)[-1] != fingerprint, "fingerprint unchanged"
+    check_forward(rebuilt, new_projs, 'rebuilt after new weights')
+    del rebuilt
+    inode = os.stat(layout_path).st_ino
+    restrided = make_moe(new_projs, 64, layout_path)
+    assert os.stat(layout_path).st_ino != inode
+    assert header(layout_path)[6] == 64
+    check_forward(restrided, new_projs, 'rebuilt after new stride')
+    del restrided
+
+    # a truncated file and a corrupt header are rebuilt too
+    for damage in ['truncate', 'corrupt']:
+        if damage == 'truncate':
+            os.truncate(layout_path, os.path.getsize(layout_path) // 2)
+        else:
+            with open(layout_path, 'r+b') as fh:
+                fh.write(b'garbage!')
+        inode = os.stat(layout_path).st_ino
+        repaired = make_moe(new_projs, 64, layout_path)
+        assert os.stat(layout_path).st_ino != inode, damage
+        assert header(layout_path)[0] == b'KTNUMALY'
+        check_forward(repaired, new_projs, 'rebuilt after ' + damage)
+        del repaired
+
+    # a cache that cannot be written leaves the layer built in memory
+    unwritable = os.path.join(tmp, 'missing', 'blk.0.layout')
+    check_forward(make_moe(new_projs, 64, unwritable), new_projs, 'unwritable cache')
+    assert not os.path.exists(unwritable)
+    print('layout caches are mapped when valid and rebuilt otherwise')
@@ -0,0 +1,83 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  MOE.forward with expert ids masked to -1, on both the
+                per-token path and the grouped (qlen >= group_min_len) one
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 16
+hidden_size = 1024
+intermediate_size = 512
+stride = 32
+group_min_len = 10
+group_max_len = 24
+gate_type = 1 # ggml_type::GGML_TYPE_F16
+up_type = 1 # ggml_type::GGML_TYPE_F16
+down_type = 1 # ggml_type::GGML_TYPE_F16
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+n_routed_experts = 6
+qlens = [1, 4, 30, 64] # below group_min_len, then split into group_max_len chunks
+CPUInfer = cpuinfer_ext.CPUInfer(8)
+validation_iter = 8
+
+def act_fn(x):
+    return x / (1.0 + torch.exp(-x))
+
+def mlp_torch(input, gate_proj, up_proj, down_proj):
+    gate_buf = torch.mm(input, gate_proj.t())
+    up_buf = torch.mm(input, up_proj.t())
+    intermediate = act_fn(gate_buf) * up_buf
+    ret = torch.mm(intermediate, down_proj.t())
+    return ret
+
+def moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj):
+    # masked (negative) ids contribute nothing
+    output = torch.zeros((input.shape[0], hidden_size), dtype=torch.float32)
+    for i in range(input.shape[0]):
+        for j in range(expert_ids.shape[1]):
+            e = expert_ids[i, j]
+            if e < 0:
+                continue
+            y = mlp_torch(input[i:i+1].float(), gate_proj[e].float(), up_proj[e].float(), down_proj[e].float())
+            output[i] += y[0] * weights[i, j]
+    return output.to(torch.float16)
+
+with torch.inference_mode(mode=True):
+    gate_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    up_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    down_proj = (torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    config = cpuinfer_ext.moe.MOEConfig(expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len, gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), gate_type, up_type, down_type, hidden_type)
+    moe = cpuinfer_ext.moe.MOE(config)
+
+    for qlen in qlens:
+        for i in range(validation_iter):
+            expert_ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+            # mask about a third of the routes, and every route of token 0
+            expert_ids.masked_fill_(torch.rand(expert_ids.shape) < 0.3, -1)
+            expert_ids[0] = -1
+            weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+            input = (torch.randn((qlen, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+            output = torch.full((qlen, hidden_size), float('nan'), dtype=torch.float16).contiguous()
+            CPUInfer.submit(
+                moe.forward(
+                    qlen,
+                    n_routed_experts,
+                    expert_ids.data_ptr(),
+                    weights.data_ptr(),
+                    input.data_ptr(),
+                    output.data_ptr()
+                )
+            )
+            CPUInfer.sync()
+
+            t_output = moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj)
+            assert torch.all(output[0] == 0), "fully masked token must be zero"
+            diff = torch.mean(torch.abs(output.float() - t_output.float())) / torch.mean(torch.abs(t_output.float()))
+            print('qlen', qlen, 'diff = ', diff)
+            assert(diff < 0.01)
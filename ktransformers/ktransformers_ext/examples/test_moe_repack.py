@@ -0,0 +1,149 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  MOE repack: decode with Q8_0 row panels matches the GGUF
+                layout run by llamafile_sgemm at every kernel level, and the
+                repack_path caches are reloaded when valid and rebuilt when
+                the weights change or the file is truncated
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys, tempfile
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 8
+hidden_size = 1024
+intermediate_size = 512
+stride = 32
+group_min_len = 10
+group_max_len = 1024
+gate_type = 8 # ggml_type::GGML_TYPE_Q8_0
+up_type = 8 # ggml_type::GGML_TYPE_Q8_0
+down_type = 8 # ggml_type::GGML_TYPE_Q8_0
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+n_routed_experts = 4
+qlen = 1
+CPUInfer = cpuinfer_ext.CPUInfer(8)
+validation_iter = 5
+
+def act_fn(x):
+    return x / (1.0 + torch.exp(-x))
+
+def mlp_torch(input, gate_proj, up_proj, down_proj):
+    gate_buf = torch.mm(input, gate_proj.t())
+    up_buf = torch.mm(input, up_proj.t())
+    intermediate = act_fn(gate_buf) * up_buf
+    ret = torch.mm(intermediate, down_proj.t())
+    return ret
+
+def moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj):
+    output = torch.zeros((input.shape[0], hidden_size), dtype=torch.float32)
+    for i in range(input.shape[0]):
+        for j in range(expert_ids.shape[1]):
+            e = expert_ids[i, j]
+            y = mlp_torch(input[i:i+1].float(), gate_proj[e], up_proj[e], down_proj[e])
+            output[i] += y[0] * weights[i, j]
+    return output
+
+def make_q8_0(rows, cols):
+    # block_q8_0: fp16 scale followed by 32 int8 quants
+    n = expert_num * rows * cols
+    qs = torch.randint(-127, 128, (n // 32, 32), dtype=torch.int8)
+    d = (torch.rand((n // 32, 1)) / 1000).to(torch.float16)
+    blocks = torch.cat([d.view(torch.int8), qs], dim=1).contiguous()
+    ref = (qs.to(torch.float32) * d.to(torch.float32)).view(expert_num, rows, cols)
+    return blocks, ref
+
+def make_projs():
+    return [
+        make_q8_0(intermediate_size, hidden_size),
+        make_q8_0(intermediate_size, hidden_size),
+        make_q8_0(hidden_size, intermediate_size),
+    ]
+
+def make_moe(projs, repack, repack_path=""):
+    (gate_proj, _), (up_proj, _), (down_proj, _) = projs
+    config = cpuinfer_ext.moe.MOEConfig(
+        expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len,
+        gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), gate_type, up_type, down_type, hidden_type,
+        repack, repack_path,
+    )
+    return cpuinfer_ext.moe.MOE(config)
+
+def forward(moe, expert_ids, weights, input):
+    output = torch.empty((qlen, hidden_size), dtype=torch.float16).contiguous()
+    CPUInfer.submit(
+        moe.forward(qlen, n_routed_experts, expert_ids.data_ptr(), weights.data_ptr(), input.data_ptr(), output.data_ptr())
+    )
+    CPUInfer.sync()
+    return output.float()
+
+def check_parity(packed, unpacked, projs, tag):
+    for i in range(validation_iter):
+        expert_ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+        weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+        input = (torch.randn((qlen, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        p_output = forward(packed, expert_ids, weights, input)
+        u_output = forward(unpacked, expert_ids, weights, input)
+        t_output = moe_torch(input, expert_ids, weights, *[ref for _, ref in projs])
+        # the same int8 dot products, only summed in another order
+        parity = torch.mean(torch.abs(p_output - u_output)) / torch.mean(torch.abs(u_output))
+        diff = torch.mean(torch.abs(p_output - t_output)) / torch.mean(torch.abs(t_output))
+        print(tag, 'parity = ', parity, 'diff = ', diff)
+        assert parity < 1e-3
+        assert diff < 0.05
+
+def inodes(repack_path):
+    return [os.stat(repack_path + suffix).st_ino for suffix in ['.gate', '.up', '.down']]
+
+# a build with USE_NUMA, which CMake takes from the same environment
+# variable, refuses repack
+if 'USE_NUMA' in os.environ:
+    projs = make_projs()
+    try:
+        make_moe(projs, True)
+        assert False, "expected ValueError"
+    except ValueError:
+        pass
+    print('repack is refused by a USE_NUMA build')
+    sys.exit(0)
+
+with torch.inference_mode(mode=True), tempfile.TemporaryDirectory() as tmp:
+    projs = make_projs()
+    unpacked = make_moe(projs, False)
+
+    # every kernel level, including the scalar fallback of RepackedMatrix::gemv
+    default_level = cpuinfer_ext.get_isa()
+    for level in cpuinfer_ext.isa_levels():
+        assert cpuinfer_ext.set_isa(level)
+        check_parity(make_moe(projs, True), unpacked, projs, 'level ' + level)
+    assert cpuinfer_ext.set_isa(default_level)
+
+    # the first MOE writes the caches, the next one maps them unchanged
+    repack_path = os.path.join(tmp, 'blk.0')
+    built = make_moe(projs, True, repack_path)
+    check_parity(built, unpacked, projs, 'built')
+    assert not any(os.path.exists(repack_path + suffix + '.tmp') for suffix in ['.gate', '.up', '.down'])
+    built_inodes = inodes(repack_path)
+    reloaded = make_moe(projs, True, repack_path)
+    assert inodes(repack_path) == built_inodes, "valid cache rewritten"
+    check_parity(reloaded, unpacked, projs, 'reloaded')
+    del built, reloaded
+
+    # other weights behind the same path change the fingerprint
+    new_projs = make_projs()
+    new_unpacked = make_moe(new_projs, False)
+    rebuilt = make_moe(new_projs, True, repack_path)
+    assert all(a != b for a, b in zip(inodes(repack_path), built_inodes)), "stale cache reused"
+    check_parity(rebuilt, new_unpacked, new_projs, 'rebuilt after new weights')
+    del rebuilt
+
+    # and so does a truncated file
+    os.truncate(repack_path + '.down', os.path.getsize(repack_path + '.down') // 2)
+    truncated_inode = os.stat(repack_path + '.down').st_ino
+    repaired = make_moe(new_projs, True, repack_path)
+    assert os.stat(repack_path + '.down').st_ino != truncated_inode
+    check_parity(repaired, new_unpacked, new_projs, 'rebuilt after truncate')
+    print('repacked decode matches llamafile_sgemm and caches are rebuilt when stale')
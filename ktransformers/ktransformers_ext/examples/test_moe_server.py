@@ -0,0 +1,212 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  Two client processes sharing one out-of-process MOEServer,
+                requests of one layer batched across slots, slots of clients
+                that die mid-request freed by the server, and client
+                timeouts, failed requests and attach errors
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import ctypes
+import multiprocessing as mp
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 16
+hidden_size = 1024
+intermediate_size = 512
+stride = 32
+group_min_len = 10
+group_max_len = 1024
+gate_type = 1 # ggml_type::GGML_TYPE_F16
+up_type = 1 # ggml_type::GGML_TYPE_F16
+down_type = 1 # ggml_type::GGML_TYPE_F16
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+n_routed_experts = 6
+qlen = 4
+layer_num = 4
+slot_num = 8
+validation_iter = 50
+
+def act_fn(x):
+    return x / (1.0 + torch.exp(-x))
+
+def mlp_torch(input, gate_proj, up_proj, down_proj):
+    gate_buf = torch.mm(input, gate_proj.t())
+    up_buf = torch.mm(input, up_proj.t())
+    intermediate = act_fn(gate_buf) * up_buf
+    ret = torch.mm(intermediate, down_proj.t())
+    return ret
+
+def moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj):
+    output = torch.zeros((input.shape[0], hidden_size), dtype=torch.float32)
+    for i in range(input.shape[0]):
+        for j in range(expert_ids.shape[1]):
+            e = expert_ids[i, j]
+            y = mlp_torch(input[i:i+1].float(), gate_proj[e].float(), up_proj[e].float(), down_proj[e].float())
+            output[i] += y[0] * weights[i, j]
+    return output.to(torch.float16)
+
+def make_weights():
+    # Same seed in every process, so clients can compute the reference.
+    torch.manual_seed(0)
+    layers = []
+    for _ in range(layer_num):
+        gate_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        up_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        down_proj = (torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        layers.append((gate_proj, up_proj, down_proj))
+    return layers
+
+def server_main(shm_name, ready):
+    CPUInfer = cpuinfer_ext.CPUInfer(8)
+    layers = make_weights()
+    server_config = cpuinfer_ext.moe.MOEServerConfig(shm_name, slot_num, qlen, n_routed_experts, hidden_size, hidden_type)
+    server = cpuinfer_ext.moe.MOEServer(server_config)
+    moes = []
+    for gate_proj, up_proj, down_proj in layers:
+        config = cpuinfer_ext.moe.MOEConfig(expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len, gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), gate_type, up_type, down_type, hidden_type)
+        moe = cpuinfer_ext.moe.MOE(config)
+        server.add_layer(moe)
+        moes.append(moe)
+    ready.set()
+    server.run(CPUInfer)
+
+def shm_tensor(ptr, shape, dtype):
+    numel = 1
+    for s in shape:
+        numel *= s
+    nbytes = numel * torch.empty((), dtype=dtype).element_size()
+    buf = (ctypes.c_uint8 * nbytes).from_address(ptr)
+    return torch.frombuffer(buf, dtype=dtype).view(shape)
+
+def client_main(shm_name, client_id, zero_copy, result):
+    layers = make_weights()
+    client = cpuinfer_ext.moe.MOEClient(shm_name)
+    assert client.layer_num() == layer_num
+    torch.manual_seed(100 + client_id)
+    max_diff = 0
+    for i in range(validation_iter):
+        layer = i % layer_num
+        expert_ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+        weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+        input = (torch.randn((qlen, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        if zero_copy:
+            slot = client.acquire()
+            shm_tensor(client.expert_ids(slot), (qlen, n_routed_experts), torch.int64).copy_(expert_ids)
+            shm_tensor(client.weights(slot), (qlen, n_routed_experts), torch.float32).copy_(weights)
+            shm_tensor(client.input(slot), (qlen, hidden_size), torch.float16).copy_(input)
+            client.submit(slot, layer, qlen)
+            client.wait(slot)
+            output = shm_tensor(client.output(slot), (qlen, hidden_size), torch.float16).clone()
+            client.release(slot)
+        else:
+            output = torch.empty((qlen, hidden_size), dtype=torch.float16).contiguous()
+            client.forward(layer, qlen, expert_ids.data_ptr(), weights.data_ptr(), input.data_ptr(), output.data_ptr())
+
+        gate_proj, up_proj, down_proj = layers[layer]
+        t_output = moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj)
+        diff = torch.mean(torch.abs(output.float() - t_output.float())) / torch.mean(torch.abs(t_output.float()))
+        max_diff = max(max_diff, diff.item())
+    print('client', client_id, 'max diff = ', max_diff)
+    result.put(max_diff)
+
+def check_batched(shm_name):
+    # every slot on one layer at once: the server runs them as one forward
+    # of slot_num * qlen >= group_min_len tokens and scatters the output back
+    layers = make_weights()
+    client = cpuinfer_ext.moe.MOEClient(shm_name)
+    torch.manual_seed(200)
+    layer = 1
+    requests = []
+    slots = [client.acquire(timeout_ms=10000) for _ in range(slot_num)]
+    assert -1 not in slots
+    for slot in slots:
+        expert_ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+        weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+        input = (torch.randn((qlen, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        shm_tensor(client.expert_ids(slot), (qlen, n_routed_experts), torch.int64).copy_(expert_ids)
+        shm_tensor(client.weights(slot), (qlen, n_routed_experts), torch.float32).copy_(weights)
+        shm_tensor(client.input(slot), (qlen, hidden_size), torch.float16).copy_(input)
+        requests.append((expert_ids, weights, input))
+    for slot in slots:
+        client.submit(slot, layer, qlen)
+    max_diff = 0
+    for slot, (expert_ids, weights, input) in zip(slots, requests):
+        assert client.wait(slot, timeout_ms=60000)
+        assert not client.failed(slot)
+        output = shm_tensor(client.output(slot), (qlen, hidden_size), torch.float16).clone()
+        client.release(slot)
+        t_output = moe_torch(input, expert_ids, weights, *layers[layer])
+        diff = torch.mean(torch.abs(output.float() - t_output.float())) / torch.mean(torch.abs(t_output.float()))
+        max_diff = max(max_diff, diff.item())
+    print('batched max diff = ', max_diff)
+    assert max_diff < 0.01, max_diff
+
+    # a request for a layer the server does not have fails
+    slot = client.acquire(timeout_ms=10000)
+    client.submit(slot, layer_num, qlen)
+    assert client.wait(slot, timeout_ms=60000) and client.failed(slot)
+    client.release(slot)
+    try:
+        output = torch.empty((qlen, hidden_size), dtype=torch.float16).contiguous()
+        client.forward(layer_num, qlen, requests[0][0].data_ptr(), requests[0][1].data_ptr(), requests[0][2].data_ptr(), output.data_ptr(), 60000)
+        assert False, "a failed request must raise"
+    except RuntimeError:
+        pass
+
+def crash_main(shm_name, submit):
+    # exits holding a CLAIMED slot, or a DONE one once the server ran it
+    client = cpuinfer_ext.moe.MOEClient(shm_name)
+    slot = client.acquire()
+    if submit:
+        client.submit(slot, 0, qlen)
+    os._exit(0)
+
+if __name__ == "__main__":
+    shm_name = "ktransformers_test_moe_server_%d" % os.getpid()
+    ctx = mp.get_context("spawn")
+    ready = ctx.Event()
+    result = ctx.Queue()
+    try:
+        cpuinfer_ext.moe.MOEClient(shm_name)
+        assert False, "attaching without a server must fail"
+    except RuntimeError:
+        pass
+    server = ctx.Process(target=server_main, args=(shm_name, ready))
+    server.start()
+    ready.wait()
+    clients = [ctx.Process(target=client_main, args=(shm_name, i, i == 0, result)) for i in range(2)]
+    for c in clients:
+        c.start()
+    for c in clients:
+        c.join()
+    check_batched(shm_name)
+
+    # clients dying between acquire and release leave no slot behind
+    crashes = [ctx.Process(target=crash_main, args=(shm_name, submit)) for submit in [False, True] * 2]
+    for c in crashes:
+        c.start()
+    for c in crashes:
+        c.join()
+    client = cpuinfer_ext.moe.MOEClient(shm_name)
+    slots = [client.acquire(timeout_ms=10000) for _ in range(slot_num)]
+    assert -1 not in slots and len(set(slots)) == slot_num, slots
+    assert client.acquire(timeout_ms=50) == -1, "every slot is taken"
+    # a request that is never submitted is never done
+    assert not client.wait(slots[0], timeout_ms=50)
+    for slot in slots:
+        client.release(slot)
+    try:
+        client.submit(slots[0], 0, qlen)
+        assert False, "submitting a released slot must fail"
+    except ValueError:
+        pass
+    client.shutdown()
+    server.join()
+    diffs = [result.get() for _ in clients]
+    assert all(c.exitcode == 0 for c in clients + crashes)
+    assert max(diffs) < 0.01, diffs
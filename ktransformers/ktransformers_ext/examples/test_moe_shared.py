@@ -0,0 +1,165 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  MOE shared_path weights: a second layer attaches to the
+                files of the first, while stale, mismatched, truncated and
+                corrupt files are rebuilt and unusable paths fall back to
+                private copies, with forward checked against torch
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys, struct, tempfile, ctypes, ctypes.util
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 8
+hidden_size = 1024
+intermediate_size = 512
+group_min_len = 10
+group_max_len = 1024
+gate_type = 1 # ggml_type::GGML_TYPE_F16
+up_type = 1 # ggml_type::GGML_TYPE_F16
+down_type = 1 # ggml_type::GGML_TYPE_F16
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+n_routed_experts = 4
+qlen = 3
+header_format = '<8sIiiiiiiiiQ' # MOE's LayoutHeader
+CPUInfer = cpuinfer_ext.CPUInfer(8)
+
+def act_fn(x):
+    return x / (1.0 + torch.exp(-x))
+
+def mlp_torch(input, gate_proj, up_proj, down_proj):
+    gate_buf = torch.mm(input, gate_proj.t())
+    up_buf = torch.mm(input, up_proj.t())
+    intermediate = act_fn(gate_buf) * up_buf
+    ret = torch.mm(intermediate, down_proj.t())
+    return ret
+
+def moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj):
+    output = torch.zeros((input.shape[0], hidden_size), dtype=torch.float32)
+    for i in range(input.shape[0]):
+        for j in range(expert_ids.shape[1]):
+            e = expert_ids[i, j]
+            y = mlp_torch(input[i:i+1].float(), gate_proj[e].float(), up_proj[e].float(), down_proj[e].float())
+            output[i] += y[0] * weights[i, j]
+    return output.to(torch.float16)
+
+def make_projs():
+    gate_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    up_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    down_proj = (torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    return gate_proj, up_proj, down_proj
+
+def make_moe(projs, stride, shared_path, expert_parallel=False, layout_path=""):
+    gate_proj, up_proj, down_proj = projs
+    config = cpuinfer_ext.moe.MOEConfig(
+        expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len,
+        gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), gate_type, up_type, down_type, hidden_type,
+        False, "", expert_parallel,
+    )
+    config.shared_path = shared_path
+    config.layout_path = layout_path
+    return cpuinfer_ext.moe.MOE(config)
+
+def check_forward(moe, projs, tag):
+    expert_ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+    weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+    input = (torch.randn((qlen, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    output = torch.empty((qlen, hidden_size), dtype=torch.float16).contiguous()
+    CPUInfer.submit(
+        moe.forward(qlen, n_routed_experts, expert_ids.data_ptr(), weights.data_ptr(), input.data_ptr(), output.data_ptr())
+    )
+    CPUInfer.sync()
+    t_output = moe_torch(input, expert_ids, weights, *projs)
+    diff = torch.mean(torch.abs(output.float() - t_output.float())) / torch.mean(torch.abs(t_output.float()))
+    print(tag, 'diff = ', diff)
+    assert diff < 0.01
+
+def shared_files(shared_path):
+    return [f'{shared_path}.{proj}.node{i}' for i in range(n_numa_nodes) for proj in ['gate', 'up', 'down']]
+
+def inodes(shared_path):
+    return [os.stat(f).st_ino for f in shared_files(shared_path)]
+
+def headers(shared_path):
+    result = []
+    for f in shared_files(shared_path):
+        with open(f, 'rb') as fh:
+            result.append(struct.unpack(header_format, fh.read(struct.calcsize(header_format))))
+    return result
+
+# shared_path is only used by a build with USE_NUMA, which CMake takes from
+# the same environment variable
+if 'USE_NUMA' not in os.environ or not ctypes.util.find_library('numa'):
+    print('shared_path needs a USE_NUMA build, skipping')
+    sys.exit(0)
+n_numa_nodes = ctypes.CDLL(ctypes.util.find_library('numa')).numa_num_configured_nodes()
+
+with torch.inference_mode(mode=True), tempfile.TemporaryDirectory() as tmp:
+    shared_path = os.path.join(tmp, 'blk.0')
+    projs = make_projs()
+    first = make_moe(projs, 32, shared_path)
+    check_forward(first, projs, 'built')
+    for magic, version, nodes, experts, hidden, intermediate, stride, gate, up, down, fingerprint in headers(shared_path):
+        assert magic == b'KTSHARED' and version == 1
+        assert (nodes, experts, hidden, intermediate, stride) == (n_numa_nodes, expert_num, hidden_size, intermediate_size, 32)
+        assert (gate, up, down) == (gate_type, up_type, down_type)
+    built = inodes(shared_path)
+    assert not any(name.startswith('blk.0.') and '.tmp.' in name for name in os.listdir(tmp))
+
+    # the same layer attaches to the files instead of rebuilding them
+    attached = make_moe(projs, 32, shared_path)
+    assert inodes(shared_path) == built
+    check_forward(attached, projs, 'attached')
+
+    # different weights behind the same path: stale files are replaced, and
+    # layers still mapping the old ones keep computing with them
+    new_projs = make_projs()
+    headers_before = headers(shared_path)
+    rebuilt = make_moe(new_projs, 32, shared_path)
+    assert all(a != b for a, b in zip(inodes(shared_path), built))
+    assert all(a[-1] != b[-1] for a, b in zip(headers(shared_path), headers_before)), "fingerprint unchanged"
+    check_forward(rebuilt, new_projs, 'rebuilt after new weights')
+    check_forward(attached, projs, 'old files after rebuild')
+    del first, attached, rebuilt
+
+    # a different layout (stride) of the same weights does not match either
+    before = inodes(shared_path)
+    restrided = make_moe(new_projs, 64, shared_path)
+    assert all(a != b for a, b in zip(inodes(shared_path), before))
+    assert all(h[6] == 64 for h in headers(shared_path))
+    check_forward(restrided, new_projs, 'rebuilt after new stride')
+    # nothing may map the files damaged below
+    del restrided
+
+    # a truncated file and a corrupt header are rebuilt too
+    for damage in ['truncate', 'corrupt']:
+        victim = shared_files(shared_path)[-1]
+        if damage == 'truncate':
+            os.truncate(victim, os.path.getsize(victim) // 2)
+        else:
+            with open(victim, 'r+b') as fh:
+                fh.write(b'garbage!')
+        before = inodes(shared_path)
+        repaired = make_moe(new_projs, 64, shared_path)
+        assert all(a != b for a, b in zip(inodes(shared_path), before)), damage
+        check_forward(repaired, new_projs, 'rebuilt after ' + damage)
+        del repaired
+
+    # files that cannot be created leave the layer on private copies
+    missing_dir = os.path.join(tmp, 'missing')
+    private = make_moe(new_projs, 64, os.path.join(missing_dir, 'blk.0'))
+    check_forward(private, new_projs, 'private copies')
+    assert not os.path.exists(missing_dir)
+    del private
+
+    # expert_parallel and layout_path are refused rather than ignored
+    for args in [{'expert_parallel': True}, {'layout_path': os.path.join(tmp, 'blk.0.layout')}]:
+        try:
+            make_moe(new_projs, 64, shared_path, **args)
+            assert False, "expected ValueError"
+        except ValueError:
+            pass
+    print('shared weights attach when they match and are rebuilt otherwise')
@@ -0,0 +1,109 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  Expert skipping in MOE.forward_one: the kept experts, their
+                rescaled weights and expert_skip_stats against a torch
+                reference of the routing rule
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 16
+hidden_size = 1024
+intermediate_size = 512
+stride = 32
+group_min_len = 10
+group_max_len = 1024
+gate_type = 1 # ggml_type::GGML_TYPE_F16
+up_type = 1 # ggml_type::GGML_TYPE_F16
+down_type = 1 # ggml_type::GGML_TYPE_F16
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+n_routed_experts = 6
+qlens = [1, 4, 9] # below group_min_len, so every token goes through forward_one
+# (routing_mass_threshold, routing_weight_floor), the first one off
+skip_configs = [(1.0, 0.0), (0.8, 0.0), (1.0, 0.1), (0.6, 0.05)]
+CPUInfer = cpuinfer_ext.CPUInfer(8)
+
+def act_fn(x):
+    return x / (1.0 + torch.exp(-x))
+
+def mlp_torch(input, gate_proj, up_proj, down_proj):
+    gate_buf = torch.mm(input, gate_proj.t())
+    up_buf = torch.mm(input, up_proj.t())
+    intermediate = act_fn(gate_buf) * up_buf
+    ret = torch.mm(intermediate, down_proj.t())
+    return ret
+
+def skip_torch(ids, weights, mass_threshold, weight_floor):
+    # heaviest first until the kept mass reaches the threshold, lighter than
+    # the floor dropped, the heaviest always kept, the rest scaled back up;
+    # accumulated in float32 in the order MOE::skip_light_experts_ uses
+    total = torch.zeros((), dtype=torch.float32)
+    for w in weights:
+        total += w
+    order = sorted(range(len(ids)), key=lambda i: -float(weights[i]))
+    keep = 0
+    mass = torch.zeros((), dtype=torch.float32)
+    limit = torch.tensor(mass_threshold, dtype=torch.float32) * total
+    while keep < len(ids):
+        w = weights[order[keep]]
+        if keep > 0 and (w < weight_floor or mass >= limit):
+            break
+        mass += w
+        keep += 1
+    scale = total / mass
+    return [ids[i] for i in order[:keep]], [weights[i] * scale for i in order[:keep]]
+
+def moe_torch(input, expert_ids, weights, mass_threshold, weight_floor):
+    output = torch.zeros((input.shape[0], hidden_size), dtype=torch.float32)
+    stats = [0, 0, 0]
+    skipping = mass_threshold < 1 or weight_floor > 0
+    for i in range(input.shape[0]):
+        ids = expert_ids[i].tolist()
+        ws = list(weights[i])
+        if skipping:
+            kept_ids, ws = skip_torch(ids, ws, mass_threshold, weight_floor)
+            stats[0] += 1
+            stats[1] += len(kept_ids) < len(ids)
+            stats[2] += len(ids) - len(kept_ids)
+            ids = kept_ids
+        for e, w in zip(ids, ws):
+            y = mlp_torch(input[i:i+1].float(), gate_proj[e].float(), up_proj[e].float(), down_proj[e].float())
+            output[i] += y[0] * w
+    return output.to(torch.float16), stats
+
+with torch.inference_mode(mode=True):
+    gate_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    up_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    down_proj = (torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+    for mass_threshold, weight_floor in skip_configs:
+        config = cpuinfer_ext.moe.MOEConfig(
+            expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len,
+            gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), gate_type, up_type, down_type, hidden_type,
+        )
+        config.routing_mass_threshold = mass_threshold
+        config.routing_weight_floor = weight_floor
+        moe = cpuinfer_ext.moe.MOE(config)
+        for qlen in qlens:
+            expert_ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+            # peaked routing, as after a softmax, so that some tokens skip
+            weights = torch.softmax(torch.randn((qlen, n_routed_experts), dtype=torch.float32) * 2, dim=-1).contiguous()
+            input = (torch.randn((qlen, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+            output = torch.empty((qlen, hidden_size), dtype=torch.float16).contiguous()
+            CPUInfer.submit(
+                moe.forward(qlen, n_routed_experts, expert_ids.data_ptr(), weights.data_ptr(), input.data_ptr(), output.data_ptr())
+            )
+            CPUInfer.sync()
+            t_output, t_stats = moe_torch(input, expert_ids, weights, mass_threshold, weight_floor)
+            diff = torch.mean(torch.abs(output.float() - t_output.float())) / torch.mean(torch.abs(t_output.float()))
+            stats = moe.expert_skip_stats()
+            print('mass', mass_threshold, 'floor', weight_floor, 'qlen', qlen, 'stats', stats, 'diff = ', diff)
+            assert diff < 0.01
+            # [tokens routed through skipping, tokens that skipped, experts skipped]
+            assert list(stats) == t_stats, (list(stats), t_stats)
+            # and the counters reset on read
+            assert list(moe.expert_skip_stats()) == [0, 0, 0]
@@ -0,0 +1,175 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  :  MOE layers reading their experts from a file through an
+                ExpertStore against all-resident MOEs, per token and grouped,
+                with the store's hit/miss/prefetch/eviction counters, and
+                config and read errors
+Version      : 1.0.0
+Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys, tempfile
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 3
+expert_num = 8
+hidden_size = 1024
+intermediate_size = 512
+stride = 32
+group_min_len = 10
+group_max_len = 1024
+gate_type = 1 # ggml_type::GGML_TYPE_F16
+up_type = 1 # ggml_type::GGML_TYPE_F16
+down_type = 1 # ggml_type::GGML_TYPE_F16
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+n_routed_experts = 4
+qlens = [1, 3, 16] # 16 >= group_min_len still runs token by token from the store
+header_bytes = 4096 + 32 # tensors need not start on an O_DIRECT boundary
+CPUInfer = cpuinfer_ext.CPUInfer(8)
+
+def forward(moe, expert_ids, weights, input):
+    qlen = expert_ids.shape[0]
+    output = torch.empty((qlen, hidden_size), dtype=torch.float16).contiguous()
+    CPUInfer.submit(
+        moe.forward(qlen, n_routed_experts, expert_ids.data_ptr(), weights.data_ptr(), input.data_ptr(), output.data_ptr())
+    )
+    CPUInfer.sync()
+    return output
+
+def make_config(gate_ptr, up_ptr, down_ptr, expert_parallel=False):
+    return cpuinfer_ext.moe.MOEConfig(
+        expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len,
+        gate_ptr, up_ptr, down_ptr, gate_type, up_type, down_type, hidden_type, False, "", expert_parallel,
+    )
+
+with torch.inference_mode(mode=True), tempfile.TemporaryDirectory() as tmp:
+    projs = []
+    for _ in range(layer_num):
+        gate_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        up_proj = (torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        down_proj = (torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+        projs.append((gate_proj, up_proj, down_proj))
+    resident = [cpuinfer_ext.moe.MOE(make_config(g.data_ptr(), u.data_ptr(), d.data_ptr())) for g, u, d in projs]
+
+    # one file holding every layer's gate, up and down tensors, as a GGUF does
+    path = os.path.join(tmp, 'experts.bin')
+    offsets = [[], [], []]
+    with open(path, 'wb') as f:
+        f.write(b'\0' * header_bytes)
+        for layer_projs in projs:
+            for i, proj in enumerate(layer_projs):
+                offsets[i].append(f.tell())
+                f.write(proj.numpy().tobytes())
+    gate_bytes = intermediate_size * hidden_size * 2
+    up_bytes = intermediate_size * hidden_size * 2
+    down_bytes = hidden_size * intermediate_size * 2
+
+    for cache_experts in [layer_num * expert_num, n_routed_experts + 1]:
+        store = cpuinfer_ext.moe.ExpertStore(cpuinfer_ext.moe.ExpertStoreConfig(
+            path, layer_num, expert_num, offsets[0], offsets[1], offsets[2],
+            gate_bytes, up_bytes, down_bytes, cache_experts,
+        ))
+        stored = []
+        for layer_idx in range(layer_num):
+            # no resident weights at all: everything has to come from the store
+            config = make_config(0, 0, 0)
+            config.store = store
+            config.store_layer = layer_idx
+            stored.append(cpuinfer_ext.moe.MOE(config))
+
+        steps = []
+        for qlen in qlens:
+            expert_ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+            weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+            input = (torch.randn((qlen, hidden_size), dtype=torch.float32) / 10).to(torch.float16).contiguous()
+            steps.append((expert_ids, weights, input))
+
+        for repeat in range(2):
+            for expert_ids, weights, input in steps:
+                for layer_idx in range(layer_num):
+                    output = forward(stored[layer_idx], expert_ids, weights, input)
+                    # the resident layer token by token, as the store runs
+                    t_output = torch.cat([
+                        forward(resident[layer_idx], expert_ids[i:i+1].contiguous(), weights[i:i+1].contiguous(), input[i:i+1].contiguous())
+                        for i in range(expert_ids.shape[0])
+                    ])
+                    diff = torch.mean(torch.abs(output.float() - t_output.float())) / torch.mean(torch.abs(t_output.float()))
+                    assert diff < 0.001, (cache_experts, layer_idx, expert_ids.shape[0], diff)
+            hits, misses, prefetches, evictions = store.stats()
+            print('cache_experts', cache_experts, 'pass', repeat, 'hits', hits, 'misses', misses, 'prefetches', prefetches, 'evictions', evictions)
+            # every routed expert of every token pins one slot
+            acquired = sum(ids.numel() for ids, _, _ in steps) * layer_num
+            assert hits + misses == acquired
+            if cache_experts == layer_num * expert_num:
+                # nothing is evicted, so the next layer's last routes are
+                # always cached and prefetching never loads anything; each
+                # expert misses once, when a token first routes to it
+                routed = len(set(torch.cat([ids.view(-1) for ids, _, _ in steps]).tolist()))
+                expected_misses = routed * layer_num if repeat == 0 else 0
+                assert (hits, misses, prefetches, evictions) == (acquired - expected_misses, expected_misses, 0, 0)
+            else:
+                assert evictions > 0
+        # the counters reset on read
+        assert list(store.stats()) == [0, 0, 0, 0]
+        del stored, store
+
+    # bad configs and a missing file raise instead of exiting
+    for args, error in [((path, layer_num, expert_num, offsets[0][:1], offsets[1], offsets[2], gate_bytes, up_bytes, down_bytes, 8), ValueError),
+                        ((path, layer_num, expert_num, offsets[0], offsets[1], offsets[2], gate_bytes, up_bytes, down_bytes, 0), ValueError),
+                        ((path + '.missing', layer_num, expert_num, offsets[0], offsets[1], offsets[2], gate_bytes, up_bytes, down_bytes, 8), RuntimeError)]:
+        try:
+            cpuinfer_ext.moe.ExpertStore(cpuinfer_ext.moe.ExpertStoreConfig(*args))
+            assert False, "bad ExpertStore config accepted"
+        except error:
+            pass
+    small = cpuinfer_ext.moe.ExpertStore(cpuinfer_ext.moe.ExpertStoreConfig(
+        path, layer_num, expert_num, offsets[0], offsets[1], offsets[2], gate_bytes, up_bytes, down_bytes, n_routed_experts - 1,
+    ))
+    config = make_config(0, 0, 0)
+    config.store = small
+    try:
+        cpuinfer_ext.moe.MOE(config)
+        assert False, "a cache smaller than routed_expert_num accepted"
+    except ValueError:
+        pass
+    del small
+
+    # expert_parallel is refused with a store rather than ignored
+    store = cpuinfer_ext.moe.ExpertStore(cpuinfer_ext.moe.ExpertStoreConfig(
+        path, layer_num, expert_num, offsets[0], offsets[1], offsets[2], gate_bytes, up_bytes, down_bytes, layer_num * expert_num,
+    ))
+    config = make_config(0, 0, 0, True)
+    config.store = store
+    try:
+        cpuinfer_ext.moe.MOE(config)
+        assert False, "expert_parallel accepted with a store"
+    except ValueError:
+        pass
+    del store
+
+    # a read past the end of the file fails the forward, not the process,
+    # and the store keeps serving the layers it can read
+    past_end = os.path.getsize(path) + header_bytes
+    store = cpuinfer_ext.moe.ExpertStore(cpuinfer_ext.moe.ExpertStoreConfig(
+        path, 2, expert_num, offsets[0][:1] + [past_end], offsets[1][:2], offsets[2][:2],
+        gate_bytes, up_bytes, down_bytes, layer_num * expert_num,
+    ))
+    stored = []
+    for layer_idx in range(2):
+        config = make_config(0, 0, 0)
+        config.store = store
+        config.store_layer = layer_idx
+        stored.append(cpuinfer_ext.moe.MOE(config))
+    expert_ids, weights, input = steps[0]
+    try:
+        forward(stored[1], expert_ids, weights, input)
+        assert False, "a failed read must raise"
+    except RuntimeError as e:
+        print('read error:', e)
+    t_output = forward(resident[0], expert_ids, weights, input)
+    output = forward(stored[0], expert_ids, weights, input)
+    assert torch.mean(torch.abs(output.float() - t_output.float())) / torch.mean(torch.abs(t_output.float())) < 0.001
+    del stored, store
+    print('ExpertStore layers match the resident ones')
@@ -10,11 +10,16 @@
 // Python bindings
 #include "cpu_backend/cpuinfer.h"
 #include "llamafile/flags.h"
+#include "operators/gguf/dequant.h"
+#include "operators/gguf/reader.h"
 #include "operators/kvcache/kvcache.h"
 #include "operators/llamafile/linear.h"
 #include "operators/llamafile/mlp.h"
 #include "operators/llamafile/moe.h"
+#include "operators/llamafile/moe_expert_group.h"
+#include "operators/llamafile/moe_server.h"
 #include "pybind11/functional.h"
+#include "pybind11/numpy.h"
 #include "pybind11/operators.h"
 #include "pybind11/pybind11.h"
 #include "pybind11/stl.h"
@@ -183,6 +188,47 @@ class KVCacheBindings {
         }
     };
 
+    class GatherKVCacheFp16Bindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            KVCache *kv_cache;
+            ggml_fp16_t *k_out;
+            ggml_fp16_t *v_out;
+            int layer_begin;
+            int layer_end;
+            int *block_table;
+            int batch_size;
+            int max_block_num;
+            int *cache_seqlens;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(
+                &KVCache::gather_kvcache_fp16, args_->kv_cache, args_->k_out,
+                args_->v_out, args_->layer_begin, args_->layer_end,
+                args_->block_table, args_->batch_size, args_->max_block_num,
+                args_->cache_seqlens);
+        }
+        static std::pair<intptr_t, intptr_t>
+        cpuinfer_interface(KVCache &kv_cache, intptr_t k_out, intptr_t v_out,
+                           int layer_begin, int layer_end,
+                           intptr_t block_table, int batch_size,
+                           int max_block_num, intptr_t cache_seqlens) {
+            Args *args = new Args{nullptr,
+                                  &kv_cache,
+                                  (ggml_fp16_t *)k_out,
+                                  (ggml_fp16_t *)v_out,
+                                  layer_begin,
+                                  layer_end,
+                                  (int *)block_table,
+                                  batch_size,
+                                  max_block_num,
+                                  (int *)cache_seqlens};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+
     class UpdateKVCacheFp16Bindings {
       public:
         struct Args {
@@ -317,6 +363,129 @@ class KVCacheBindings {
         }
     };
 
+    class AttnWithKVCacheVarlenBindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            KVCache *kv_cache;
+            const ggml_fp16_t *q_in;
+            const ggml_fp16_t *k_in;
+            const ggml_fp16_t *v_in;
+            ggml_fp16_t *output;
+            float *attn_lse;
+            int layer_idx;
+            int batch_size;
+            int *cu_seqlens_q;
+            int max_block_num;
+            int *block_table;
+            int *cache_seqlens;
+            const uint8_t *tree_mask;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(
+                &KVCache::attn_with_kvcache_varlen, args_->kv_cache,
+                args_->q_in, args_->k_in, args_->v_in, args_->output,
+                args_->attn_lse, args_->layer_idx, args_->batch_size,
+                args_->cu_seqlens_q, args_->max_block_num, args_->block_table,
+                args_->cache_seqlens, args_->tree_mask);
+        }
+        static std::pair<intptr_t, intptr_t>
+        cpuinfer_interface(KVCache &kv_cache, intptr_t q_in, intptr_t k_in,
+                           intptr_t v_in, intptr_t output, intptr_t attn_lse,
+                           int layer_idx, int batch_size, intptr_t cu_seqlens_q,
+                           int max_block_num, intptr_t block_table,
+                           intptr_t cache_seqlens, intptr_t tree_mask) {
+            Args *args = new Args{nullptr,
+                                  &kv_cache,
+                                  (const ggml_fp16_t *)q_in,
+                                  (const ggml_fp16_t *)k_in,
+                                  (const ggml_fp16_t *)v_in,
+                                  (ggml_fp16_t *)output,
+                                  (float *)attn_lse,
+                                  layer_idx,
+                                  batch_size,
+                                  (int *)cu_seqlens_q,
+                                  max_block_num,
+                                  (int *)block_table,
+                                  (int *)cache_seqlens,
+                                  (const uint8_t *)tree_mask};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+
+    class TruncateBindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            KVCache *kv_cache;
+            int *block_table;
+            int *cache_seqlens;
+            int batch_id;
+            int max_block_num;
+            int new_len;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(&KVCache::truncate, args_->kv_cache,
+                                     args_->block_table, args_->cache_seqlens,
+                                     args_->batch_id, args_->max_block_num,
+                                     args_->new_len);
+        }
+        static std::pair<intptr_t, intptr_t>
+        cpuinfer_interface(KVCache &kv_cache, intptr_t block_table,
+                           intptr_t cache_seqlens, int batch_id,
+                           int max_block_num, int new_len) {
+            Args *args = new Args{nullptr,
+                                  &kv_cache,
+                                  (int *)block_table,
+                                  (int *)cache_seqlens,
+                                  batch_id,
+                                  max_block_num,
+                                  new_len};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+
+    class EvictBindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            KVCache *kv_cache;
+            int *block_table;
+            int *cache_seqlens;
+            int batch_id;
+            int max_block_num;
+            int budget;
+            int recent_len;
+            bool merge;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(&KVCache::evict, args_->kv_cache,
+                                     args_->block_table, args_->cache_seqlens,
+                                     args_->batch_id, args_->max_block_num,
+                                     args_->budget, args_->recent_len,
+                                     args_->merge);
+        }
+        static std::pair<intptr_t, intptr_t>
+        cpuinfer_interface(KVCache &kv_cache, intptr_t block_table,
+                           intptr_t cache_seqlens, int batch_id,
+                           int max_block_num, int budget, int recent_len,
+                           bool merge) {
+            Args *args = new Args{nullptr,
+                                  &kv_cache,
+                                  (int *)block_table,
+                                  (int *)cache_seqlens,
+                                  batch_id,
+                                  max_block_num,
+                                  budget,
+                                  recent_len,
+                                  merge};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+
     class ClearImportanceAllLayersBindings {
       public:
         struct Args {
@@ -422,6 +591,36 @@ class KVCacheBindings {
             return std::make_pair((intptr_t)&inner, (intptr_t)args);
         }
     };
+    class SnapshotKVCacheBindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            KVCache *kv_cache;
+            int *block_table;
+            int cache_total_len;
+            std::string tensor_file_path;
+            int io_priority;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(
+                &KVCache::snapshot_kvcache, args_->kv_cache,
+                args_->block_table, args_->cache_total_len,
+                args_->tensor_file_path, args_->io_priority);
+        }
+        static std::pair<intptr_t, intptr_t>
+        cpuinfer_interface(KVCache &kv_cache, intptr_t block_table,
+                           int cache_total_len, std::string tensor_file_path,
+                           int io_priority) {
+            Args *args = new Args{nullptr,
+                                  &kv_cache,
+                                  (int *)block_table,
+                                  cache_total_len,
+                                  (std::string)tensor_file_path,
+                                  io_priority};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
 };
 
 class LinearBindings {
@@ -558,13 +757,112 @@ class MOEBindings {
     };
 };
 
+class MOEExpertGroupBindings {
+  public:
+    class ForwardBindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            MOEExpertGroup *group;
+            int layer;
+            int qlen;
+            int k;
+            const uint64_t *expert_ids;
+            const float *weights;
+            const void *input;
+            void *output;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(&MOEExpertGroup::forward, args_->group,
+                                     args_->layer, args_->qlen, args_->k,
+                                     args_->expert_ids, args_->weights,
+                                     args_->input, args_->output);
+        }
+        static std::pair<intptr_t, intptr_t>
+        cpuinfer_interface(MOEExpertGroup &group, int layer, int qlen, int k,
+                           intptr_t expert_ids, intptr_t weights,
+                           intptr_t input, intptr_t output) {
+            group.validate(layer, qlen, k);
+            Args *args = new Args{nullptr,
+                                  &group,
+                                  layer,
+                                  qlen,
+                                  k,
+                                  (const uint64_t *)expert_ids,
+                                  (const float *)weights,
+                                  (const void *)input,
+                                  (void *)output};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+};
+
+class DequantBindings {
+  public:
+    class ForwardBindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            Dequant *dequant;
+            int64_t n;
+            const void *input;
+            void *output;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(&Dequant::forward, args_->dequant,
+                                     args_->n, args_->input, args_->output);
+        }
+        static std::pair<intptr_t, intptr_t>
+        cpuinfer_interface(Dequant &dequant, int64_t n, intptr_t input,
+                           intptr_t output) {
+            Args *args = new Args{nullptr, &dequant, n, (const void *)input,
+                                  (void *)output};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+};
+
 PYBIND11_MODULE(cpuinfer_ext, m) {
     py::class_<CPUInfer>(m, "CPUInfer")
         .def(py::init<int>())
-        .def("submit", &CPUInfer::submit)
-        .def("submit_with_cuda_stream", &CPUInfer::submit_with_cuda_stream)
-        .def("sync", &CPUInfer::sync)
-        .def("sync_with_cuda_stream", &CPUInfer::sync_with_cuda_stream);
+        .def(py::init<int, std::vector<int>>())
+        .def("submit", &CPUInfer::submit, py::arg("params"),
+             py::arg("stream") = 0, py::arg("priority") = 0)
+        .def("submit_with_cuda_stream", &CPUInfer::submit_with_cuda_stream,
+             py::arg("user_cuda_stream"), py::arg("params"),
+             py::arg("stream") = 0, py::arg("priority") = 0)
+        .def("sync", &CPUInfer::sync, py::arg("stream") = -1)
+        .def("sync_with_cuda_stream", &CPUInfer::sync_with_cuda_stream,
+             py::arg("user_cuda_stream"), py::arg("stream") = -1)
+        .def("get_stream_num", &CPUInfer::get_stream_num)
+        .def("create_event", &CPUInfer::create_event)
+        .def("record_event", &CPUInfer::record_event, py::arg("event"),
+             py::arg("stream") = 0, py::arg("priority") = 0)
+        .def("query_event", &CPUInfer::query_event)
+        .def("wait_event", &CPUInfer::wait_event, py::arg("event"),
+             py::arg("stream") = 0, py::arg("priority") = 0);
+
+    // llamafile kernel level registry, see third_party/llamafile/sgemm.cpp
+    m.def("isa_levels", []() {
+        std::vector<std::string> levels;
+        for (int isa = 0; isa < LLAMAFILE_ISA_COUNT; isa++) {
+            if (isa != LLAMAFILE_ISA_UNSUPPORTED && llamafile_isa_available(isa)) {
+                levels.push_back(llamafile_isa_name(isa));
+            }
+        }
+        return levels;
+    });
+    m.def("get_isa", []() { return std::string(llamafile_isa_name(llamafile_isa_get())); });
+    m.def("set_isa", [](std::string name) {
+        for (int isa = 0; isa < LLAMAFILE_ISA_COUNT; isa++) {
+            if (name == llamafile_isa_name(isa)) {
+                return llamafile_isa_set(isa);
+            }
+        }
+        return false;
+    });
 
     auto linear_module = m.def_submodule("linear");
     py::class_<LinearConfig>(linear_module, "LinearConfig")
@@ -598,6 +896,25 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
         .def("forward", &MLPBindings::ForwardBindings::cpuinfer_interface);
 
     auto moe_module = m.def_submodule("moe");
+    py::class_<ExpertStoreConfig>(moe_module, "ExpertStoreConfig")
+        .def(py::init<std::string, int, int, std::vector<uint64_t>,
+                      std::vector<uint64_t>, std::vector<uint64_t>, uint64_t,
+                      uint64_t, uint64_t, int, int, bool>(),
+             py::arg("path"), py::arg("layer_num"), py::arg("expert_num"),
+             py::arg("gate_offsets"), py::arg("up_offsets"),
+             py::arg("down_offsets"), py::arg("gate_bytes"),
+             py::arg("up_bytes"), py::arg("down_bytes"),
+             py::arg("cache_experts"), py::arg("io_thread_num") = 4,
+             py::arg("direct_io") = true);
+    // The store must outlive every MOE whose config points at it.
+    py::class_<ExpertStore>(moe_module, "ExpertStore")
+        .def(py::init<ExpertStoreConfig>())
+        .def("prefetch",
+             [](ExpertStore &store, int layer,
+                std::vector<uint64_t> expert_ids) {
+                 store.prefetch(layer, expert_ids.size(), expert_ids.data());
+             })
+        .def("stats", &ExpertStore::stats);
     py::class_<MOEConfig>(moe_module, "MOEConfig")
         .def(py::init([](int expert_num, int routed_expert_num, int hidden_size,
                          int intermediate_size, int stride, int group_min_len,
@@ -610,11 +927,164 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
                              (void *)down_proj, (ggml_type)gate_type,
                              (ggml_type)up_type, (ggml_type)down_type,
                              (ggml_type)hidden_type);
-        }));
+        }))
+        .def(py::init([](int expert_num, int routed_expert_num, int hidden_size,
+                         int intermediate_size, int stride, int group_min_len,
+                         int group_max_len, intptr_t gate_proj,
+                         intptr_t up_proj, intptr_t down_proj, int gate_type,
+                         int up_type, int down_type, int hidden_type,
+                         bool repack, std::string repack_path) {
+            return MOEConfig(expert_num, routed_expert_num, hidden_size,
+                             intermediate_size, stride, group_min_len,
+                             group_max_len, (void *)gate_proj, (void *)up_proj,
+                             (void *)down_proj, (ggml_type)gate_type,
+                             (ggml_type)up_type, (ggml_type)down_type,
+                             (ggml_type)hidden_type, repack, repack_path);
+        }))
+        .def(py::init([](int expert_num, int routed_expert_num, int hidden_size,
+                         int intermediate_size, int stride, int group_min_len,
+                         int group_max_len, intptr_t gate_proj,
+                         intptr_t up_proj, intptr_t down_proj, int gate_type,
+                         int up_type, int down_type, int hidden_type,
+                         bool repack, std::string repack_path,
+                         bool expert_parallel) {
+            return MOEConfig(expert_num, routed_expert_num, hidden_size,
+                             intermediate_size, stride, group_min_len,
+                             group_max_len, (void *)gate_proj, (void *)up_proj,
+                             (void *)down_proj, (ggml_type)gate_type,
+                             (ggml_type)up_type, (ggml_type)down_type,
+                             (ggml_type)hidden_type, repack, repack_path,
+                             expert_parallel);
+        }))
+        .def_readwrite("down_sparse_threshold",
+                       &MOEConfig::down_sparse_threshold)
+        .def_readwrite("down_sparse_keep", &MOEConfig::down_sparse_keep)
+        .def_readwrite("routing_mass_threshold",
+                       &MOEConfig::routing_mass_threshold)
+        .def_readwrite("routing_weight_floor",
+                       &MOEConfig::routing_weight_floor)
+        .def_readwrite("store", &MOEConfig::store)
+        .def_readwrite("store_layer", &MOEConfig::store_layer)
+        .def_readwrite("shared_path", &MOEConfig::shared_path)
+        .def_readwrite("layout_path", &MOEConfig::layout_path);
     py::class_<MOE>(moe_module, "MOE")
         .def(py::init<MOEConfig>())
         .def("warm_up", &MOEBindings::WarmUpBindinds::cpuinfer_interface)
+        .def("rebalance_experts", &MOE::rebalance_experts,
+             py::call_guard<py::gil_scoped_release>())
+        .def("expert_nodes", &MOE::expert_nodes)
+        .def("down_sparse_stats", &MOE::down_sparse_stats)
+        .def("expert_skip_stats", &MOE::expert_skip_stats)
         .def("forward", &MOEBindings::ForwardBindings::cpuinfer_interface);
+    py::class_<MOEServerConfig>(moe_module, "MOEServerConfig")
+        .def(py::init([](std::string name, int slot_num, int max_qlen,
+                         int routed_expert_num, int hidden_size,
+                         int hidden_type) {
+            return MOEServerConfig(name, slot_num, max_qlen,
+                                   routed_expert_num, hidden_size,
+                                   (ggml_type)hidden_type);
+        }));
+    // run() blocks the calling thread until shutdown, so it drops the GIL.
+    py::class_<MOEServer>(moe_module, "MOEServer")
+        .def(py::init<MOEServerConfig>())
+        .def("add_layer", &MOEServer::add_layer, py::keep_alive<1, 2>())
+        .def("run", &MOEServer::run, py::call_guard<py::gil_scoped_release>())
+        .def("stop", &MOEServer::stop);
+    py::class_<MOEClient>(moe_module, "MOEClient")
+        .def(py::init<std::string>())
+        .def("acquire", &MOEClient::acquire, py::arg("timeout_ms") = -1,
+             py::call_guard<py::gil_scoped_release>())
+        .def("expert_ids",
+             [](MOEClient &client, int slot) {
+                 return (intptr_t)client.expert_ids(slot);
+             })
+        .def("weights",
+             [](MOEClient &client, int slot) {
+                 return (intptr_t)client.weights(slot);
+             })
+        .def("input",
+             [](MOEClient &client, int slot) {
+                 return (intptr_t)client.input(slot);
+             })
+        .def("output",
+             [](MOEClient &client, int slot) {
+                 return (intptr_t)client.output(slot);
+             })
+        .def("submit", &MOEClient::submit)
+        .def("wait", &MOEClient::wait, py::arg("slot"),
+             py::arg("timeout_ms") = -1,
+             py::call_guard<py::gil_scoped_release>())
+        .def("failed", &MOEClient::failed)
+        .def("release", &MOEClient::release)
+        .def("forward",
+             [](MOEClient &client, int layer, int qlen, intptr_t expert_ids,
+                intptr_t weights, intptr_t input, intptr_t output,
+                int timeout_ms) {
+                 py::gil_scoped_release release;
+                 client.forward(layer, qlen, (const uint64_t *)expert_ids,
+                                (const float *)weights, (const void *)input,
+                                (void *)output, timeout_ms);
+             },
+             py::arg("layer"), py::arg("qlen"), py::arg("expert_ids"),
+             py::arg("weights"), py::arg("input"), py::arg("output"),
+             py::arg("timeout_ms") = -1)
+        .def("shutdown", &MOEClient::shutdown)
+        .def("max_qlen", &MOEClient::max_qlen)
+        .def("routed_expert_num", &MOEClient::routed_expert_num)
+        .def("layer_num", &MOEClient::layer_num);
+
+    py::class_<ExpertTransport>(moe_module, "ExpertTransport")
+        .def("rank", &ExpertTransport::rank)
+        .def("world_size", &ExpertTransport::world_size);
+    py::class_<TCPTransport, ExpertTransport>(moe_module, "TCPTransport")
+        .def(py::init<int, std::vector<std::string>, int>(),
+             py::call_guard<py::gil_scoped_release>());
+    py::class_<ShmTransport, ExpertTransport>(moe_module, "ShmTransport")
+        .def(py::init<std::string, int, int, size_t>(), py::arg("name"),
+             py::arg("rank"), py::arg("world_size"),
+             py::arg("ring_bytes") = 16 << 20);
+    py::class_<MOEExpertGroupConfig>(moe_module, "MOEExpertGroupConfig")
+        .def(py::init([](int expert_num, int routed_expert_num,
+                         int hidden_size, int hidden_type, int max_qlen) {
+            return MOEExpertGroupConfig(expert_num, routed_expert_num,
+                                        hidden_size, (ggml_type)hidden_type,
+                                        max_qlen);
+        }));
+    py::class_<MOEExpertGroup>(moe_module, "MOEExpertGroup")
+        .def(py::init<MOEExpertGroupConfig, ExpertTransport *>(),
+             py::keep_alive<1, 3>())
+        .def("add_layer", &MOEExpertGroup::add_layer, py::keep_alive<1, 2>())
+        .def("owner", &MOEExpertGroup::owner)
+        .def("local_id", &MOEExpertGroup::local_id)
+        .def("forward",
+             &MOEExpertGroupBindings::ForwardBindings::cpuinfer_interface)
+        .def("serve", &MOEExpertGroup::serve,
+             py::call_guard<py::gil_scoped_release>())
+        .def("shutdown", &MOEExpertGroup::shutdown);
+
+    auto gguf_module = m.def_submodule("gguf");
+    py::class_<DequantConfig>(gguf_module, "DequantConfig")
+        .def(py::init([](int src_type, int dst_type, int chunk_len) {
+            return DequantConfig((ggml_type)src_type, (ggml_type)dst_type,
+                                 chunk_len);
+        }));
+    py::class_<Dequant>(gguf_module, "Dequant")
+        .def(py::init<DequantConfig>())
+        .def("forward", &DequantBindings::ForwardBindings::cpuinfer_interface);
+    py::class_<ReaderConfig>(gguf_module, "ReaderConfig")
+        .def(py::init([](std::string path, int io_thread_num,
+                         int64_t chunk_size, bool direct_io) {
+            return ReaderConfig(path, io_thread_num, chunk_size, direct_io);
+        }));
+    // I/O runs on the reader's own threads rather than the CPUInfer queue so
+    // that it overlaps with dequantization submitted to CPUInfer.
+    py::class_<Reader>(gguf_module, "Reader")
+        .def(py::init<ReaderConfig>())
+        .def("submit",
+             [](Reader &reader, int64_t offset, int64_t size, intptr_t dst) {
+                 return reader.submit(offset, size, (void *)dst);
+             })
+        .def("wait", &Reader::wait, py::call_guard<py::gil_scoped_release>());
 
     auto kvcache_module = m.def_submodule("kvcache");
 
@@ -637,6 +1107,17 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
     py::class_<KVCacheConfig>(kvcache_module, "KVCacheConfig")
         .def(py::init<int, int, int, int, int, int, AnchorType, ggml_type,
                       RetrievalType, int, int, int, int, int, int>())
+        .def(py::init<int, int, int, int, int, int, AnchorType, ggml_type,
+                      RetrievalType, int, int, int, int, int, int, int, int>())
+        .def(py::init<int, int, int, int, int, int, AnchorType, ggml_type,
+                      RetrievalType, int, int, int, int, int, int, int, int,
+                      int, int>())
+        .def(py::init<int, int, int, int, int, int, AnchorType, ggml_type,
+                      RetrievalType, int, int, int, int, int, int, int, int,
+                      int, int, int>())
+        .def(py::init<int, int, int, int, int, int, AnchorType, ggml_type,
+                      RetrievalType, int, int, int, int, int, int, int, int,
+                      int, int, int, float>())
         .def_readwrite("layer_num", &KVCacheConfig::layer_num)
         .def_readwrite("kv_head_num", &KVCacheConfig::kv_head_num)
         .def_readwrite("q_head_num", &KVCacheConfig::q_head_num)
@@ -645,13 +1126,19 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
         .def_readwrite("anchor_num", &KVCacheConfig::anchor_num)
         .def_readwrite("anchor_type", &KVCacheConfig::anchor_type)
         .def_readwrite("kv_type", &KVCacheConfig::kv_type)
+        .def_readwrite("k_quant_type", &KVCacheConfig::k_quant_type)
+        .def_readwrite("v_quant_type", &KVCacheConfig::v_quant_type)
         .def_readwrite("retrieval_type", &KVCacheConfig::retrieval_type)
         .def_readwrite("layer_step", &KVCacheConfig::layer_step)
         .def_readwrite("token_step", &KVCacheConfig::token_step)
         .def_readwrite("layer_offset", &KVCacheConfig::layer_offset)
         .def_readwrite("max_block_num", &KVCacheConfig::max_block_num)
         .def_readwrite("max_batch_size", &KVCacheConfig::max_batch_size)
-        .def_readwrite("max_thread_num", &KVCacheConfig::max_thread_num);
+        .def_readwrite("max_thread_num", &KVCacheConfig::max_thread_num)
+        .def_readwrite("sink_block_num", &KVCacheConfig::sink_block_num)
+        .def_readwrite("window_block_num", &KVCacheConfig::window_block_num)
+        .def_readwrite("mla_latent_dim", &KVCacheConfig::mla_latent_dim)
+        .def_readwrite("rope_theta", &KVCacheConfig::rope_theta);
     py::class_<KVCache>(kvcache_module, "KVCache")
         .def(py::init<KVCacheConfig>())
         .def("get_cache_total_len", &KVCache::get_cache_total_len)
@@ -668,12 +1155,53 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
                  cpuinfer_interface)
         .def("get_kvcache_fp16",
              &KVCacheBindings::GetKVCacheFp16Bindings::cpuinfer_interface)
+        .def("gather_kvcache_fp16",
+             &KVCacheBindings::GatherKVCacheFp16Bindings::cpuinfer_interface)
+        // Zero-copy, read-only numpy view of one fp16 block, [block_len,
+        // head_dim] for both K and V (V through strides). The view keeps the
+        // KVCache alive, and blocks are only allocated by its constructor, so
+        // the view stays valid as long as it exists; the tokens it shows are
+        // the block's current content. It is read-only because writes through
+        // it would bypass the copy-on-write of a running snapshot_kvcache and
+        // leave the anchors stale; write through update_kvcache_fp16.
+        // Out-of-range indices raise IndexError.
+        .def("block_view",
+             [](py::object self, int layer_id, int head_id, int block_idx,
+                bool is_k) {
+                 KVCache &kv_cache = self.cast<KVCache &>();
+                 ssize_t block_len = kv_cache.get_block_len();
+                 ssize_t head_dim = kv_cache.get_head_dim();
+                 ssize_t item = sizeof(ggml_fp16_t);
+                 std::vector<ssize_t> strides =
+                     is_k ? std::vector<ssize_t>{head_dim * item, item}
+                          : std::vector<ssize_t>{item, block_len * item};
+                 py::array view(
+                     py::dtype("float16"), {block_len, head_dim}, strides,
+                     kv_cache.block_data_fp16(layer_id, head_id, block_idx,
+                                              is_k),
+                     self);
+                 view.attr("flags").attr("writeable") = false;
+                 return view;
+             })
         .def("update_kvcache_fp16",
              &KVCacheBindings::UpdateKVCacheFp16Bindings::cpuinfer_interface)
         .def("update_importance",
              &KVCacheBindings::UpdateImportanceBindings::cpuinfer_interface)
         .def("attn_with_kvcache",
              &KVCacheBindings::AttnWithKVCacheBindings::cpuinfer_interface)
+        .def("attn_with_kvcache_varlen",
+             &KVCacheBindings::AttnWithKVCacheVarlenBindings::
+                 cpuinfer_interface)
+        .def("load_kvcache",
+             &KVCacheBindings::LoadKVCacheBindings::cpuinfer_interface)
+        .def("dump_kvcache",
+             &KVCacheBindings::DumpKVCacheBindings::cpuinfer_interface)
+        .def("snapshot_kvcache",
+             &KVCacheBindings::SnapshotKVCacheBindings::cpuinfer_interface)
+        .def("wait_snapshot", &KVCache::wait_snapshot,
+             py::call_guard<py::gil_scoped_release>())
+        .def("truncate", &KVCacheBindings::TruncateBindings::cpuinfer_interface)
+        .def("evict", &KVCacheBindings::EvictBindings::cpuinfer_interface)
         .def("clear_importance_all_layers",
              &KVCacheBindings::ClearImportanceAllLayersBindings::
                  cpuinfer_interface)
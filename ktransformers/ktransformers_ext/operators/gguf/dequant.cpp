@@ -0,0 +1,52 @@
+/**
+ * @Description  : Multi-threaded GGML dequantization into caller buffers
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#include "dequant.h"
+
+#include <stdexcept>
+#include <string>
+
+Dequant::Dequant(DequantConfig config) {
+    config_ = config;
+    if (ggml_internal_get_type_traits(config_.src_type).to_float == nullptr && config_.src_type != GGML_TYPE_F32) {
+        throw std::invalid_argument("Dequant: unsupported src_type " + std::to_string(config_.src_type));
+    }
+    if (config_.dst_type != GGML_TYPE_F32 && config_.dst_type != GGML_TYPE_F16 && config_.dst_type != GGML_TYPE_BF16) {
+        throw std::invalid_argument("Dequant: unsupported dst_type " + std::to_string(config_.dst_type));
+    }
+    int blck = ggml_blck_size(config_.src_type);
+    config_.chunk_len = std::max(config_.chunk_len, blck);
+    config_.chunk_len = (config_.chunk_len + blck - 1) / blck * blck;
+}
+
+Dequant::~Dequant() {}
+
+void Dequant::forward(int64_t n, const void* input, void* output, Backend* backend) {
+    int64_t blck = ggml_blck_size(config_.src_type);
+    assert(n % blck == 0);
+    int64_t src_row_bytes = ggml_type_size(config_.src_type) * config_.chunk_len / blck;
+    int64_t dst_row_bytes = ggml_type_size(config_.dst_type) * config_.chunk_len;
+    int task_num = (n + config_.chunk_len - 1) / config_.chunk_len;
+    if (config_.dst_type != GGML_TYPE_F32 && (int)thread_fp32_.size() < backend->get_thread_num()) {
+        thread_fp32_.resize(backend->get_thread_num());
+        for (auto& buf : thread_fp32_) {
+            buf.resize(config_.chunk_len);
+        }
+    }
+    backend->do_work_stealing_job(task_num, nullptr, [&](int task_id) {
+        int len = std::min((int64_t)config_.chunk_len, n - (int64_t)task_id * config_.chunk_len);
+        const uint8_t* src = (const uint8_t*)input + task_id * src_row_bytes;
+        uint8_t* dst = (uint8_t*)output + task_id * dst_row_bytes;
+        if (config_.dst_type == GGML_TYPE_F32) {
+            to_float(src, (float*)dst, len, config_.src_type);
+        } else if (config_.src_type == config_.dst_type) {
+            memcpy(dst, src, len * ggml_type_size(config_.dst_type));
+        } else {
+            float* fp32 = thread_fp32_[Backend::thread_local_id].data();
+            to_float(src, fp32, len, config_.src_type);
+            from_float(fp32, dst, len, config_.dst_type);
+        }
+    }, nullptr);
+}
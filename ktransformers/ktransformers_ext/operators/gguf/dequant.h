@@ -0,0 +1,44 @@
+/**
+ * @Description  : Multi-threaded GGML dequantization into caller buffers
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_OPERATOR_DEQUANT_H
+#define CPUINFER_OPERATOR_DEQUANT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "../../cpu_backend/backend.h"
+#include "../llamafile/conversion.h"
+#include "llama.cpp/ggml-impl.h"
+#include "llama.cpp/ggml-quants.h"
+#include "llama.cpp/ggml.h"
+
+struct DequantConfig {
+    ggml_type src_type;  // any type with ggml to_float traits (Q*_K, Q*_0, IQ4_XS, F16, BF16, F32 ...)
+    ggml_type dst_type;  // GGML_TYPE_F32, GGML_TYPE_F16 or GGML_TYPE_BF16
+    int chunk_len;       // elements per task, rounded up to a multiple of the source block size
+
+    DequantConfig() {}
+
+    DequantConfig(ggml_type src_type, ggml_type dst_type, int chunk_len)
+        : src_type(src_type), dst_type(dst_type), chunk_len(chunk_len) {}
+};
+
+class Dequant {
+   public:
+    // Throws std::invalid_argument for a src_type or dst_type it cannot handle.
+    Dequant(DequantConfig);
+    ~Dequant();
+    // Dequantize `n` elements of src_type from `input` into dst_type at `output`.
+    // `n` must be a multiple of the source block size.
+    void forward(int64_t n, const void* input, void* output, Backend* backend);
+
+   private:
+    DequantConfig config_;
+    std::vector<std::vector<float>> thread_fp32_;  // [thread_num, chunk_len], unused when dst_type is F32
+};
+
+#endif
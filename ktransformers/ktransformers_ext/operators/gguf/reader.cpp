@@ -0,0 +1,184 @@
+/**
+ * @Description  : Parallel pread-based GGUF tensor reader
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#include "reader.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+Reader::Reader(ReaderConfig config) {
+    config_ = config;
+    config_.io_thread_num = std::max(config_.io_thread_num, 1);
+    config_.chunk_size = std::max(config_.chunk_size, alignment_);
+    config_.chunk_size = (config_.chunk_size + alignment_ - 1) / alignment_ * alignment_;
+
+    fd_ = open(config_.path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        throw std::runtime_error("Reader: failed to open " + config_.path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        std::string error = strerror(errno);
+        close(fd_);
+        throw std::runtime_error("Reader: failed to stat " + config_.path + ": " + error);
+    }
+    file_size_ = st.st_size;
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    direct_fd_ = -1;
+    if (config_.direct_io) {
+        direct_fd_ = open(config_.path.c_str(), O_RDONLY | O_DIRECT);
+        if (direct_fd_ < 0) {
+            printf("Reader: O_DIRECT unavailable for %s, using buffered reads\n", config_.path.c_str());
+        }
+    }
+
+    next_ticket_ = 0;
+    exit_ = false;
+    for (int i = 0; i < config_.io_thread_num; i++) {
+        workers_.emplace_back(&Reader::worker_thread, this);
+    }
+}
+
+Reader::~Reader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        exit_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+    if (direct_fd_ >= 0) {
+        close(direct_fd_);
+    }
+    close(fd_);
+}
+
+int64_t Reader::submit(int64_t offset, int64_t size, void* dst) {
+    if (offset < 0 || size < 0 || offset + size > file_size_) {
+        throw std::out_of_range("Reader: range [" + std::to_string(offset) + ", " + std::to_string(offset + size) + ") out of " +
+                                config_.path + " (" + std::to_string(file_size_) + " bytes), the file may be truncated");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t ticket = next_ticket_++;
+    int64_t chunk_num = 0;
+    for (int64_t pos = 0; pos < size; pos += config_.chunk_size) {
+        chunks_.push_back({ticket, offset + pos, std::min(config_.chunk_size, size - pos), (uint8_t*)dst + pos});
+        chunk_num++;
+    }
+    remaining_[ticket] = chunk_num;
+    work_cv_.notify_all();
+    return ticket;
+}
+
+void Reader::wait(int64_t ticket) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [&] { return remaining_[ticket] == 0; });
+    remaining_.erase(ticket);
+    auto it = errors_.find(ticket);
+    if (it != errors_.end()) {
+        std::string error = it->second;
+        errors_.erase(it);
+        throw std::runtime_error(error);
+    }
+}
+
+void Reader::worker_thread() {
+    uint8_t* bounce = nullptr;
+    if (direct_fd_ >= 0) {
+        // a chunk may straddle one extra aligned block on each side
+        if (posix_memalign((void**)&bounce, alignment_, config_.chunk_size + 2 * alignment_) != 0) {
+            printf("Reader: failed to allocate O_DIRECT bounce buffer, using buffered reads\n");
+            bounce = nullptr;
+        }
+    }
+    while (true) {
+        Chunk chunk;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_cv_.wait(lock, [&] { return exit_ || !chunks_.empty(); });
+            if (chunks_.empty()) {
+                break;
+            }
+            chunk = chunks_.front();
+            chunks_.pop_front();
+        }
+        std::string error;
+        if (bounce == nullptr || !read_direct(chunk, bounce)) {
+            error = read_buffered(chunk);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error.empty()) {
+                errors_.emplace(chunk.ticket, error);  // first failure of the ticket wins
+            }
+            remaining_[chunk.ticket]--;
+        }
+        done_cv_.notify_all();
+    }
+    free(bounce);
+}
+
+std::string Reader::read_buffered(const Chunk& chunk) {
+    int64_t done = 0;
+    while (done < chunk.size) {
+        ssize_t ret = pread(fd_, chunk.dst + done, chunk.size - done, chunk.offset + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return "Reader: pread failed on " + config_.path + " at " + std::to_string(chunk.offset + done) + ": " +
+                   (ret == 0 ? "unexpected EOF" : strerror(errno));
+        }
+        done += ret;
+    }
+    return "";
+}
+
+bool Reader::read_direct(const Chunk& chunk, uint8_t* bounce) {
+    if (chunk.offset % alignment_ == 0 && chunk.size % alignment_ == 0 && (intptr_t)chunk.dst % alignment_ == 0) {
+        int64_t done = 0;
+        while (done < chunk.size) {
+            ssize_t ret = pread(direct_fd_, chunk.dst + done, chunk.size - done, chunk.offset + done);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                return false;
+            }
+            done += ret;
+        }
+        return true;
+    }
+    int64_t begin = chunk.offset / alignment_ * alignment_;
+    int64_t end = (chunk.offset + chunk.size + alignment_ - 1) / alignment_ * alignment_;
+    int64_t done = 0;
+    while (begin + done < end) {
+        ssize_t ret = pread(direct_fd_, bounce + done, end - begin - done, begin + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return false;
+        }
+        if (ret == 0) {
+            break;  // EOF inside the last aligned block
+        }
+        done += ret;
+    }
+    if (done < chunk.offset + chunk.size - begin) {
+        return false;
+    }
+    memcpy(chunk.dst, bounce + (chunk.offset - begin), chunk.size);
+    return true;
+}
@@ -0,0 +1,76 @@
+/**
+ * @Description  : Parallel pread-based GGUF tensor reader
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_OPERATOR_READER_H
+#define CPUINFER_OPERATOR_READER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct ReaderConfig {
+    std::string path;
+    int io_thread_num;   // concurrent preads in flight
+    int64_t chunk_size;  // bytes per pread, rounded up to the O_DIRECT alignment
+    bool direct_io;      // bypass the page cache with O_DIRECT, falls back to buffered reads if unsupported
+
+    ReaderConfig() {}
+
+    ReaderConfig(std::string path, int io_thread_num, int64_t chunk_size, bool direct_io)
+        : path(path), io_thread_num(io_thread_num), chunk_size(chunk_size), direct_io(direct_io) {}
+};
+
+// Reads byte ranges of a file into caller buffers on a private pool of I/O
+// threads, so reads can be queued ahead and overlap with dequantization
+// running on the CPUInfer backend.
+class Reader {
+   public:
+    // Throws std::runtime_error when the file cannot be opened.
+    Reader(ReaderConfig);
+    ~Reader();
+    // Queue a read of [offset, offset + size) into dst, returns a ticket for wait().
+    // Throws std::out_of_range when the range is past the end of the file.
+    int64_t submit(int64_t offset, int64_t size, void* dst);
+    // Block until every chunk of the ticket has landed in its destination.
+    // Throws std::runtime_error if any of them failed to read.
+    void wait(int64_t ticket);
+
+   private:
+    struct Chunk {
+        int64_t ticket;
+        int64_t offset;
+        int64_t size;
+        uint8_t* dst;
+    };
+
+    static const int64_t alignment_ = 4096;
+
+    ReaderConfig config_;
+    int fd_;
+    int direct_fd_;  // -1 when direct_io is off or unsupported
+    int64_t file_size_;
+
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::deque<Chunk> chunks_;
+    std::unordered_map<int64_t, int64_t> remaining_;  // ticket -> chunks not yet read
+    std::unordered_map<int64_t, std::string> errors_;  // ticket -> first read error
+    int64_t next_ticket_;
+    bool exit_;
+    std::vector<std::thread> workers_;
+
+    void worker_thread();
+    std::string read_buffered(const Chunk&);  // empty on success, else the error
+    bool read_direct(const Chunk&, uint8_t* bounce);
+};
+
+#endif
@@ -128,6 +128,22 @@ struct KVCacheConfig {
     int anchor_num;  /**< Number of anchors used in attention. */
 
     ggml_type kv_type; /**< Data type of the KV Cache (e.g., fp16, q8_0). */
+    int k_quant_type = 0; /**< Quantization axis of quantized K blocks: 0 for
+                             per_token, 1 for per_channel. */
+    int v_quant_type = 1; /**< Quantization axis of quantized V blocks: 0 for
+                             per_token, 1 for per_channel. */
+    int sink_block_num = 0;   /**< Leading blocks always attended to in
+                                 window mode (attention sinks). */
+    int window_block_num = 0; /**< Blocks in the sliding window, including
+                                 the one being filled. 0 disables window
+                                 mode. */
+    int mla_latent_dim = 0;   /**< Latent (kv_lora_rank) width of a
+                                 multi-latent-attention cache. 0 disables
+                                 MLA mode. */
+    float rope_theta = 0;     /**< RoPE base the cached keys were rotated
+                                 with. When > 0 in window mode, the sinks
+                                 are attended at the positions right before
+                                 the window. */
 
     // Controls the pre-allocated memory size
     int max_block_num;  /**< Maximum number of blocks that can be allocated. */
@@ -172,12 +188,43 @@ struct KVCacheConfig {
      * @param max_block_num The maximum number of blocks that can be allocated.
      * @param max_batch_size The maximum batch size that can be processed.
      * @param max_thread_num The maximum number of threads that can be used.
+     * @param k_quant_type The quantization axis of K for q4_0/q8_0 caches.
+     * 0 (per_token) groups 32 channels of one token, 1 (per_channel) groups
+     * 32 tokens of one channel, which keeps outlier channels from inflating
+     * the scale of every other channel.
+     * @param v_quant_type The quantization axis of V, same encoding.
+     * @param sink_block_num The number of leading blocks kept in window mode.
+     * @param window_block_num The sliding window size in blocks. When > 0,
+     * attention only reads the sink blocks and the last window_block_num
+     * blocks, and logical blocks past the sinks are recycled through
+     * window_block_num columns of the block table, so a row needs only
+     * sink_block_num + window_block_num entries however long the sequence.
+     * @param mla_latent_dim When > 0, the cache stores MLA tokens: one
+     * shared kv head (kv_head_num == 1) of head_dim = latent + rope dims,
+     * e.g. 512 + 64 for DeepSeek-V2/V3. Only the K cache is kept; values
+     * are the first mla_latent_dim entries of each K row. Queries are the
+     * absorbed q_nope * W_UK concatenated with q_pe, already multiplied by
+     * the softmax scale, and outputs are latent vectors (to be multiplied
+     * by W_UV) in the first mla_latent_dim entries of each head, with the
+     * remaining entries zero.
+     * @param rope_theta The RoPE base of the keys written to the cache, in
+     * the rotate_half (GPT-NeoX / HF Llama) layout. Window mode recycles
+     * blocks, so the gap between the sinks and the window keeps growing and
+     * soon exceeds the positions the model was trained on. With rope_theta
+     * > 0 the sinks are scored as if their keys sat directly before the
+     * window (StreamingLLM cache positions) by rotating the query back by
+     * the gap for the sink blocks only; the window keys and the query keep
+     * their positions, whose differences are unchanged. 0 leaves every key
+     * at the position it was written with.
      */
     KVCacheConfig(int layer_num, int kv_head_num, int q_head_num, int head_dim,
                   int block_len, int anchor_num, AnchorType anchor_type,
                   ggml_type kv_type, RetrievalType retrieval_type,
                   int layer_step, int token_step, int layer_offset,
-                  int max_block_num, int max_batch_size, int max_thread_num);
+                  int max_block_num, int max_batch_size, int max_thread_num,
+                  int k_quant_type = 0, int v_quant_type = 1,
+                  int sink_block_num = 0, int window_block_num = 0,
+                  int mla_latent_dim = 0, float rope_theta = 0);
 };
 
 /**
@@ -352,6 +399,27 @@ class KVCache {
     void dump_kvcache(int *block_table, int cache_total_len,
                       std::string tensor_file_path, Backend *backend);
 
+    /**
+     * @brief dump_kvcache that returns once the block table is captured.
+     *
+     * The blocks are written to tensor_file_path (through a temporary
+     * file, renamed when complete) by a background thread at best-effort
+     * I/O priority io_priority (0 highest, 7 lowest), while attention and
+     * updates keep running. A block that is about to be modified before
+     * it was written is copied first (copy-on-write). The file has the
+     * dump_kvcache layout and is read back with load_kvcache. A new
+     * snapshot, BlockResize and load_kvcache wait for the previous one.
+     * A snapshot that fails removes its temporary file, keeps the previous
+     * file and is reported by wait_snapshot or the next snapshot_kvcache.
+     */
+    void snapshot_kvcache(int *block_table, int cache_total_len,
+                          std::string tensor_file_path, int io_priority,
+                          Backend *backend);
+    // Blocks until the running snapshot, if any, is on disk; throws
+    // std::runtime_error if it failed.
+    void wait_snapshot();
+    ~KVCache() { join_snapshot_(); }
+
     void get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                      int layer_id, int *block_table,
                                      int batch_size, int max_block_num,
@@ -362,6 +430,54 @@ class KVCache {
                           int *block_table, int batch_size, int max_block_num,
                           int *cache_seqlens, Backend *backend);
 
+    /**
+     * @brief get_kvcache_fp16 for layers [layer_begin, layer_end) in one
+     * parallel pass, e.g. into a pinned staging buffer for the GPU.
+     *
+     * @param k_out [layer_end - layer_begin, batch_size, max_block_num *
+     * block_len, kv_head_num, head_dim], same for v_out. Only the first
+     * cache_seqlens[b] tokens of each sequence are written.
+     */
+    void gather_kvcache_fp16(ggml_fp16_t *k_out, ggml_fp16_t *v_out,
+                             int layer_begin, int layer_end, int *block_table,
+                             int batch_size, int max_block_num,
+                             int *cache_seqlens, Backend *backend);
+
+    /**
+     * @brief Storage of one fp16 K or V block, for zero-copy views.
+     *
+     * K blocks are [block_len, head_dim] and V blocks [head_dim, block_len],
+     * both contiguous. Every block is a separate allocation, so there is no
+     * single view over a layer or head. The pointer stays valid until the
+     * next BlockResize.
+     *
+     * @throws std::invalid_argument if the cache is not fp16, or for V of
+     * an MLA cache, which keeps none.
+     * @throws std::out_of_range if layer_id, head_id or block_idx is out of
+     * range.
+     */
+    ggml_fp16_t *block_data_fp16(int layer_id, int head_id, int block_idx,
+                                 bool is_k) {
+        if (config_.kv_type != ggml_type::GGML_TYPE_F16) {
+            throw std::invalid_argument("block views need an fp16 KVCache");
+        }
+        if (!is_k && config_.mla_latent_dim != 0) {
+            throw std::invalid_argument("an MLA KVCache has no V blocks");
+        }
+        auto &cache = is_k ? k_cache_fp16_ : v_cache_fp16_;
+        if (layer_id < 0 || layer_id >= (int)cache.size()) {
+            throw std::out_of_range("layer_id out of range");
+        }
+        if (head_id < 0 || head_id >= (int)cache[layer_id].size()) {
+            throw std::out_of_range("head_id out of range");
+        }
+        if (block_idx < 0 ||
+            block_idx >= (int)cache[layer_id][head_id].size()) {
+            throw std::out_of_range("block_idx out of range");
+        }
+        return cache[layer_id][head_id][block_idx].data();
+    }
+
     void update_kvcache_fp16(const ggml_fp16_t *k_in, const ggml_fp16_t *v_in,
                              int layer_id, int *block_table, int batch_size,
                              int max_block_num, int *cache_seqlens, int q_len,
@@ -379,6 +495,35 @@ class KVCache {
                            int *cache_seqlens, int topk, int local,
                            Backend *backend);
 
+    /**
+     * @brief attn_with_kvcache for a ragged batch.
+     *
+     * Request b owns the query tokens [cu_seqlens_q[b], cu_seqlens_q[b + 1])
+     * of the packed inputs, so a decode step (1 token) and a prefill chunk
+     * can share one call. The tokens' K/V are appended at cache_seqlens[b],
+     * cache_seqlens[b] is advanced, and every token attends causally to all
+     * cached tokens up to and including itself (no block retrieval).
+     *
+     * @param q_in [total_q, q_head_num, head_dim]
+     * @param k_in [total_q, kv_head_num, head_dim], same for v_in
+     * @param output [total_q, q_head_num, head_dim]
+     * @param attn_lse [total_q, q_head_num]
+     * @param cu_seqlens_q [batch_size + 1] offsets of each request's tokens
+     * @param tree_mask Optional, replaces the causal mask among the new
+     * tokens of each request (e.g. a speculative draft tree). For a request
+     * of q_len tokens it holds q_len * q_len bytes, row t non-zero at s if
+     * new token t attends to new token s; requests are concatenated in
+     * order. All cached tokens before the call stay visible.
+     */
+    void attn_with_kvcache_varlen(const ggml_fp16_t *q_in,
+                                  const ggml_fp16_t *k_in,
+                                  const ggml_fp16_t *v_in, ggml_fp16_t *output,
+                                  float *attn_lse, int layer_idx,
+                                  int batch_size, int *cu_seqlens_q,
+                                  int max_block_num, int *block_table,
+                                  int *cache_seqlens, const uint8_t *tree_mask,
+                                  Backend *backend);
+
     void clear_importance_all_layers(int *block_table, int *cache_seqlens,
                                      int batch_size, int max_block_num,
                                      Backend *backend);
@@ -387,6 +532,54 @@ class KVCache {
                                   int batch_size, int max_block_num,
                                   Backend *backend);
 
+    /**
+     * @brief Drops the tokens of one sequence past `new_len` in all layers.
+     *
+     * The dropped K/V entries and their importance are zeroed, so the cache
+     * is as if they had never been written; the anchors of dropped blocks
+     * are cleared and the anchor of a new partial tail block is recomputed.
+     * Used to roll back rejected speculative tokens.
+     *
+     * @param block_table [batch_size, max_block_num], or nullptr for the
+     * single sequence addressed by cache_total_len_.
+     * @param cache_seqlens [batch_size]; cache_seqlens[batch_id] is set to
+     * new_len. Ignored when block_table is nullptr, in which case
+     * cache_total_len_ and the per layer block counts are updated instead.
+     */
+    void truncate(int *block_table, int *cache_seqlens, int batch_id,
+                  int max_block_num, int new_len, Backend *backend);
+
+    /**
+     * @brief Shrinks one sequence to `budget` tokens in all layers by
+     * evicting the tokens of least accumulated importance (H2O).
+     *
+     * Every kv head of every layer keeps its recent_len newest tokens plus
+     * the budget - recent_len older tokens with the largest importance
+     * summed over its query heads, compacted in order to [0, budget).
+     * Tokens ahead of the first evicted one are not moved, and only blocks
+     * from there on get their anchors recomputed; dropped blocks are
+     * cleared as in truncate. Importance must have been accumulated with
+     * update_importance. Calling this every few blocks past the budget,
+     * rather than every token, amortizes the compaction.
+     *
+     * Keys keep the rotary position they were written with, so after an
+     * eviction cache_seqlens is no longer the position of the next token;
+     * the caller tracks positions on its own.
+     *
+     * @param block_table [batch_size, max_block_num], or nullptr for the
+     * single sequence addressed by cache_total_len_. Entries from
+     * ceil(budget / block_len) on are no longer referenced afterwards and
+     * may be handed back to the block allocator.
+     * @param cache_seqlens [batch_size]; cache_seqlens[batch_id] is set to
+     * budget. Same nullptr convention as truncate.
+     * @param merge When true, each evicted value is folded into the next
+     * kept token of its head, weighted by importance, and its importance is
+     * added to that token (cache merging); otherwise it is dropped.
+     */
+    void evict(int *block_table, int *cache_seqlens, int batch_id,
+               int max_block_num, int budget, int recent_len, bool merge,
+               Backend *backend);
+
     void get_sincos(ggml_fp16_t *sin, ggml_fp16_t *cos, int seqlen);
 
     void get_attn_sparsity(const ggml_fp16_t *q_in, float *attn_sparsity,
@@ -403,6 +596,7 @@ class KVCache {
     // Persistent data
     KVCacheConfig config_;
     int n_gqa_;                            // q_head_num / kv_head_num
+    int numa_nodes_ = 1; // NUMA nodes the KV blocks are spread over
     int cache_total_len_;                  // Number of tokens in cache
     std::vector<uint64_t> past_block_num_; // [layer_num]
     std::vector<std::vector<std::vector<std::vector<block_q4_0>>>>
@@ -486,6 +680,11 @@ class KVCache {
                                          // batch_size, max_block_num,
                                          // kv_head_num]
 
+    std::vector<std::vector<std::vector<std::vector<int>>>>
+        selected_blocks_history_qhead_; // [layer_num // layer_step,
+                                        // batch_size, max_block_num,
+                                        // q_head_num]
+
     std::vector<std::vector<int>>
         block_table_before_retrieval_; // [batch_size, max_block_num]
     std::vector<std::vector<int>>
@@ -507,11 +706,29 @@ class KVCache {
 
     std::vector<std::vector<std::unique_ptr<std::mutex>>>
         mutex_; // [batch_size, kv_head_num]
+
+    // Copy-on-write snapshot state. snapshot_state_[block_idx] is one of
+    // the SNAPSHOT_* values below; snapshot_copies_[block_idx] holds the
+    // serialized block once it was copied ahead of a write.
+    enum { SNAPSHOT_NONE, SNAPSHOT_PENDING, SNAPSHOT_BUSY, SNAPSHOT_COPIED };
+    std::atomic<bool> snapshot_active_{false};
+    std::vector<std::atomic<int>> snapshot_state_; // [max_block_num]
+    std::vector<std::vector<char>> snapshot_copies_; // [max_block_num]
+    std::thread snapshot_thread_;
+    std::string snapshot_error_; // set by a failed snapshot_thread_
     std::vector<std::vector<std::vector<block_q8_0>>>
         q_q8_0_; // [batch_size, kv_head_num, n_gqa * head_dim / QK8_0]
     std::vector<std::vector<std::vector<float>>>
         q_fp32_; // [batch_size, kv_head_num, n_gqa * head_dim]
 
+    // Window mode with rope_theta > 0: the query rotated back by
+    // sink_rope_shift_ positions, used against the sink blocks only.
+    std::vector<int> sink_rope_shift_; // [batch_size]
+    std::vector<std::vector<ggml_fp16_t>>
+        q_sink_fp16_; // [batch_size, q_head_num * head_dim]
+    std::vector<std::vector<std::vector<block_q8_0>>>
+        q_sink_q8_0_; // [batch_size, kv_head_num, n_gqa * head_dim / QK8_0]
+
     std::vector<std::vector<std::vector<float>>>
         output_fp32_; // [batch_size, kv_head_num, n_gqa * head_dim]
     std::vector<std::vector<std::vector<float>>>
@@ -519,6 +736,17 @@ class KVCache {
 
     std::vector<std::pair<int, int>> thread_cur_head_idx_; // [thread_num]
 
+    // One K/V block read by QHEAD attention for a (batch, kv_head) group,
+    // with the query heads of the group that selected it.
+    struct QHeadTile {
+        int batch_id;
+        int kv_head_id;
+        int block_idx;
+        int len;            // valid tokens in the block
+        uint64_t head_mask; // bit i set if query head i of the group reads it
+    };
+    std::vector<QHeadTile> qhead_tiles_; // sorted by (batch_id, kv_head_id)
+
     std::vector<std::vector<block_q8_0>>
         thread_local_output_q8_0_; // [thread_num, n_gqa * head_dim / QK8_0]
     std::vector<std::vector<float>>
@@ -536,16 +764,75 @@ class KVCache {
     std::vector<std::vector<char>>
         thread_local_draft_; // [thread_num, 2 * n_gqa * block_len + 6 * n_gqa *
                              // head_dim + 2 * block_len * head_dim]
+    std::vector<std::vector<float>>
+        thread_local_chunk_output_fp32_; // [thread_num, CHUNK_SIZE * n_gqa *
+                                         // head_dim]
+    std::vector<std::vector<float>>
+        thread_local_chunk_attn_lse_; // [thread_num, CHUNK_SIZE * n_gqa]
+    std::vector<std::vector<block_q8_0>>
+        thread_local_chunk_q_q8_0_; // [thread_num, CHUNK_SIZE * n_gqa *
+                                    // head_dim / QK8_0]
 
     // tmp space
     std::vector<float> q_fp32; // [n_gqa * head_dim]
 
+    // Column of the block table holding logical block `block_id`. In window
+    // mode the blocks past the sinks share window_block_num columns.
+    int block_slot_(int block_id) {
+        if (config_.window_block_num == 0 ||
+            block_id < config_.sink_block_num) {
+            return block_id;
+        }
+        return config_.sink_block_num +
+               (block_id - config_.sink_block_num) % config_.window_block_num;
+    }
+
+    // NUMA node owning the K/V of (head_id, block_idx) in every layer. Heads
+    // are split over the nodes when there are enough of them, otherwise
+    // blocks are spread round-robin. Always 0 without USE_NUMA.
+    int kv_numa_node_(int head_id, int block_idx) {
+        if (config_.kv_head_num >= numa_nodes_) {
+            return head_id * numa_nodes_ / config_.kv_head_num;
+        }
+        return block_idx % numa_nodes_;
+    }
+    // Moves the pages of blocks [begin_block, end_block) to their owner.
+    void bind_kvcache_numa_(int begin_block, int end_block);
+    // do_work_stealing_job where task task_id only runs on threads of node
+    // task_node(task_id), so every task reads node-local K/V. Falls back to
+    // plain work stealing without USE_NUMA.
+    void do_kv_numa_job_(Backend *backend, int task_num,
+                         std::function<int(int)> task_node,
+                         std::function<void(int)> init_func,
+                         std::function<void(int)> compute_func,
+                         std::function<void(int)> finalize_func);
+
+    // Must be called before block block_idx (any layer, head, importance
+    // or anchor) is modified; copies it first if a snapshot still needs
+    // it. Cheap when no snapshot is running.
+    void cow_block_(int block_idx) {
+        if (snapshot_active_.load(std::memory_order_acquire)) {
+            cow_block_slow_(block_idx);
+        }
+    }
+    void cow_block_slow_(int block_idx);
+    // Serialized K/V, importance and anchors of a block in all layers.
+    void serialize_block_(int block_idx, std::vector<char> &out);
+    size_t serialized_block_size_();
+    // Waits for snapshot_thread_ and leaves its error for wait_snapshot.
+    void join_snapshot_();
+
     void quantize_q_(const uint16_t *q_in_data, int batch_size);
+    void attn_initialize_window_(int batch_size, int *block_table,
+                                 int max_block_num, int *cache_seqlens);
+    void rotate_sink_q_(const uint16_t *q_in_data, int batch_size);
     void attn_initialize_layer_(int batch_size, int layer_idx, int *block_table,
                                 int &max_block_num, int *cache_seqlens);
     void attn_initialize_kvhead_(int batch_size, int layer_idx,
                                  int *block_table, int &max_block_num,
                                  int *cache_seqlens);
+    void attn_initialize_qhead_(int batch_size, int *block_table,
+                                int &max_block_num, int *cache_seqlens);
     void retrieval_kvcache_layer_(const uint16_t *q_in_data, int init_block_num,
                                   int local_block_num, int pick_block_num,
                                   int q_len, int generate_token_idx,
@@ -558,6 +845,12 @@ class KVCache {
                                    int generate_token_idx, int batch_size,
                                    int layer_idx, int *cache_seqlens,
                                    int &max_block_num, Backend *backend);
+    void retrieval_kvcache_qhead_(const uint16_t *q_in_data, int init_block_num,
+                                  int local_block_num, int pick_block_num,
+                                  int q_len, int generate_token_idx,
+                                  int batch_size, int layer_idx,
+                                  int *cache_seqlens, int &max_block_num,
+                                  Backend *backend);
 
     void calculate_block_similarity_layer_(
         const uint16_t *q_in_data, int batch_size, int layer_idx, int q_len,
@@ -567,6 +860,10 @@ class KVCache {
         const uint16_t *q_in_data, int batch_size, int layer_idx, int q_len,
         int max_block_num, int *cache_seqlens, int init_block_num,
         int local_block_num, int pick_block_num, Backend *backend);
+    void calculate_block_similarity_qhead_(
+        const uint16_t *q_in_data, int batch_size, int layer_idx, int q_len,
+        int max_block_num, int init_block_num, int local_block_num,
+        Backend *backend);
 
     void select_block_layer_(int batch_size, int layer_idx, int max_block_num,
                              int init_block_num, int local_block_num,
@@ -574,6 +871,9 @@ class KVCache {
     void select_block_kvhead_(int batch_size, int layer_idx, int max_block_num,
                               int init_block_num, int local_block_num,
                               int pick_block_num);
+    void select_block_qhead_(int batch_size, int layer_idx, int max_block_num,
+                             int init_block_num, int local_block_num,
+                             int pick_block_num);
 
     void calculate_sparsity_layer_(const uint16_t *q_in_data,
                                    float *attn_sparsity, int batch_size,
@@ -584,10 +884,37 @@ class KVCache {
                                     int max_block_num, int *block_table,
                                     int *cache_seqlens, Backend *backend);
 
+    // Access to one token of a quantized K (is_k) or V block that hides
+    // whether the block is stored per_token or per_channel.
+    void dequant_kv_token_(bool is_k, int layer_id, int head_id,
+                           int block_idx, int pos, float *out);
+    // Quantizes tokens [begin, end) of a block, token t read from
+    // in[(t - begin) * stride]. Per_channel groups touched by the range are
+    // requantized once, with the tokens outside the range kept as stored
+    // before `begin` and zeroed from `end` on.
+    void quant_kv_tokens_(bool is_k, int layer_id, int head_id, int block_idx,
+                          int begin, int end, const ggml_fp16_t *in,
+                          int stride);
+    // Zeroes tokens [begin, block_len) of a K and V block, any kv_type.
+    void zero_kv_tokens_(int layer_id, int head_id, int block_idx, int begin);
+
+    // MLA attention of all q_head_num heads over the first `len` tokens of
+    // one latent block. q [q_head_num, head_dim] fp16, pre-scaled; output
+    // [q_head_num, head_dim] fp32 with the latent result in the first
+    // mla_latent_dim entries of each head; lse [q_head_num].
+    void mla_attn_one_block_(const uint16_t *q, const ggml_fp16_t *kv,
+                             int len, float *attn_score, float *output,
+                             float *lse, char *draft);
+
     void attention_kvhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
                            float *attn_lse, int batch_size, Backend *backend);
     void attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
                           float *attn_lse, int batch_size, Backend *backend);
+    // Groups the per query head block tables of each (batch, kv_head) into
+    // qhead_tiles_, one entry per distinct block.
+    void build_qhead_tiles_(int batch_size);
+    void attention_qhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
+                          float *attn_lse, int batch_size, Backend *backend);
 
     /**
      * @brief Computes attention with KV cache for one block.
@@ -619,7 +946,8 @@ class KVCache {
      *                     per_channel. Other values will raise an error.
      * @param k_cache Pointer to the K cache tensor [seq_len, head_dim]. If
      *                quant_type == 0, head_dim % 32 must be 0. If quant_type ==
-     * 1, seq_len % 32 must be 0.
+     * 1, seq_len % 32 must be 0 and the blocks are laid out [head_dim,
+     * seq_len / 32].
      * @param num_k_anchor The number of K anchors. If num_k_anchor == 0, it
      * means no anchor is present.
      * @param k_cache_anchors Pointer to the K cache anchors [num_k_anchor,
@@ -627,8 +955,10 @@ class KVCache {
      * @param k_cache_anchor_pos Pointer to the K cache anchor positions. Each
      * token is associated with the nearest previous anchor position.
      * @param v_type The data type of V cache (GGML data type).
-     * @param v_quant_type Quantization type for V cache.
-     * @param v_cache Pointer to the V cache tensor [head_dim, seq_len].
+     * @param v_quant_type Quantization type for V cache, same encoding as
+     * k_quant_type.
+     * @param v_cache Pointer to the V cache tensor, [head_dim, seq_len] for
+     * per_channel and [seq_len, head_dim] for per_token.
      * @param num_v_anchor The number of V anchors.
      * @param v_cache_anchors Pointer to the V cache anchors.
      * @param v_cache_anchor_pos Pointer to the V cache anchor positions.
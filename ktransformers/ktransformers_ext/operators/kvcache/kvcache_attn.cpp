@@ -12,6 +12,131 @@
 
 #include <chrono>
 
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// acc[0, 32) += w * quants of `block`; the caller folds the block scale into w.
+inline void axpy_block(float w, const block_q8_0 &block, float *acc) {
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 vw = _mm256_set1_ps(w);
+    for (int i = 0; i < 4; i++) {
+        __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(
+            _mm_loadl_epi64((const __m128i *)(block.qs + i * 8))));
+        _mm256_storeu_ps(acc + i * 8,
+                         _mm256_fmadd_ps(vw, q, _mm256_loadu_ps(acc + i * 8)));
+    }
+#else
+    for (int j = 0; j < QK8_0; j++) {
+        acc[j] += w * block.qs[j];
+    }
+#endif
+}
+
+inline void axpy_block(float w, const block_q4_0 &block, float *acc) {
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 vw = _mm256_set1_ps(w);
+    __m128i raw = _mm_loadu_si128((const __m128i *)block.qs);
+    __m128i mask = _mm_set1_epi8(0x0F);
+    __m128i offset = _mm_set1_epi8(8);
+    // low nibbles hold elements [0, 16), high nibbles [16, 32)
+    __m128i half[2] = {
+        _mm_sub_epi8(_mm_and_si128(raw, mask), offset),
+        _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(raw, 4), mask), offset)};
+    for (int i = 0; i < 4; i++) {
+        __m128i bytes = half[i / 2];
+        if (i & 1) {
+            bytes = _mm_srli_si128(bytes, 8);
+        }
+        __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+        _mm256_storeu_ps(acc + i * 8,
+                         _mm256_fmadd_ps(vw, q, _mm256_loadu_ps(acc + i * 8)));
+    }
+#else
+    for (int j = 0; j < QK4_0 / 2; j++) {
+        acc[j] += w * ((block.qs[j] & 0x0F) - 8);
+        acc[j + QK4_0 / 2] += w * ((block.qs[j] >> 4) - 8);
+    }
+#endif
+}
+
+// attn_score[b, t] = q[b, :] . k[t, :] with k quantized per_channel, i.e.
+// blocks laid out [head_dim, seq_len / 32]. Each block adds one channel's
+// contribution to the scores of 32 consecutive tokens.
+template <typename block_t>
+void attn_score_per_channel(int head_dim, int bsz, int seq_len,
+                            const float *q, const block_t *k,
+                            float *attn_score) {
+    int group_num = seq_len / 32;
+    for (int b = 0; b < bsz; b++) {
+        for (int g = 0; g < group_num; g++) {
+            float *acc = attn_score + b * seq_len + g * 32;
+            std::fill(acc, acc + 32, 0.0f);
+            for (int c = 0; c < head_dim; c++) {
+                const block_t &block = k[c * group_num + g];
+                axpy_block(q[b * head_dim + c] * GGML_FP16_TO_FP32(block.d),
+                           block, acc);
+            }
+        }
+    }
+}
+
+// output[b, :] = sum_t attn_score[b, t] * v[t, :] with v quantized per_token,
+// i.e. blocks laid out [seq_len, head_dim / 32]. Masked tokens are skipped.
+template <typename block_t>
+void attn_output_per_token(int head_dim, int bsz, int seq_len,
+                           const float *attn_score, const block_t *v,
+                           float *output) {
+    std::fill(output, output + bsz * head_dim, 0.0f);
+    for (int t = 0; t < seq_len; t++) {
+        for (int b = 0; b < bsz; b++) {
+            float w = attn_score[b * seq_len + t];
+            if (w == 0) {
+                continue;
+            }
+            for (int l = 0; l < head_dim / 32; l++) {
+                const block_t &block = v[t * head_dim / 32 + l];
+                axpy_block(w * GGML_FP16_TO_FP32(block.d), block,
+                           output + b * head_dim + l * 32);
+            }
+        }
+    }
+}
+
+// Merges a partial attention result (part, part_lse) of one head into
+// (out, lse). A lse of -inf marks an empty side.
+inline void merge_partial_attn(float *out, float &lse, const float *part,
+                               float part_lse, int head_dim) {
+    if (part_lse == -std::numeric_limits<float>::infinity()) {
+        return;
+    }
+    if (lse == -std::numeric_limits<float>::infinity()) {
+        std::copy(part, part + head_dim, out);
+        lse = part_lse;
+        return;
+    }
+    float new_lse = std::max(lse, part_lse) +
+                    std::log1p(std::exp(-std::abs(lse - part_lse)));
+    float out_scale = std::exp(lse - new_lse);
+    float part_scale = std::exp(part_lse - new_lse);
+    for (int i = 0; i < head_dim; i++) {
+        out[i] = out[i] * out_scale + part[i] * part_scale;
+    }
+    lse = new_lse;
+}
+
+// Bit mask of the first `seq_len` tokens of a block of `block_len` tokens.
+inline void fill_attn_mask(uint8_t *mask, int seq_len, int block_len) {
+    for (int i = 0; i < block_len / 8; i++) {
+        int bits = std::min(std::max(seq_len - i * 8, 0), 8);
+        mask[i] = (uint8_t)((1 << bits) - 1);
+    }
+}
+
+} // namespace
+
 void KVCache::attention_kvhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
                                 float *attn_lse, int batch_size,
                                 Backend *backend) {
@@ -19,8 +144,24 @@ void KVCache::attention_kvhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
     auto start = std::chrono::high_resolution_clock::now();
     seq_len_ = config_.block_len;
 
-    backend->do_work_stealing_job(
+    do_kv_numa_job_(
+        backend,
         batch_size * config_.kv_head_num * max_block_num_after_retrieval_,
+        [&](int task_id) {
+            int batch_id = task_id / (config_.kv_head_num *
+                                      max_block_num_after_retrieval_);
+            int head_id = (task_id % (config_.kv_head_num *
+                                      max_block_num_after_retrieval_)) /
+                          max_block_num_after_retrieval_;
+            int block_id = task_id % max_block_num_after_retrieval_;
+            if (cache_seqlens_[batch_id] / config_.block_len < block_id) {
+                return 0;
+            }
+            return kv_numa_node_(
+                head_id,
+                block_table_after_retrieval_kvhead_[batch_id][block_id]
+                                                   [head_id]);
+        },
         [&](int thread_id) {
             thread_cur_head_idx_[thread_id].first = -1;
             thread_cur_head_idx_[thread_id].second = -1;
@@ -90,9 +231,9 @@ void KVCache::attention_kvhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
                         seq_len_, 0, false,
                         thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q4_0, 0,
+                        GGML_TYPE_Q4_0, config_.k_quant_type,
                         k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q4_0, config_.v_quant_type,
                         v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -111,9 +252,9 @@ void KVCache::attention_kvhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
                         seq_len_, 0, false,
                         thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q8_0, 0,
+                        GGML_TYPE_Q8_0, config_.k_quant_type,
                         k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q8_0, config_.v_quant_type,
                         v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -150,9 +291,10 @@ void KVCache::attention_kvhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
                         config_.head_dim,
                         config_.q_head_num / config_.kv_head_num,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0, 0,
+                        seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0,
+                        config_.k_quant_type,
                         k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q4_0, config_.v_quant_type,
                         v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -169,9 +311,10 @@ void KVCache::attention_kvhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
                         config_.head_dim,
                         config_.q_head_num / config_.kv_head_num,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0, 0,
+                        seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0,
+                        config_.k_quant_type,
                         k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q8_0, config_.v_quant_type,
                         v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -353,14 +496,86 @@ void KVCache::attention_kvhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
     //        diff.count());
 }
 
+void KVCache::mla_attn_one_block_(const uint16_t *q, const ggml_fp16_t *kv,
+                                  int len, float *attn_score, float *output,
+                                  float *lse, char *draft) {
+    int head_num = config_.q_head_num;
+    int block_len = config_.block_len;
+    int head_dim = config_.head_dim;
+    int latent = config_.mla_latent_dim;
+
+    // Scores over the full latent + rope row: [head_num, block_len].
+    bool ok = llamafile_sgemm(block_len, head_num, head_dim, kv, head_dim, q,
+                              head_dim, attn_score, block_len, 0, 1,
+                              GGML_TASK_TYPE_COMPUTE, GGML_TYPE_F16,
+                              GGML_TYPE_F16, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+    if (!ok) {
+        printf("llamafile_sgemm failed\n");
+    }
+
+    // Softmax over the first `len` tokens, kept as fp16 for the V product.
+    ggml_fp16_t *prob = (ggml_fp16_t *)draft;
+    for (int h = 0; h < head_num; h++) {
+        float *score = attn_score + h * block_len;
+        float max_score = -std::numeric_limits<float>::infinity();
+        for (int t = 0; t < len; t++) {
+            max_score = std::max(max_score, score[t]);
+        }
+        float sum = 0;
+        for (int t = 0; t < len; t++) {
+            score[t] = std::exp(score[t] - max_score);
+            sum += score[t];
+        }
+        for (int t = 0; t < block_len; t++) {
+            prob[h * block_len + t] =
+                GGML_FP32_TO_FP16(t < len ? score[t] / sum : 0.0f);
+        }
+        lse[h] = max_score + std::log(sum);
+    }
+
+    // V is the latent part of K; transpose it to [latent, block_len].
+    ggml_fp16_t *latent_t = prob + head_num * block_len;
+    for (int t = 0; t < block_len; t++) {
+        for (int l = 0; l < latent; l++) {
+            latent_t[l * block_len + t] =
+                t < len ? kv[t * head_dim + l] : GGML_FP32_TO_FP16(0.0f);
+        }
+    }
+    ok = llamafile_sgemm(latent, head_num, block_len, latent_t, block_len,
+                         prob, block_len, output, head_dim, 0, 1,
+                         GGML_TASK_TYPE_COMPUTE, GGML_TYPE_F16, GGML_TYPE_F16,
+                         GGML_TYPE_F32, GGML_PREC_DEFAULT);
+    if (!ok) {
+        printf("llamafile_sgemm failed\n");
+    }
+    for (int h = 0; h < head_num; h++) {
+        std::fill(output + h * head_dim + latent, output + (h + 1) * head_dim,
+                  0.0f);
+    }
+}
+
 void KVCache::attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
                                float *attn_lse, int batch_size,
                                Backend *backend) {
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
     seq_len_ = config_.block_len;
-    backend->do_work_stealing_job(
+    do_kv_numa_job_(
+        backend,
         batch_size * config_.kv_head_num * max_block_num_after_retrieval_,
+        [&](int task_id) {
+            int batch_id = task_id / (config_.kv_head_num *
+                                      max_block_num_after_retrieval_);
+            int head_id = (task_id % (config_.kv_head_num *
+                                      max_block_num_after_retrieval_)) /
+                          max_block_num_after_retrieval_;
+            int block_id = task_id % max_block_num_after_retrieval_;
+            if (cache_seqlens_[batch_id] / config_.block_len < block_id) {
+                return 0;
+            }
+            return kv_numa_node_(
+                head_id, block_table_after_retrieval_[batch_id][block_id]);
+        },
         [&](int thread_id) {
             thread_cur_head_idx_[thread_id].first = -1;
             thread_cur_head_idx_[thread_id].second = -1;
@@ -378,6 +593,22 @@ void KVCache::attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
                 return;
             }
             int block_idx = block_table_after_retrieval_[batch_id][block_id];
+            // The sinks of a slid window score against the query rotated
+            // back by the gap (see rotate_sink_q_). They are always full.
+            bool sink_query = config_.rope_theta > 0 &&
+                              block_id < config_.sink_block_num &&
+                              sink_rope_shift_[batch_id] > 0;
+            const void *q_fp16 =
+                sink_query
+                    ? (const void *)(q_sink_fp16_[batch_id].data() +
+                                     head_id * n_gqa_ * config_.head_dim)
+                    : (const void *)&q_in_data[batch_id * config_.kv_head_num *
+                                                   n_gqa_ * config_.head_dim +
+                                               head_id * n_gqa_ *
+                                                   config_.head_dim];
+            const block_q8_0 *q_q8_0 =
+                sink_query ? q_sink_q8_0_[batch_id][head_id].data()
+                           : q_q8_0_[batch_id][head_id].data();
             if (cache_seqlens_[batch_id] / config_.block_len == block_id) {
                 int seq_len = cache_seqlens_[batch_id] % config_.block_len;
                 if (seq_len == 0)
@@ -402,7 +633,15 @@ void KVCache::attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
                 for (int i = full_blocks + 1; i < seq_len_ / 8; ++i) {
                     thread_local_attn_mask_[thread_id][i] = 0;
                 }
-                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                if (config_.mla_latent_dim > 0) {
+                    mla_attn_one_block_(
+                        &q_in_data[batch_id * n_gqa_ * config_.head_dim],
+                        k_cache_fp16_[layer_id_][0][block_idx].data(), seq_len,
+                        thread_local_attn_score_[thread_id].data(),
+                        thread_local_output_fp32_[thread_id].data(),
+                        thread_local_attn_lse_[thread_id].data(),
+                        thread_local_draft_[thread_id].data());
+                } else if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
                     attn_with_kvcache_one_block_(
                         config_.head_dim,
                         config_.q_head_num / config_.kv_head_num, GGML_TYPE_F16,
@@ -428,9 +667,9 @@ void KVCache::attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
                         seq_len_, 0, false,
                         thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q4_0, 0,
+                        GGML_TYPE_Q4_0, config_.k_quant_type,
                         k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q4_0, config_.v_quant_type,
                         v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -449,9 +688,9 @@ void KVCache::attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
                         seq_len_, 0, false,
                         thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q8_0, 0,
+                        GGML_TYPE_Q8_0, config_.k_quant_type,
                         k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q8_0, config_.v_quant_type,
                         v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -465,14 +704,20 @@ void KVCache::attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
                         n_gqa_ * config_.head_dim);
                 }
             } else {
-                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                if (config_.mla_latent_dim > 0) {
+                    mla_attn_one_block_(
+                        &q_in_data[batch_id * n_gqa_ * config_.head_dim],
+                        k_cache_fp16_[layer_id_][0][block_idx].data(),
+                        config_.block_len,
+                        thread_local_attn_score_[thread_id].data(),
+                        thread_local_output_fp32_[thread_id].data(),
+                        thread_local_attn_lse_[thread_id].data(),
+                        thread_local_draft_[thread_id].data());
+                } else if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
                     attn_with_kvcache_one_block_(
                         config_.head_dim,
                         config_.q_head_num / config_.kv_head_num, GGML_TYPE_F16,
-                        (void *)&q_in_data[batch_id * config_.kv_head_num *
-                                               n_gqa_ * config_.head_dim +
-                                           head_id * n_gqa_ * config_.head_dim],
-                        seq_len_, 0, true, nullptr, GGML_TYPE_F16, 0,
+                        q_fp16, seq_len_, 0, true, nullptr, GGML_TYPE_F16, 0,
                         k_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr, GGML_TYPE_F16, 1,
                         v_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
@@ -487,10 +732,10 @@ void KVCache::attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
                     attn_with_kvcache_one_block_(
                         config_.head_dim,
                         config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0, 0,
+                        GGML_TYPE_Q8_0, q_q8_0, seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0,
+                        config_.k_quant_type,
                         k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q4_0, config_.v_quant_type,
                         v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -506,10 +751,10 @@ void KVCache::attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
                     attn_with_kvcache_one_block_(
                         config_.head_dim,
                         config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0, 0,
+                        GGML_TYPE_Q8_0, q_q8_0, seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0,
+                        config_.k_quant_type,
                         k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q8_0, config_.v_quant_type,
                         v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -704,8 +949,19 @@ void KVCache::attn(const ggml_fp16_t *q_in, ggml_fp16_t *output,
 
     const uint16_t *q_in_data = const_cast<const uint16_t *>(q_in);
 
+    // MLA blocks carry no anchors, so there is nothing to retrieve with.
+    assert(config_.mla_latent_dim == 0 || pick_block_num == -1 ||
+           config_.window_block_num > 0);
     quantize_q_(q_in_data, batch_size);
-    if (config_.retrieval_type == RetrievalType::LAYER) {
+    if (config_.window_block_num > 0) {
+        // Sinks plus sliding window: no retrieval, constant work per token.
+        attn_initialize_window_(batch_size, block_table, max_block_num,
+                                cache_seqlens);
+        if (config_.rope_theta > 0) {
+            rotate_sink_q_(q_in_data, batch_size);
+        }
+        attention_layer_(q_in_data, output, attn_lse, batch_size, backend);
+    } else if (config_.retrieval_type == RetrievalType::LAYER) {
         attn_initialize_layer_(batch_size, layer_idx, block_table,
                                max_block_num, cache_seqlens);
         retrieval_kvcache_layer_(q_in_data, init_block_num, local_block_num,
@@ -721,6 +977,14 @@ void KVCache::attn(const ggml_fp16_t *q_in, ggml_fp16_t *output,
                                   batch_size, layer_idx, cache_seqlens,
                                   max_block_num, backend);
         attention_kvhead_(q_in_data, output, attn_lse, batch_size, backend);
+    } else if (config_.retrieval_type == RetrievalType::QHEAD) {
+        attn_initialize_qhead_(batch_size, block_table, max_block_num,
+                               cache_seqlens);
+        retrieval_kvcache_qhead_(q_in_data, init_block_num, local_block_num,
+                                 pick_block_num, q_len, generate_token_idx,
+                                 batch_size, layer_idx, cache_seqlens,
+                                 max_block_num, backend);
+        attention_qhead_(q_in_data, output, attn_lse, batch_size, backend);
     }
 
     // Timer end
@@ -766,9 +1030,252 @@ void KVCache::attn_with_kvcache(
     //     layer_idx, diff.count());
 }
 
-void KVCache::quantize_q_(const uint16_t *q_in_data, int batch_size) {
+void KVCache::attn_with_kvcache_varlen(
+    const ggml_fp16_t *q_in, const ggml_fp16_t *k_in, const ggml_fp16_t *v_in,
+    ggml_fp16_t *output, float *attn_lse, int layer_idx, int batch_size,
+    int *cu_seqlens_q, int max_block_num, int *block_table,
+    int *cache_seqlens, const uint8_t *tree_mask, Backend *backend) {
+    // Ring slots of window mode are not tracked per query token, and MLA
+    // blocks use their own kernel.
+    if (config_.window_block_num != 0 || config_.mla_latent_dim != 0) {
+        throw std::invalid_argument("attn_with_kvcache_varlen does not "
+                                    "support window or MLA caches");
+    }
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
+
+    layer_id_ = layer_idx;
+    seq_len_ = config_.block_len;
+
+    size_t q_stride = config_.q_head_num * config_.head_dim;
+    size_t kv_stride = config_.kv_head_num * config_.head_dim;
+    for (int b = 0; b < batch_size; b++) {
+        int q_len = cu_seqlens_q[b + 1] - cu_seqlens_q[b];
+        if (q_len == 0) {
+            continue;
+        }
+        update_kvcache_fp16(k_in + cu_seqlens_q[b] * kv_stride,
+                            v_in + cu_seqlens_q[b] * kv_stride, layer_idx,
+                            block_table + b * max_block_num, 1, max_block_num,
+                            cache_seqlens + b, q_len, backend);
+        // cache_seqlens memory is modified.
+        cache_seqlens[b] += q_len;
+    }
+
+    // One task per (request, kv_head, chunk of up to CHUNK_SIZE query
+    // tokens); a chunk walks the blocks once and reuses each of them for all
+    // its tokens. The largest tasks are handed out first so that long
+    // prefill chunks do not end up as the tail of the job.
+    struct VarlenTask {
+        int batch_id;
+        int head_id;
+        int q_begin; // token offsets inside the request
+        int q_end;
+        long cost;
+    };
+    std::vector<VarlenTask> tasks;
+    for (int b = 0; b < batch_size; b++) {
+        int q_len = cu_seqlens_q[b + 1] - cu_seqlens_q[b];
+        int past_len = cache_seqlens[b] - q_len;
+        for (int q_begin = 0; q_begin < q_len; q_begin += CHUNK_SIZE) {
+            int q_end = std::min(q_len, q_begin + CHUNK_SIZE);
+            long block_num = (past_len + q_end + config_.block_len - 1) /
+                             config_.block_len;
+            for (int h = 0; h < config_.kv_head_num; h++) {
+                tasks.push_back(
+                    {b, h, q_begin, q_end, (q_end - q_begin) * block_num});
+            }
+        }
+    }
+    std::stable_sort(tasks.begin(), tasks.end(),
+                     [](const VarlenTask &a, const VarlenTask &b) {
+                         return a.cost > b.cost;
+                     });
+    // Offset of each request's [q_len, q_len] slice of tree_mask.
+    std::vector<size_t> tree_mask_offset(batch_size + 1, 0);
+    for (int b = 0; b < batch_size; b++) {
+        size_t q_len = cu_seqlens_q[b + 1] - cu_seqlens_q[b];
+        tree_mask_offset[b + 1] = tree_mask_offset[b] + q_len * q_len;
+    }
+
+    const uint16_t *q_in_data = reinterpret_cast<const uint16_t *>(q_in);
+    uint16_t *output_data = reinterpret_cast<uint16_t *>(output);
+    int q_blocks = n_gqa_ * config_.head_dim / QK8_0;
+    backend->do_work_stealing_job(
+        tasks.size(), nullptr,
+        [&](int task_id) {
+            const VarlenTask &task = tasks[task_id];
+            int batch_id = task.batch_id;
+            int head_id = task.head_id;
+            int thread_id = Backend::thread_local_id;
+            int q_len = cu_seqlens_q[batch_id + 1] - cu_seqlens_q[batch_id];
+            int past_len = cache_seqlens[batch_id] - q_len;
+            int chunk_len = task.q_end - task.q_begin;
+            const int *row = block_table + batch_id * max_block_num;
+            float *acc = thread_local_chunk_output_fp32_[thread_id].data();
+            float *acc_lse = thread_local_chunk_attn_lse_[thread_id].data();
+
+            // The q heads of the group are contiguous in q_in.
+            auto q_ptr = [&](int t) {
+                return q_in_data +
+                       (cu_seqlens_q[batch_id] + t) * q_stride +
+                       head_id * n_gqa_ * config_.head_dim;
+            };
+            for (int t = 0; t < chunk_len; t++) {
+                if (config_.kv_type != ggml_type::GGML_TYPE_F16) {
+                    const uint16_t *q = q_ptr(task.q_begin + t);
+                    float *q_fp32 = thread_local_output_fp32_[thread_id].data();
+                    for (int j = 0; j < n_gqa_ * config_.head_dim; j++) {
+                        q_fp32[j] = GGML_FP16_TO_FP32(q[j]);
+                    }
+                    quantize_row_q8_0(
+                        q_fp32,
+                        thread_local_chunk_q_q8_0_[thread_id].data() +
+                            t * q_blocks,
+                        n_gqa_ * config_.head_dim);
+                }
+                for (int i = 0; i < n_gqa_; i++) {
+                    acc_lse[t * n_gqa_ + i] =
+                        -std::numeric_limits<float>::infinity();
+                }
+            }
+
+            // A tree may let a token see new tokens after its own chunk.
+            int block_num =
+                (past_len + (tree_mask == nullptr ? task.q_end : q_len) +
+                 config_.block_len - 1) /
+                config_.block_len;
+            for (int block_id = 0; block_id < block_num; block_id++) {
+                int block_idx = row[block_id];
+                for (int t = 0; t < chunk_len; t++) {
+                    int q_id = task.q_begin + t;
+                    int block_begin = block_id * config_.block_len;
+                    bool is_full_attn =
+                        block_begin + config_.block_len <= past_len;
+                    if (tree_mask == nullptr && !is_full_attn) {
+                        // Causal: token q_id sees the cache up to itself.
+                        int len = std::min(past_len + q_id + 1 - block_begin,
+                                           config_.block_len);
+                        if (len <= 0) {
+                            continue;
+                        }
+                        is_full_attn = len == config_.block_len;
+                        fill_attn_mask(
+                            thread_local_attn_mask_[thread_id].data(), len,
+                            seq_len_);
+                    } else if (!is_full_attn) {
+                        const uint8_t *tree_row =
+                            tree_mask + tree_mask_offset[batch_id] +
+                            (size_t)q_id * q_len;
+                        uint8_t *mask =
+                            thread_local_attn_mask_[thread_id].data();
+                        int visible = 0;
+                        for (int i = 0; i < config_.block_len; i++) {
+                            int s = block_begin + i - past_len;
+                            bool bit = s < 0 || (s < q_len && tree_row[s]);
+                            if (i % 8 == 0) {
+                                mask[i / 8] = 0;
+                            }
+                            mask[i / 8] |= bit << (i % 8);
+                            visible += bit;
+                        }
+                        // A row with nothing visible has no softmax.
+                        if (visible == 0) {
+                            continue;
+                        }
+                        is_full_attn = visible == config_.block_len;
+                    }
+                    uint8_t *attn_mask =
+                        is_full_attn
+                            ? nullptr
+                            : thread_local_attn_mask_[thread_id].data();
+                    if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                        attn_with_kvcache_one_block_(
+                            config_.head_dim, n_gqa_, GGML_TYPE_F16,
+                            (void *)q_ptr(task.q_begin + t), seq_len_, 0,
+                            is_full_attn, attn_mask, GGML_TYPE_F16, 0,
+                            k_cache_fp16_[layer_id_][head_id][block_idx].data(),
+                            0, nullptr, nullptr, GGML_TYPE_F16, 1,
+                            v_cache_fp16_[layer_id_][head_id][block_idx].data(),
+                            0, nullptr, nullptr,
+                            thread_local_attn_score_[thread_id].data(),
+                            thread_local_output_fp32_[thread_id].data(),
+                            thread_local_attn_lse_[thread_id].data(),
+                            thread_local_draft_[thread_id].data(), nullptr,
+                            cos_.data(), sin_.data());
+                    } else {
+                        bool is_q4 =
+                            config_.kv_type == ggml_type::GGML_TYPE_Q4_0;
+                        void *k_cache =
+                            is_q4 ? (void *)k_cache_q4[layer_id_][head_id]
+                                                      [block_idx]
+                                                          .data()
+                                  : (void *)k_cache_q8[layer_id_][head_id]
+                                                      [block_idx]
+                                                          .data();
+                        void *v_cache =
+                            is_q4 ? (void *)v_cache_q4[layer_id_][head_id]
+                                                      [block_idx]
+                                                          .data()
+                                  : (void *)v_cache_q8[layer_id_][head_id]
+                                                      [block_idx]
+                                                          .data();
+                        attn_with_kvcache_one_block_(
+                            config_.head_dim, n_gqa_, GGML_TYPE_Q8_0,
+                            thread_local_chunk_q_q8_0_[thread_id].data() +
+                                t * q_blocks,
+                            seq_len_, 0, is_full_attn, attn_mask,
+                            config_.kv_type, config_.k_quant_type, k_cache, 0,
+                            nullptr, nullptr, config_.kv_type,
+                            config_.v_quant_type, v_cache, 0, nullptr, nullptr,
+                            thread_local_attn_score_[thread_id].data(),
+                            thread_local_output_q8_0_[thread_id].data(),
+                            thread_local_attn_lse_[thread_id].data(),
+                            thread_local_draft_[thread_id].data(), nullptr,
+                            cos_.data(), sin_.data());
+                        dequantize_row_q8_0(
+                            thread_local_output_q8_0_[thread_id].data(),
+                            thread_local_output_fp32_[thread_id].data(),
+                            n_gqa_ * config_.head_dim);
+                    }
+                    for (int i = 0; i < n_gqa_; i++) {
+                        merge_partial_attn(
+                            acc + (t * n_gqa_ + i) * config_.head_dim,
+                            acc_lse[t * n_gqa_ + i],
+                            thread_local_output_fp32_[thread_id].data() +
+                                i * config_.head_dim,
+                            thread_local_attn_lse_[thread_id][i],
+                            config_.head_dim);
+                    }
+                }
+            }
+
+            // Each (token, kv_head) is owned by exactly one task.
+            for (int t = 0; t < chunk_len; t++) {
+                size_t token = cu_seqlens_q[batch_id] + task.q_begin + t;
+                for (int i = 0; i < n_gqa_; i++) {
+                    int q_head_id = head_id * n_gqa_ + i;
+                    for (int j = 0; j < config_.head_dim; j++) {
+                        output_data[token * q_stride +
+                                    q_head_id * config_.head_dim + j] =
+                            GGML_FP32_TO_FP16(
+                                acc[(t * n_gqa_ + i) * config_.head_dim + j]);
+                    }
+                    attn_lse[token * config_.q_head_num + q_head_id] =
+                        acc_lse[t * n_gqa_ + i];
+                }
+            }
+        },
+        nullptr);
+
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    // printf("layer %d time of ragged attention with kvcache: %f s\n",
+    //        layer_idx, diff.count());
+}
+
+void KVCache::quantize_q_(const uint16_t *q_in_data, int batch_size) {
     for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
         if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
             // quantize q
@@ -794,16 +1301,10 @@ void KVCache::quantize_q_(const uint16_t *q_in_data, int batch_size) {
             }
         }
     }
-    // Timer end
-    auto end = std::chrono::high_resolution_clock::now();
-    // printf("time of quantizing q: %f s\n",
-    //        std::chrono::duration<double>(end - start).count());
 }
 void KVCache::attn_initialize_layer_(int batch_size, int layer_idx,
                                      int *block_table, int &max_block_num,
                                      int *cache_seqlens) {
-    // Timer start
-    auto start = std::chrono::high_resolution_clock::now();
     for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
         // initialize output_fp32_ and attn_lse_
         for (int i = 0; i < config_.kv_head_num; i++) {
@@ -843,10 +1344,100 @@ void KVCache::attn_initialize_layer_(int batch_size, int layer_idx,
             }
         }
     }
-    // Timer end
-    auto end = std::chrono::high_resolution_clock::now();
-    // printf("layer %d time of initializing attention: %f s\n", layer_idx,
-    //        std::chrono::duration<double>(end - start).count());
+}
+
+// Builds block_table_after_retrieval_ from the sink blocks followed by the
+// last window_block_num blocks in sequence order, with cache_seqlens_ set so
+// that attention_layer_ masks the partially filled block at the end.
+void KVCache::attn_initialize_window_(int batch_size, int *block_table,
+                                      int max_block_num, int *cache_seqlens) {
+    // Ring slots are only assigned by update_kvcache_fp16, which always
+    // comes with a block table.
+    assert(block_table != nullptr && cache_seqlens != nullptr);
+    max_block_num_after_retrieval_ = 0;
+    for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        // initialize output_fp32_ and attn_lse_
+        for (int i = 0; i < config_.kv_head_num; i++) {
+            for (int j = 0; j < n_gqa_ * config_.head_dim; j++) {
+                output_fp32_[batch_idx][i][j] = 0;
+            }
+            for (int j = 0; j < n_gqa_; j++) {
+                attn_lse_[batch_idx][i][j] = 0;
+            }
+        }
+
+        int seq_len = cache_seqlens[batch_idx];
+        int block_num = (seq_len + config_.block_len - 1) / config_.block_len;
+        int *row = block_table + batch_idx * max_block_num;
+        int n = 0;
+        for (int i = 0; i < std::min(block_num, config_.sink_block_num); i++) {
+            block_table_after_retrieval_[batch_idx][n++] = row[i];
+        }
+        int first_window_block = std::max(
+            config_.sink_block_num, block_num - config_.window_block_num);
+        for (int i = first_window_block; i < block_num; i++) {
+            block_table_after_retrieval_[batch_idx][n++] = row[block_slot_(i)];
+        }
+        if (config_.rope_theta > 0) {
+            // Positions dropped between the sinks and the window.
+            sink_rope_shift_[batch_idx] =
+                (first_window_block - config_.sink_block_num) *
+                config_.block_len;
+        }
+        cache_seqlens_[batch_idx] =
+            n == 0 ? 0 : seq_len - (block_num - n) * config_.block_len;
+        max_block_num_after_retrieval_ =
+            std::max(max_block_num_after_retrieval_, n);
+    }
+}
+
+// Rotates each query head back by sink_rope_shift_ positions into
+// q_sink_fp16_ / q_sink_q8_0_. Rotations compose, so scoring a sink key
+// (rotated at p) against this query equals scoring the key rotated at
+// p + shift against the original query: the sinks are moved up against the
+// window without touching the cache.
+void KVCache::rotate_sink_q_(const uint16_t *q_in_data, int batch_size) {
+    int half = config_.head_dim / 2;
+    std::vector<float> cos_val(half), sin_val(half);
+    std::vector<float> head_fp32(n_gqa_ * config_.head_dim);
+    for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        int shift = sink_rope_shift_[batch_idx];
+        if (shift == 0) {
+            continue;
+        }
+        for (int i = 0; i < half; i++) {
+            double angle = shift * std::pow((double)config_.rope_theta,
+                                            -2.0 * i / config_.head_dim);
+            cos_val[i] = std::cos(angle);
+            sin_val[i] = std::sin(angle);
+        }
+        for (int kv_head = 0; kv_head < config_.kv_head_num; kv_head++) {
+            const uint16_t *q = q_in_data +
+                                (batch_idx * config_.kv_head_num + kv_head) *
+                                    n_gqa_ * config_.head_dim;
+            for (int h = 0; h < n_gqa_; h++) {
+                for (int i = 0; i < half; i++) {
+                    float x0 = GGML_FP16_TO_FP32(q[h * config_.head_dim + i]);
+                    float x1 =
+                        GGML_FP16_TO_FP32(q[h * config_.head_dim + i + half]);
+                    head_fp32[h * config_.head_dim + i] =
+                        x0 * cos_val[i] + x1 * sin_val[i];
+                    head_fp32[h * config_.head_dim + i + half] =
+                        x1 * cos_val[i] - x0 * sin_val[i];
+                }
+            }
+            ggml_fp16_t *out = q_sink_fp16_[batch_idx].data() +
+                               kv_head * n_gqa_ * config_.head_dim;
+            for (int j = 0; j < n_gqa_ * config_.head_dim; j++) {
+                out[j] = GGML_FP32_TO_FP16(head_fp32[j]);
+            }
+            if (config_.kv_type != ggml_type::GGML_TYPE_F16) {
+                quantize_row_q8_0(head_fp32.data(),
+                                  q_sink_q8_0_[batch_idx][kv_head].data(),
+                                  n_gqa_ * config_.head_dim);
+            }
+        }
+    }
 }
 
 void KVCache::calculate_block_similarity_layer_(
@@ -1114,8 +1705,6 @@ void KVCache::retrieval_kvcache_layer_(const uint16_t *q_in_data,
                                        int generate_token_idx, int batch_size,
                                        int layer_idx, int *cache_seqlens,
                                        int &max_block_num, Backend *backend) {
-    // Timer start
-    auto start = std::chrono::high_resolution_clock::now();
     max_block_num_after_retrieval_ = 0;
     if (pick_block_num != -1 &&
         (generate_token_idx % config_.token_step != 0 ||
@@ -1181,11 +1770,6 @@ void KVCache::retrieval_kvcache_layer_(const uint16_t *q_in_data,
         max_block_num_after_retrieval_ = max_block_num;
         block_table_after_retrieval_.swap(block_table_before_retrieval_);
     }
-
-    // Timer end
-    auto end = std::chrono::high_resolution_clock::now();
-    //     printf("layer %d time of retrieval kvcache: %f s\n", layer_idx,
-    //     std::chrono::duration<double>(end - start).count());
 }
 void KVCache::calculate_sparsity_layer_(const uint16_t *q_in_data,
                                         float *attn_sparsity, int batch_size,
@@ -1262,9 +1846,9 @@ void KVCache::calculate_sparsity_layer_(const uint16_t *q_in_data,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
                         seq_len_, 0, false,
                         thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q4_0, 0,
+                        GGML_TYPE_Q4_0, config_.k_quant_type,
                         k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q4_0, config_.v_quant_type,
                         v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -1283,9 +1867,9 @@ void KVCache::calculate_sparsity_layer_(const uint16_t *q_in_data,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
                         seq_len_, 0, false,
                         thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q8_0, 0,
+                        GGML_TYPE_Q8_0, config_.k_quant_type,
                         k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q8_0, config_.v_quant_type,
                         v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -1322,9 +1906,10 @@ void KVCache::calculate_sparsity_layer_(const uint16_t *q_in_data,
                         config_.head_dim,
                         config_.q_head_num / config_.kv_head_num,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0, 0,
+                        seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0,
+                        config_.k_quant_type,
                         k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q4_0, config_.v_quant_type,
                         v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -1341,9 +1926,10 @@ void KVCache::calculate_sparsity_layer_(const uint16_t *q_in_data,
                         config_.head_dim,
                         config_.q_head_num / config_.kv_head_num,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0, 0,
+                        seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0,
+                        config_.k_quant_type,
                         k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q8_0, config_.v_quant_type,
                         v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -1526,8 +2112,6 @@ void KVCache::calculate_sparsity_layer_(const uint16_t *q_in_data,
 void KVCache::attn_initialize_kvhead_(int batch_size, int layer_idx,
                                       int *block_table, int &max_block_num,
                                       int *cache_seqlens) {
-    // Timer start
-    auto start = std::chrono::high_resolution_clock::now();
     for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
         // initialize output_fp32_ and attn_lse_
         for (int i = 0; i < config_.kv_head_num; i++) {
@@ -1554,11 +2138,6 @@ void KVCache::attn_initialize_kvhead_(int batch_size, int layer_idx,
             }
         }
     }
-
-    // Timer end
-    auto end = std::chrono::high_resolution_clock::now();
-    // printf("layer %d time of initializing attn: %f s\n", layer_idx,
-    //        std::chrono::duration<double>(end - start).count());
 }
 void KVCache::retrieval_kvcache_kvhead_(const uint16_t *q_in_data,
                                         int init_block_num, int local_block_num,
@@ -1566,8 +2145,6 @@ void KVCache::retrieval_kvcache_kvhead_(const uint16_t *q_in_data,
                                         int generate_token_idx, int batch_size,
                                         int layer_idx, int *cache_seqlens,
                                         int &max_block_num, Backend *backend) {
-    // Timer start
-    auto start = std::chrono::high_resolution_clock::now();
     max_block_num_after_retrieval_ = 0;
     if (pick_block_num != -1 &&
         (generate_token_idx % config_.token_step != 0 ||
@@ -1652,11 +2229,6 @@ void KVCache::retrieval_kvcache_kvhead_(const uint16_t *q_in_data,
             }
         }
     }
-
-    // Timer end
-    auto end = std::chrono::high_resolution_clock::now();
-    // printf("layer %d time of retrieval kvcache: %f s\n", layer_idx,
-    //        std::chrono::duration<double>(end - start).count());
 }
 void KVCache::calculate_sparsity_kvhead_(const uint16_t *q_in_data,
                                          float *attn_sparsity, int batch_size,
@@ -1732,9 +2304,9 @@ void KVCache::calculate_sparsity_kvhead_(const uint16_t *q_in_data,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
                         seq_len_, 0, false,
                         thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q4_0, 0,
+                        GGML_TYPE_Q4_0, config_.k_quant_type,
                         k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q4_0, config_.v_quant_type,
                         v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -1753,9 +2325,9 @@ void KVCache::calculate_sparsity_kvhead_(const uint16_t *q_in_data,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
                         seq_len_, 0, false,
                         thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q8_0, 0,
+                        GGML_TYPE_Q8_0, config_.k_quant_type,
                         k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q8_0, config_.v_quant_type,
                         v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -1792,9 +2364,10 @@ void KVCache::calculate_sparsity_kvhead_(const uint16_t *q_in_data,
                         config_.head_dim,
                         config_.q_head_num / config_.kv_head_num,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0, 0,
+                        seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0,
+                        config_.k_quant_type,
                         k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q4_0, config_.v_quant_type,
                         v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -1811,9 +2384,10 @@ void KVCache::calculate_sparsity_kvhead_(const uint16_t *q_in_data,
                         config_.head_dim,
                         config_.q_head_num / config_.kv_head_num,
                         GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0, 0,
+                        seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0,
+                        config_.k_quant_type,
                         k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
+                        nullptr, nullptr, GGML_TYPE_Q8_0, config_.v_quant_type,
                         v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
                         nullptr, nullptr,
                         thread_local_attn_score_[thread_id].data(),
@@ -2146,6 +2720,464 @@ void KVCache::select_block_kvhead_(int batch_size, int layer_idx,
     //        diff.count())
 }
 
+void KVCache::attn_initialize_qhead_(int batch_size, int *block_table,
+                                     int &max_block_num, int *cache_seqlens) {
+    for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        // initialize output_fp32_ and attn_lse_, -inf marks a head that has
+        // not been merged yet
+        for (int i = 0; i < config_.kv_head_num; i++) {
+            for (int j = 0; j < n_gqa_ * config_.head_dim; j++) {
+                output_fp32_[batch_idx][i][j] = 0;
+            }
+            for (int j = 0; j < n_gqa_; j++) {
+                attn_lse_[batch_idx][i][j] =
+                    -std::numeric_limits<float>::infinity();
+            }
+        }
+
+        // clear top_similar_block_
+        while (!top_similar_block_[batch_idx].empty())
+            top_similar_block_[batch_idx].pop();
+    }
+
+    for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        cache_seqlens_[batch_idx] = cache_seqlens[batch_idx];
+        for (int i = 0; i < max_block_num; i++) {
+            for (int j = 0; j < config_.q_head_num; j++) {
+                block_table_before_retrieval_qhead_[batch_idx][i][j] =
+                    block_table[batch_idx * max_block_num + i];
+                block_similar_q_head_[batch_idx][i][j] = 0;
+            }
+        }
+    }
+}
+void KVCache::retrieval_kvcache_qhead_(const uint16_t *q_in_data,
+                                       int init_block_num, int local_block_num,
+                                       int pick_block_num, int q_len,
+                                       int generate_token_idx, int batch_size,
+                                       int layer_idx, int *cache_seqlens,
+                                       int &max_block_num, Backend *backend) {
+    int history_idx = (layer_idx - config_.layer_offset) / config_.layer_step;
+    max_block_num_after_retrieval_ = 0;
+    if (pick_block_num != -1 &&
+        (generate_token_idx % config_.token_step != 0 ||
+         (layer_idx % config_.layer_step != config_.layer_offset))) {
+
+        if (selected_blocks_num_history_[history_idx] == 0) {
+            max_block_num_after_retrieval_ = max_block_num;
+            for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+                for (int i = 0; i < max_block_num; i++) {
+                    for (int j = 0; j < config_.q_head_num; j++) {
+                        block_table_after_retrieval_qhead_[batch_idx][i][j] =
+                            block_table_before_retrieval_qhead_[batch_idx][i]
+                                                               [j];
+                    }
+                }
+            }
+        } else {
+            max_block_num_after_retrieval_ =
+                selected_blocks_num_history_[history_idx];
+
+            for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+                for (int i = 0; i < max_block_num_after_retrieval_; i++) {
+                    for (int j = 0; j < config_.q_head_num; j++) {
+                        block_table_after_retrieval_qhead_[batch_idx][i][j] =
+                            selected_blocks_history_qhead_[history_idx]
+                                                          [batch_idx][i][j];
+                    }
+                }
+
+                if (cache_seqlens[batch_idx] % config_.block_len == 1) {
+                    selected_blocks_num_history_[history_idx] += 1;
+                    int x = selected_blocks_num_history_[history_idx];
+                    for (int i = 0; i < config_.q_head_num; i++) {
+                        int last_block_idx =
+                            block_table_before_retrieval_qhead_
+                                [batch_idx][cache_seqlens[batch_idx] /
+                                            config_.block_len][i];
+                        selected_blocks_history_qhead_[history_idx][batch_idx]
+                                                      [x - 1][i] =
+                                                          last_block_idx;
+                        block_table_after_retrieval_qhead_[batch_idx][x - 1]
+                                                          [i] = last_block_idx;
+                    }
+                }
+                cache_seqlens_[batch_idx] = std::min(
+                    cache_seqlens_[batch_idx],
+                    (cache_seqlens_[batch_idx] % config_.block_len) +
+                        (init_block_num + pick_block_num + local_block_num) *
+                            config_.block_len);
+            }
+        }
+    } else if (pick_block_num != -1) {
+        max_block_num_after_retrieval_ =
+            std::min(max_block_num,
+                     init_block_num + pick_block_num + local_block_num + 1);
+        calculate_block_similarity_qhead_(q_in_data, batch_size, layer_idx,
+                                          q_len, max_block_num, init_block_num,
+                                          local_block_num, backend);
+        select_block_qhead_(batch_size, layer_idx, max_block_num,
+                            init_block_num, local_block_num, pick_block_num);
+    } else {
+        selected_blocks_num_history_[history_idx] = 0;
+        max_block_num_after_retrieval_ = max_block_num;
+        for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+            for (int i = 0; i < max_block_num; i++) {
+                for (int j = 0; j < config_.q_head_num; j++) {
+                    block_table_after_retrieval_qhead_[batch_idx][i][j] =
+                        block_table_before_retrieval_qhead_[batch_idx][i][j];
+                }
+            }
+        }
+    }
+}
+void KVCache::calculate_block_similarity_qhead_(
+    const uint16_t *q_in_data, int batch_size, int layer_idx, int q_len,
+    int max_block_num, int init_block_num, int local_block_num,
+    Backend *backend) {
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
+    backend->do_work_stealing_job(
+        batch_size * max_block_num, nullptr,
+        [&](int task_id) {
+            int batch_id = task_id / max_block_num;
+            int block_id = task_id % max_block_num;
+            int seq_len = cache_seqlens_[batch_id];
+
+            if (block_id < init_block_num ||
+                block_id >= (seq_len / config_.block_len) - local_block_num) {
+                return;
+            }
+            int block_idx =
+                block_table_before_retrieval_qhead_[batch_id][block_id][0];
+
+            for (int head_id = 0; head_id < config_.q_head_num; head_id++) {
+                float similar = 0;
+                for (int i = 0; i < config_.head_dim; i++) {
+                    float q_i = 0, qa_i = std::numeric_limits<float>::lowest();
+                    for (int q_id = 0; q_id < q_len; q_id++) {
+                        q_i += GGML_FP16_TO_FP32(
+                            q_in_data[batch_id * q_len * config_.q_head_num *
+                                          config_.head_dim +
+                                      q_id * config_.q_head_num *
+                                          config_.head_dim +
+                                      head_id * config_.head_dim + i]);
+                    }
+                    q_i /= q_len;
+                    for (int anchor_id = 0; anchor_id < config_.anchor_num;
+                         anchor_id++) {
+                        qa_i = std::max(
+                            qa_i,
+                            GGML_FP16_TO_FP32(
+                                anchor_[layer_idx * config_.max_block_num *
+                                            config_.anchor_num *
+                                            config_.q_head_num *
+                                            config_.head_dim +
+                                        block_idx * config_.anchor_num *
+                                            config_.q_head_num *
+                                            config_.head_dim +
+                                        anchor_id * config_.q_head_num *
+                                            config_.head_dim +
+                                        head_id * config_.head_dim + i]) *
+                                q_i);
+                    }
+                    similar += qa_i;
+                }
+                block_similar_q_head_[batch_id][block_id][head_id] = similar;
+            }
+        },
+        nullptr);
+
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    // printf("layer %d time of calculating similarity: %f s\n", layer_idx,
+    //        diff.count());
+}
+void KVCache::select_block_qhead_(int batch_size, int layer_idx,
+                                  int max_block_num, int init_block_num,
+                                  int local_block_num, int pick_block_num) {
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
+    int history_idx = (layer_idx - config_.layer_offset) / config_.layer_step;
+
+    for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        int cache_len_after_retrieval = 0;
+        int block_num = cache_seqlens_[batch_idx] / config_.block_len;
+        if (block_num <= init_block_num + pick_block_num + local_block_num) {
+            selected_blocks_num_history_[history_idx] = 0;
+            for (int i = 0; i < max_block_num; i++) {
+                for (int j = 0; j < config_.q_head_num; j++) {
+                    block_table_after_retrieval_qhead_[batch_idx][i][j] =
+                        block_table_before_retrieval_qhead_[batch_idx][i][j];
+                }
+            }
+            continue;
+        }
+        for (int head_id = 0; head_id < config_.q_head_num; head_id++) {
+            for (int block_id = init_block_num;
+                 block_id < block_num - local_block_num; block_id++) {
+                top_similar_block_[batch_idx].push(std::make_pair(
+                    block_similar_q_head_[batch_idx][block_id][head_id],
+                    block_table_before_retrieval_qhead_[batch_idx][block_id]
+                                                       [head_id]));
+                if (top_similar_block_[batch_idx].size() > pick_block_num) {
+                    top_similar_block_[batch_idx].pop();
+                }
+            }
+
+            int i = 0;
+            for (; i < init_block_num; i++) {
+                block_table_after_retrieval_qhead_[batch_idx][i][head_id] =
+                    block_table_before_retrieval_qhead_[batch_idx][i][head_id];
+            }
+            while (!top_similar_block_[batch_idx].empty()) {
+                block_table_after_retrieval_qhead_[batch_idx][i][head_id] =
+                    top_similar_block_[batch_idx].top().second;
+                top_similar_block_[batch_idx].pop();
+                i++;
+            }
+            for (; i < init_block_num + pick_block_num + local_block_num; i++) {
+                block_table_after_retrieval_qhead_[batch_idx][i][head_id] =
+                    block_table_before_retrieval_qhead_
+                        [batch_idx][block_num - local_block_num + i -
+                                    init_block_num - pick_block_num][head_id];
+            }
+            if (cache_seqlens_[batch_idx] % config_.block_len != 0) {
+                block_table_after_retrieval_qhead_[batch_idx][i][head_id] =
+                    block_table_before_retrieval_qhead_[batch_idx][block_num]
+                                                       [head_id];
+                cache_len_after_retrieval =
+                    (cache_seqlens_[batch_idx] % config_.block_len) +
+                    i * config_.block_len;
+                i++;
+            } else {
+                cache_len_after_retrieval = i * config_.block_len;
+            }
+            for (int j = 0; j < i; j++) {
+                selected_blocks_history_qhead_[history_idx][batch_idx][j]
+                                              [head_id] =
+                    block_table_after_retrieval_qhead_[batch_idx][j][head_id];
+            }
+        }
+        cache_seqlens_[batch_idx] = cache_len_after_retrieval;
+        selected_blocks_num_history_[history_idx] =
+            (cache_len_after_retrieval + config_.block_len - 1) /
+            config_.block_len;
+    }
+
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    // printf("layer %d time of selecting block: %f s\n", layer_idx,
+    //        diff.count())
+}
+
+void KVCache::build_qhead_tiles_(int batch_size) {
+    qhead_tiles_.clear();
+    // (block_idx, query head in group) of one group, sorted so that query
+    // heads reading the same block end up next to each other
+    std::vector<std::pair<int, int>> picks;
+    for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        int last_block = cache_seqlens_[batch_idx] / config_.block_len;
+        int last_len = cache_seqlens_[batch_idx] % config_.block_len;
+        for (int kv_head_id = 0; kv_head_id < config_.kv_head_num;
+             kv_head_id++) {
+            picks.clear();
+            for (int g = 0; g < n_gqa_; g++) {
+                int head_id = kv_head_id * n_gqa_ + g;
+                for (int i = 0; i < max_block_num_after_retrieval_; i++) {
+                    // Blocks past the last one are out of the sequence, and
+                    // an empty last block has nothing to attend to.
+                    if (i > last_block || (i == last_block && last_len == 0)) {
+                        break;
+                    }
+                    picks.emplace_back(
+                        block_table_after_retrieval_qhead_[batch_idx][i]
+                                                          [head_id],
+                        g);
+                }
+            }
+            std::sort(picks.begin(), picks.end());
+
+            // Every query head ends its table with the block holding the
+            // sequence tail, the only partial one.
+            int tail_block_idx =
+                last_len == 0 || last_block >= max_block_num_after_retrieval_
+                    ? -1
+                    : block_table_after_retrieval_qhead_[batch_idx][last_block]
+                                                        [kv_head_id * n_gqa_];
+            for (size_t i = 0; i < picks.size(); i++) {
+                if (i > 0 && picks[i].first == picks[i - 1].first) {
+                    qhead_tiles_.back().head_mask |= 1ull << picks[i].second;
+                    continue;
+                }
+                QHeadTile tile;
+                tile.batch_id = batch_idx;
+                tile.kv_head_id = kv_head_id;
+                tile.block_idx = picks[i].first;
+                tile.len = picks[i].first == tail_block_idx ? last_len
+                                                            : config_.block_len;
+                tile.head_mask = 1ull << picks[i].second;
+                qhead_tiles_.push_back(tile);
+            }
+        }
+    }
+}
+
+// Attention where every query head reads its own selection of blocks. A
+// task computes one K/V block for all query heads of its group in a single
+// pass over the block, so a block shared by several heads is loaded once;
+// the results of heads that did not select the block are dropped before
+// merging.
+void KVCache::attention_qhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
+                               float *attn_lse, int batch_size,
+                               Backend *backend) {
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
+    seq_len_ = config_.block_len;
+    build_qhead_tiles_(batch_size);
+
+    // Folds the running result of `thread_id` into output_fp32_.
+    auto flush = [&](int thread_id) {
+        int cur_batch_idx = thread_cur_head_idx_[thread_id].first;
+        int cur_head_id = thread_cur_head_idx_[thread_id].second;
+        if (cur_batch_idx == -1) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(*mutex_[cur_batch_idx][cur_head_id]);
+        for (int i = 0; i < n_gqa_; i++) {
+            merge_partial_attn(
+                output_fp32_[cur_batch_idx][cur_head_id].data() +
+                    i * config_.head_dim,
+                attn_lse_[cur_batch_idx][cur_head_id][i],
+                thread_local_cur_output_fp32_[thread_id].data() +
+                    i * config_.head_dim,
+                thread_local_cur_attn_lse_[thread_id][i], config_.head_dim);
+        }
+    };
+
+    backend->do_work_stealing_job(
+        qhead_tiles_.size(),
+        [&](int thread_id) {
+            thread_cur_head_idx_[thread_id].first = -1;
+            thread_cur_head_idx_[thread_id].second = -1;
+        },
+        [&](int task_id) {
+            const QHeadTile &tile = qhead_tiles_[task_id];
+            int batch_id = tile.batch_id;
+            int head_id = tile.kv_head_id;
+            int block_idx = tile.block_idx;
+            int thread_id = Backend::thread_local_id;
+
+            bool is_full_attn = tile.len == config_.block_len;
+            if (!is_full_attn) {
+                fill_attn_mask(thread_local_attn_mask_[thread_id].data(),
+                               tile.len, seq_len_);
+            }
+            uint8_t *attn_mask = is_full_attn
+                                     ? nullptr
+                                     : thread_local_attn_mask_[thread_id].data();
+            if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                attn_with_kvcache_one_block_(
+                    config_.head_dim, n_gqa_, GGML_TYPE_F16,
+                    (void *)&q_in_data[batch_id * config_.kv_head_num * n_gqa_ *
+                                           config_.head_dim +
+                                       head_id * n_gqa_ * config_.head_dim],
+                    seq_len_, 0, is_full_attn, attn_mask, GGML_TYPE_F16, 0,
+                    k_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
+                    nullptr, nullptr, GGML_TYPE_F16, 1,
+                    v_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
+                    nullptr, nullptr,
+                    thread_local_attn_score_[thread_id].data(),
+                    thread_local_output_fp32_[thread_id].data(),
+                    thread_local_attn_lse_[thread_id].data(),
+                    thread_local_draft_[thread_id].data(), nullptr, cos_.data(),
+                    sin_.data());
+            } else {
+                bool is_q4 = config_.kv_type == ggml_type::GGML_TYPE_Q4_0;
+                void *k_cache =
+                    is_q4 ? (void *)k_cache_q4[layer_id_][head_id][block_idx]
+                                .data()
+                          : (void *)k_cache_q8[layer_id_][head_id][block_idx]
+                                .data();
+                void *v_cache =
+                    is_q4 ? (void *)v_cache_q4[layer_id_][head_id][block_idx]
+                                .data()
+                          : (void *)v_cache_q8[layer_id_][head_id][block_idx]
+                                .data();
+                attn_with_kvcache_one_block_(
+                    config_.head_dim, n_gqa_, GGML_TYPE_Q8_0,
+                    q_q8_0_[batch_id][head_id].data(), seq_len_, 0,
+                    is_full_attn, attn_mask, config_.kv_type,
+                    config_.k_quant_type, k_cache, 0, nullptr, nullptr,
+                    config_.kv_type, config_.v_quant_type, v_cache, 0, nullptr,
+                    nullptr, thread_local_attn_score_[thread_id].data(),
+                    thread_local_output_q8_0_[thread_id].data(),
+                    thread_local_attn_lse_[thread_id].data(),
+                    thread_local_draft_[thread_id].data(), nullptr, cos_.data(),
+                    sin_.data());
+                dequantize_row_q8_0(thread_local_output_q8_0_[thread_id].data(),
+                                    thread_local_output_fp32_[thread_id].data(),
+                                    n_gqa_ * config_.head_dim);
+            }
+            for (int i = 0; i < n_gqa_; i++) {
+                if (!((tile.head_mask >> i) & 1)) {
+                    thread_local_attn_lse_[thread_id][i] =
+                        -std::numeric_limits<float>::infinity();
+                }
+            }
+
+            // Tiles of one group are contiguous, so a thread usually keeps
+            // accumulating locally and takes the group lock once.
+            if (batch_id != thread_cur_head_idx_[thread_id].first ||
+                head_id != thread_cur_head_idx_[thread_id].second) {
+                flush(thread_id);
+                thread_cur_head_idx_[thread_id].first = batch_id;
+                thread_cur_head_idx_[thread_id].second = head_id;
+                for (int i = 0; i < n_gqa_; i++) {
+                    thread_local_cur_attn_lse_[thread_id][i] =
+                        -std::numeric_limits<float>::infinity();
+                }
+            }
+            for (int i = 0; i < n_gqa_; i++) {
+                merge_partial_attn(
+                    thread_local_cur_output_fp32_[thread_id].data() +
+                        i * config_.head_dim,
+                    thread_local_cur_attn_lse_[thread_id][i],
+                    thread_local_output_fp32_[thread_id].data() +
+                        i * config_.head_dim,
+                    thread_local_attn_lse_[thread_id][i], config_.head_dim);
+            }
+        },
+        // Merge the results of the remaining blocks.
+        [&](int thread_id) { flush(thread_id); });
+
+    // move the results to output and attn_lse
+    uint16_t *output_data = reinterpret_cast<uint16_t *>(output);
+    float *attn_lse_data = attn_lse;
+    for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        for (int i = 0; i < config_.kv_head_num; i++) {
+            for (int j = 0; j < n_gqa_ * config_.head_dim; j++) {
+                output_data[batch_idx * config_.kv_head_num * n_gqa_ *
+                                config_.head_dim +
+                            i * n_gqa_ * config_.head_dim + j] =
+                    GGML_FP32_TO_FP16(output_fp32_[batch_idx][i][j]);
+            }
+            for (int j = 0; j < n_gqa_; j++) {
+                attn_lse_data[batch_idx * config_.kv_head_num * n_gqa_ +
+                              i * n_gqa_ + j] = attn_lse_[batch_idx][i][j];
+            }
+        }
+    }
+
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    // printf("layer %d time of computing attention: %f s\n", layer_idx,
+    //        diff.count());
+}
+
 void KVCache::get_attn_sparsity(const ggml_fp16_t *q_in, float *attn_sparsity,
                                 int layer_idx, int generate_token_idx,
                                 int q_len, int batch_size, int max_block_num,
@@ -2249,12 +3281,16 @@ void KVCache::attn_with_kvcache_one_block_(
     // alibi_slopes=None,
 ) {
     assert(head_dim % 32 == 0);
-    assert(k_quant_type == 0);
-    assert(v_quant_type == 1);
+    assert(k_quant_type == 0 || k_quant_type == 1);
+    assert(v_quant_type == 0 || v_quant_type == 1);
     assert(q_type == GGML_TYPE_F16 || q_type == GGML_TYPE_Q8_0);
     if (q_type == GGML_TYPE_F16) {
         assert(k_type == GGML_TYPE_F16);
         assert(v_type == GGML_TYPE_F16);
+        // fp16 caches are stored unquantized, K [seq_len, head_dim] and V
+        // [head_dim, seq_len]
+        assert(k_quant_type == 0);
+        assert(v_quant_type == 1);
 
         // attn = q * k + q * k_anchor
         // TODO: anchor
@@ -2406,6 +3442,8 @@ void KVCache::attn_with_kvcache_one_block_(
         assert(num_k_anchor == 0);
 
         if (rotary_angle != nullptr) {
+            // TODO: online rope for per_channel K
+            assert(k_quant_type == 0);
             ggml_fp16_t *k_cache_with_rope_fp16 =
                 (reinterpret_cast<ggml_fp16_t *>(draft) +
                  sizeof(block_q8_0) * bsz * past_kv_len / QK8_0 +
@@ -2474,12 +3512,27 @@ void KVCache::attn_with_kvcache_one_block_(
                             (block_q8_0 *)q, head_dim / 32, attn_score,
                             past_kv_len, 0, 1, GGML_TASK_TYPE_COMPUTE, k_type,
                             GGML_TYPE_Q8_0, GGML_TYPE_F32, GGML_PREC_DEFAULT);
-        } else {
+        } else if (k_quant_type == 0) {
             llamafile_sgemm(past_kv_len, bsz, head_dim / 32,
                             (block_q4_0 *)k_cache, head_dim / 32,
                             (block_q8_0 *)q, head_dim / 32, attn_score,
                             past_kv_len, 0, 1, GGML_TASK_TYPE_COMPUTE, k_type,
                             GGML_TYPE_Q8_0, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        } else {
+            // per_channel K: q is dequantized once, after the [bsz, head_dim]
+            // fp32 sum area of draft
+            float *q_fp32 = reinterpret_cast<float *>(
+                reinterpret_cast<char *>(draft) +
+                sizeof(block_q8_0) * bsz * past_kv_len / QK8_0 +
+                sizeof(float) * bsz * head_dim);
+            dequantize_row_q8_0((const block_q8_0 *)q, q_fp32, bsz * head_dim);
+            if (k_type == GGML_TYPE_Q4_0) {
+                attn_score_per_channel(head_dim, bsz, past_kv_len, q_fp32,
+                                       (const block_q4_0 *)k_cache, attn_score);
+            } else {
+                attn_score_per_channel(head_dim, bsz, past_kv_len, q_fp32,
+                                       (const block_q8_0 *)k_cache, attn_score);
+            }
         }
 
         // attn = attn * scale
@@ -2516,19 +3569,28 @@ void KVCache::attn_with_kvcache_one_block_(
         }
 
         // output = attn * v + attn * v_anchor
-        // std::vector<block_q8_0> attn_q8_0(bsz * past_kv_len / QK8_0);
-        block_q8_0 *attn_q8_0 = reinterpret_cast<block_q8_0 *>(draft);
-        quantize_row_q8_0(attn_score, attn_q8_0, bsz * past_kv_len);
         // std::vector<float> sum(bsz * head_dim);
         float *sum = reinterpret_cast<float *>(reinterpret_cast<char *>(draft) +
                                                sizeof(block_q8_0) * bsz *
                                                    past_kv_len / QK8_0);
         // TODO: anchor
         assert(num_v_anchor == 0);
-        llamafile_sgemm(head_dim, bsz, past_kv_len / 32, (block_q4_0 *)v_cache,
-                        past_kv_len / 32, attn_q8_0, past_kv_len / 32, sum,
-                        head_dim, 0, 1, GGML_TASK_TYPE_COMPUTE, v_type,
-                        GGML_TYPE_Q8_0, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        if (v_quant_type == 1) {
+            // std::vector<block_q8_0> attn_q8_0(bsz * past_kv_len / QK8_0);
+            block_q8_0 *attn_q8_0 = reinterpret_cast<block_q8_0 *>(draft);
+            quantize_row_q8_0(attn_score, attn_q8_0, bsz * past_kv_len);
+            llamafile_sgemm(head_dim, bsz, past_kv_len / 32,
+                            (block_q4_0 *)v_cache, past_kv_len / 32, attn_q8_0,
+                            past_kv_len / 32, sum, head_dim, 0, 1,
+                            GGML_TASK_TYPE_COMPUTE, v_type, GGML_TYPE_Q8_0,
+                            GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        } else if (v_type == GGML_TYPE_Q4_0) {
+            attn_output_per_token(head_dim, bsz, past_kv_len, attn_score,
+                                  (const block_q4_0 *)v_cache, sum);
+        } else {
+            attn_output_per_token(head_dim, bsz, past_kv_len, attn_score,
+                                  (const block_q8_0 *)v_cache, sum);
+        }
 
         quantize_row_q8_0(sum, (block_q8_0 *)output, bsz * head_dim);
     }
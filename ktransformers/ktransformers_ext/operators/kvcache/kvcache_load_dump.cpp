@@ -11,8 +11,12 @@
 #include "kvcache.h"
 
 #include <chrono>
+#include <cstdio>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 void KVCache::load_kvcache(std::string tensor_file_path, Backend *backend) {
+    join_snapshot_();
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
     std::ifstream ifs_tensor(tensor_file_path, std::ios::binary);
@@ -47,6 +51,13 @@ void KVCache::load_kvcache(std::string tensor_file_path, Backend *backend) {
                     ifs_tensor.read(
                         reinterpret_cast<char *>(v_cache_q4[i][j][k].data()),
                         v_cache_q4[i][j][k].size() * sizeof(block_q4_0));
+                } else if (config_.kv_type == GGML_TYPE_Q8_0) {
+                    ifs_tensor.read(
+                        reinterpret_cast<char *>(k_cache_q8[i][j][k].data()),
+                        k_cache_q8[i][j][k].size() * sizeof(block_q8_0));
+                    ifs_tensor.read(
+                        reinterpret_cast<char *>(v_cache_q8[i][j][k].data()),
+                        v_cache_q8[i][j][k].size() * sizeof(block_q8_0));
                 }
             }
         }
@@ -105,6 +116,15 @@ void KVCache::dump_kvcache(int *block_table, int cache_total_len,
                                   v_cache_q4[i][j][block_idx].data()),
                               v_cache_q4[i][j][block_idx].size() *
                                   sizeof(block_q4_0));
+                } else if (config_.kv_type == GGML_TYPE_Q8_0) {
+                    ofs.write(reinterpret_cast<const char *>(
+                                  k_cache_q8[i][j][block_idx].data()),
+                              k_cache_q8[i][j][block_idx].size() *
+                                  sizeof(block_q8_0));
+                    ofs.write(reinterpret_cast<const char *>(
+                                  v_cache_q8[i][j][block_idx].data()),
+                              v_cache_q8[i][j][block_idx].size() *
+                                  sizeof(block_q8_0));
                 }
             }
         }
@@ -123,4 +143,236 @@ void KVCache::dump_kvcache(int *block_table, int cache_total_len,
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> diff = end - start;
     printf("time of dump: %f s\n", diff.count());
-}
\ No newline at end of file
+}
+
+size_t KVCache::serialized_block_size_() {
+    size_t kv_bytes = 0;
+    if (config_.kv_type == GGML_TYPE_F16) {
+        kv_bytes = k_cache_fp16_[0][0][0].size() * sizeof(ggml_fp16_t) +
+                   v_cache_fp16_[0][0][0].size() * sizeof(ggml_fp16_t);
+    } else if (config_.kv_type == GGML_TYPE_Q4_0) {
+        kv_bytes = k_cache_q4[0][0][0].size() * sizeof(block_q4_0) +
+                   v_cache_q4[0][0][0].size() * sizeof(block_q4_0);
+    } else if (config_.kv_type == GGML_TYPE_Q8_0) {
+        kv_bytes = k_cache_q8[0][0][0].size() * sizeof(block_q8_0) +
+                   v_cache_q8[0][0][0].size() * sizeof(block_q8_0);
+    }
+    size_t importance_bytes =
+        (size_t)config_.block_len * config_.q_head_num * sizeof(ggml_fp16_t);
+    size_t anchor_bytes = (size_t)config_.anchor_num * config_.q_head_num *
+                          config_.head_dim * sizeof(ggml_fp16_t);
+    return config_.layer_num *
+           (config_.kv_head_num * kv_bytes + importance_bytes + anchor_bytes);
+}
+
+// Per layer: K and V of every kv head, the importance rows and the anchors
+// of the block, in that order.
+void KVCache::serialize_block_(int block_idx, std::vector<char> &out) {
+    out.resize(serialized_block_size_());
+    char *dst = out.data();
+    auto append = [&](const void *src, size_t bytes) {
+        memcpy(dst, src, bytes);
+        dst += bytes;
+    };
+    size_t anchor_block_elems =
+        (size_t)config_.anchor_num * config_.q_head_num * config_.head_dim;
+    for (int i = 0; i < config_.layer_num; ++i) {
+        for (int j = 0; j < config_.kv_head_num; ++j) {
+            if (config_.kv_type == GGML_TYPE_F16) {
+                auto &k = k_cache_fp16_[i][j][block_idx];
+                auto &v = v_cache_fp16_[i][j][block_idx];
+                append(k.data(), k.size() * sizeof(ggml_fp16_t));
+                append(v.data(), v.size() * sizeof(ggml_fp16_t));
+            } else if (config_.kv_type == GGML_TYPE_Q4_0) {
+                auto &k = k_cache_q4[i][j][block_idx];
+                auto &v = v_cache_q4[i][j][block_idx];
+                append(k.data(), k.size() * sizeof(block_q4_0));
+                append(v.data(), v.size() * sizeof(block_q4_0));
+            } else if (config_.kv_type == GGML_TYPE_Q8_0) {
+                auto &k = k_cache_q8[i][j][block_idx];
+                auto &v = v_cache_q8[i][j][block_idx];
+                append(k.data(), k.size() * sizeof(block_q8_0));
+                append(v.data(), v.size() * sizeof(block_q8_0));
+            }
+        }
+        for (int l = 0; l < config_.block_len; l++) {
+            append(importance_[i][block_idx][l].data(),
+                   config_.q_head_num * sizeof(ggml_fp16_t));
+        }
+        append(anchor_.data() +
+                   ((size_t)i * config_.max_block_num + block_idx) *
+                       anchor_block_elems,
+               anchor_block_elems * sizeof(ggml_fp16_t));
+    }
+}
+
+void KVCache::cow_block_slow_(int block_idx) {
+    while (true) {
+        int expected = SNAPSHOT_PENDING;
+        if (snapshot_state_[block_idx].compare_exchange_strong(
+                expected, SNAPSHOT_BUSY, std::memory_order_acq_rel)) {
+            serialize_block_(block_idx, snapshot_copies_[block_idx]);
+            snapshot_state_[block_idx].store(SNAPSHOT_COPIED,
+                                             std::memory_order_release);
+            return;
+        }
+        if (expected != SNAPSHOT_BUSY) {
+            return;
+        }
+        // The writer thread is reading this block right now.
+        std::this_thread::yield();
+    }
+}
+
+void KVCache::snapshot_kvcache(int *block_table, int cache_total_len,
+                               std::string tensor_file_path, int io_priority,
+                               Backend *backend) {
+    if (config_.mla_latent_dim != 0) {
+        throw std::invalid_argument(
+            "snapshot_kvcache does not support MLA caches");
+    }
+    wait_snapshot();
+    int past_block_num =
+        (cache_total_len + config_.block_len - 1) / config_.block_len;
+    printf("snapshot_kvcache: %s, cache_total_len: %d, past_block_num: %d\n",
+           tensor_file_path.c_str(), cache_total_len, past_block_num);
+    std::vector<int> blocks(block_table, block_table + past_block_num);
+
+    snapshot_state_ = std::vector<std::atomic<int>>(config_.max_block_num);
+    snapshot_copies_.assign(config_.max_block_num, std::vector<char>());
+    for (int b = 0; b < config_.max_block_num; b++) {
+        snapshot_state_[b].store(SNAPSHOT_NONE, std::memory_order_relaxed);
+    }
+    for (int block_idx : blocks) {
+        snapshot_state_[block_idx].store(SNAPSHOT_PENDING,
+                                         std::memory_order_relaxed);
+    }
+    snapshot_active_.store(true, std::memory_order_release);
+
+    snapshot_thread_ = std::thread([this, blocks, cache_total_len,
+                                    tensor_file_path, io_priority]() {
+        auto start = std::chrono::high_resolution_clock::now();
+        // IOPRIO_WHO_PROCESS of this thread, IOPRIO_CLASS_BE. Best effort:
+        // a kernel or scheduler without I/O priorities just ignores it.
+        syscall(SYS_ioprio_set, 1, 0, (2 << 13) | io_priority);
+
+        std::string tmp_path = tensor_file_path + ".tmp";
+        std::ofstream ofs(tmp_path, std::ios::binary);
+        if (!ofs.is_open()) {
+            std::cerr << "Cannot open file " << tmp_path << std::endl;
+            snapshot_error_ = "Cannot open file " + tmp_path;
+            for (int block_idx : blocks) {
+                snapshot_state_[block_idx].store(SNAPSHOT_NONE,
+                                                 std::memory_order_release);
+            }
+            snapshot_active_.store(false, std::memory_order_release);
+            return;
+        }
+        ofs.write(reinterpret_cast<const char *>(&cache_total_len),
+                  sizeof(cache_total_len));
+
+        // Offsets of the dump_kvcache layout.
+        int nb = blocks.size();
+        size_t block_bytes = serialized_block_size_() / config_.layer_num;
+        size_t importance_bytes = (size_t)config_.block_len *
+                                  config_.q_head_num * sizeof(ggml_fp16_t);
+        size_t anchor_bytes = (size_t)config_.anchor_num *
+                              config_.q_head_num * config_.head_dim *
+                              sizeof(ggml_fp16_t);
+        size_t kv_bytes = (block_bytes - importance_bytes - anchor_bytes) /
+                          config_.kv_head_num;
+        size_t anchor_area = anchor_.size() * sizeof(ggml_fp16_t);
+        size_t layer_bytes =
+            (size_t)nb * (config_.kv_head_num * kv_bytes + importance_bytes);
+
+        std::vector<char> buf;
+        for (int k = 0; k < nb; k++) {
+            int block_idx = blocks[k];
+            while (true) {
+                int expected = SNAPSHOT_PENDING;
+                if (snapshot_state_[block_idx].compare_exchange_strong(
+                        expected, SNAPSHOT_BUSY, std::memory_order_acq_rel)) {
+                    // After a write error the blocks are only released.
+                    if (!ofs.fail()) {
+                        serialize_block_(block_idx, buf);
+                    }
+                    snapshot_state_[block_idx].store(
+                        SNAPSHOT_NONE, std::memory_order_release);
+                    break;
+                }
+                if (expected == SNAPSHOT_COPIED) {
+                    buf.swap(snapshot_copies_[block_idx]);
+                    std::vector<char>().swap(snapshot_copies_[block_idx]);
+                    snapshot_state_[block_idx].store(
+                        SNAPSHOT_NONE, std::memory_order_release);
+                    break;
+                }
+                std::this_thread::yield();
+            }
+            if (ofs.fail()) {
+                continue;
+            }
+
+            const char *src = buf.data();
+            for (int i = 0; i < config_.layer_num; ++i) {
+                size_t layer_off =
+                    sizeof(int) + anchor_area + (size_t)i * layer_bytes;
+                for (int j = 0; j < config_.kv_head_num; ++j) {
+                    ofs.seekp(layer_off + ((size_t)j * nb + k) * kv_bytes);
+                    ofs.write(src, kv_bytes);
+                    src += kv_bytes;
+                }
+                ofs.seekp(layer_off + (size_t)config_.kv_head_num * nb *
+                                          kv_bytes +
+                          (size_t)k * importance_bytes);
+                ofs.write(src, importance_bytes);
+                src += importance_bytes;
+                ofs.seekp(sizeof(int) +
+                          ((size_t)i * config_.max_block_num + block_idx) *
+                              anchor_bytes);
+                ofs.write(src, anchor_bytes);
+                src += anchor_bytes;
+            }
+        }
+        bool written = !ofs.fail();
+        ofs.close();
+        written = written && !ofs.fail();
+        // Anchors of blocks outside the snapshot are holes that read back as
+        // zeros; extend the file in case none of them was written last.
+        size_t file_bytes =
+            sizeof(int) + anchor_area + config_.layer_num * layer_bytes;
+        if (!written) {
+            snapshot_error_ = "Cannot write " + tmp_path;
+        } else if (::truncate(tmp_path.c_str(), file_bytes) != 0) {
+            snapshot_error_ = "Cannot resize " + tmp_path;
+        } else if (std::rename(tmp_path.c_str(), tensor_file_path.c_str()) !=
+                   0) {
+            snapshot_error_ = "Cannot rename " + tmp_path;
+        }
+        // A failed snapshot leaves the previous file in place.
+        if (!snapshot_error_.empty()) {
+            std::cerr << snapshot_error_ << std::endl;
+            ::unlink(tmp_path.c_str());
+        }
+        snapshot_active_.store(false, std::memory_order_release);
+
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> diff = end - start;
+        printf("time of snapshot: %f s\n", diff.count());
+    });
+}
+
+void KVCache::join_snapshot_() {
+    if (snapshot_thread_.joinable()) {
+        snapshot_thread_.join();
+    }
+}
+
+void KVCache::wait_snapshot() {
+    join_snapshot_();
+    if (!snapshot_error_.empty()) {
+        std::string error;
+        error.swap(snapshot_error_);
+        throw std::runtime_error(error);
+    }
+}
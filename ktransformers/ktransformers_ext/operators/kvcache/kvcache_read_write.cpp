@@ -14,6 +14,8 @@
 
 void KVCache::get_anchor_one_block(ggml_fp16_t *anchor, int layer_id,
                                    int block_idx, Backend *backend) {
+    // MLA keeps neither V blocks nor anchors and importance.
+    assert(config_.mla_latent_dim == 0);
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
@@ -31,11 +33,13 @@ void KVCache::get_anchor_one_block(ggml_fp16_t *anchor, int layer_id,
 
 void KVCache::update_anchor_one_block(const ggml_fp16_t *anchor, int layer_id,
                                       int block_idx, Backend *backend) {
+    assert(config_.mla_latent_dim == 0);
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
     layer_id_ = layer_id;
     block_idx = block_idx;
+    cow_block_(block_idx);
     seq_len_ = config_.block_len;
     anchor_data_ = const_cast<uint16_t *>(anchor);
 
@@ -59,11 +63,13 @@ void KVCache::update_anchor_one_block(const ggml_fp16_t *anchor, int layer_id,
 void KVCache::update_importance_one_block(const ggml_fp16_t *importance,
                                           int layer_id, int block_idx,
                                           Backend *backend) {
+    assert(config_.mla_latent_dim == 0);
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
     layer_id_ = layer_id;
     block_idx = block_idx;
+    cow_block_(block_idx);
     seq_len_ = config_.block_len;
     importance_data_ = const_cast<uint16_t *>(importance);
 
@@ -86,6 +92,7 @@ void KVCache::update_importance_one_block(const ggml_fp16_t *importance,
 
 void KVCache::get_importance_one_block(ggml_fp16_t *importance, int layer_id,
                                        int block_idx, Backend *backend) {
+    assert(config_.mla_latent_dim == 0);
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
@@ -116,11 +123,13 @@ void KVCache::update_kvcache_one_block_fp16(const ggml_fp16_t *k_in,
                                             const ggml_fp16_t *v_in,
                                             int layer_id, int block_idx,
                                             Backend *backend) {
+    assert(config_.mla_latent_dim == 0);
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
     layer_id_ = layer_id;
     block_idx = block_idx;
+    cow_block_(block_idx);
     seq_len_ = config_.block_len;
     k_data_ = const_cast<uint16_t *>(k_in);
     v_data_ = const_cast<uint16_t *>(v_in);
@@ -143,50 +152,25 @@ void KVCache::update_kvcache_one_block_fp16(const ggml_fp16_t *k_in,
     backend->do_work_stealing_job(
         config_.kv_head_num * 2, nullptr,
         [&](int task_id) {
-            std::vector<float> block_fp32(32);
             int head_id = task_id / 2;
             if (task_id & 1) {
                 // fill k_cache_
                 k_cache_q4[layer_id_][head_id][block_idx].resize(
                     config_.block_len * config_.head_dim / 32);
-                for (int k = 0; k < config_.block_len; k++) {
-                    for (int l = 0; l < config_.head_dim / 32; l++) {
-                        block_q4_0 block;
-                        for (int m = 0; m < 32; m++) {
-
-                            block_fp32[m] = GGML_FP16_TO_FP32(
-                                k_data_[((0 * config_.kv_head_num + head_id) *
-                                             seq_len_ +
-                                         0 * config_.block_len + k) *
-                                            config_.head_dim +
-                                        l * 32 + m]);
-                        }
-                        quantize_row_q4_0(block_fp32.data(), &block, 32);
-                        k_cache_q4[layer_id_][head_id][block_idx]
-                                  [k * config_.head_dim / 32 + l] = block;
-                    }
-                }
+                quant_kv_tokens_(true, layer_id_, head_id, block_idx, 0,
+                                 config_.block_len,
+                                 k_data_ +
+                                     head_id * seq_len_ * config_.head_dim,
+                                 config_.head_dim);
             } else {
                 // fill v_cache_
                 v_cache_q4[layer_id_][head_id][block_idx].resize(
                     config_.head_dim * config_.block_len / 32);
-                for (int k = 0; k < config_.block_len / 32; k++) {
-                    for (int l = 0; l < config_.head_dim; l++) {
-                        block_q4_0 block;
-                        for (int m = 0; m < 32; m++) {
-
-                            block_fp32[m] = GGML_FP16_TO_FP32(
-                                v_data_[((0 * config_.kv_head_num + head_id) *
-                                             seq_len_ +
-                                         0 * config_.block_len + k * 32 + m) *
-                                            config_.head_dim +
-                                        l]);
-                        }
-                        quantize_row_q4_0(block_fp32.data(), &block, 32);
-                        v_cache_q4[layer_id_][head_id][block_idx]
-                                  [l * config_.block_len / 32 + k] = block;
-                    }
-                }
+                quant_kv_tokens_(false, layer_id_, head_id, block_idx, 0,
+                                 config_.block_len,
+                                 v_data_ +
+                                     head_id * seq_len_ * config_.head_dim,
+                                 config_.head_dim);
             }
         },
         nullptr);
@@ -203,6 +187,7 @@ void KVCache::update_kvcache_one_block_fp16(const ggml_fp16_t *k_in,
 void KVCache::get_kvcache_one_block_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                          int layer_id, int block_idx,
                                          Backend *backend) {
+    assert(config_.mla_latent_dim == 0);
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
@@ -216,44 +201,16 @@ void KVCache::get_kvcache_one_block_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
     backend->do_work_stealing_job(
         config_.kv_head_num * 2, nullptr,
         [&](int task_id) {
-            std::vector<float> block_fp32(32);
+            std::vector<float> token_fp32(config_.head_dim);
             int head_id = task_id / 2;
-            if (task_id & 1) {
-                // get k_cache_
-                for (int k = 0; k < config_.block_len; k++) {
-                    for (int l = 0; l < config_.head_dim / 32; l++) {
-                        block_q4_0 block =
-                            k_cache_q4[layer_id_][head_id][block_idx]
-                                      [k * config_.head_dim / 32 + l];
-                        dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                        for (int m = 0; m < 32; m++) {
-
-                            k_data_[((0 * config_.kv_head_num + head_id) *
-                                         seq_len_ +
-                                     0 * config_.block_len + k) *
-                                        config_.head_dim +
-                                    l * 32 + m] =
-                                GGML_FP32_TO_FP16(block_fp32[m]);
-                        }
-                    }
-                }
-            } else {
-                // get v_cache_
-                for (int k = 0; k < config_.block_len / 32; k++) {
-                    for (int l = 0; l < config_.head_dim; l++) {
-                        block_q4_0 block =
-                            v_cache_q4[layer_id_][head_id][block_idx]
-                                      [l * config_.block_len / 32 + k];
-                        dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                        for (int m = 0; m < 32; m++) {
-
-                            v_data_[((0 * config_.kv_head_num + head_id) *
-                                         seq_len_ +
-                                     0 * config_.block_len + k * 32 + m) *
-                                        config_.head_dim +
-                                    l] = GGML_FP32_TO_FP16(block_fp32[m]);
-                        }
-                    }
+            uint16_t *out = (task_id & 1 ? k_data_ : v_data_) +
+                            head_id * seq_len_ * config_.head_dim;
+            for (int k = 0; k < config_.block_len; k++) {
+                dequant_kv_token_(task_id & 1, layer_id_, head_id, block_idx,
+                                  k, token_fp32.data());
+                for (int l = 0; l < config_.head_dim; l++) {
+                    out[k * config_.head_dim + l] =
+                        GGML_FP32_TO_FP16(token_fp32[l]);
                 }
             }
         },
@@ -274,6 +231,7 @@ void KVCache::get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                           int batch_size, int max_block_num,
                                           int *cache_seqlens, int q_len,
                                           Backend *backend) {
+    assert(config_.mla_latent_dim == 0);
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
@@ -286,7 +244,6 @@ void KVCache::get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
         config_.kv_head_num * max_block_num * batch_size, nullptr,
         [&](int task_id) {
             // printf("block_idx: %d, task_id: %d\n", block_idx, task_id);
-            std::vector<float> block_fp32(32);
             int batch_id = task_id / (config_.kv_head_num * max_block_num);
             int block_id = (task_id / config_.kv_head_num) % max_block_num;
             int head_id = task_id % config_.kv_head_num;
@@ -325,113 +282,39 @@ void KVCache::get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                                  [l * config_.block_len + k];
                         }
                     }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                    // get k_cache_
+                } else {
+                    std::vector<float> token_fp32(config_.head_dim);
                     for (int k = 0; k < config_.block_len; k++) {
                         if (block_id * config_.block_len + k >= seq_len)
                             break;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q4_0 block =
-                                k_cache_q4[layer_id_][head_id][block_idx]
-                                          [k * config_.head_dim / 32 + l];
-                            dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                k_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        k * (config_.kv_head_num *
-                                             config_.head_dim) +
-                                        head_id * config_.head_dim + l * 32 +
-                                        m] = GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
-                        }
-                    }
-                    // get v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
+                        size_t offset =
+                            batch_id *
+                                (max_block_num * config_.block_len *
+                                 config_.kv_head_num * config_.head_dim) +
+                            block_id * (config_.block_len *
+                                        config_.kv_head_num *
+                                        config_.head_dim) +
+                            k * (config_.kv_head_num * config_.head_dim) +
+                            head_id * config_.head_dim;
+                        // get k_cache_
+                        dequant_kv_token_(true, layer_id_, head_id,
+                                          block_idx, k, token_fp32.data());
                         for (int l = 0; l < config_.head_dim; l++) {
-                            block_q4_0 block =
-                                v_cache_q4[layer_id_][head_id][block_idx]
-                                          [l * config_.block_len / 32 + k];
-                            dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len)
-                                    break;
-                                v_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        (k * 32 + m) * config_.kv_head_num *
-                                            config_.head_dim +
-                                        head_id * config_.head_dim + l] =
-                                    GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
-                        }
-                    }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    // get k_cache_
-                    for (int k = 0; k < config_.block_len; k++) {
-                        if (block_id * config_.block_len + k >= seq_len)
-                            break;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q8_0 block =
-                                k_cache_q8[layer_id_][head_id][block_idx]
-                                          [k * config_.head_dim / 32 + l];
-                            dequantize_row_q8_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                k_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        k * (config_.kv_head_num *
-                                             config_.head_dim) +
-                                        head_id * config_.head_dim + l * 32 +
-                                        m] = GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
+                            k_data_[offset + l] =
+                                GGML_FP32_TO_FP16(token_fp32[l]);
                         }
-                    }
-                    // get v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
+                        // get v_cache_
+                        dequant_kv_token_(false, layer_id_, head_id,
+                                          block_idx, k, token_fp32.data());
                         for (int l = 0; l < config_.head_dim; l++) {
-                            block_q8_0 block =
-                                v_cache_q8[layer_id_][head_id][block_idx]
-                                          [l * config_.block_len / 32 + k];
-                            dequantize_row_q8_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len)
-                                    break;
-                                v_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        (k * 32 + m) * config_.kv_head_num *
-                                            config_.head_dim +
-                                        head_id * config_.head_dim + l] =
-                                    GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
+                            v_data_[offset + l] =
+                                GGML_FP32_TO_FP16(token_fp32[l]);
                         }
                     }
                 }
             }
             if (block_r > seq_len && block_l < seq_len + q_len) {
+                cow_block_(block_idx);
                 if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
                     for (int k = 0; k < config_.block_len; k++) {
                         if (block_id * config_.block_len + k >=
@@ -465,122 +348,24 @@ void KVCache::get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                               head_id * config_.head_dim + l];
                         }
                     }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                    // fill k_cache_
-                    for (int k = 0; k < config_.block_len; k++) {
-                        if (block_id * config_.block_len + k >=
-                                seq_len + q_len ||
-                            block_id * config_.block_len + k < seq_len)
-                            continue;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q4_0 block;
-                            for (int m = 0; m < 32; m++) {
-
-                                block_fp32[m] = GGML_FP16_TO_FP32(
-                                    k_data_[batch_id * (max_block_num *
-                                                        config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            block_id * (config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            k * (config_.kv_head_num *
-                                                 config_.head_dim) +
-                                            head_id * config_.head_dim +
-                                            l * 32 + m]);
-                            }
-                            quantize_row_q4_0(block_fp32.data(), &block, 32);
-                            k_cache_q4[layer_id_][head_id][block_idx]
-                                      [k * config_.head_dim / 32 + l] = block;
-                        }
-                    }
-
-                    // fill v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
-                        for (int l = 0; l < config_.head_dim; l++) {
-                            block_q4_0 block;
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len + q_len) {
-                                    block_fp32[m] = 0;
-                                    continue;
-                                }
-                                block_fp32[m] = GGML_FP16_TO_FP32(
-                                    v_data_[batch_id * (max_block_num *
-                                                        config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            block_id * (config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            (k * 32 + m) * config_.kv_head_num *
-                                                config_.head_dim +
-                                            head_id * config_.head_dim + l]);
-                            }
-                            quantize_row_q4_0(block_fp32.data(), &block, 32);
-                            v_cache_q4[layer_id_][head_id][block_idx]
-                                      [l * config_.block_len / 32 + k] = block;
-                        }
-                    }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
+                } else {
+                    int begin = std::max(seq_len, block_l) - block_l;
+                    int end = std::min(seq_len + q_len, block_r) - block_l;
+                    size_t offset =
+                        batch_id * (max_block_num * config_.block_len *
+                                    config_.kv_head_num * config_.head_dim) +
+                        block_id * (config_.block_len * config_.kv_head_num *
+                                    config_.head_dim) +
+                        begin * (config_.kv_head_num * config_.head_dim) +
+                        head_id * config_.head_dim;
                     // fill k_cache_
-                    for (int k = 0; k < config_.block_len; k++) {
-                        if (block_id * config_.block_len + k >=
-                                seq_len + q_len ||
-                            block_id * config_.block_len + k < seq_len)
-                            continue;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q8_0 block;
-                            for (int m = 0; m < 32; m++) {
-
-                                block_fp32[m] = GGML_FP16_TO_FP32(
-                                    k_data_[batch_id * (max_block_num *
-                                                        config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            block_id * (config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            k * (config_.kv_head_num *
-                                                 config_.head_dim) +
-                                            head_id * config_.head_dim +
-                                            l * 32 + m]);
-                            }
-                            quantize_row_q8_0(block_fp32.data(), &block, 32);
-                            k_cache_q8[layer_id_][head_id][block_idx]
-                                      [k * config_.head_dim / 32 + l] = block;
-                        }
-                    }
-
+                    quant_kv_tokens_(true, layer_id_, head_id, block_idx,
+                                     begin, end, k_data_ + offset,
+                                     config_.kv_head_num * config_.head_dim);
                     // fill v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
-                        for (int l = 0; l < config_.head_dim; l++) {
-                            block_q8_0 block;
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len + q_len) {
-                                    block_fp32[m] = 0;
-                                    continue;
-                                }
-                                block_fp32[m] = GGML_FP16_TO_FP32(
-                                    v_data_[batch_id * (max_block_num *
-                                                        config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            block_id * (config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            (k * 32 + m) * config_.kv_head_num *
-                                                config_.head_dim +
-                                            head_id * config_.head_dim + l]);
-                            }
-                            quantize_row_q8_0(block_fp32.data(), &block, 32);
-                            v_cache_q8[layer_id_][head_id][block_idx]
-                                      [l * config_.block_len / 32 + k] = block;
-                        }
-                    }
+                    quant_kv_tokens_(false, layer_id_, head_id, block_idx,
+                                     begin, end, v_data_ + offset,
+                                     config_.kv_head_num * config_.head_dim);
                 }
             }
         },
@@ -599,6 +384,7 @@ void KVCache::update_importance(const ggml_fp16_t *importance, int layer_id,
                                 int *block_table, int batch_size,
                                 int max_block_num, int *offset, int width,
                                 Backend *backend) {
+    assert(config_.mla_latent_dim == 0);
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
@@ -615,6 +401,7 @@ void KVCache::update_importance(const ggml_fp16_t *importance, int layer_id,
             if (block_id > (offset[batch_id] + width) / config_.block_len) {
                 return;
             }
+            cow_block_(block_idx);
             for (int k = 0; k < config_.block_len; k++) {
                 for (int head_id = 0; head_id < config_.q_head_num; head_id++) {
                     importance_[layer_id_][block_idx][k][head_id] =
@@ -646,6 +433,7 @@ void KVCache::get_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                int layer_id, int *block_table, int batch_size,
                                int max_block_num, int *cache_seqlens,
                                Backend *backend) {
+    assert(config_.mla_latent_dim == 0);
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
@@ -658,7 +446,6 @@ void KVCache::get_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
         config_.kv_head_num * max_block_num * batch_size, nullptr,
         [&](int task_id) {
             // printf("block_idx: %d, task_id: %d\n", block_idx, task_id);
-            std::vector<float> block_fp32(32);
             int batch_id = task_id / (config_.kv_head_num * max_block_num);
             int block_id = (task_id / config_.kv_head_num) % max_block_num;
             int head_id = task_id % config_.kv_head_num;
@@ -697,108 +484,33 @@ void KVCache::get_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                                  [l * config_.block_len + k];
                         }
                     }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                    // get k_cache_
+                } else {
+                    std::vector<float> token_fp32(config_.head_dim);
                     for (int k = 0; k < config_.block_len; k++) {
                         if (block_id * config_.block_len + k >= seq_len)
                             break;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q4_0 block =
-                                k_cache_q4[layer_id_][head_id][block_idx]
-                                          [k * config_.head_dim / 32 + l];
-                            dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                k_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        k * (config_.kv_head_num *
-                                             config_.head_dim) +
-                                        head_id * config_.head_dim + l * 32 +
-                                        m] = GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
-                        }
-                    }
-                    // get v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
+                        size_t offset =
+                            batch_id *
+                                (max_block_num * config_.block_len *
+                                 config_.kv_head_num * config_.head_dim) +
+                            block_id * (config_.block_len *
+                                        config_.kv_head_num *
+                                        config_.head_dim) +
+                            k * (config_.kv_head_num * config_.head_dim) +
+                            head_id * config_.head_dim;
+                        // get k_cache_
+                        dequant_kv_token_(true, layer_id_, head_id,
+                                          block_idx, k, token_fp32.data());
                         for (int l = 0; l < config_.head_dim; l++) {
-                            block_q4_0 block =
-                                v_cache_q4[layer_id_][head_id][block_idx]
-                                          [l * config_.block_len / 32 + k];
-                            dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len)
-                                    break;
-                                v_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        (k * 32 + m) * config_.kv_head_num *
-                                            config_.head_dim +
-                                        head_id * config_.head_dim + l] =
-                                    GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
+                            k_data_[offset + l] =
+                                GGML_FP32_TO_FP16(token_fp32[l]);
                         }
-                    }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    // get k_cache_
-                    for (int k = 0; k < config_.block_len; k++) {
-                        if (block_id * config_.block_len + k >= seq_len)
-                            break;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q8_0 block =
-                                k_cache_q8[layer_id_][head_id][block_idx]
-                                          [k * config_.head_dim / 32 + l];
-                            dequantize_row_q8_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                k_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        k * (config_.kv_head_num *
-                                             config_.head_dim) +
-                                        head_id * config_.head_dim + l * 32 +
-                                        m] = GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
-                        }
-                    }
-                    // get v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
+                        // get v_cache_
+                        dequant_kv_token_(false, layer_id_, head_id,
+                                          block_idx, k, token_fp32.data());
                         for (int l = 0; l < config_.head_dim; l++) {
-                            block_q8_0 block =
-                                v_cache_q8[layer_id_][head_id][block_idx]
-                                          [l * config_.block_len / 32 + k];
-                            dequantize_row_q8_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len)
-                                    break;
-                                v_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        (k * 32 + m) * config_.kv_head_num *
-                                            config_.head_dim +
-                                        head_id * config_.head_dim + l] =
-                                    GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
+                            v_data_[offset + l] =
+                                GGML_FP32_TO_FP16(token_fp32[l]);
                         }
                     }
                 }
@@ -811,6 +523,80 @@ void KVCache::get_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
     std::chrono::duration<double> duration = end - start;
 }
 
+void KVCache::gather_kvcache_fp16(ggml_fp16_t *k_out, ggml_fp16_t *v_out,
+                                  int layer_begin, int layer_end,
+                                  int *block_table, int batch_size,
+                                  int max_block_num, int *cache_seqlens,
+                                  Backend *backend) {
+    assert(config_.mla_latent_dim == 0);
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
+
+    size_t token_stride = (size_t)config_.kv_head_num * config_.head_dim;
+    size_t batch_stride = (size_t)max_block_num * config_.block_len *
+                          token_stride;
+    size_t layer_stride = batch_size * batch_stride;
+    int layer_num = layer_end - layer_begin;
+
+    // Each task copies one block of one kv head in one layer.
+    backend->do_work_stealing_job(
+        layer_num * batch_size * max_block_num * config_.kv_head_num, nullptr,
+        [&](int task_id) {
+            int layer_id = layer_begin + task_id / (batch_size *
+                                                    max_block_num *
+                                                    config_.kv_head_num);
+            int batch_id =
+                task_id / (max_block_num * config_.kv_head_num) % batch_size;
+            int block_id = task_id / config_.kv_head_num % max_block_num;
+            int head_id = task_id % config_.kv_head_num;
+            int len = std::min(cache_seqlens[batch_id] -
+                                   block_id * config_.block_len,
+                               config_.block_len);
+            if (len <= 0) {
+                return;
+            }
+            int block_idx = block_table[batch_id * max_block_num + block_id];
+            size_t offset = (layer_id - layer_begin) * layer_stride +
+                            batch_id * batch_stride +
+                            (size_t)block_id * config_.block_len *
+                                token_stride +
+                            head_id * config_.head_dim;
+            std::vector<float> token_fp32(config_.head_dim);
+            for (int k = 0; k < len; k++) {
+                ggml_fp16_t *k_token = k_out + offset + k * token_stride;
+                ggml_fp16_t *v_token = v_out + offset + k * token_stride;
+                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                    const ggml_fp16_t *v_block =
+                        v_cache_fp16_[layer_id][head_id][block_idx].data();
+                    memcpy(k_token,
+                           k_cache_fp16_[layer_id][head_id][block_idx].data() +
+                               k * config_.head_dim,
+                           config_.head_dim * sizeof(ggml_fp16_t));
+                    for (int l = 0; l < config_.head_dim; l++) {
+                        v_token[l] = v_block[l * config_.block_len + k];
+                    }
+                    continue;
+                }
+                dequant_kv_token_(true, layer_id, head_id, block_idx, k,
+                                  token_fp32.data());
+                for (int l = 0; l < config_.head_dim; l++) {
+                    k_token[l] = GGML_FP32_TO_FP16(token_fp32[l]);
+                }
+                dequant_kv_token_(false, layer_id, head_id, block_idx, k,
+                                  token_fp32.data());
+                for (int l = 0; l < config_.head_dim; l++) {
+                    v_token[l] = GGML_FP32_TO_FP16(token_fp32[l]);
+                }
+            }
+        },
+        nullptr);
+
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> duration = end - start;
+    // printf("time of gather_kvcache_fp16: %f s\n", duration.count());
+}
+
 void KVCache::update_kvcache_fp16(const ggml_fp16_t *k_in,
                                   const ggml_fp16_t *v_in, int layer_id,
                                   int *block_table, int batch_size,
@@ -822,9 +608,68 @@ void KVCache::update_kvcache_fp16(const ggml_fp16_t *k_in,
     layer_id_ = layer_id;
     k_data_ = const_cast<uint16_t *>(k_in);
     v_data_ = const_cast<uint16_t *>(v_in);
+    if (config_.kv_type != ggml_type::GGML_TYPE_F16) {
+        // Quantized caches are written one head at a time, so that the new
+        // tokens sharing a per_channel group are requantized together.
+        do_kv_numa_job_(
+            backend, batch_size * config_.kv_head_num,
+            [&](int task_id) {
+                int batch_id = task_id / config_.kv_head_num;
+                int block_id = cache_seqlens[batch_id] / config_.block_len;
+                return kv_numa_node_(
+                    task_id % config_.kv_head_num,
+                    block_table[batch_id * max_block_num +
+                                block_slot_(block_id)]);
+            },
+            nullptr,
+            [&](int task_id) {
+                int batch_id = task_id / config_.kv_head_num;
+                int head_id = task_id % config_.kv_head_num;
+                int begin = cache_seqlens[batch_id];
+                for (int pos = begin; pos < begin + q_len;) {
+                    int block_id = pos / config_.block_len;
+                    int block_idx =
+                        block_table[batch_id * max_block_num +
+                                    block_slot_(block_id)];
+                    int pos_in_block = pos % config_.block_len;
+                    cow_block_(block_idx);
+                    int len = std::min(begin + q_len - pos,
+                                       config_.block_len - pos_in_block);
+                    size_t offset =
+                        batch_id * (q_len * config_.kv_head_num *
+                                    config_.head_dim) +
+                        (pos - begin) * config_.kv_head_num *
+                            config_.head_dim +
+                        head_id * config_.head_dim;
+                    // fill k_cache_
+                    quant_kv_tokens_(true, layer_id_, head_id, block_idx,
+                                     pos_in_block, pos_in_block + len,
+                                     k_data_ + offset,
+                                     config_.kv_head_num * config_.head_dim);
+                    // fill v_cache_
+                    quant_kv_tokens_(false, layer_id_, head_id, block_idx,
+                                     pos_in_block, pos_in_block + len,
+                                     v_data_ + offset,
+                                     config_.kv_head_num * config_.head_dim);
+                    pos += len;
+                }
+            },
+            nullptr);
+        return;
+    }
+
     // Each task updates the k cache and v cache of a certain header
-    backend->do_work_stealing_job(
-        batch_size * config_.kv_head_num * q_len, nullptr,
+    do_kv_numa_job_(
+        backend, batch_size * config_.kv_head_num * q_len,
+        [&](int task_id) {
+            int batch_id = task_id / (config_.kv_head_num * q_len);
+            int block_id =
+                (cache_seqlens[batch_id] + task_id % q_len) / config_.block_len;
+            return kv_numa_node_(task_id / q_len % config_.kv_head_num,
+                                 block_table[batch_id * max_block_num +
+                                             block_slot_(block_id)]);
+        },
+        nullptr,
         [&](int task_id) {
             int batch_id = task_id / (config_.kv_head_num * q_len);
             int head_id = task_id / q_len % config_.kv_head_num;
@@ -832,96 +677,32 @@ void KVCache::update_kvcache_fp16(const ggml_fp16_t *k_in,
             int q_offset = task_id % q_len;
 
             int block_id = seq_len / config_.block_len;
-            int block_idx = block_table[batch_id * max_block_num + block_id];
+            int block_idx =
+                block_table[batch_id * max_block_num + block_slot_(block_id)];
             int pos_in_block = seq_len % config_.block_len;
-
-            if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-                for (int l = 0; l < config_.head_dim; l++) {
-                    k_cache_fp16_[layer_id_][head_id][block_idx]
-                                 [pos_in_block * config_.head_dim + l] =
-                                     k_data_[batch_id *
-                                                 (q_len * config_.kv_head_num *
-                                                  config_.head_dim) +
-                                             q_offset * config_.kv_head_num *
-                                                 config_.head_dim +
-                                             head_id * config_.head_dim + l];
-                    v_cache_fp16_[layer_id_][head_id][block_idx]
-                                 [l * config_.block_len + pos_in_block] =
-                                     v_data_[batch_id *
-                                                 (q_len * config_.kv_head_num *
-                                                  config_.head_dim) +
-                                             q_offset * config_.kv_head_num *
-                                                 config_.head_dim +
-                                             head_id * config_.head_dim + l];
-                }
-            } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                std::vector<float> block_fp32(32);
-                // fill k_cache_
-                for (int l = 0; l < config_.head_dim / 32; l++) {
-                    block_q4_0 block;
-                    for (int m = 0; m < 32; m++) {
-
-                        block_fp32[m] = GGML_FP16_TO_FP32(
-                            k_data_[batch_id * (q_len * config_.kv_head_num *
-                                                config_.head_dim) +
-                                    head_id * config_.head_dim + l * 32 + m]);
-                    }
-                    quantize_row_q4_0(block_fp32.data(), &block, 32);
-
-                    k_cache_q4[layer_id_][head_id][block_idx]
-                              [pos_in_block * config_.head_dim / 32 + l] =
-                                  block;
-                }
-
-                // fill v_cache_
-                for (int l = 0; l < config_.head_dim; l++) {
-                    block_q4_0 block = v_cache_q4[layer_id_][head_id][block_idx]
-                                                 [l * config_.block_len / 32 +
-                                                  pos_in_block / 32];
-                    dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                    block_fp32[pos_in_block % 32] = GGML_FP16_TO_FP32(
-                        v_data_[batch_id * (q_len * config_.kv_head_num *
-                                            config_.head_dim) +
-                                head_id * config_.head_dim + l]);
-                    quantize_row_q4_0(block_fp32.data(), &block, 32);
-                    v_cache_q4[layer_id_][head_id][block_idx]
-                              [l * config_.block_len / 32 + pos_in_block / 32] =
-                                  block;
-                }
-            } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                std::vector<float> block_fp32(32);
-                // fill k_cache_
-                for (int l = 0; l < config_.head_dim / 32; l++) {
-                    block_q8_0 block;
-                    for (int m = 0; m < 32; m++) {
-
-                        block_fp32[m] = GGML_FP16_TO_FP32(
-                            k_data_[batch_id * (q_len * config_.kv_head_num *
-                                                config_.head_dim) +
-                                    head_id * config_.head_dim + l * 32 + m]);
-                    }
-                    quantize_row_q8_0(block_fp32.data(), &block, 32);
-
-                    k_cache_q8[layer_id_][head_id][block_idx]
-                              [pos_in_block * config_.head_dim / 32 + l] =
-                                  block;
-                }
-
-                // fill v_cache_
-                for (int l = 0; l < config_.head_dim; l++) {
-                    block_q8_0 block = v_cache_q8[layer_id_][head_id][block_idx]
-                                                 [l * config_.block_len / 32 +
-                                                  pos_in_block / 32];
-                    dequantize_row_q8_0(&block, block_fp32.data(), 32);
-                    block_fp32[pos_in_block % 32] = GGML_FP16_TO_FP32(
-                        v_data_[batch_id * (q_len * config_.kv_head_num *
-                                            config_.head_dim) +
-                                head_id * config_.head_dim + l]);
-                    quantize_row_q8_0(block_fp32.data(), &block, 32);
-                    v_cache_q8[layer_id_][head_id][block_idx]
-                              [l * config_.block_len / 32 + pos_in_block / 32] =
-                                  block;
+            cow_block_(block_idx);
+
+            for (int l = 0; l < config_.head_dim; l++) {
+                k_cache_fp16_[layer_id_][head_id][block_idx]
+                             [pos_in_block * config_.head_dim + l] =
+                                 k_data_[batch_id * (q_len *
+                                                     config_.kv_head_num *
+                                                     config_.head_dim) +
+                                         q_offset * config_.kv_head_num *
+                                             config_.head_dim +
+                                         head_id * config_.head_dim + l];
+                if (config_.mla_latent_dim > 0) {
+                    // MLA: V is the latent part of K.
+                    continue;
                 }
+                v_cache_fp16_[layer_id_][head_id][block_idx]
+                             [l * config_.block_len + pos_in_block] =
+                                 v_data_[batch_id * (q_len *
+                                                     config_.kv_head_num *
+                                                     config_.head_dim) +
+                                         q_offset * config_.kv_head_num *
+                                             config_.head_dim +
+                                         head_id * config_.head_dim + l];
             }
         },
         nullptr);
@@ -935,6 +716,7 @@ void KVCache::update_kvcache_fp16(const ggml_fp16_t *k_in,
 
 void KVCache::get_all_kvcache_one_layer(int layer_id, ggml_fp16_t *k_in,
                                         ggml_fp16_t *v_in, Backend *backend) {
+    assert(config_.mla_latent_dim == 0);
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
@@ -948,66 +730,24 @@ void KVCache::get_all_kvcache_one_layer(int layer_id, ggml_fp16_t *k_in,
     backend->do_work_stealing_job(
         config_.kv_head_num * past_block_num_[layer_id] * 2, nullptr,
         [&](int task_id) {
-            std::vector<float> block_fp32(32);
             int head_id = task_id / 2 / past_block_num_[layer_id];
             int block_idx = task_id / 2 % past_block_num_[layer_id];
             if (block_idx >= block_num_)
                 return;
 
-            int max_offset = 0;
-            if (task_id & 1) {
-                // get k_cache_
-                for (int k = 0; k < config_.block_len; k++) {
-                    if (block_idx * seq_len_ + k >= cache_total_len_)
-                        break;
-                    for (int l = 0; l < config_.head_dim / 32; l++) {
-                        block_q4_0 block =
-                            k_cache_q4[layer_id_][head_id][block_idx]
-                                      [k * config_.head_dim / 32 + l];
-                        dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                        for (int m = 0; m < 32; m++) {
-
-                            k_data_[(head_id * cache_total_len_ +
-                                     block_idx * config_.block_len + k) *
-                                        config_.head_dim +
-                                    l * 32 + m] =
-                                GGML_FP32_TO_FP16(block_fp32[m]);
-                            max_offset = std::max(
-                                max_offset,
-                                (int)(head_id * cache_total_len_ +
-                                      block_idx * config_.block_len + k) *
-                                        config_.head_dim +
-                                    l * 32 + m);
-                        }
-                    }
-                }
-            } else {
-                // get v_cache_
-                for (int k = 0; k < config_.block_len / 32; k++) {
-                    for (int l = 0; l < config_.head_dim; l++) {
-                        block_q4_0 block =
-                            v_cache_q4[layer_id_][head_id][block_idx]
-                                      [l * config_.block_len / 32 + k];
-                        dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                        for (int m = 0; m < 32; m++) {
-
-                            if (block_idx * seq_len_ + k * 32 + m >=
-                                cache_total_len_)
-                                break;
-                            v_data_[(head_id * cache_total_len_ +
-                                     block_idx * config_.block_len + k * 32 +
-                                     m) *
-                                        config_.head_dim +
-                                    l] = GGML_FP32_TO_FP16(block_fp32[m]);
-                            max_offset =
-                                std::max(max_offset,
-                                         (int)((head_id * cache_total_len_ +
-                                                block_idx * config_.block_len +
-                                                k * 32 + m) *
-                                                   config_.head_dim +
-                                               l));
-                        }
-                    }
+            std::vector<float> token_fp32(config_.head_dim);
+            uint16_t *out = (task_id & 1 ? k_data_ : v_data_) +
+                            (head_id * cache_total_len_ +
+                             block_idx * config_.block_len) *
+                                config_.head_dim;
+            for (int k = 0; k < config_.block_len; k++) {
+                if (block_idx * seq_len_ + k >= cache_total_len_)
+                    break;
+                dequant_kv_token_(task_id & 1, layer_id_, head_id, block_idx,
+                                  k, token_fp32.data());
+                for (int l = 0; l < config_.head_dim; l++) {
+                    out[k * config_.head_dim + l] =
+                        GGML_FP32_TO_FP16(token_fp32[l]);
                 }
             }
         },
@@ -12,6 +12,12 @@
 
 #include <chrono>
 
+#ifdef USE_NUMA
+#include <numa.h>
+#include <numaif.h>
+#include <unistd.h>
+#endif
+
 std::string ggml_type_to_string(ggml_type type) {
     switch (type) {
     case GGML_TYPE_F32:
@@ -57,44 +63,73 @@ KVCacheConfig::KVCacheConfig(int layer_num, int kv_head_num, int q_head_num,
                              RetrievalType retrieval_type, int layer_step,
                              int token_step, int layer_offset,
                              int max_block_num, int max_batch_size,
-                             int max_thread_num)
+                             int max_thread_num, int k_quant_type,
+                             int v_quant_type, int sink_block_num,
+                             int window_block_num, int mla_latent_dim,
+                             float rope_theta)
     : layer_num(layer_num), kv_head_num(kv_head_num), q_head_num(q_head_num),
       head_dim(head_dim), block_len(block_len), anchor_num(anchor_num),
-      anchor_type(anchor_type), kv_type(kv_type),
-      retrieval_type(retrieval_type), layer_step(layer_step),
-      token_step(token_step), layer_offset(layer_offset),
-      max_block_num(max_block_num), max_batch_size(max_batch_size),
-      max_thread_num(max_thread_num) {
+      anchor_type(anchor_type), kv_type(kv_type), k_quant_type(k_quant_type),
+      v_quant_type(v_quant_type), sink_block_num(sink_block_num),
+      window_block_num(window_block_num), mla_latent_dim(mla_latent_dim),
+      rope_theta(rope_theta), retrieval_type(retrieval_type),
+      layer_step(layer_step), token_step(token_step),
+      layer_offset(layer_offset), max_block_num(max_block_num),
+      max_batch_size(max_batch_size), max_thread_num(max_thread_num) {
     printf(
         "layer_num: %d, kv_head_num: %d, q_head_num: %d, head_dim: %d, "
         "block_len: %d, anchor_num: %d, anchor_type: %s, kv_type: %s, "
         "retrieval_type: %s, layer_step: %d, token_step: %d, layer_offset: %d,"
-        "max_block_num: %d, max_batch_size: %d, max_thread_num: %d\n",
+        "max_block_num: %d, max_batch_size: %d, max_thread_num: %d, "
+        "k_quant_type: %d, v_quant_type: %d, sink_block_num: %d, "
+        "window_block_num: %d, mla_latent_dim: %d, rope_theta: %f\n",
         layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
         AnchorTypeToString(anchor_type).c_str(),
         ggml_type_to_string(kv_type).c_str(),
         RetrievalTypeToString(retrieval_type).c_str(), layer_step, token_step,
-        layer_offset, max_block_num, max_batch_size, max_thread_num);
+        layer_offset, max_block_num, max_batch_size, max_thread_num,
+        k_quant_type, v_quant_type, sink_block_num, window_block_num,
+        mla_latent_dim, rope_theta);
     assert(q_head_num % kv_head_num == 0);
+    assert(k_quant_type == 0 || k_quant_type == 1);
+    assert(v_quant_type == 0 || v_quant_type == 1);
+    assert(head_dim % 32 == 0 && block_len % 32 == 0);
+    // window mode reuses the shared (LAYER) attention path
+    assert(window_block_num == 0 || retrieval_type == RetrievalType::LAYER);
+    assert(window_block_num == 0 ||
+           sink_block_num + window_block_num <= max_block_num);
+    // MLA keeps one shared latent head in fp16 and attends through LAYER.
+    assert(mla_latent_dim == 0 ||
+           (kv_head_num == 1 && mla_latent_dim < head_dim &&
+            kv_type == GGML_TYPE_F16 &&
+            retrieval_type == RetrievalType::LAYER));
+    // sinks are only re-rotated in window mode, on full rotary heads
+    assert(rope_theta == 0 || (window_block_num > 0 && mla_latent_dim == 0));
 }
 KVCache::KVCache(KVCacheConfig config) {
     this->config_ = config;
 
     n_gqa_ = config_.q_head_num / config_.kv_head_num;
+#ifdef USE_NUMA
+    numa_nodes_ = numa_num_configured_nodes();
+#endif
+    // QHeadTile::head_mask holds one bit per query head of a group
+    assert(config_.retrieval_type != RetrievalType::QHEAD || n_gqa_ <= 64);
+    // Selection history is kept for every kv_type.
+    selected_blocks_num_history_.resize(config_.layer_num / config_.layer_step);
+    if (config_.retrieval_type == RetrievalType::LAYER) {
+        selected_blocks_history_.resize(config_.layer_num / config_.layer_step);
+    } else if (config_.retrieval_type == RetrievalType::KVHEAD) {
+        selected_blocks_history_kvhead_.resize(config_.layer_num /
+                                               config_.layer_step);
+    } else if (config_.retrieval_type == RetrievalType::QHEAD) {
+        selected_blocks_history_qhead_.resize(config_.layer_num /
+                                              config_.layer_step);
+    }
     if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
         // TODO: Elegant implement
         k_cache_fp16_.resize(config_.layer_num);
         v_cache_fp16_.resize(config_.layer_num);
-        selected_blocks_num_history_.resize(config_.layer_num /
-                                            config_.layer_step);
-        if (config_.retrieval_type == RetrievalType::LAYER) {
-            selected_blocks_history_.resize(config_.layer_num /
-                                            config_.layer_step);
-        } else if (config_.retrieval_type == RetrievalType::KVHEAD) {
-            selected_blocks_history_kvhead_.resize(config_.layer_num /
-                                                   config_.layer_step);
-        } else if (config_.retrieval_type == RetrievalType::QHEAD) {
-        }
     } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
         k_cache_q4.resize(config.layer_num);
         v_cache_q4.resize(config.layer_num);
@@ -104,8 +139,13 @@ KVCache::KVCache(KVCacheConfig config) {
     } else {
         assert(false);
     }
-    anchor_.resize(config.layer_num * config.max_block_num * config.anchor_num *
-                   config.q_head_num * config.head_dim);
+    // MLA caches have no anchors (or importance), they would be larger than
+    // the latent cache itself.
+    if (config_.mla_latent_dim == 0) {
+        anchor_.resize(config.layer_num * config.max_block_num *
+                       config.anchor_num * config.q_head_num *
+                       config.head_dim);
+    }
     importance_.resize(config.layer_num);
     past_block_num_.resize(config.layer_num);
     for (int i = 0; i < config.layer_num; i++) {
@@ -128,6 +168,9 @@ void KVCache::ThreadResize(int thread_num) {
     thread_local_draft_.resize(thread_num);
     thread_cur_head_idx_.resize(thread_num);
     thread_local_attn_mask_.resize(thread_num);
+    thread_local_chunk_output_fp32_.resize(thread_num);
+    thread_local_chunk_attn_lse_.resize(thread_num);
+    thread_local_chunk_q_q8_0_.resize(thread_num);
     for (int i = 0; i < thread_num; i++) {
         thread_local_output_q8_0_[i].resize(n_gqa_ * config_.head_dim / QK8_0);
         thread_local_attn_score_[i].resize(n_gqa_ * config_.block_len);
@@ -140,6 +183,11 @@ void KVCache::ThreadResize(int thread_num) {
             2 * config_.block_len * config_.head_dim +
             config_.block_len * config_.head_dim / QK4_0);
         thread_local_attn_mask_[i].resize(config_.block_len / 8);
+        thread_local_chunk_output_fp32_[i].resize(CHUNK_SIZE * n_gqa_ *
+                                                  config_.head_dim);
+        thread_local_chunk_attn_lse_[i].resize(CHUNK_SIZE * n_gqa_);
+        thread_local_chunk_q_q8_0_[i].resize(CHUNK_SIZE * n_gqa_ *
+                                             config_.head_dim / QK8_0);
     }
 }
 void KVCache::BatchResize(int batch_size) {
@@ -168,8 +216,23 @@ void KVCache::BatchResize(int batch_size) {
     } else if (config_.retrieval_type == RetrievalType::QHEAD) {
         block_table_before_retrieval_qhead_.resize(batch_size);
         block_table_after_retrieval_qhead_.resize(batch_size);
+        for (int i = 0; i < config_.layer_num / config_.layer_step; i++) {
+            selected_blocks_history_qhead_[i].resize(batch_size);
+        }
     }
     cache_seqlens_.resize(batch_size);
+    if (config_.rope_theta > 0) {
+        sink_rope_shift_.resize(batch_size);
+        q_sink_fp16_.resize(batch_size);
+        q_sink_q8_0_.resize(batch_size);
+        for (int i = 0; i < batch_size; i++) {
+            q_sink_fp16_[i].resize(config_.q_head_num * config_.head_dim);
+            q_sink_q8_0_[i].resize(config_.kv_head_num);
+            for (int j = 0; j < config_.kv_head_num; j++) {
+                q_sink_q8_0_[i][j].resize(n_gqa_ * config_.head_dim / QK8_0);
+            }
+        }
+    }
     if (config_.retrieval_type == RetrievalType::LAYER) {
         block_similar_.resize(batch_size);
     } else if (config_.retrieval_type == RetrievalType::KVHEAD) {
@@ -206,6 +269,7 @@ void KVCache::BatchResize(int batch_size) {
 }
 
 void KVCache::BlockResize(int max_block_num) {
+    join_snapshot_();
     sin_.resize(max_block_num * config_.block_len);
     cos_.resize(max_block_num * config_.block_len);
     for (int i = 0; i < max_block_num * config_.block_len; i++) {
@@ -224,6 +288,11 @@ void KVCache::BlockResize(int max_block_num) {
                         config_.kv_head_num);
                 }
             } else if (config_.retrieval_type == RetrievalType::QHEAD) {
+                selected_blocks_history_qhead_[i][j].resize(max_block_num);
+                for (int k = 0; k < max_block_num; k++) {
+                    selected_blocks_history_qhead_[i][j][k].resize(
+                        config_.q_head_num);
+                }
             }
         }
     }
@@ -243,8 +312,11 @@ void KVCache::BlockResize(int max_block_num) {
                 for (int j = 0; j < max_block_num; j++) {
                     k_cache_fp16_[layer_id][i][j].resize(config_.block_len *
                                                          config_.head_dim);
-                    v_cache_fp16_[layer_id][i][j].resize(config_.block_len *
-                                                         config_.head_dim);
+                    // MLA values are read from the latent part of K
+                    if (config_.mla_latent_dim == 0) {
+                        v_cache_fp16_[layer_id][i][j].resize(
+                            config_.block_len * config_.head_dim);
+                    }
                 }
             }
 
@@ -313,18 +385,462 @@ void KVCache::BlockResize(int max_block_num) {
             }
         }
 
-        for (int i = 0; i < max_block_num; i++) {
+        for (int i = 0; i < max_block_num && config_.mla_latent_dim == 0;
+             i++) {
             importance_[layer_id][i].resize(config_.block_len);
             for (int j = 0; j < config_.block_len; j++) {
                 importance_[layer_id][i][j].resize(config_.q_head_num);
             }
         }
     }
+    bind_kvcache_numa_(0, max_block_num);
+}
+
+void KVCache::bind_kvcache_numa_(int begin_block, int end_block) {
+#ifdef USE_NUMA
+    if (numa_nodes_ <= 1) {
+        return;
+    }
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    // Only whole pages inside a block can be moved; the partial pages at
+    // its ends may be shared with a neighbouring allocation.
+    auto bind = [&](void *data, size_t bytes, int node) {
+        uintptr_t begin = ((uintptr_t)data + page_size - 1) / page_size *
+                          page_size;
+        uintptr_t end = ((uintptr_t)data + bytes) / page_size * page_size;
+        if (end <= begin) {
+            return;
+        }
+        unsigned long nodemask = 1UL << node;
+        if (mbind((void *)begin, end - begin, MPOL_BIND, &nodemask,
+                  sizeof(nodemask) * 8, MPOL_MF_MOVE)) {
+            perror("mbind failed");
+        }
+    };
+    auto bind_block = [&](auto &block, int node) {
+        if (!block.empty()) {
+            bind(block.data(), block.size() * sizeof(block[0]), node);
+        }
+    };
+    for (int layer_id = 0; layer_id < config_.layer_num; layer_id++) {
+        for (int head_id = 0; head_id < config_.kv_head_num; head_id++) {
+            for (int block_idx = begin_block; block_idx < end_block;
+                 block_idx++) {
+                int node = kv_numa_node_(head_id, block_idx);
+                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                    bind_block(k_cache_fp16_[layer_id][head_id][block_idx],
+                               node);
+                    bind_block(v_cache_fp16_[layer_id][head_id][block_idx],
+                               node);
+                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
+                    bind_block(k_cache_q4[layer_id][head_id][block_idx], node);
+                    bind_block(v_cache_q4[layer_id][head_id][block_idx], node);
+                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
+                    bind_block(k_cache_q8[layer_id][head_id][block_idx], node);
+                    bind_block(v_cache_q8[layer_id][head_id][block_idx], node);
+                }
+            }
+        }
+    }
+#endif
+}
+
+void KVCache::do_kv_numa_job_(Backend *backend, int task_num,
+                              std::function<int(int)> task_node,
+                              std::function<void(int)> init_func,
+                              std::function<void(int)> compute_func,
+                              std::function<void(int)> finalize_func) {
+#ifdef USE_NUMA
+    if (numa_nodes_ > 1) {
+        // The numa aware job numbers the tasks of each node from 0.
+        std::vector<std::vector<int>> node_tasks(numa_nodes_);
+        for (int task_id = 0; task_id < task_num; task_id++) {
+            node_tasks[task_node(task_id)].push_back(task_id);
+        }
+        std::vector<int> task_splits(numa_nodes_);
+        for (int node = 0; node < numa_nodes_; node++) {
+            task_splits[node] = node_tasks[node].size();
+        }
+        backend->do_work_stealing_job_numa_aware(
+            task_num, task_splits, init_func,
+            [&](int task_id) {
+                compute_func(node_tasks[Backend::numa_node][task_id]);
+            },
+            finalize_func);
+        return;
+    }
+#endif
+    backend->do_work_stealing_job(task_num, init_func, compute_func,
+                                  finalize_func);
+}
+
+void KVCache::truncate(int *block_table, int *cache_seqlens, int batch_id,
+                       int max_block_num, int new_len, Backend *backend) {
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
+
+    int old_len = block_table == nullptr ? cache_total_len_
+                                         : cache_seqlens[batch_id];
+    assert(new_len >= 0 && new_len <= old_len);
+    // Recycled window slots cannot be rolled back past the window.
+    assert(config_.window_block_num == 0 ||
+           old_len - new_len <= config_.window_block_num * config_.block_len);
+    if (new_len == old_len) {
+        return;
+    }
+    auto physical_block = [&](int block_id) {
+        return block_table == nullptr
+                   ? block_id
+                   : block_table[batch_id * max_block_num +
+                                 block_slot_(block_id)];
+    };
+    int first_block = new_len / config_.block_len;
+    int block_num = (old_len + config_.block_len - 1) / config_.block_len -
+                    first_block;
+    size_t anchor_layer_stride = (size_t)config_.max_block_num *
+                                 config_.anchor_num * config_.q_head_num *
+                                 config_.head_dim;
+    size_t anchor_block_stride =
+        (size_t)config_.anchor_num * config_.q_head_num * config_.head_dim;
+
+    for (int block_id = first_block; block_id < first_block + block_num;
+         block_id++) {
+        cow_block_(physical_block(block_id));
+    }
+    // Each task rolls back one block of a kv head in one layer, together
+    // with the importance and anchors of the query heads of that group.
+    backend->do_work_stealing_job(
+        config_.layer_num * block_num * config_.kv_head_num, nullptr,
+        [&](int task_id) {
+            int layer_id = task_id / (block_num * config_.kv_head_num);
+            int block_id =
+                first_block + task_id / config_.kv_head_num % block_num;
+            int head_id = task_id % config_.kv_head_num;
+            int block_idx = physical_block(block_id);
+            int begin =
+                block_id == first_block ? new_len % config_.block_len : 0;
+
+            zero_kv_tokens_(layer_id, head_id, block_idx, begin);
+            if (config_.mla_latent_dim > 0) {
+                return;
+            }
+            for (int l = begin; l < config_.block_len; l++) {
+                for (int i = 0; i < n_gqa_; i++) {
+                    importance_[layer_id][block_idx][l][head_id * n_gqa_ + i] =
+                        0;
+                }
+            }
+            if (begin == 0) {
+                for (int anchor_id = 0; anchor_id < config_.anchor_num;
+                     anchor_id++) {
+                    ggml_fp16_t *anchor =
+                        anchor_.data() + layer_id * anchor_layer_stride +
+                        block_idx * anchor_block_stride +
+                        (anchor_id * config_.q_head_num + head_id * n_gqa_) *
+                            config_.head_dim;
+                    std::fill(anchor, anchor + n_gqa_ * config_.head_dim, 0);
+                }
+            }
+        },
+        nullptr);
+
+    if (new_len % config_.block_len != 0) {
+        // The new tail block lost tokens, recompute its anchors alone.
+        int tail_block_idx = physical_block(first_block);
+        int tail_seqlen = 0;
+        calc_anchor_all_layers(&tail_block_idx, &tail_seqlen, 1, 1, backend);
+    }
+
+    if (block_table == nullptr) {
+        cache_total_len_ = new_len;
+        uint64_t kept_block_num =
+            (new_len + config_.block_len - 1) / config_.block_len;
+        for (int i = 0; i < config_.layer_num; i++) {
+            past_block_num_[i] = std::min(past_block_num_[i], kept_block_num);
+        }
+    } else {
+        // cache_seqlens memory is modified.
+        cache_seqlens[batch_id] = new_len;
+    }
+
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> duration = end - start;
+    //    printf("time of truncate: %f s\n", duration.count());
+}
+
+void KVCache::evict(int *block_table, int *cache_seqlens, int batch_id,
+                    int max_block_num, int budget, int recent_len, bool merge,
+                    Backend *backend) {
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // MLA keeps no importance, and recycled window slots cannot be compacted.
+    assert(config_.mla_latent_dim == 0 && config_.window_block_num == 0);
+    assert(recent_len >= 0 && recent_len <= budget);
+    int old_len = block_table == nullptr ? cache_total_len_
+                                         : cache_seqlens[batch_id];
+    if (old_len <= budget) {
+        return;
+    }
+    auto physical_block = [&](int block_id) {
+        return block_table == nullptr
+                   ? block_id
+                   : block_table[batch_id * max_block_num + block_id];
+    };
+    int heavy_num = budget - recent_len;
+    int candidate_num = old_len - recent_len;
+    int kept_block_num = (budget + config_.block_len - 1) / config_.block_len;
+    size_t anchor_layer_stride = (size_t)config_.max_block_num *
+                                 config_.anchor_num * config_.q_head_num *
+                                 config_.head_dim;
+    size_t anchor_block_stride =
+        (size_t)config_.anchor_num * config_.q_head_num * config_.head_dim;
+    for (int block_id = 0; block_id * config_.block_len < old_len;
+         block_id++) {
+        cow_block_(physical_block(block_id));
+    }
+    // First token position each (layer, kv head) rewrote.
+    std::vector<int> first_moved(config_.layer_num * config_.kv_head_num);
+
+    // Each task compacts one kv head of one layer: the recent_len newest
+    // tokens and the heavy_num older tokens of largest accumulated
+    // importance (summed over the query heads of the group) are kept in
+    // order at [0, budget), the rest is evicted.
+    backend->do_work_stealing_job(
+        config_.layer_num * config_.kv_head_num, nullptr,
+        [&](int task_id) {
+            int layer_id = task_id / config_.kv_head_num;
+            int head_id = task_id % config_.kv_head_num;
+            auto importance_at = [&](int t) {
+                return importance_[layer_id][physical_block(
+                                       t / config_.block_len)]
+                                  [t % config_.block_len]
+                                      .data() +
+                       head_id * n_gqa_;
+            };
+
+            std::vector<float> score(candidate_num);
+            std::vector<int> kept(candidate_num);
+            for (int t = 0; t < candidate_num; t++) {
+                ggml_fp16_t *importance = importance_at(t);
+                score[t] = 0;
+                for (int i = 0; i < n_gqa_; i++) {
+                    score[t] += GGML_FP16_TO_FP32(importance[i]);
+                }
+                kept[t] = t;
+            }
+            std::nth_element(
+                kept.begin(), kept.begin() + heavy_num, kept.end(),
+                [&](int a, int b) { return score[a] > score[b]; });
+            kept.resize(heavy_num);
+            std::sort(kept.begin(), kept.end());
+            for (int t = candidate_num; t < old_len; t++) {
+                kept.push_back(t);
+            }
+            // Tokens before the first evicted one stay where they are.
+            int first = 0;
+            while (first < budget && kept[first] == first) {
+                first++;
+            }
+            first_moved[task_id] = first;
+
+            // Gather the moving tokens, kept[first, budget), in fp32.
+            int move_num = budget - first;
+            std::vector<float> k_buf((size_t)move_num * config_.head_dim);
+            std::vector<float> v_buf((size_t)move_num * config_.head_dim);
+            std::vector<float> imp_buf((size_t)move_num * n_gqa_);
+            auto read_token = [&](int t, float *k, float *v) {
+                int block_idx = physical_block(t / config_.block_len);
+                int pos = t % config_.block_len;
+                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                    // K [block_len, head_dim], V [head_dim, block_len]
+                    const ggml_fp16_t *k_block =
+                        k_cache_fp16_[layer_id][head_id][block_idx].data();
+                    const ggml_fp16_t *v_block =
+                        v_cache_fp16_[layer_id][head_id][block_idx].data();
+                    for (int c = 0; c < config_.head_dim; c++) {
+                        k[c] = GGML_FP16_TO_FP32(
+                            k_block[pos * config_.head_dim + c]);
+                        v[c] = GGML_FP16_TO_FP32(
+                            v_block[c * config_.block_len + pos]);
+                    }
+                } else {
+                    dequant_kv_token_(true, layer_id, head_id, block_idx, pos,
+                                      k);
+                    dequant_kv_token_(false, layer_id, head_id, block_idx,
+                                      pos, v);
+                }
+            };
+            for (int i = 0; i < move_num; i++) {
+                read_token(kept[first + i],
+                           k_buf.data() + i * config_.head_dim,
+                           v_buf.data() + i * config_.head_dim);
+                ggml_fp16_t *importance = importance_at(kept[first + i]);
+                for (int h = 0; h < n_gqa_; h++) {
+                    imp_buf[i * n_gqa_ + h] = GGML_FP16_TO_FP32(importance[h]);
+                }
+            }
+
+            if (merge) {
+                // Fold every evicted value into the next kept token,
+                // weighted by importance, and let the importance accumulate
+                // so the merged token keeps its rank. Post-RoPE keys are
+                // left alone, since averaging them blurs positions.
+                std::vector<float> v_evicted(config_.head_dim);
+                std::vector<float> k_unused(config_.head_dim);
+                int next = 0;
+                for (int t = first; t < candidate_num && move_num > 0; t++) {
+                    while (next < move_num && kept[first + next] < t) {
+                        next++;
+                    }
+                    if (next < move_num && kept[first + next] == t) {
+                        continue;
+                    }
+                    // Past the last kept token, fold into that one instead.
+                    int target = std::min(next, move_num - 1);
+                    float w_evicted = score[t];
+                    float w_kept = 0;
+                    for (int h = 0; h < n_gqa_; h++) {
+                        w_kept += imp_buf[target * n_gqa_ + h];
+                    }
+                    if (w_evicted + w_kept <= 0) {
+                        continue;
+                    }
+                    read_token(t, k_unused.data(), v_evicted.data());
+                    float *v = v_buf.data() + target * config_.head_dim;
+                    for (int c = 0; c < config_.head_dim; c++) {
+                        v[c] = (v[c] * w_kept + v_evicted[c] * w_evicted) /
+                               (w_kept + w_evicted);
+                    }
+                    ggml_fp16_t *importance = importance_at(t);
+                    for (int h = 0; h < n_gqa_; h++) {
+                        imp_buf[target * n_gqa_ + h] +=
+                            GGML_FP16_TO_FP32(importance[h]);
+                    }
+                }
+            }
+
+            // Write the moving tokens back block by block.
+            std::vector<ggml_fp16_t> k_fp16((size_t)config_.block_len *
+                                            config_.head_dim);
+            std::vector<ggml_fp16_t> v_fp16((size_t)config_.block_len *
+                                            config_.head_dim);
+            for (int block_id = first / config_.block_len;
+                 block_id < kept_block_num; block_id++) {
+                int block_idx = physical_block(block_id);
+                int block_begin = block_id * config_.block_len;
+                int begin = std::max(first, block_begin) - block_begin;
+                int end = std::min(budget, block_begin + config_.block_len) -
+                          block_begin;
+                for (int pos = begin; pos < end; pos++) {
+                    int i = block_begin + pos - first;
+                    for (int c = 0; c < config_.head_dim; c++) {
+                        k_fp16[(pos - begin) * config_.head_dim + c] =
+                            GGML_FP32_TO_FP16(
+                                k_buf[i * config_.head_dim + c]);
+                        v_fp16[(pos - begin) * config_.head_dim + c] =
+                            GGML_FP32_TO_FP16(
+                                v_buf[i * config_.head_dim + c]);
+                    }
+                    ggml_fp16_t *importance =
+                        importance_[layer_id][block_idx][pos].data() +
+                        head_id * n_gqa_;
+                    for (int h = 0; h < n_gqa_; h++) {
+                        importance[h] =
+                            GGML_FP32_TO_FP16(imp_buf[i * n_gqa_ + h]);
+                    }
+                }
+                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                    ggml_fp16_t *k_block =
+                        k_cache_fp16_[layer_id][head_id][block_idx].data();
+                    ggml_fp16_t *v_block =
+                        v_cache_fp16_[layer_id][head_id][block_idx].data();
+                    for (int pos = begin; pos < end; pos++) {
+                        for (int c = 0; c < config_.head_dim; c++) {
+                            k_block[pos * config_.head_dim + c] =
+                                k_fp16[(pos - begin) * config_.head_dim + c];
+                            v_block[c * config_.block_len + pos] =
+                                v_fp16[(pos - begin) * config_.head_dim + c];
+                        }
+                    }
+                } else {
+                    quant_kv_tokens_(true, layer_id, head_id, block_idx, begin,
+                                     end, k_fp16.data(), config_.head_dim);
+                    quant_kv_tokens_(false, layer_id, head_id, block_idx,
+                                     begin, end, v_fp16.data(),
+                                     config_.head_dim);
+                }
+            }
+
+            // Drop everything past the budget, as truncate does.
+            for (int block_id = budget / config_.block_len;
+                 block_id * config_.block_len < old_len; block_id++) {
+                int block_idx = physical_block(block_id);
+                int begin = std::max(budget - block_id * config_.block_len, 0);
+                zero_kv_tokens_(layer_id, head_id, block_idx, begin);
+                for (int pos = begin; pos < config_.block_len; pos++) {
+                    std::fill(importance_[layer_id][block_idx][pos].begin() +
+                                  head_id * n_gqa_,
+                              importance_[layer_id][block_idx][pos].begin() +
+                                  (head_id + 1) * n_gqa_,
+                              0);
+                }
+                if (begin != 0) {
+                    continue;
+                }
+                for (int anchor_id = 0; anchor_id < config_.anchor_num;
+                     anchor_id++) {
+                    ggml_fp16_t *anchor =
+                        anchor_.data() + layer_id * anchor_layer_stride +
+                        block_idx * anchor_block_stride +
+                        (anchor_id * config_.q_head_num + head_id * n_gqa_) *
+                            config_.head_dim;
+                    std::fill(anchor, anchor + n_gqa_ * config_.head_dim, 0);
+                }
+            }
+        },
+        nullptr);
+
+    // Only blocks from the first rewritten token on need new anchors.
+    int first_block =
+        *std::min_element(first_moved.begin(), first_moved.end()) /
+        config_.block_len;
+    if (first_block < kept_block_num) {
+        std::vector<int> changed_blocks;
+        for (int block_id = first_block; block_id < kept_block_num;
+             block_id++) {
+            changed_blocks.push_back(physical_block(block_id));
+        }
+        int changed_seqlen =
+            ((int)changed_blocks.size() - 1) * config_.block_len;
+        calc_anchor_all_layers(changed_blocks.data(), &changed_seqlen, 1,
+                               changed_blocks.size(), backend);
+    }
+
+    if (block_table == nullptr) {
+        cache_total_len_ = budget;
+        for (int i = 0; i < config_.layer_num; i++) {
+            past_block_num_[i] =
+                std::min(past_block_num_[i], (uint64_t)kept_block_num);
+        }
+    } else {
+        // cache_seqlens memory is modified.
+        cache_seqlens[batch_id] = budget;
+    }
+
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> duration = end - start;
+    //    printf("time of evict: %f s\n", duration.count());
 }
 
 void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                                      int batch_size, int max_block_num,
                                      Backend *backend) {
+    if (config_.mla_latent_dim > 0) {
+        return;
+    }
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
@@ -344,8 +860,9 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                 return;
             }
             int block_idx = block_table[batch_id * max_block_num + block_id];
+            cow_block_(block_idx);
 
-            std::vector<float> block_fp32(32);
+            std::vector<float> token_fp32(config_.head_dim);
             if (config_.anchor_type == AnchorType::DYNAMIC) {
 
                 // clear anchor_
@@ -440,12 +957,12 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
 
                         } else if (config_.kv_type ==
                                    ggml_type::GGML_TYPE_Q4_0) {
+                            dequant_kv_token_(true, layer_id, head_id / n_gqa_,
+                                              top_block_idx, top_indice,
+                                              token_fp32.data());
                             for (int l = 0; l < config_.head_dim / 32; l++) {
-                                block_q4_0 block = k_cache_q4
-                                    [layer_id][head_id / n_gqa_][top_block_idx]
-                                    [top_indice * config_.head_dim / 32 + l];
-                                dequantize_row_q4_0(&block, block_fp32.data(),
-                                                    32);
+                                const float *block_fp32 =
+                                    token_fp32.data() + l * 32;
                                 for (int m = 0; m < 32; m++) {
                                     anchor_[layer_id * config_.max_block_num *
                                                 config_.anchor_num *
@@ -480,12 +997,12 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                             }
                         } else if (config_.kv_type ==
                                    ggml_type::GGML_TYPE_Q8_0) {
+                            dequant_kv_token_(true, layer_id, head_id / n_gqa_,
+                                              top_block_idx, top_indice,
+                                              token_fp32.data());
                             for (int l = 0; l < config_.head_dim / 32; l++) {
-                                block_q8_0 block = k_cache_q8
-                                    [layer_id][head_id / n_gqa_][top_block_idx]
-                                    [top_indice * config_.head_dim / 32 + l];
-                                dequantize_row_q8_0(&block, block_fp32.data(),
-                                                    32);
+                                const float *block_fp32 =
+                                    token_fp32.data() + l * 32;
                                 for (int m = 0; m < 32; m++) {
                                     anchor_[layer_id * config_.max_block_num *
                                                 config_.anchor_num *
@@ -811,13 +1328,12 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                     for (int indice = 0; indice < seq_len_; indice++) {
                         for (int head_id = 0; head_id < config_.kv_head_num;
                              head_id++) {
+                            dequant_kv_token_(true, layer_id, head_id,
+                                              block_idx, indice,
+                                              token_fp32.data());
                             for (int l = 0; l < config_.head_dim / 32; l++) {
-                                block_q4_0 block =
-                                    k_cache_q4[layer_id][head_id][block_idx]
-                                              [indice * config_.head_dim / 32 +
-                                               l];
-                                dequantize_row_q4_0(&block, block_fp32.data(),
-                                                    32);
+                                const float *block_fp32 =
+                                    token_fp32.data() + l * 32;
 
                                 for (int m = 0; m < 32; m++) {
                                     for (int gqa_idx = 0; gqa_idx < n_gqa_;
@@ -907,13 +1423,12 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                     for (int indice = 0; indice < seq_len_; indice++) {
                         for (int head_id = 0; head_id < config_.kv_head_num;
                              head_id++) {
+                            dequant_kv_token_(true, layer_id, head_id,
+                                              block_idx, indice,
+                                              token_fp32.data());
                             for (int l = 0; l < config_.head_dim / 32; l++) {
-                                block_q8_0 block =
-                                    k_cache_q8[layer_id][head_id][block_idx]
-                                              [indice * config_.head_dim / 32 +
-                                               l];
-                                dequantize_row_q8_0(&block, block_fp32.data(),
-                                                    32);
+                                const float *block_fp32 =
+                                    token_fp32.data() + l * 32;
 
                                 for (int m = 0; m < 32; m++) {
                                     for (int gqa_idx = 0; gqa_idx < n_gqa_;
@@ -1015,6 +1530,9 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
 void KVCache::clear_importance_all_layers(int *block_table, int *cache_seqlens,
                                           int batch_size, int max_block_num,
                                           Backend *backend) {
+    if (config_.mla_latent_dim > 0) {
+        return;
+    }
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
@@ -1034,6 +1552,7 @@ void KVCache::clear_importance_all_layers(int *block_table, int *cache_seqlens,
                 return;
             }
             int block_idx = block_table[batch_id * max_block_num + block_id];
+            cow_block_(block_idx);
 
             if (config_.anchor_type == AnchorType::DYNAMIC) {
 
@@ -1079,12 +1598,15 @@ void KVCache::clear_kvcache_all_layers(int *block_table, int *cache_seqlens,
                 return;
             }
             int block_idx = block_table[batch_id * max_block_num + block_id];
+            cow_block_(block_idx);
 
             if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-                for (int l = 0; l < config_.block_len * config_.head_dim; l++) {
-                    k_cache_fp16_[layer_id][head_id][block_idx][l] = 0;
-                    v_cache_fp16_[layer_id][head_id][block_idx][l] = 0;
-                }
+                std::fill(k_cache_fp16_[layer_id][head_id][block_idx].begin(),
+                          k_cache_fp16_[layer_id][head_id][block_idx].end(),
+                          0);
+                std::fill(v_cache_fp16_[layer_id][head_id][block_idx].begin(),
+                          v_cache_fp16_[layer_id][head_id][block_idx].end(),
+                          0);
             } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
                 for (int l = 0; l < config_.block_len * config_.head_dim / 32;
                      l++) {
@@ -1107,6 +1629,169 @@ void KVCache::clear_kvcache_all_layers(int *block_table, int *cache_seqlens,
     //    printf("time of clear_kvcache_all_layers: %f s\n", duration.count());
 }
 
+namespace {
+
+inline float block_at(const block_q4_0 &block, int j) {
+    int q = j < QK4_0 / 2 ? (block.qs[j] & 0x0F)
+                          : (block.qs[j - QK4_0 / 2] >> 4);
+    return (q - 8) * GGML_FP16_TO_FP32(block.d);
+}
+inline float block_at(const block_q8_0 &block, int j) {
+    return block.qs[j] * GGML_FP16_TO_FP32(block.d);
+}
+inline void dequant_block(const block_q4_0 &block, float *out) {
+    dequantize_row_q4_0(&block, out, QK4_0);
+}
+inline void dequant_block(const block_q8_0 &block, float *out) {
+    dequantize_row_q8_0(&block, out, QK8_0);
+}
+inline void quant_block(const float *in, block_q4_0 &block) {
+    quantize_row_q4_0(in, &block, QK4_0);
+}
+inline void quant_block(const float *in, block_q8_0 &block) {
+    quantize_row_q8_0(in, &block, QK8_0);
+}
+
+// per_token blocks:   [block_len, head_dim / 32], one block per 32 channels
+// per_channel blocks: [head_dim, block_len / 32], one block per 32 tokens
+template <typename block_t>
+void dequant_token(const std::vector<block_t> &blocks, bool per_channel,
+                   int block_len, int head_dim, int pos, float *out) {
+    if (!per_channel) {
+        for (int l = 0; l < head_dim / 32; l++) {
+            dequant_block(blocks[pos * head_dim / 32 + l], out + l * 32);
+        }
+    } else {
+        for (int c = 0; c < head_dim; c++) {
+            out[c] =
+                block_at(blocks[c * block_len / 32 + pos / 32], pos % 32);
+        }
+    }
+}
+
+template <typename block_t>
+void quant_tokens(std::vector<block_t> &blocks, bool per_channel,
+                  int block_len, int head_dim, int begin, int end,
+                  const ggml_fp16_t *in, int stride) {
+    float group[32];
+    if (!per_channel) {
+        for (int t = begin; t < end; t++) {
+            for (int l = 0; l < head_dim / 32; l++) {
+                for (int m = 0; m < 32; m++) {
+                    group[m] = GGML_FP16_TO_FP32(
+                        in[(t - begin) * stride + l * 32 + m]);
+                }
+                quant_block(group, blocks[t * head_dim / 32 + l]);
+            }
+        }
+    } else {
+        for (int g = begin / 32; g * 32 < end; g++) {
+            for (int c = 0; c < head_dim; c++) {
+                block_t &block = blocks[c * block_len / 32 + g];
+                dequant_block(block, group);
+                for (int m = 0; m < 32; m++) {
+                    int t = g * 32 + m;
+                    if (t >= end) {
+                        group[m] = 0;
+                    } else if (t >= begin) {
+                        group[m] =
+                            GGML_FP16_TO_FP32(in[(t - begin) * stride + c]);
+                    }
+                }
+                quant_block(group, block);
+            }
+        }
+    }
+}
+
+template <typename block_t>
+void zero_tokens(std::vector<block_t> &blocks, bool per_channel,
+                 int block_len, int head_dim, int begin) {
+    int first = begin;
+    if (per_channel && begin % 32 != 0) {
+        // the group straddling `begin` keeps its leading tokens
+        quant_tokens(blocks, true, block_len, head_dim, begin, begin,
+                     (const ggml_fp16_t *)nullptr, 0);
+        first = (begin / 32 + 1) * 32;
+    }
+    for (int t = first; t < block_len; t += per_channel ? 32 : 1) {
+        for (int l = 0; l < (per_channel ? head_dim : head_dim / 32); l++) {
+            block_t &block = per_channel ? blocks[l * block_len / 32 + t / 32]
+                                         : blocks[t * head_dim / 32 + l];
+            std::memset(&block, 0, sizeof(block_t));
+        }
+    }
+}
+
+} // namespace
+
+void KVCache::dequant_kv_token_(bool is_k, int layer_id, int head_id,
+                                int block_idx, int pos, float *out) {
+    bool per_channel =
+        (is_k ? config_.k_quant_type : config_.v_quant_type) == 1;
+    if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
+        dequant_token((is_k ? k_cache_q4 : v_cache_q4)[layer_id][head_id]
+                                                      [block_idx],
+                      per_channel, config_.block_len, config_.head_dim, pos,
+                      out);
+    } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
+        dequant_token((is_k ? k_cache_q8 : v_cache_q8)[layer_id][head_id]
+                                                      [block_idx],
+                      per_channel, config_.block_len, config_.head_dim, pos,
+                      out);
+    } else {
+        assert(false);
+    }
+}
+
+void KVCache::quant_kv_tokens_(bool is_k, int layer_id, int head_id,
+                               int block_idx, int begin, int end,
+                               const ggml_fp16_t *in, int stride) {
+    bool per_channel =
+        (is_k ? config_.k_quant_type : config_.v_quant_type) == 1;
+    if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
+        quant_tokens((is_k ? k_cache_q4 : v_cache_q4)[layer_id][head_id]
+                                                     [block_idx],
+                     per_channel, config_.block_len, config_.head_dim, begin,
+                     end, in, stride);
+    } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
+        quant_tokens((is_k ? k_cache_q8 : v_cache_q8)[layer_id][head_id]
+                                                     [block_idx],
+                     per_channel, config_.block_len, config_.head_dim, begin,
+                     end, in, stride);
+    } else {
+        assert(false);
+    }
+}
+
+void KVCache::zero_kv_tokens_(int layer_id, int head_id, int block_idx,
+                              int begin) {
+    bool k_per_channel = config_.k_quant_type == 1;
+    bool v_per_channel = config_.v_quant_type == 1;
+    if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+        // K [block_len, head_dim], V [head_dim, block_len]
+        auto &k = k_cache_fp16_[layer_id][head_id][block_idx];
+        auto &v = v_cache_fp16_[layer_id][head_id][block_idx];
+        std::fill(k.begin() + begin * config_.head_dim, k.end(), 0);
+        for (int c = 0; c < config_.head_dim && !v.empty(); c++) {
+            std::fill(v.begin() + c * config_.block_len + begin,
+                      v.begin() + (c + 1) * config_.block_len, 0);
+        }
+    } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
+        zero_tokens(k_cache_q4[layer_id][head_id][block_idx], k_per_channel,
+                    config_.block_len, config_.head_dim, begin);
+        zero_tokens(v_cache_q4[layer_id][head_id][block_idx], v_per_channel,
+                    config_.block_len, config_.head_dim, begin);
+    } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
+        zero_tokens(k_cache_q8[layer_id][head_id][block_idx], k_per_channel,
+                    config_.block_len, config_.head_dim, begin);
+        zero_tokens(v_cache_q8[layer_id][head_id][block_idx], v_per_channel,
+                    config_.block_len, config_.head_dim, begin);
+    } else {
+        assert(false);
+    }
+}
+
 void KVCache::get_sincos(ggml_fp16_t *sin, ggml_fp16_t *cos, int seqlen) {
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
@@ -0,0 +1,252 @@
+/**
+ * @Description  : File-backed MoE expert weights with a DRAM LRU cache
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#include "expert_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <stdexcept>
+
+
+ExpertStore::ExpertStore(ExpertStoreConfig config) : config_(config) {
+    if (config_.cache_experts <= 0 || config_.layer_num <= 0 || config_.expert_num <= 0) {
+        throw std::invalid_argument("ExpertStore: cache_experts, layer_num and expert_num must be positive");
+    }
+    if ((int)config_.gate_offsets.size() != config_.layer_num || (int)config_.up_offsets.size() != config_.layer_num ||
+        (int)config_.down_offsets.size() != config_.layer_num) {
+        throw std::invalid_argument("ExpertStore: gate, up and down offsets must have layer_num entries");
+    }
+    if (config_.gate_bytes == 0 || config_.up_bytes == 0 || config_.down_bytes == 0) {
+        throw std::invalid_argument("ExpertStore: gate, up and down bytes must be positive");
+    }
+    int flags = O_RDONLY;
+    if (config_.direct_io) {
+        flags |= O_DIRECT;
+    }
+    fd_ = open(config_.path.c_str(), flags);
+    if (fd_ < 0 && config_.direct_io) {
+        // tmpfs and some network filesystems refuse O_DIRECT
+        printf("ExpertStore: O_DIRECT open of %s failed, using buffered reads\n", config_.path.c_str());
+        config_.direct_io = false;
+        fd_ = open(config_.path.c_str(), O_RDONLY);
+    }
+    if (fd_ < 0) {
+        throw std::runtime_error("ExpertStore: cannot open " + config_.path + ": " + strerror(errno));
+    }
+
+    // An unaligned part needs at most one extra block in front of it.
+    uint64_t max_bytes = std::max({config_.gate_bytes, config_.up_bytes, config_.down_bytes});
+    part_capacity_ = (max_bytes + alignment_ - 1) / alignment_ * alignment_ + alignment_;
+    slots_ = std::vector<Slot>(config_.cache_experts);
+    for (auto& slot : slots_) {
+        slot.buffer = (uint8_t*)aligned_alloc(alignment_, 3 * part_capacity_);
+        if (!slot.buffer) {
+            for (auto& allocated : slots_) {
+                free(allocated.buffer);
+            }
+            close(fd_);
+            throw std::runtime_error("ExpertStore: failed to allocate " + std::to_string(config_.cache_experts) + " cache slots");
+        }
+    }
+    last_routed_.resize(config_.layer_num);
+
+    for (int i = 0; i < std::max(config_.io_thread_num, 1); i++) {
+        io_workers_.emplace_back(&ExpertStore::io_worker_, this);
+    }
+}
+
+ExpertStore::~ExpertStore() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        exit_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : io_workers_) {
+        worker.join();
+    }
+    for (auto& slot : slots_) {
+        free(slot.buffer);
+    }
+    close(fd_);
+}
+
+// Called with mutex_ held. Returns the slot of (layer, expert), queueing a
+// load into the least recently used free slot if it is not cached, or -1
+// when nothing can be evicted and pin is false.
+int ExpertStore::lookup_or_load_(int layer, uint64_t expert, bool pin) {
+    uint64_t key = (uint64_t)layer * config_.expert_num + expert;
+    auto it = slot_of_.find(key);
+    if (it != slot_of_.end()) {
+        Slot& slot = slots_[it->second];
+        slot.last_use = ++tick_;
+        if (pin) {
+            slot.pins++;
+            int state = slot.state.load(std::memory_order_relaxed);
+            if (state == READY) {
+                hits_++;
+            } else {
+                misses_++;
+            }
+            if (state == FAILED) {
+                slot.state.store(LOADING, std::memory_order_relaxed);
+                load_queue_.push_back(it->second);
+                cv_.notify_one();
+            }
+        }
+        return it->second;
+    }
+
+    int victim = -1;
+    for (int i = 0; i < (int)slots_.size(); i++) {
+        if (slots_[i].pins > 0 || slots_[i].state.load(std::memory_order_relaxed) == LOADING) {
+            continue;
+        }
+        if (victim < 0 || slots_[i].last_use < slots_[victim].last_use) {
+            victim = i;
+        }
+    }
+    if (victim < 0) {
+        if (pin) {
+            throw std::runtime_error("ExpertStore: all " + std::to_string(config_.cache_experts) + " cache slots are pinned, cache_experts must be at least routed_expert_num");
+        }
+        return -1;
+    }
+    Slot& slot = slots_[victim];
+    if (slot.layer >= 0) {
+        slot_of_.erase((uint64_t)slot.layer * config_.expert_num + slot.expert);
+        evictions_++;
+    }
+    slot.layer = layer;
+    slot.expert = expert;
+    slot.state.store(LOADING, std::memory_order_relaxed);
+    slot.pins = pin ? 1 : 0;
+    slot.last_use = ++tick_;
+    slot_of_[key] = victim;
+    if (pin) {
+        misses_++;
+    } else {
+        prefetches_++;
+    }
+    load_queue_.push_back(victim);
+    cv_.notify_one();
+    return victim;
+}
+
+void ExpertStore::acquire(int layer, int k, const uint64_t* expert_ids, int* slots) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < k; i++) {
+        try {
+            slots[i] = lookup_or_load_(layer, expert_ids[i], true);
+        } catch (const std::runtime_error&) {
+            for (int j = 0; j < i; j++) {
+                slots_[slots[j]].pins--;
+            }
+            throw;
+        }
+    }
+    // Routing is strongly correlated between steps, so the experts the next
+    // layer used last time are the best guess for what it needs now.
+    last_routed_[layer].assign(expert_ids, expert_ids + k);
+    if (layer + 1 < config_.layer_num) {
+        for (uint64_t expert : last_routed_[layer + 1]) {
+            lookup_or_load_(layer + 1, expert, false);
+        }
+    }
+}
+
+void ExpertStore::release(int k, const int* slots) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < k; i++) {
+        slots_[slots[i]].pins--;
+    }
+}
+
+void ExpertStore::prefetch(int layer, int k, const uint64_t* expert_ids) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < k; i++) {
+        if (lookup_or_load_(layer, expert_ids[i], false) < 0) {
+            return;
+        }
+    }
+}
+
+bool ExpertStore::wait(int slot) const {
+    while (true) {
+        int state = slots_[slot].state.load(std::memory_order_acquire);
+        if (state != LOADING) {
+            return state == READY;
+        }
+        std::this_thread::yield();
+    }
+}
+
+std::vector<uint64_t> ExpertStore::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<uint64_t> stats = {hits_, misses_, prefetches_, evictions_};
+    hits_ = 0;
+    misses_ = 0;
+    prefetches_ = 0;
+    evictions_ = 0;
+    return stats;
+}
+
+const void* ExpertStore::read_(uint8_t* dst, uint64_t offset, uint64_t bytes) {
+    uint64_t begin = offset;
+    uint64_t end = offset + bytes;
+    if (config_.direct_io) {
+        begin = offset / alignment_ * alignment_;
+        end = (end + alignment_ - 1) / alignment_ * alignment_;
+    }
+    uint64_t done = 0;
+    while (begin + done < end) {
+        ssize_t n = pread(fd_, dst + done, end - begin - done, begin + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // The aligned tail may run past the end of the file.
+            if (n == 0 && begin + done >= offset + bytes) {
+                break;
+            }
+            throw std::runtime_error("ExpertStore: reading " + config_.path + " at " + std::to_string(begin + done) + " failed: " +
+                                     (n == 0 ? "unexpected end of file" : strerror(errno)));
+        }
+        done += n;
+    }
+    return dst + (offset - begin);
+}
+
+void ExpertStore::io_worker_() {
+    while (true) {
+        int slot_id;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return exit_ || !load_queue_.empty(); });
+            if (exit_) {
+                return;
+            }
+            slot_id = load_queue_.front();
+            load_queue_.pop_front();
+        }
+        // A LOADING slot is never evicted, so layer and expert are stable.
+        Slot& slot = slots_[slot_id];
+        uint64_t expert = slot.expert;
+        try {
+            slot.gate = read_(slot.buffer, config_.gate_offsets[slot.layer] + expert * config_.gate_bytes, config_.gate_bytes);
+            slot.up = read_(slot.buffer + part_capacity_, config_.up_offsets[slot.layer] + expert * config_.up_bytes, config_.up_bytes);
+            slot.down = read_(slot.buffer + 2 * part_capacity_, config_.down_offsets[slot.layer] + expert * config_.down_bytes, config_.down_bytes);
+        } catch (const std::runtime_error& e) {
+            slot.error = e.what();
+            slot.state.store(FAILED, std::memory_order_release);
+            continue;
+        }
+        slot.state.store(READY, std::memory_order_release);
+    }
+}
@@ -0,0 +1,118 @@
+/**
+ * @Description  : File-backed MoE expert weights with a DRAM LRU cache
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_OPERATOR_EXPERT_STORE_H
+#define CPUINFER_OPERATOR_EXPERT_STORE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Where the expert tensors of every MoE layer live in one file, typically
+// the GGUF file itself: the gate tensor of layer l starts at gate_offsets[l]
+// and holds expert_num experts of gate_bytes each, likewise up and down.
+struct ExpertStoreConfig {
+    std::string path;
+    int layer_num;
+    int expert_num;
+    std::vector<uint64_t> gate_offsets;  // [layer_num]
+    std::vector<uint64_t> up_offsets;    // [layer_num]
+    std::vector<uint64_t> down_offsets;  // [layer_num]
+    uint64_t gate_bytes;                 // per expert
+    uint64_t up_bytes;                   // per expert
+    uint64_t down_bytes;                 // per expert
+    int cache_experts;                   // experts held in DRAM, over all layers
+    int io_thread_num;
+    bool direct_io;                      // O_DIRECT, bypassing the page cache
+
+    ExpertStoreConfig() {}
+
+    ExpertStoreConfig(std::string path, int layer_num, int expert_num, std::vector<uint64_t> gate_offsets, std::vector<uint64_t> up_offsets, std::vector<uint64_t> down_offsets, uint64_t gate_bytes, uint64_t up_bytes, uint64_t down_bytes, int cache_experts, int io_thread_num = 4, bool direct_io = true)
+        : path(path), layer_num(layer_num), expert_num(expert_num), gate_offsets(gate_offsets), up_offsets(up_offsets), down_offsets(down_offsets), gate_bytes(gate_bytes), up_bytes(up_bytes), down_bytes(down_bytes), cache_experts(cache_experts), io_thread_num(io_thread_num), direct_io(direct_io) {}
+};
+
+// Experts are loaded into cache slots by a pool of I/O threads. A MOE layer
+// acquires the slots of the experts it routes to (pinning them), computes on
+// each one once it is ready, and releases them. Unpinned slots are evicted
+// least recently used first. Acquiring the experts of layer l also
+// prefetches the experts layer l + 1 routed to last time. A failed read
+// leaves its slot FAILED until the expert is acquired again, which retries.
+class ExpertStore {
+   public:
+    // Throws std::invalid_argument for a bad config and std::runtime_error
+    // if the file cannot be opened or the cache not allocated.
+    ExpertStore(ExpertStoreConfig);
+    ~ExpertStore();
+
+    // Pins expert_ids[0, k) of layer and writes their slots. Missing experts
+    // are queued for loading; use ready()/wait() before touching them.
+    // Throws std::runtime_error, pinning nothing, if every slot is pinned.
+    void acquire(int layer, int k, const uint64_t* expert_ids, int* slots);
+    void release(int k, const int* slots);
+    // Queues loads for experts that are not cached, without pinning them.
+    // Skipped when every slot is pinned or loading.
+    void prefetch(int layer, int k, const uint64_t* expert_ids);
+
+    bool ready(int slot) const { return slots_[slot].state.load(std::memory_order_acquire) == READY; }
+    // Returns false if the load failed, see error().
+    bool wait(int slot) const;
+    const std::string& error(int slot) const { return slots_[slot].error; }
+    const void* gate(int slot) const { return slots_[slot].gate; }
+    const void* up(int slot) const { return slots_[slot].up; }
+    const void* down(int slot) const { return slots_[slot].down; }
+
+    // hits, misses, prefetched loads and evictions since the last call
+    std::vector<uint64_t> stats();
+
+    const ExpertStoreConfig& config() const { return config_; }
+
+   private:
+    enum { EMPTY, LOADING, READY, FAILED };
+
+    static const uint64_t alignment_ = 4096;  // O_DIRECT offset, size and buffer alignment
+
+    struct Slot {
+        int layer = -1;
+        int expert = -1;
+        std::atomic<int> state{EMPTY};
+        int pins = 0;
+        uint64_t last_use = 0;
+        uint8_t* buffer = nullptr;
+        const void* gate = nullptr;
+        const void* up = nullptr;
+        const void* down = nullptr;
+        std::string error;  // of the last load, if FAILED
+    };
+
+    ExpertStoreConfig config_;
+    int fd_;
+    uint64_t part_capacity_;  // buffer bytes reserved for each of gate, up and down
+    std::vector<Slot> slots_;
+    std::unordered_map<uint64_t, int> slot_of_;  // layer * expert_num + expert -> slot
+    std::vector<std::vector<uint64_t>> last_routed_;  // [layer_num]
+    uint64_t tick_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t prefetches_ = 0;
+    uint64_t evictions_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<int> load_queue_;
+    bool exit_ = false;
+    std::vector<std::thread> io_workers_;
+
+    int lookup_or_load_(int layer, uint64_t expert, bool pin);
+    void io_worker_();
+    const void* read_(uint8_t* dst, uint64_t offset, uint64_t bytes);
+};
+
+#endif
@@ -0,0 +1,217 @@
+/**
+ * @Description  : Point-to-point transports for multi-host expert parallelism
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#include "expert_transport.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+
+TCPTransport::TCPTransport(int rank, std::vector<std::string> hosts, int base_port) {
+    rank_ = rank;
+    int world_size = hosts.size();
+    sockets_.assign(world_size, -1);
+
+    int listener = -1;
+    // Closes what is open so far; the destructor does not run after a throw.
+    auto fail = [&](const std::string& what) {
+        if (listener >= 0) {
+            close(listener);
+        }
+        for (int fd : sockets_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        throw std::runtime_error("TCPTransport: rank " + std::to_string(rank_) + " " + what);
+    };
+    if (rank_ + 1 < world_size) {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(base_port + rank_);
+        if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, world_size) != 0) {
+            fail("failed to listen on port " + std::to_string(base_port + rank_) + ": " + strerror(errno));
+        }
+    }
+
+    for (int peer = 0; peer < rank_; peer++) {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* res;
+        std::string port = std::to_string(base_port + peer);
+        if (getaddrinfo(hosts[peer].c_str(), port.c_str(), &hints, &res) != 0) {
+            fail("cannot resolve " + hosts[peer]);
+        }
+        int fd;
+        while (true) {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(fd, res->ai_addr, res->ai_addrlen) == 0) {
+                break;
+            }
+            // The peer may not be listening yet.
+            close(fd);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        freeaddrinfo(res);
+        ::send(fd, &rank_, sizeof(rank_), 0);
+        sockets_[peer] = fd;
+    }
+
+    for (int accepted = rank_ + 1; accepted < world_size; accepted++) {
+        int fd = accept(listener, nullptr, nullptr);
+        int peer = -1;
+        if (fd < 0 || ::recv(fd, &peer, sizeof(peer), MSG_WAITALL) != sizeof(peer) || peer <= rank_ || peer >= world_size) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            fail("got a bad connection");
+        }
+        sockets_[peer] = fd;
+    }
+    if (listener >= 0) {
+        close(listener);
+    }
+
+    for (int fd : sockets_) {
+        if (fd >= 0) {
+            // Requests are small and latency bound.
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    }
+}
+
+TCPTransport::~TCPTransport() {
+    for (int fd : sockets_) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+void TCPTransport::send(int peer, const void* data, size_t bytes) {
+    const uint8_t* p = (const uint8_t*)data;
+    while (bytes > 0) {
+        ssize_t n = ::send(sockets_[peer], p, bytes, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("TCPTransport: send to rank " + std::to_string(peer) + " failed: " + strerror(errno));
+        }
+        p += n;
+        bytes -= n;
+    }
+}
+
+void TCPTransport::recv(int peer, void* data, size_t bytes) {
+    uint8_t* p = (uint8_t*)data;
+    while (bytes > 0) {
+        ssize_t n = ::recv(sockets_[peer], p, bytes, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("TCPTransport: recv from rank " + std::to_string(peer) + " failed: " + (n == 0 ? "connection closed" : strerror(errno)));
+        }
+        p += n;
+        bytes -= n;
+    }
+}
+
+ShmTransport::ShmTransport(std::string name, int rank, int world_size, size_t ring_bytes) {
+    name_ = "/" + name;
+    rank_ = rank;
+    world_size_ = world_size;
+    ring_bytes_ = (ring_bytes + 63) / 64 * 64;
+    bytes_ = (size_t)world_size_ * world_size_ * (sizeof(Ring) + ring_bytes_);
+
+    int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("ShmTransport: shm_open " + name_ + " failed: " + strerror(errno));
+    }
+    // Every rank sizes it the same; only the first call extends the file.
+    if (ftruncate(fd, bytes_) != 0) {
+        std::string error = strerror(errno);
+        close(fd);
+        throw std::runtime_error("ShmTransport: failed to size " + name_ + ": " + error);
+    }
+    base_ = (uint8_t*)mmap(NULL, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base_ == MAP_FAILED) {
+        throw std::runtime_error("ShmTransport: mmap " + name_ + " failed: " + strerror(errno));
+    }
+}
+
+ShmTransport::~ShmTransport() {
+    munmap(base_, bytes_);
+    if (rank_ == 0) {
+        shm_unlink(name_.c_str());
+    }
+}
+
+ShmTransport::Ring* ShmTransport::ring_(int from, int to) {
+    return (Ring*)(base_ + ((size_t)from * world_size_ + to) * (sizeof(Ring) + ring_bytes_));
+}
+
+void ShmTransport::send(int peer, const void* data, size_t bytes) {
+    Ring* ring = ring_(rank_, peer);
+    uint8_t* ring_data = ring_data_(rank_, peer);
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    while (bytes > 0) {
+        uint64_t space = ring_bytes_ - (head - ring->tail.load(std::memory_order_acquire));
+        if (space == 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        size_t pos = head % ring_bytes_;
+        size_t n = std::min<size_t>({bytes, space, ring_bytes_ - pos});
+        memcpy(ring_data + pos, p, n);
+        head += n;
+        ring->head.store(head, std::memory_order_release);
+        p += n;
+        bytes -= n;
+    }
+}
+
+void ShmTransport::recv(int peer, void* data, size_t bytes) {
+    Ring* ring = ring_(peer, rank_);
+    uint8_t* ring_data = ring_data_(peer, rank_);
+    uint8_t* p = (uint8_t*)data;
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    while (bytes > 0) {
+        uint64_t avail = ring->head.load(std::memory_order_acquire) - tail;
+        if (avail == 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        size_t pos = tail % ring_bytes_;
+        size_t n = std::min<size_t>({bytes, avail, ring_bytes_ - pos});
+        memcpy(p, ring_data + pos, n);
+        tail += n;
+        ring->tail.store(tail, std::memory_order_release);
+        p += n;
+        bytes -= n;
+    }
+}
@@ -0,0 +1,74 @@
+/**
+ * @Description  : Point-to-point transports for multi-host expert parallelism
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_OPERATOR_EXPERT_TRANSPORT_H
+#define CPUINFER_OPERATOR_EXPERT_TRANSPORT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Reliable, ordered byte streams between every pair of ranks. send and
+// recv block until all bytes are handed over; messages to one peer arrive
+// in the order they were sent. Failures throw std::runtime_error.
+class ExpertTransport {
+   public:
+    virtual ~ExpertTransport() {}
+    virtual int rank() = 0;
+    virtual int world_size() = 0;
+    virtual void send(int peer, const void* data, size_t bytes) = 0;
+    virtual void recv(int peer, void* data, size_t bytes) = 0;
+};
+
+// Full mesh of TCP connections. Rank i listens on hosts[i]:base_port + i,
+// accepts the ranks above it and connects to the ranks below it, retrying
+// until they are up.
+class TCPTransport : public ExpertTransport {
+   public:
+    TCPTransport(int rank, std::vector<std::string> hosts, int base_port);
+    ~TCPTransport();
+    int rank() override { return rank_; }
+    int world_size() override { return sockets_.size(); }
+    void send(int peer, const void* data, size_t bytes) override;
+    void recv(int peer, void* data, size_t bytes) override;
+
+   private:
+    int rank_;
+    std::vector<int> sockets_;  // [world_size], -1 for self
+};
+
+// Single-box stand-in for tests: one single-producer single-consumer byte
+// ring per ordered pair of ranks in a POSIX shm segment. Every rank maps
+// the same zero-filled segment, which is already a valid empty state, so
+// the name must be fresh for each run. Rank 0 unlinks it on destruction.
+class ShmTransport : public ExpertTransport {
+   public:
+    ShmTransport(std::string name, int rank, int world_size, size_t ring_bytes);
+    ~ShmTransport();
+    int rank() override { return rank_; }
+    int world_size() override { return world_size_; }
+    void send(int peer, const void* data, size_t bytes) override;
+    void recv(int peer, void* data, size_t bytes) override;
+
+   private:
+    struct alignas(64) Ring {
+        std::atomic<uint64_t> head;  // bytes written, by the sender
+        alignas(64) std::atomic<uint64_t> tail;  // bytes read, by the receiver
+    };
+
+    std::string name_;
+    int rank_;
+    int world_size_;
+    size_t ring_bytes_;
+    size_t bytes_;
+    uint8_t* base_;
+
+    Ring* ring_(int from, int to);
+    uint8_t* ring_data_(int from, int to) { return (uint8_t*)ring_(from, to) + sizeof(Ring); }
+};
+
+#endif
@@ -8,6 +8,10 @@
  * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
  **/
 #include "moe.h"
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
 #include <iostream>
 #include <cstdint>
 
@@ -15,7 +19,12 @@
 #include <numa.h>
 #include <numaif.h>
 #endif
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+#include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -41,10 +50,273 @@ void* MOE::numa_alloc_huge_pages(size_t mem_size, int numa_id)
 
     return ptr;
 }
+
+namespace {
+
+const size_t kLayoutHeaderBytes = 4096;  // regions start page aligned
+const char kLayoutMagic[8] = {'K', 'T', 'N', 'U', 'M', 'A', 'L', 'Y'};
+const char kSharedMagic[8] = {'K', 'T', 'S', 'H', 'A', 'R', 'E', 'D'};
+const uint32_t kLayoutVersion = 1;
+
+// Identifies the layer a layout_path or shared_path file was built from.
+struct LayoutHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t numa_nodes;
+    int32_t expert_num;
+    int32_t hidden_size;
+    int32_t intermediate_size;
+    int32_t stride;
+    int32_t gate_type;
+    int32_t up_type;
+    int32_t down_type;
+    uint64_t fingerprint;
+};
+
+LayoutHeader layout_header(const char* magic, const MOEConfig& config, int numa_nodes, uint64_t fingerprint) {
+    LayoutHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = kLayoutVersion;
+    header.numa_nodes = numa_nodes;
+    header.expert_num = config.expert_num;
+    header.hidden_size = config.hidden_size;
+    header.intermediate_size = config.intermediate_size;
+    header.stride = config.stride;
+    header.gate_type = config.gate_type;
+    header.up_type = config.up_type;
+    header.down_type = config.down_type;
+    header.fingerprint = fingerprint;
+    return header;
+}
+
+size_t layout_align(size_t x) { return (x + kLayoutHeaderBytes - 1) / kLayoutHeaderBytes * kLayoutHeaderBytes; }
+
+// Shared weights start one filesystem block into their file, after the
+// header: mappings of a hugetlbfs file must start on a huge page.
+size_t shared_header_bytes(int fd) {
+    struct statfs fs;
+    return fstatfs(fd, &fs) == 0 && fs.f_bsize > 0 ? fs.f_bsize : 4096;
+}
+
+}  // namespace
+
+std::string MOE::shared_file_name_(const char* proj, int numa_id) {
+    return config_.shared_path + "." + proj + ".node" + std::to_string(numa_id);
+}
+
+// A shared weights file of this layer holding mem_size bytes of weights:
+// the header matches (shapes, types, stride, node count and the source
+// weights' fingerprint) and the file is long enough.
+bool MOE::shared_file_valid_(const std::string& file, size_t mem_size, int numa_nodes, uint64_t fingerprint) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    LayoutHeader expect = layout_header(kSharedMagic, config_, numa_nodes, fingerprint);
+    LayoutHeader header;
+    struct stat st;
+    bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 memcmp(&header, &expect, sizeof(header)) == 0 &&
+                 fstat(fd, &st) == 0 && (size_t)st.st_size >= shared_header_bytes(fd) + mem_size;
+    close(fd);
+    return valid;
+}
+
+// Maps a shared weights file MAP_SHARED and binds it to numa_id, returning
+// the weights past its header block. On hugetlbfs the file is backed by
+// huge pages, so the header costs one huge page and the size is rounded up
+// to the filesystem block, which is the huge page size there. create makes
+// a new writable file with the header filled in, otherwise an existing one
+// that passed shared_file_valid_ is mapped read-only. Returns nullptr, with
+// a created file removed again, if the file cannot be opened, sized or
+// mapped.
+void* MOE::map_shared_(const std::string& file, size_t mem_size, int numa_id, int numa_nodes, uint64_t fingerprint, bool create) {
+    int fd = create ? open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        printf("[MOE] failed to open shared weights %s: %s\n", file.c_str(), strerror(errno));
+        return nullptr;
+    }
+    size_t block = shared_header_bytes(fd);
+    size_t map_size = block + (mem_size + block - 1) / block * block;
+    void* ptr = MAP_FAILED;
+    if (create && ftruncate(fd, map_size) != 0) {
+        printf("[MOE] failed to size shared weights %s: %s\n", file.c_str(), strerror(errno));
+    } else {
+        ptr = mmap(NULL, map_size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            printf("[MOE] failed to map shared weights %s: %s\n", file.c_str(), strerror(errno));
+        }
+    }
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        if (create) {
+            unlink(file.c_str());
+        }
+        return nullptr;
+    }
+    if (create) {
+        // Before the first touch, so the pages are allocated on the node.
+        unsigned long nodemask = (1UL << numa_id);
+        if (mbind(ptr, map_size, MPOL_BIND, &nodemask, sizeof(nodemask)*8, 0)) {
+            perror("mbind failed");
+        }
+        LayoutHeader header = layout_header(kSharedMagic, config_, numa_nodes, fingerprint);
+        memcpy(ptr, &header, sizeof(header));
+    }
+    shared_maps_.push_back({ptr, map_size});
+    return (uint8_t*)ptr + block;
+}
+
+std::vector<size_t> MOE::numa_region_bytes_(int numa_nodes) {
+    std::vector<size_t> bytes;
+    for (int i = 0; i < numa_nodes; i++) {
+        bytes.push_back(config_.gate_proj_element_size_on_numa_node(i) * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type));
+        bytes.push_back(config_.up_proj_element_size_on_numa_node(i) * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type));
+        bytes.push_back((size_t)config_.expert_num * config_.hidden_size * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type));
+    }
+    return bytes;
+}
+
+uint64_t MOE::numa_layout_fingerprint_() {
+    size_t gate_bytes = (size_t)config_.expert_num * config_.intermediate_size * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
+    size_t up_bytes = (size_t)config_.expert_num * config_.intermediate_size * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
+    size_t down_bytes = (size_t)config_.expert_num * config_.hidden_size * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
+    return (weights_fingerprint(gate_proj_, gate_bytes) * 31 + weights_fingerprint(up_proj_, up_bytes)) * 31 + weights_fingerprint(down_proj_, down_bytes);
+}
+
+// Maps every region of a valid layout_path file. Each region is mapped
+// and populated with the thread bound to its node, so pages read from
+// disk land there; pages still in the page cache from an earlier run stay
+// where that run put them, which was the same node. The caller's memory
+// policy is restored afterwards.
+//
+// Unlike the MAP_HUGETLB copies of the rebuild path, the regions are page
+// cache pages, 4K unless the kernel collapses them into huge pages for
+// read-only file mappings (MADV_HUGEPAGE asks for that where supported).
+bool MOE::load_numa_layout_(int numa_nodes) {
+    const std::string& path = config_.layout_path;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    std::vector<size_t> bytes = numa_region_bytes_(numa_nodes);
+    size_t total = kLayoutHeaderBytes;
+    for (size_t b : bytes) {
+        total += layout_align(b);
+    }
+    LayoutHeader expect = layout_header(kLayoutMagic, config_, numa_nodes, numa_layout_fingerprint_());
+    LayoutHeader header;
+    bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 memcmp(&header, &expect, sizeof(header)) == 0;
+    struct stat st;
+    valid = valid && fstat(fd, &st) == 0 && (size_t)st.st_size >= total;
+    if (!valid) {
+        printf("[MOE] stale NUMA layout %s, rebuilding\n", path.c_str());
+        close(fd);
+        return false;
+    }
+
+    int saved_mode;
+    unsigned long saved_maxnode = numa_num_possible_nodes();
+    std::vector<unsigned long> saved_mask((saved_maxnode + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long)));
+    if (get_mempolicy(&saved_mode, saved_mask.data(), saved_maxnode, NULL, 0) != 0) {
+        saved_mode = MPOL_DEFAULT;
+    }
+    auto restore_mempolicy = [&]() {
+        if (saved_mode == MPOL_DEFAULT) {
+            set_mempolicy(MPOL_DEFAULT, NULL, 0);
+        } else {
+            set_mempolicy(saved_mode, saved_mask.data(), saved_maxnode);
+        }
+    };
+
+    std::vector<void*> regions;
+    size_t offset = kLayoutHeaderBytes;
+    for (size_t r = 0; r < bytes.size(); r++) {
+        int numa_id = r / 3;
+        unsigned long nodemask = (1UL << numa_id);
+        set_mempolicy(MPOL_BIND, &nodemask, sizeof(nodemask)*8);
+        void* ptr = mmap(NULL, bytes[r], PROT_READ, MAP_SHARED | MAP_POPULATE, fd, offset);
+        restore_mempolicy();
+        if (ptr == MAP_FAILED) {
+            printf("[MOE] failed to map NUMA layout %s: %s, rebuilding\n", path.c_str(), strerror(errno));
+            for (size_t i = 0; i < regions.size(); i++) {
+                munmap(regions[i], bytes[i]);
+            }
+            close(fd);
+            return false;
+        }
+        mbind(ptr, bytes[r], MPOL_BIND, &nodemask, sizeof(nodemask)*8, 0);
+        madvise(ptr, bytes[r], MADV_HUGEPAGE);
+        regions.push_back(ptr);
+        offset += layout_align(bytes[r]);
+    }
+    close(fd);
+
+    gate_proj_numa_.resize(numa_nodes);
+    up_proj_numa_.resize(numa_nodes);
+    down_proj_numa_.resize(numa_nodes);
+    for (int i = 0; i < numa_nodes; i++) {
+        gate_proj_numa_[i] = regions[3 * i];
+        up_proj_numa_[i] = regions[3 * i + 1];
+        down_proj_numa_[i] = regions[3 * i + 2];
+    }
+    for (size_t r = 0; r < regions.size(); r++) {
+        shared_maps_.push_back({regions[r], bytes[r]});
+    }
+    return true;
+}
+
+void MOE::store_numa_layout_(int numa_nodes) {
+    const std::string& path = config_.layout_path;
+    std::string tmp_path = path + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    if (f == nullptr) {
+        printf("[MOE] cannot write NUMA layout %s\n", tmp_path.c_str());
+        return;
+    }
+    LayoutHeader header = layout_header(kLayoutMagic, config_, numa_nodes, numa_layout_fingerprint_());
+    std::string pad(kLayoutHeaderBytes - sizeof(header), '\0');
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(pad.data(), pad.size(), 1, f) == 1;
+    std::vector<size_t> bytes = numa_region_bytes_(numa_nodes);
+    for (size_t r = 0; r < bytes.size() && ok; r++) {
+        void* region = r % 3 == 0 ? gate_proj_numa_[r / 3] : r % 3 == 1 ? up_proj_numa_[r / 3] : down_proj_numa_[r / 3];
+        pad.assign(layout_align(bytes[r]) - bytes[r], '\0');
+        ok = fwrite(region, bytes[r], 1, f) == 1 &&
+             (pad.empty() || fwrite(pad.data(), pad.size(), 1, f) == 1);
+    }
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        printf("[MOE] failed to write NUMA layout %s\n", path.c_str());
+        unlink(tmp_path.c_str());
+    }
+}
 #endif
 
 MOE::MOE(MOEConfig config) {
     config_ = config;
+    if (config_.store && config_.expert_parallel) {
+        throw std::invalid_argument("MOE: expert_parallel cannot be combined with an ExpertStore");
+    }
+    if (!config_.shared_path.empty() && (config_.expert_parallel || !config_.layout_path.empty())) {
+        throw std::invalid_argument("MOE: shared_path cannot be combined with expert_parallel or layout_path");
+    }
+    #ifdef USE_NUMA
+    if (config_.repack) {
+        throw std::invalid_argument("MOE: repack is not supported with USE_NUMA");
+    }
+    #endif
+    if (config_.store) {
+        const ExpertStoreConfig& store_config = config_.store->config();
+        if (config_.store_layer < 0 || config_.store_layer >= store_config.layer_num || store_config.expert_num != config_.expert_num) {
+            throw std::invalid_argument("MOE: store_layer or expert_num does not match the ExpertStore");
+        }
+        if (store_config.cache_experts < config_.routed_expert_num) {
+            throw std::invalid_argument("MOE: the ExpertStore caches " + std::to_string(store_config.cache_experts) + " experts, fewer than routed_expert_num");
+        }
+    }
     gate_proj_ = config_.gate_proj;
     up_proj_ = config_.up_proj;
     down_proj_ = config_.down_proj;
@@ -52,126 +324,263 @@ MOE::MOE(MOEConfig config) {
     #ifdef USE_NUMA
     printf("======================= Enable NUMA =====================\n");
     int numa_nodes = numa_num_configured_nodes();
-    gate_proj_numa_.resize(numa_nodes);
-    up_proj_numa_.resize(numa_nodes);
-    down_proj_numa_.resize(numa_nodes);
-    size_t exp_inter_hidden_mul_ = (size_t)config.expert_num * config.intermediate_size * config.hidden_size;
-    printf("gate_proj_numa_ size: %ld\n", exp_inter_hidden_mul_);
-    printf("up_proj_numa_ size: %ld\n", exp_inter_hidden_mul_);
-    printf("down_proj_numa_ size: %ld\n", exp_inter_hidden_mul_);
-    size_t gate_ele_size = 0, up_ele_size = 0, down_ele_size = 0;
-    for (int i = 0; i < numa_nodes; ++i) {
-        size_t gate_node_ele_size = config_.gate_proj_element_size_on_numa_node(i);
-        size_t up_node_ele_size = config_.up_proj_element_size_on_numa_node(i);
-        size_t down_node_ele_size = config_.down_proj_element_size_on_numa_node(i);
-        printf("numa-node[%d] gate_node_ele_size=%ld up_node_ele_size=%ld down_node_ele_size=%ld\n", i, gate_node_ele_size, up_node_ele_size, down_node_ele_size);
-        gate_ele_size += gate_node_ele_size;
-        up_ele_size += up_node_ele_size;
-        down_ele_size += down_node_ele_size;
-    }
+    if (config_.store) {
+        printf("[MOE] weights come from an ExpertStore, skipping NUMA placement\n");
+    } else if (config_.expert_parallel) {
+        // Whole experts per node, round-robin until rebalance_experts has
+        // seen some load. Gate, up and down are not replicated.
+        expert_node_.resize(config_.expert_num);
+        gate_proj_expert_.resize(config_.expert_num);
+        up_proj_expert_.resize(config_.expert_num);
+        down_proj_expert_.resize(config_.expert_num);
+        expert_load_.assign(config_.expert_num, 0);
+        for (int expert_id = 0; expert_id < config_.expert_num; ++expert_id) {
+            place_expert_(expert_id, expert_id % numa_nodes);
+        }
+    } else if (!config_.layout_path.empty() && load_numa_layout_(numa_nodes)) {
+        printf("[MOE] mapped NUMA layout %s\n", config_.layout_path.c_str());
+    } else {
+        gate_proj_numa_.resize(numa_nodes);
+        up_proj_numa_.resize(numa_nodes);
+        down_proj_numa_.resize(numa_nodes);
+        size_t exp_inter_hidden_mul_ = (size_t)config.expert_num * config.intermediate_size * config.hidden_size;
+        printf("gate_proj_numa_ size: %ld\n", exp_inter_hidden_mul_);
+        printf("up_proj_numa_ size: %ld\n", exp_inter_hidden_mul_);
+        printf("down_proj_numa_ size: %ld\n", exp_inter_hidden_mul_);
+        size_t gate_ele_size = 0, up_ele_size = 0, down_ele_size = 0;
+        for (int i = 0; i < numa_nodes; ++i) {
+            size_t gate_node_ele_size = config_.gate_proj_element_size_on_numa_node(i);
+            size_t up_node_ele_size = config_.up_proj_element_size_on_numa_node(i);
+            size_t down_node_ele_size = config_.down_proj_element_size_on_numa_node(i);
+            printf("numa-node[%d] gate_node_ele_size=%ld up_node_ele_size=%ld down_node_ele_size=%ld\n", i, gate_node_ele_size, up_node_ele_size, down_node_ele_size);
+            gate_ele_size += gate_node_ele_size;
+            up_ele_size += up_node_ele_size;
+            down_ele_size += down_node_ele_size;
+        }
 
-    if (exp_inter_hidden_mul_ != gate_ele_size) {
-        printf("gate_ele_size: %ld expected, get %ld\n", exp_inter_hidden_mul_, gate_ele_size);
-        exit(EXIT_FAILURE);
-    }
+        if (exp_inter_hidden_mul_ != gate_ele_size) {
+            printf("gate_ele_size: %ld expected, get %ld\n", exp_inter_hidden_mul_, gate_ele_size);
+            exit(EXIT_FAILURE);
+        }
 
-    if (exp_inter_hidden_mul_ != up_ele_size) {
-        printf("up_ele_size: %ld expected, get %ld\n", exp_inter_hidden_mul_, up_ele_size);
-        exit(EXIT_FAILURE);
-    }
+        if (exp_inter_hidden_mul_ != up_ele_size) {
+            printf("up_ele_size: %ld expected, get %ld\n", exp_inter_hidden_mul_, up_ele_size);
+            exit(EXIT_FAILURE);
+        }
 
-    if (exp_inter_hidden_mul_ != down_ele_size) {
-        printf("down_ele_size: %ld expected, get %ld\n", exp_inter_hidden_mul_, down_ele_size);
-        exit(EXIT_FAILURE);
-    }
+        if (exp_inter_hidden_mul_ != down_ele_size) {
+            printf("down_ele_size: %ld expected, get %ld\n", exp_inter_hidden_mul_, down_ele_size);
+            exit(EXIT_FAILURE);
+        }
 
-    for (int i = 0; i < numa_nodes; i++) {
-        gate_proj_numa_[i] = MOE::numa_alloc_huge_pages(config_.gate_proj_element_size_on_numa_node(i) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type), i);
-        // printf("########## alloc gate_proj_numa_[%d]: 0x%p size: %ld type_size: %ld block_size: %ld\n", i, gate_proj_numa_[i], config_.gate_proj_element_size_on_numa_node(i), ggml_type_size(config.gate_type), ggml_blck_size(config.gate_type));
-        up_proj_numa_[i] = MOE::numa_alloc_huge_pages(config_.up_proj_element_size_on_numa_node(i) * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type), i);
-        // printf("########## alloc up_proj_numa_[%d]: 0x%p size: %ld type_size: %ld block_size: %ld\n", i, up_proj_numa_[i], config_.up_proj_element_size_on_numa_node(i), ggml_type_size(config.up_type), ggml_blck_size(config.up_type));
-        // Deal with gate and up firstly.
-        down_proj_numa_[i] = MOE::numa_alloc_huge_pages(exp_inter_hidden_mul_ * ggml_type_size(config.down_type) / ggml_blck_size(config.down_type), i);
-        if (!gate_proj_numa_[i]) {
-            std::cout << "Memory allocation failed for gate_proj_numa_ on node " << i << std::endl;
-        }
-        if (!up_proj_numa_[i]) {
-            std::cout << "Memory allocation failed for up_proj_numa_ on node " << i << std::endl;
-        }
-        if (!down_proj_numa_[i]) {
-            std::cout << "Memory allocation failed for down_proj_numa_ on node " << i << std::endl;
-        }
-        // memcpy(gate_proj_numa_[i], gate_proj_, exp_inter_hidden_mul_* ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type));
-        // memcpy(up_proj_numa_[i], up_proj_, exp_inter_hidden_mul_* ggml_type_size(config.up_type) / ggml_blck_size(config.up_type));
-        memcpy(down_proj_numa_[i], down_proj_, exp_inter_hidden_mul_* ggml_type_size(config.down_type) / ggml_blck_size(config.down_type));
-    }
-
-    for (size_t expert_id = 0; expert_id < config_.expert_num; ++expert_id) {
-        size_t gate_stride_offset_per_expert = 0;
-        size_t up_stride_offset_per_expert = 0;
-        for (int numa_node_id = 0; numa_node_id < numa_nodes; ++numa_node_id) {
-            int n_gate_stride_per_expert = config_.gate_num_stride_on_numa_node(numa_node_id);
-            int n_up_stride_per_expert = config_.up_num_stride_on_numa_node(numa_node_id);
+        // With shared_path the node copies are named shared files. If every
+        // one of them exists and was built from this layer's weights it is
+        // mapped read-only and nothing is copied; otherwise they are all
+        // built under temporary names and renamed over the missing or stale
+        // ones once filled. Processes still mapping a replaced file keep
+        // its old contents. If a file cannot be mapped, the layer falls back
+        // to private copies.
+        std::vector<size_t> region_bytes = numa_region_bytes_(numa_nodes);
+        uint64_t fingerprint = config_.shared_path.empty() ? 0 : numa_layout_fingerprint_();
+        bool use_shared = !config_.shared_path.empty();
+        bool shared_attach = use_shared;
+        for (int i = 0; i < numa_nodes && shared_attach; i++) {
+            const char* projs[] = {"gate", "up", "down"};
+            for (int p = 0; p < 3 && shared_attach; p++) {
+                std::string file = shared_file_name_(projs[p], i);
+                shared_attach = shared_file_valid_(file, region_bytes[3 * i + p], numa_nodes, fingerprint);
+                if (!shared_attach && access(file.c_str(), F_OK) == 0) {
+                    printf("[MOE] shared weights %s do not match this layer, rebuilding\n", file.c_str());
+                }
+            }
+        }
+        std::vector<std::string> shared_tmp_files;
+        auto alloc_node = [&](const char* proj, size_t mem_size, int numa_id) {
+            if (!use_shared) {
+                return MOE::numa_alloc_huge_pages(mem_size, numa_id);
+            }
+            std::string file = shared_file_name_(proj, numa_id);
+            if (shared_attach) {
+                return map_shared_(file, mem_size, numa_id, numa_nodes, fingerprint, false);
+            }
+            shared_tmp_files.push_back(file);
+            return map_shared_(file + ".tmp." + std::to_string(getpid()), mem_size, numa_id, numa_nodes, fingerprint, true);
+        };
+        if (shared_attach) {
+            printf("[MOE] attaching shared weights %s.*\n", config_.shared_path.c_str());
+        }
+        while (true) {
+            bool mapped = true;
+            for (int i = 0; i < numa_nodes; i++) {
+                gate_proj_numa_[i] = alloc_node("gate", config_.gate_proj_element_size_on_numa_node(i) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type), i);
+                // printf("########## alloc gate_proj_numa_[%d]: 0x%p size: %ld type_size: %ld block_size: %ld\n", i, gate_proj_numa_[i], config_.gate_proj_element_size_on_numa_node(i), ggml_type_size(config.gate_type), ggml_blck_size(config.gate_type));
+                up_proj_numa_[i] = alloc_node("up", config_.up_proj_element_size_on_numa_node(i) * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type), i);
+                // printf("########## alloc up_proj_numa_[%d]: 0x%p size: %ld type_size: %ld block_size: %ld\n", i, up_proj_numa_[i], config_.up_proj_element_size_on_numa_node(i), ggml_type_size(config.up_type), ggml_blck_size(config.up_type));
+                // Deal with gate and up firstly.
+                down_proj_numa_[i] = alloc_node("down", exp_inter_hidden_mul_ * ggml_type_size(config.down_type) / ggml_blck_size(config.down_type), i);
+                if (!gate_proj_numa_[i]) {
+                    std::cout << "Memory allocation failed for gate_proj_numa_ on node " << i << std::endl;
+                }
+                if (!up_proj_numa_[i]) {
+                    std::cout << "Memory allocation failed for up_proj_numa_ on node " << i << std::endl;
+                }
+                if (!down_proj_numa_[i]) {
+                    std::cout << "Memory allocation failed for down_proj_numa_ on node " << i << std::endl;
+                }
+                mapped = mapped && gate_proj_numa_[i] && up_proj_numa_[i] && down_proj_numa_[i];
+            }
+            if (mapped || !use_shared) {
+                break;
+            }
+            printf("[MOE] shared weights %s.* unavailable, using private copies\n", config_.shared_path.c_str());
+            for (auto& map : shared_maps_) {
+                munmap(map.first, map.second);
+            }
+            shared_maps_.clear();
+            for (const std::string& file : shared_tmp_files) {
+                unlink((file + ".tmp." + std::to_string(getpid())).c_str());
+            }
+            shared_tmp_files.clear();
+            use_shared = false;
+            shared_attach = false;
+        }
+        for (int i = 0; i < numa_nodes && !shared_attach; i++) {
+            // memcpy(gate_proj_numa_[i], gate_proj_, exp_inter_hidden_mul_* ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type));
+            // memcpy(up_proj_numa_[i], up_proj_, exp_inter_hidden_mul_* ggml_type_size(config.up_type) / ggml_blck_size(config.up_type));
+            memcpy(down_proj_numa_[i], down_proj_, exp_inter_hidden_mul_* ggml_type_size(config.down_type) / ggml_blck_size(config.down_type));
+        }
+
+        for (size_t expert_id = 0; expert_id < config_.expert_num && !shared_attach; ++expert_id) {
+            size_t gate_stride_offset_per_expert = 0;
+            size_t up_stride_offset_per_expert = 0;
+            for (int numa_node_id = 0; numa_node_id < numa_nodes; ++numa_node_id) {
+                int n_gate_stride_per_expert = config_.gate_num_stride_on_numa_node(numa_node_id);
+                int n_up_stride_per_expert = config_.up_num_stride_on_numa_node(numa_node_id);
             
-            void* gate_data_ptr = (uint8_t*)gate_proj_ + (
-                expert_id * config_.intermediate_size * config_.hidden_size + 
-                gate_stride_offset_per_expert * config_.stride * config_.hidden_size
-            ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type);
-            void* up_data_ptr = (uint8_t*)up_proj_ + (
-                expert_id * config_.intermediate_size * config_.hidden_size + 
-                up_stride_offset_per_expert * config_.stride * config_.hidden_size
-            ) * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type);
-
-            void* numa_gate_data_ptr = (uint8_t*)(gate_proj_numa_[numa_node_id]) + (
-                expert_id * n_gate_stride_per_expert * config_.stride * config_.hidden_size
-            ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type);
-            size_t bytes_gate_copy = n_gate_stride_per_expert * config_.stride * config_.hidden_size * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type);
-            // printf("########## copy size:%ld gate_proj_(0x%p, expert_offset:%ld + internal_offset: %ld) to  gate_proj_numa_[%d](0x%p, offset: %ld)\n", 
-            //         bytes_gate_copy, 
-            //         gate_proj_,
-            //         (
-            //             expert_id * config_.intermediate_size * config_.hidden_size
-            //         ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type),
-            //         (
-            //             gate_stride_offset_per_expert * config_.stride * config_.hidden_size
-            //         ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type),
-            //         numa_node_id,
-            //         gate_proj_numa_[numa_node_id],
-            //         (
-            //             expert_id * n_gate_stride_per_expert * config_.stride * config_.hidden_size
-            //         ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type)
-            // );
-
-            void* numa_up_data_ptr = (uint8_t*)(up_proj_numa_[numa_node_id]) + (
-                expert_id * n_up_stride_per_expert * config_.stride * config_.hidden_size
-            ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type);
-            size_t bytes_up_copy = n_up_stride_per_expert * config_.stride * config_.hidden_size * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type);
-            // printf("########## copy size:%ld up_proj_(0x%p, expert_offset:%ld + internal_offset: %ld) to  up_proj_numa_[%d](0x%p, offset: %ld)\n", 
-            //         bytes_up_copy, 
-            //         up_proj_,
-            //         (
-            //             expert_id * config_.intermediate_size * config_.hidden_size
-            //         ) * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type),
-            //         (
-            //             up_stride_offset_per_expert * config_.stride * config_.hidden_size
-            //         ) * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type),
-            //         numa_node_id,
-            //         up_proj_numa_[numa_node_id],
-            //         (
-            //             expert_id * n_up_stride_per_expert * config_.stride * config_.hidden_size
-            //         ) * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type)
-            // );
-
-            memcpy(numa_gate_data_ptr, gate_data_ptr, bytes_gate_copy);
-            memcpy(numa_up_data_ptr, up_data_ptr, bytes_up_copy);
-
-            gate_stride_offset_per_expert += n_gate_stride_per_expert;
-            up_stride_offset_per_expert += n_up_stride_per_expert;
+                void* gate_data_ptr = (uint8_t*)gate_proj_ + (
+                    expert_id * config_.intermediate_size * config_.hidden_size + 
+                    gate_stride_offset_per_expert * config_.stride * config_.hidden_size
+                ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type);
+                void* up_data_ptr = (uint8_t*)up_proj_ + (
+                    expert_id * config_.intermediate_size * config_.hidden_size + 
+                    up_stride_offset_per_expert * config_.stride * config_.hidden_size
+                ) * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type);
+
+                void* numa_gate_data_ptr = (uint8_t*)(gate_proj_numa_[numa_node_id]) + (
+                    expert_id * n_gate_stride_per_expert * config_.stride * config_.hidden_size
+                ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type);
+                size_t bytes_gate_copy = n_gate_stride_per_expert * config_.stride * config_.hidden_size * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type);
+                // printf("########## copy size:%ld gate_proj_(0x%p, expert_offset:%ld + internal_offset: %ld) to  gate_proj_numa_[%d](0x%p, offset: %ld)\n", 
+                //         bytes_gate_copy, 
+                //         gate_proj_,
+                //         (
+                //             expert_id * config_.intermediate_size * config_.hidden_size
+                //         ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type),
+                //         (
+                //             gate_stride_offset_per_expert * config_.stride * config_.hidden_size
+                //         ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type),
+                //         numa_node_id,
+                //         gate_proj_numa_[numa_node_id],
+                //         (
+                //             expert_id * n_gate_stride_per_expert * config_.stride * config_.hidden_size
+                //         ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type)
+                // );
+
+                void* numa_up_data_ptr = (uint8_t*)(up_proj_numa_[numa_node_id]) + (
+                    expert_id * n_up_stride_per_expert * config_.stride * config_.hidden_size
+                ) * ggml_type_size(config.gate_type) / ggml_blck_size(config.gate_type);
+                size_t bytes_up_copy = n_up_stride_per_expert * config_.stride * config_.hidden_size * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type);
+                // printf("########## copy size:%ld up_proj_(0x%p, expert_offset:%ld + internal_offset: %ld) to  up_proj_numa_[%d](0x%p, offset: %ld)\n", 
+                //         bytes_up_copy, 
+                //         up_proj_,
+                //         (
+                //             expert_id * config_.intermediate_size * config_.hidden_size
+                //         ) * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type),
+                //         (
+                //             up_stride_offset_per_expert * config_.stride * config_.hidden_size
+                //         ) * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type),
+                //         numa_node_id,
+                //         up_proj_numa_[numa_node_id],
+                //         (
+                //             expert_id * n_up_stride_per_expert * config_.stride * config_.hidden_size
+                //         ) * ggml_type_size(config.up_type) / ggml_blck_size(config.up_type)
+                // );
+
+                memcpy(numa_gate_data_ptr, gate_data_ptr, bytes_gate_copy);
+                memcpy(numa_up_data_ptr, up_data_ptr, bytes_up_copy);
+
+                gate_stride_offset_per_expert += n_gate_stride_per_expert;
+                up_stride_offset_per_expert += n_up_stride_per_expert;
+            }
+        }
+        for (auto& map : shared_maps_) {
+            mprotect(map.first, map.second, PROT_READ);
+        }
+        // This layer keeps its mappings either way; an unpublished file is
+        // only lost to other processes.
+        for (const std::string& file : shared_tmp_files) {
+            std::string tmp = file + ".tmp." + std::to_string(getpid());
+            if (rename(tmp.c_str(), file.c_str()) != 0) {
+                printf("[MOE] publishing shared weights %s failed: %s\n", file.c_str(), strerror(errno));
+                unlink(tmp.c_str());
+            }
+        }
+        if (!config_.layout_path.empty()) {
+            store_numa_layout_(numa_nodes);
         }
     }
     printf("========================================================\n");
     #endif
 
+    #ifndef USE_NUMA
+    if (config_.repack && !config_.store) {
+        int64_t gate_rows = (int64_t)config_.expert_num * config_.intermediate_size;
+        int64_t down_rows = (int64_t)config_.expert_num * config_.hidden_size;
+        auto cache_path = [&](const char* suffix) {
+            return config_.repack_path.empty() ? std::string() : config_.repack_path + suffix;
+        };
+        if (config_.stride % REPACK_PANEL_ROWS == 0) {
+            if (RepackedMatrix::supported(config_.gate_type, gate_rows, config_.hidden_size)) {
+                gate_packed_.reset(new RepackedMatrix(config_.gate_type, gate_rows, config_.hidden_size, gate_proj_, cache_path(".gate")));
+            }
+            if (RepackedMatrix::supported(config_.up_type, gate_rows, config_.hidden_size)) {
+                up_packed_.reset(new RepackedMatrix(config_.up_type, gate_rows, config_.hidden_size, up_proj_, cache_path(".up")));
+            }
+            if (RepackedMatrix::supported(config_.down_type, down_rows, config_.intermediate_size)) {
+                down_packed_.reset(new RepackedMatrix(config_.down_type, down_rows, config_.intermediate_size, down_proj_, cache_path(".down")));
+            }
+        }
+    }
+    #endif
+
+    if ((config_.down_sparse_threshold > 0 || config_.down_sparse_keep < 1) && !config_.store) {
+        #ifdef USE_NUMA
+        printf("[MOE] activation-sparse down_proj is not supported with USE_NUMA, running dense\n");
+        #else
+        ggml_type down_vec_dot_type = ggml_internal_get_type_traits(config_.down_type).vec_dot_type;
+        int group = std::max<int>(ggml_blck_size(config_.down_type), 32);
+        if (config_.intermediate_size % group != 0 || group % ggml_blck_size(down_vec_dot_type) != 0 ||
+            ggml_internal_get_type_traits(config_.down_type).vec_dot == nullptr) {
+            printf("[MOE] activation-sparse down_proj does not support this down_type, running dense\n");
+        } else {
+            down_group_ = group;
+            if (!config_.repack_path.empty()) {
+                down_colblocked_.reset(new ColumnBlockedMatrix(config_.down_type, config_.expert_num, config_.hidden_size, config_.intermediate_size, group, down_proj_, config_.repack_path + ".down_sparse"));
+            }
+            s_down_candidates_.reserve(config_.intermediate_size / group);
+            s_down_groups_.resize(config_.routed_expert_num);
+            for (auto& groups : s_down_groups_) {
+                groups.reserve(config_.intermediate_size / group);
+            }
+        }
+        #endif
+    }
+
+    s_expert_ids_.resize(config_.routed_expert_num);
+    s_weights_.resize(config_.routed_expert_num);
+    s_routing_.resize(config_.routed_expert_num);
+    s_store_slots_.resize(config_.routed_expert_num);
+    s_store_order_.resize(config_.routed_expert_num);
     std::vector<std::pair<void**, uint64_t>> s_mem_requests;
     s_mem_requests.push_back({(void**)&s_input_fp32_, sizeof(float) * config_.hidden_size});
     s_mem_requests.push_back({(void**)&s_gate_input_, config_.hidden_size * ggml_type_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type)});
@@ -231,7 +640,18 @@ MOE::~MOE() {
     shared_mem_buffer.dealloc(this);
 
     #ifdef USE_NUMA
-    int numa_nodes = numa_num_configured_nodes();
+    size_t gate_bytes = (size_t)config_.intermediate_size * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
+    size_t up_bytes = (size_t)config_.intermediate_size * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
+    size_t down_bytes = (size_t)config_.hidden_size * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
+    for (size_t expert_id = 0; expert_id < gate_proj_expert_.size(); expert_id++) {
+        numa_free(gate_proj_expert_[expert_id], gate_bytes);
+        numa_free(up_proj_expert_[expert_id], up_bytes);
+        numa_free(down_proj_expert_[expert_id], down_bytes);
+    }
+    for (auto& map : shared_maps_) {
+        munmap(map.first, map.second);
+    }
+    int numa_nodes = shared_maps_.empty() ? gate_proj_numa_.size() : 0;
     for (int i = 0; i < numa_nodes; i++) {
         numa_free(gate_proj_numa_[i], config_.expert_num * config_.intermediate_size * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type));
         numa_free(up_proj_numa_[i], config_.expert_num * config_.intermediate_size * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type));
@@ -240,7 +660,96 @@ MOE::~MOE() {
     #endif
 }
 
+#ifdef USE_NUMA
+// Moves (or first places) all rows of one expert to numa_node_id.
+void MOE::place_expert_(int expert_id, int numa_node_id) {
+    size_t gate_bytes = (size_t)config_.intermediate_size * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
+    size_t up_bytes = (size_t)config_.intermediate_size * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
+    size_t down_bytes = (size_t)config_.hidden_size * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
+    auto move = [&](void*& dst, const void* src, size_t bytes) {
+        void* ptr = numa_alloc_onnode(bytes, numa_node_id);
+        if (!ptr) {
+            printf("[MOE] Memory allocation failed for expert %d on node %d\n", expert_id, numa_node_id);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(ptr, src, bytes);
+        if (dst) {
+            numa_free(dst, bytes);
+        }
+        dst = ptr;
+    };
+    const void* gate_src = gate_proj_expert_[expert_id] ? gate_proj_expert_[expert_id] : (uint8_t*)gate_proj_ + expert_id * gate_bytes;
+    const void* up_src = up_proj_expert_[expert_id] ? up_proj_expert_[expert_id] : (uint8_t*)up_proj_ + expert_id * up_bytes;
+    const void* down_src = down_proj_expert_[expert_id] ? down_proj_expert_[expert_id] : (uint8_t*)down_proj_ + expert_id * down_bytes;
+    move(gate_proj_expert_[expert_id], gate_src, gate_bytes);
+    move(up_proj_expert_[expert_id], up_src, up_bytes);
+    move(down_proj_expert_[expert_id], down_src, down_bytes);
+    expert_node_[expert_id] = numa_node_id;
+}
+#endif
+
+void MOE::rebalance_experts() {
+#ifdef USE_NUMA
+    if (!config_.expert_parallel) {
+        return;
+    }
+    // Longest processing time first: the busiest experts go to the least
+    // loaded node that still has room, so every node keeps about the same
+    // number of experts (memory) and the same routed load (bandwidth).
+    int n_numa_nodes = config_.e_n_numa_nodes;
+    int capacity = (config_.expert_num + n_numa_nodes - 1) / n_numa_nodes;
+    std::vector<int> order(config_.expert_num);
+    for (int i = 0; i < config_.expert_num; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return expert_load_[a] > expert_load_[b];
+    });
+    std::vector<uint64_t> node_load(n_numa_nodes, 0);
+    std::vector<int> node_experts(n_numa_nodes, 0);
+    std::vector<int> new_node(config_.expert_num);
+    for (int expert_id : order) {
+        // prefer the current node on ties to avoid needless migrations
+        int best = -1;
+        for (int node = 0; node < n_numa_nodes; node++) {
+            if (node_experts[node] >= capacity) {
+                continue;
+            }
+            if (best < 0 || node_load[node] < node_load[best] ||
+                (node_load[node] == node_load[best] && node == expert_node_[expert_id])) {
+                best = node;
+            }
+        }
+        new_node[expert_id] = best;
+        node_load[best] += expert_load_[expert_id];
+        node_experts[best]++;
+    }
+    int moved = 0;
+    for (int expert_id = 0; expert_id < config_.expert_num; expert_id++) {
+        if (new_node[expert_id] != expert_node_[expert_id]) {
+            place_expert_(expert_id, new_node[expert_id]);
+            moved++;
+        }
+        // keep half of the history so placement follows shifting load
+        expert_load_[expert_id] /= 2;
+    }
+    printf("[MOE] rebalance_experts moved %d experts\n", moved);
+#endif
+}
+
+std::vector<int> MOE::expert_nodes() {
+#ifdef USE_NUMA
+    return expert_node_;
+#else
+    return {};
+#endif
+}
+
 void MOE::warm_up(Backend* backend) {
+    if (config_.store) {
+        // Would only cycle every expert through the store's cache.
+        return;
+    }
     std::vector<float> input_fp32(config_.hidden_size);
     std::vector<uint8_t> input(config_.hidden_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type));
     std::vector<uint8_t> output(config_.hidden_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type));
@@ -259,7 +768,72 @@ static float act_fn(float x) {
     return x / (1.0f + expf(-x));
 }
 
+// Keeps the heaviest experts of one token, see
+// MOEConfig::routing_mass_threshold, and writes them to s_expert_ids_ and
+// s_weights_. Returns the number kept.
+int MOE::skip_light_experts_(int k, const uint64_t* expert_ids, const float* weights) {
+    float total = 0;
+    for (int i = 0; i < k; i++) {
+        s_routing_[i] = {weights[i], expert_ids[i]};
+        total += weights[i];
+    }
+    std::stable_sort(s_routing_.begin(), s_routing_.begin() + k, [](const std::pair<float, uint64_t>& a, const std::pair<float, uint64_t>& b) {
+        return a.first > b.first;
+    });
+    int keep = 0;
+    float mass = 0;
+    while (keep < k) {
+        if (keep > 0 && (s_routing_[keep].first < config_.routing_weight_floor || mass >= config_.routing_mass_threshold * total)) {
+            break;
+        }
+        mass += s_routing_[keep].first;
+        keep++;
+    }
+    float scale = mass > 0 ? total / mass : 1;
+    for (int i = 0; i < keep; i++) {
+        s_expert_ids_[i] = s_routing_[i].second;
+        s_weights_[i] = s_routing_[i].first * scale;
+    }
+    skip_tokens_++;
+    skip_fired_tokens_ += keep < k;
+    skip_experts_ += k - keep;
+    return keep;
+}
+
+std::vector<uint64_t> MOE::expert_skip_stats() {
+    std::vector<uint64_t> stats = {skip_tokens_, skip_fired_tokens_, skip_experts_};
+    skip_tokens_ = 0;
+    skip_fired_tokens_ = 0;
+    skip_experts_ = 0;
+    return stats;
+}
+
 void MOE::forward_one(int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend) {
+    // Expert ids outside [0, expert_num) are computed elsewhere (e.g. by a
+    // device-resident copy of hot experts) and are dropped from this call.
+    int valid_k = 0;
+    for (int i = 0; i < k; i++) {
+        if (expert_ids[i] < (uint64_t)config_.expert_num) {
+            s_expert_ids_[valid_k] = expert_ids[i];
+            s_weights_[valid_k] = weights[i];
+            valid_k++;
+        }
+    }
+    if (valid_k != k) {
+        k = valid_k;
+        expert_ids = s_expert_ids_.data();
+        weights = s_weights_.data();
+    }
+    if (k > 1 && (config_.routing_mass_threshold < 1 || config_.routing_weight_floor > 0)) {
+        k = skip_light_experts_(k, expert_ids, weights);
+        expert_ids = s_expert_ids_.data();
+        weights = s_weights_.data();
+    }
+    if (k == 0) {
+        memset(s_output_fp32_, 0, sizeof(float) * config_.hidden_size);
+        from_float(s_output_fp32_, output, config_.hidden_size, config_.hidden_type);
+        return;
+    }
     const void* gate_input_ptr;
     const void* up_input_ptr;
     if (config_.hidden_type == ggml_internal_get_type_traits(config_.gate_type).vec_dot_type && config_.hidden_type == ggml_internal_get_type_traits(config_.up_type).vec_dot_type) {
@@ -284,6 +858,16 @@ void MOE::forward_one(int k, const uint64_t* expert_ids, const float* weights, c
             }
         }
     }
+    if (config_.store) {
+        forward_one_store_(k, expert_ids, weights, gate_input_ptr, up_input_ptr, output, backend);
+        return;
+    }
+#ifdef USE_NUMA
+    if (config_.expert_parallel) {
+        forward_one_expert_parallel_(k, expert_ids, weights, gate_input_ptr, up_input_ptr, output, backend);
+        return;
+    }
+#endif
     // moe_intermediate_size=2048,
     // stride = 64
     // nth = 2^5 = 32
@@ -343,12 +927,20 @@ void MOE::forward_one(int k, const uint64_t* expert_ids, const float* weights, c
         void* gate_proj_ptr = (uint8_t*)gate_proj_ + (expert_id * config_.intermediate_size + ith * config_.stride) * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
 
         float* gate_output_ptr = s_gate_output_[expert_idx] + ith * config_.stride;
-        llamafile_sgemm(config_.stride, 1, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_proj_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_input_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_output_ptr, config_.stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.gate_type, ggml_internal_get_type_traits(config_.gate_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        if (gate_packed_) {
+            RepackedMatrix::gemv(config_.gate_type, config_.stride, config_.hidden_size, gate_packed_->row_ptr(expert_id * config_.intermediate_size + ith * config_.stride), gate_input_ptr, gate_output_ptr);
+        } else {
+            llamafile_sgemm(config_.stride, 1, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_proj_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_input_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_output_ptr, config_.stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.gate_type, ggml_internal_get_type_traits(config_.gate_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        }
 
         void* up_proj_ptr = (uint8_t*)up_proj_ + (expert_id * config_.intermediate_size + ith * config_.stride) * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
 
         float* up_output_ptr = s_up_output_[expert_idx] + ith * config_.stride;
-        llamafile_sgemm(config_.stride, 1, config_.hidden_size / ggml_blck_size(config_.up_type), up_proj_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_input_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_output_ptr, config_.stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.up_type, ggml_internal_get_type_traits(config_.up_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        if (up_packed_) {
+            RepackedMatrix::gemv(config_.up_type, config_.stride, config_.hidden_size, up_packed_->row_ptr(expert_id * config_.intermediate_size + ith * config_.stride), up_input_ptr, up_output_ptr);
+        } else {
+            llamafile_sgemm(config_.stride, 1, config_.hidden_size / ggml_blck_size(config_.up_type), up_proj_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_input_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_output_ptr, config_.stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.up_type, ggml_internal_get_type_traits(config_.up_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        }
         for (int i = ith * config_.stride; i < (ith + 1) * config_.stride; i++) {
             s_intermediate_fp32_[expert_idx][i] = act_fn(s_gate_output_[expert_idx][i]) * s_up_output_[expert_idx][i];
         }
@@ -364,6 +956,10 @@ void MOE::forward_one(int k, const uint64_t* expert_ids, const float* weights, c
             from_float(s_intermediate_fp32_[i], s_down_input_[i], config_.intermediate_size, ggml_internal_get_type_traits(config_.down_type).vec_dot_type);
         }
     }
+    if (down_group_ > 0) {
+        forward_one_down_sparse_(k, expert_ids, weights, output, backend);
+        return;
+    }
     nth = config_.hidden_size / config_.stride;
     backend->do_work_stealing_job(nth, nullptr, [&](int task_id) {
         int ith = task_id;
@@ -379,6 +975,92 @@ void MOE::forward_one(int k, const uint64_t* expert_ids, const float* weights, c
             void* down_proj_ptr = (uint8_t*)down_proj_ + (expert_id * config_.hidden_size + ith * config_.stride) * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
             #endif
             
+            float* down_output_ptr = s_down_output_[expert_idx] + ith * config_.stride;
+            if (down_packed_) {
+                RepackedMatrix::gemv(config_.down_type, config_.stride, config_.intermediate_size, down_packed_->row_ptr(expert_id * config_.hidden_size + ith * config_.stride), s_down_input_[expert_idx], down_output_ptr);
+            } else {
+                llamafile_sgemm(config_.stride, 1, config_.intermediate_size / ggml_blck_size(config_.down_type), down_proj_ptr, config_.intermediate_size / ggml_blck_size(config_.down_type), s_down_input_[expert_idx], config_.intermediate_size / ggml_blck_size(config_.down_type), down_output_ptr, config_.stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.down_type, ggml_internal_get_type_traits(config_.down_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+            }
+            for (int i = ith * config_.stride; i < (ith + 1) * config_.stride; i++) {
+                s_output_fp32_[i] += s_down_output_[expert_idx][i] * weights[expert_idx];
+            }
+        }
+        if (config_.stride % ggml_blck_size(config_.hidden_type) == 0) {
+            float* output_fp32_ptr = s_output_fp32_ + ith * config_.stride;
+            void* output_ptr = (uint8_t*)output + ith * config_.stride * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type);
+            from_float(output_fp32_ptr, output_ptr, config_.stride, config_.hidden_type);
+        }
+    }, nullptr);
+    if (config_.stride % ggml_blck_size(config_.hidden_type) != 0) {
+        from_float(s_output_fp32_, output, config_.hidden_size, config_.hidden_type);
+    }
+}
+
+// Same computation as the non-NUMA path of forward_one with weights taken
+// from the store. Experts already in the cache come first in the gate/up job,
+// so threads compute on them while the missing ones are read; a task on a
+// missing expert waits for its load. down_proj needs every expert and runs
+// once all of them are in.
+void MOE::forward_one_store_(int k, const uint64_t* expert_ids, const float* weights, const void* gate_input_ptr, const void* up_input_ptr, void* output, Backend* backend) {
+    ExpertStore* store = config_.store;
+    store->acquire(config_.store_layer, k, expert_ids, s_store_slots_.data());
+    int resident = 0, missing = k;
+    for (int i = 0; i < k; i++) {
+        if (store->ready(s_store_slots_[i])) {
+            s_store_order_[resident++] = i;
+        } else {
+            s_store_order_[--missing] = i;
+        }
+    }
+
+    // Jobs must not throw: a failed read is raised once the job is done.
+    std::atomic<int> failed_slot{-1};
+    int nth = config_.intermediate_size / config_.stride;
+    backend->do_work_stealing_job(nth * k, nullptr, [&](int task_id) {
+        int expert_idx = s_store_order_[task_id / nth];
+        int ith = task_id % nth;
+        int slot = s_store_slots_[expert_idx];
+        if (!store->wait(slot)) {
+            failed_slot = slot;
+            return;
+        }
+
+        void* gate_proj_ptr = (uint8_t*)store->gate(slot) + ith * config_.stride * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
+        float* gate_output_ptr = s_gate_output_[expert_idx] + ith * config_.stride;
+        llamafile_sgemm(config_.stride, 1, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_proj_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_input_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_output_ptr, config_.stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.gate_type, ggml_internal_get_type_traits(config_.gate_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+
+        void* up_proj_ptr = (uint8_t*)store->up(slot) + ith * config_.stride * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
+        float* up_output_ptr = s_up_output_[expert_idx] + ith * config_.stride;
+        llamafile_sgemm(config_.stride, 1, config_.hidden_size / ggml_blck_size(config_.up_type), up_proj_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_input_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_output_ptr, config_.stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.up_type, ggml_internal_get_type_traits(config_.up_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+
+        for (int i = ith * config_.stride; i < (ith + 1) * config_.stride; i++) {
+            s_intermediate_fp32_[expert_idx][i] = act_fn(s_gate_output_[expert_idx][i]) * s_up_output_[expert_idx][i];
+        }
+        if (config_.stride % ggml_blck_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type) == 0) {
+            float* intermediate_fp32_ptr = s_intermediate_fp32_[expert_idx] + ith * config_.stride;
+            void* down_input_ptr = s_down_input_[expert_idx] + ith * config_.stride * ggml_type_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type);
+            from_float(intermediate_fp32_ptr, down_input_ptr, config_.stride, ggml_internal_get_type_traits(config_.down_type).vec_dot_type);
+        }
+    }, nullptr);
+    if (failed_slot >= 0) {
+        std::string error = store->error(failed_slot);
+        store->release(k, s_store_slots_.data());
+        throw std::runtime_error(error);
+    }
+    if (config_.stride % ggml_blck_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type) != 0) {
+        for (int i = 0; i < k; i++) {
+            from_float(s_intermediate_fp32_[i], s_down_input_[i], config_.intermediate_size, ggml_internal_get_type_traits(config_.down_type).vec_dot_type);
+        }
+    }
+
+    nth = config_.hidden_size / config_.stride;
+    backend->do_work_stealing_job(nth, nullptr, [&](int task_id) {
+        int ith = task_id;
+        for (int i = ith * config_.stride; i < (ith + 1) * config_.stride; i++) {
+            s_output_fp32_[i] = 0;
+        }
+        for (int expert_idx = 0; expert_idx < k; expert_idx++) {
+            void* down_proj_ptr = (uint8_t*)store->down(s_store_slots_[expert_idx]) + ith * config_.stride * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
             float* down_output_ptr = s_down_output_[expert_idx] + ith * config_.stride;
             llamafile_sgemm(config_.stride, 1, config_.intermediate_size / ggml_blck_size(config_.down_type), down_proj_ptr, config_.intermediate_size / ggml_blck_size(config_.down_type), s_down_input_[expert_idx], config_.intermediate_size / ggml_blck_size(config_.down_type), down_output_ptr, config_.stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.down_type, ggml_internal_get_type_traits(config_.down_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
             for (int i = ith * config_.stride; i < (ith + 1) * config_.stride; i++) {
@@ -394,17 +1076,221 @@ void MOE::forward_one(int k, const uint64_t* expert_ids, const float* weights, c
     if (config_.stride % ggml_blck_size(config_.hidden_type) != 0) {
         from_float(s_output_fp32_, output, config_.hidden_size, config_.hidden_type);
     }
+    store->release(k, s_store_slots_.data());
+}
+
+#ifdef USE_NUMA
+// Every expert is computed by the threads of its node only: its gate/up
+// strides, then its down strides. A down task spins until the gate/up tasks
+// of its expert are done instead of waiting for a job boundary, which is
+// safe because each thread runs its own (gate/up first) range in order.
+// The per-expert outputs are reduced by a last job over hidden strides.
+void MOE::forward_one_expert_parallel_(int k, const uint64_t* expert_ids, const float* weights, const void* gate_input_ptr, const void* up_input_ptr, void* output, Backend* backend) {
+    int n_numa_nodes = config_.e_n_numa_nodes;
+    int gate_nth = config_.intermediate_size / config_.stride;
+    int down_nth = config_.hidden_size / config_.stride;
+    int expert_tasks = gate_nth + down_nth;
+    ggml_type down_vec_dot_type = ggml_internal_get_type_traits(config_.down_type).vec_dot_type;
+    size_t gate_row_bytes = config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
+    size_t up_row_bytes = config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
+    size_t down_row_bytes = config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
+
+    // [numa_node] -> expert_idx * expert_tasks + ith, gate/up tasks first
+    std::vector<std::vector<int>> node_tasks(n_numa_nodes);
+    for (int expert_idx = 0; expert_idx < k; expert_idx++) {
+        expert_load_[expert_ids[expert_idx]]++;
+        int node = expert_node_[expert_ids[expert_idx]];
+        for (int ith = 0; ith < gate_nth; ith++) {
+            node_tasks[node].push_back(expert_idx * expert_tasks + ith);
+        }
+    }
+    for (int expert_idx = 0; expert_idx < k; expert_idx++) {
+        int node = expert_node_[expert_ids[expert_idx]];
+        for (int ith = gate_nth; ith < expert_tasks; ith++) {
+            node_tasks[node].push_back(expert_idx * expert_tasks + ith);
+        }
+    }
+    std::vector<int> task_splits(n_numa_nodes);
+    int task_num = 0;
+    for (int node = 0; node < n_numa_nodes; node++) {
+        task_splits[node] = node_tasks[node].size();
+        task_num += task_splits[node];
+    }
+    std::vector<std::atomic<int>> gate_done(k);
+    std::vector<std::atomic<bool>> down_ready(k);
+    for (int expert_idx = 0; expert_idx < k; expert_idx++) {
+        gate_done[expert_idx].store(0, std::memory_order_relaxed);
+        down_ready[expert_idx].store(false, std::memory_order_relaxed);
+    }
+
+    backend->do_work_stealing_job_numa_aware(task_num, task_splits, nullptr, [&](int task_id) {
+        int task = node_tasks[Backend::numa_node][task_id];
+        int expert_idx = task / expert_tasks;
+        int ith = task % expert_tasks;
+        uint64_t expert_id = expert_ids[expert_idx];
+        if (ith < gate_nth) {
+            void* gate_proj_ptr = (uint8_t*)gate_proj_expert_[expert_id] + ith * config_.stride * gate_row_bytes;
+            float* gate_output_ptr = s_gate_output_[expert_idx] + ith * config_.stride;
+            llamafile_sgemm(config_.stride, 1, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_proj_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_input_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_output_ptr, config_.stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.gate_type, ggml_internal_get_type_traits(config_.gate_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+            void* up_proj_ptr = (uint8_t*)up_proj_expert_[expert_id] + ith * config_.stride * up_row_bytes;
+            float* up_output_ptr = s_up_output_[expert_idx] + ith * config_.stride;
+            llamafile_sgemm(config_.stride, 1, config_.hidden_size / ggml_blck_size(config_.up_type), up_proj_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_input_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_output_ptr, config_.stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.up_type, ggml_internal_get_type_traits(config_.up_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+            for (int i = ith * config_.stride; i < (ith + 1) * config_.stride; i++) {
+                s_intermediate_fp32_[expert_idx][i] = act_fn(s_gate_output_[expert_idx][i]) * s_up_output_[expert_idx][i];
+            }
+            bool stride_aligned = config_.stride % ggml_blck_size(down_vec_dot_type) == 0;
+            if (stride_aligned) {
+                float* intermediate_fp32_ptr = s_intermediate_fp32_[expert_idx] + ith * config_.stride;
+                void* down_input_ptr = s_down_input_[expert_idx] + ith * config_.stride * ggml_type_size(down_vec_dot_type) / ggml_blck_size(down_vec_dot_type);
+                from_float(intermediate_fp32_ptr, down_input_ptr, config_.stride, down_vec_dot_type);
+            }
+            if (gate_done[expert_idx].fetch_add(1, std::memory_order_acq_rel) + 1 == gate_nth) {
+                if (!stride_aligned) {
+                    from_float(s_intermediate_fp32_[expert_idx], s_down_input_[expert_idx], config_.intermediate_size, down_vec_dot_type);
+                }
+                down_ready[expert_idx].store(true, std::memory_order_release);
+            }
+            return;
+        }
+        ith -= gate_nth;
+        // The gate/up tasks of this expert are still running on other threads.
+        while (!down_ready[expert_idx].load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        void* down_proj_ptr = (uint8_t*)down_proj_expert_[expert_id] + ith * config_.stride * down_row_bytes;
+        float* down_output_ptr = s_down_output_[expert_idx] + ith * config_.stride;
+        llamafile_sgemm(config_.stride, 1, config_.intermediate_size / ggml_blck_size(config_.down_type), down_proj_ptr, config_.intermediate_size / ggml_blck_size(config_.down_type), s_down_input_[expert_idx], config_.intermediate_size / ggml_blck_size(config_.down_type), down_output_ptr, config_.stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.down_type, down_vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+    }, nullptr);
+
+    backend->do_work_stealing_job(down_nth, nullptr, [&](int task_id) {
+        int ith = task_id;
+        for (int i = ith * config_.stride; i < (ith + 1) * config_.stride; i++) {
+            s_output_fp32_[i] = 0;
+            for (int expert_idx = 0; expert_idx < k; expert_idx++) {
+                s_output_fp32_[i] += s_down_output_[expert_idx][i] * weights[expert_idx];
+            }
+        }
+        if (config_.stride % ggml_blck_size(config_.hidden_type) == 0) {
+            float* output_fp32_ptr = s_output_fp32_ + ith * config_.stride;
+            void* output_ptr = (uint8_t*)output + ith * config_.stride * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type);
+            from_float(output_fp32_ptr, output_ptr, config_.stride, config_.hidden_type);
+        }
+    }, nullptr);
+    if (config_.stride % ggml_blck_size(config_.hidden_type) != 0) {
+        from_float(s_output_fp32_, output, config_.hidden_size, config_.hidden_type);
+    }
+}
+#endif
+
+// down_proj over the active column groups of each expert only. The groups
+// are picked from s_intermediate_fp32_ and read from down_colblocked_, where
+// the rows of one group are contiguous, or in place from down_proj_.
+void MOE::forward_one_down_sparse_(int k, const uint64_t* expert_ids, const float* weights, void* output, Backend* backend) {
+    int n_groups = config_.intermediate_size / down_group_;
+    int keep = std::max(1, (int)std::ceil(config_.down_sparse_keep * n_groups));
+    std::vector<std::pair<float, int>>& candidates = s_down_candidates_;
+    for (int expert_idx = 0; expert_idx < k; expert_idx++) {
+        const float* x = s_intermediate_fp32_[expert_idx];
+        candidates.clear();
+        for (int g = 0; g < n_groups; g++) {
+            float amax = 0;
+            float norm = 0;
+            for (int c = g * down_group_; c < (g + 1) * down_group_; c++) {
+                amax = std::max(amax, std::fabs(x[c]));
+                norm += x[c] * x[c];
+            }
+            if (amax > config_.down_sparse_threshold) {
+                candidates.push_back({norm, g});
+            }
+        }
+        if ((int)candidates.size() > keep) {
+            std::nth_element(candidates.begin(), candidates.begin() + keep, candidates.end(), std::greater<std::pair<float, int>>());
+            candidates.resize(keep);
+        }
+        std::vector<int>& groups = s_down_groups_[expert_idx];
+        groups.clear();
+        for (auto& candidate : candidates) {
+            groups.push_back(candidate.second);
+        }
+        std::sort(groups.begin(), groups.end());
+        down_groups_kept_ += groups.size();
+        down_groups_total_ += n_groups;
+    }
+
+    ggml_type down_vec_dot_type = ggml_internal_get_type_traits(config_.down_type).vec_dot_type;
+    ggml_vec_dot_t vec_dot = ggml_internal_get_type_traits(config_.down_type).vec_dot;
+    size_t group_bytes = down_group_ * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
+    size_t input_group_bytes = down_group_ * ggml_type_size(down_vec_dot_type) / ggml_blck_size(down_vec_dot_type);
+    int nth = config_.hidden_size / config_.stride;
+    backend->do_work_stealing_job(nth, nullptr, [&](int task_id) {
+        int ith = task_id;
+        float* output_fp32_ptr = s_output_fp32_ + ith * config_.stride;
+        for (int i = 0; i < config_.stride; i++) {
+            output_fp32_ptr[i] = 0;
+        }
+        for (int expert_idx = 0; expert_idx < k; expert_idx++) {
+            uint64_t expert_id = expert_ids[expert_idx];
+            float* down_output_ptr = s_down_output_[expert_idx] + ith * config_.stride;
+            for (int i = 0; i < config_.stride; i++) {
+                down_output_ptr[i] = 0;
+            }
+            for (int g : s_down_groups_[expert_idx]) {
+                const uint8_t* down_proj_ptr;
+                size_t down_row_stride;
+                if (down_colblocked_) {
+                    down_proj_ptr = (const uint8_t*)down_colblocked_->group_ptr(expert_id, g, ith * config_.stride);
+                    down_row_stride = group_bytes;
+                } else {
+                    down_row_stride = n_groups * group_bytes;
+                    down_proj_ptr = (const uint8_t*)down_proj_ + (expert_id * config_.hidden_size + ith * config_.stride) * down_row_stride + g * group_bytes;
+                }
+                const uint8_t* down_input_ptr = s_down_input_[expert_idx] + g * input_group_bytes;
+                for (int i = 0; i < config_.stride; i++) {
+                    float dot;
+                    vec_dot(down_group_, &dot, 0, down_proj_ptr + i * down_row_stride, 0, down_input_ptr, 0, 1);
+                    down_output_ptr[i] += dot;
+                }
+            }
+            for (int i = 0; i < config_.stride; i++) {
+                output_fp32_ptr[i] += down_output_ptr[i] * weights[expert_idx];
+            }
+        }
+        if (config_.stride % ggml_blck_size(config_.hidden_type) == 0) {
+            void* output_ptr = (uint8_t*)output + ith * config_.stride * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type);
+            from_float(output_fp32_ptr, output_ptr, config_.stride, config_.hidden_type);
+        }
+    }, nullptr);
+    if (config_.stride % ggml_blck_size(config_.hidden_type) != 0) {
+        from_float(s_output_fp32_, output, config_.hidden_size, config_.hidden_type);
+    }
+}
+
+std::pair<uint64_t, uint64_t> MOE::down_sparse_stats() {
+    std::pair<uint64_t, uint64_t> stats = {down_groups_kept_, down_groups_total_};
+    down_groups_kept_ = 0;
+    down_groups_total_ = 0;
+    return stats;
 }
 
 void MOE::forward_many(int qlen, int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend) {
+    assert(config_.store == nullptr);  // forward keeps ExpertStore layers on forward_one
     for (int i = 0; i < config_.expert_num; i++) {
         m_local_num_[i] = 0;
     }
     for (int i = 0; i < qlen; i++) {
         for (int j = 0; j < k; j++) {
-            m_local_pos_[i][j] = m_local_num_[expert_ids[i * k + j]]++;
+            // Ids outside [0, expert_num) are dropped as in forward_one.
+            uint64_t expert_id = expert_ids[i * k + j];
+            m_local_pos_[i][j] = expert_id < (uint64_t)config_.expert_num ? m_local_num_[expert_id]++ : -1;
         }
     }
+#ifdef USE_NUMA
+    if (config_.expert_parallel) {
+        for (int i = 0; i < config_.expert_num; i++) {
+            expert_load_[i] += m_local_num_[i];
+        }
+    }
+#endif
     uint64_t offset = 0;
     for (int i = 0; i < config_.expert_num; i++) {
         m_local_gate_input_ptr_[i] = m_local_gate_input_ + offset * config_.hidden_size * ggml_type_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type);
@@ -442,6 +1328,9 @@ void MOE::forward_many(int qlen, int k, const uint64_t* expert_ids, const float*
             }
         }
         for (int j = 0; j < k; j++) {
+            if (m_local_pos_[i][j] < 0) {
+                continue;
+            }
             memcpy(m_local_gate_input_ptr_[expert_ids[i * k + j]] + m_local_pos_[i][j] * config_.hidden_size * ggml_type_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type), gate_input_ptr, config_.hidden_size * ggml_type_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type));
             memcpy(m_local_up_input_ptr_[expert_ids[i * k + j]] + m_local_pos_[i][j] * config_.hidden_size * ggml_type_size(ggml_internal_get_type_traits(config_.up_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.up_type).vec_dot_type), up_input_ptr, config_.hidden_size * ggml_type_size(ggml_internal_get_type_traits(config_.up_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.up_type).vec_dot_type));
         }
@@ -454,7 +1343,9 @@ void MOE::forward_many(int qlen, int k, const uint64_t* expert_ids, const float*
         void* gate_input_ptr = m_local_gate_input_ptr_[expert_idx];
 
         #ifdef USE_NUMA
-        void* gate_proj_ptr = (uint8_t*)gate_proj_numa_[Backend::numa_node] + (expert_idx * config_.intermediate_size + ith * stride) * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
+        void* gate_proj_ptr = config_.expert_parallel
+            ? (uint8_t*)gate_proj_expert_[expert_idx] + ith * stride * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type)
+            : (uint8_t*)gate_proj_numa_[Backend::numa_node] + (expert_idx * config_.intermediate_size + ith * stride) * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
         #else
         void* gate_proj_ptr = (uint8_t*)gate_proj_ + (expert_idx * config_.intermediate_size + ith * stride) * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
         #endif
@@ -464,7 +1355,9 @@ void MOE::forward_many(int qlen, int k, const uint64_t* expert_ids, const float*
         void* up_input_ptr = m_local_up_input_ptr_[expert_idx];
 
         #ifdef USE_NUMA
-        void* up_proj_ptr = (uint8_t*)up_proj_numa_[Backend::numa_node] + (expert_idx * config_.intermediate_size + ith * stride) * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
+        void* up_proj_ptr = config_.expert_parallel
+            ? (uint8_t*)up_proj_expert_[expert_idx] + ith * stride * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type)
+            : (uint8_t*)up_proj_numa_[Backend::numa_node] + (expert_idx * config_.intermediate_size + ith * stride) * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
         #else
         void* up_proj_ptr = (uint8_t*)up_proj_ + (expert_idx * config_.intermediate_size + ith * stride) * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
         #endif
@@ -488,7 +1381,9 @@ void MOE::forward_many(int qlen, int k, const uint64_t* expert_ids, const float*
         void* down_input_ptr = m_local_down_input_ptr_[expert_idx];
         
         #ifdef USE_NUMA
-        void* down_proj_ptr = (uint8_t*)down_proj_numa_[Backend::numa_node] + (expert_idx * config_.hidden_size + ith * stride) * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
+        void* down_proj_ptr = config_.expert_parallel
+            ? (uint8_t*)down_proj_expert_[expert_idx] + ith * stride * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type)
+            : (uint8_t*)down_proj_numa_[Backend::numa_node] + (expert_idx * config_.hidden_size + ith * stride) * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
         #else
         void* down_proj_ptr = (uint8_t*)down_proj_ + (expert_idx * config_.hidden_size + ith * stride) * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
         #endif
@@ -501,6 +1396,9 @@ void MOE::forward_many(int qlen, int k, const uint64_t* expert_ids, const float*
             m_output_fp32_[i][e] = 0;
         }
         for (int j = 0; j < k; j++) {
+            if (m_local_pos_[i][j] < 0) {
+                continue;
+            }
             for (int e = 0; e < config_.hidden_size; e++) {
                 m_output_fp32_[i][e] += m_local_down_output_ptr_[expert_ids[i * k + j]][m_local_pos_[i][j] * config_.hidden_size + e] * weights[i * k + j];
             }
@@ -510,8 +1408,12 @@ void MOE::forward_many(int qlen, int k, const uint64_t* expert_ids, const float*
 }
 
 void MOE::forward(int qlen, int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend) {
-    if (qlen < config_.group_min_len) {
+    // ExpertStore weights only come token by token, whatever qlen.
+    if (qlen < config_.group_min_len || config_.store) {
         for (int i = 0; i < qlen; i++) {
+            if (i > 0) {
+                backend->preempt_point();
+            }
             // qlen = batchsize * seqlen
             // k 选中的专家数
             // expert_ids + i * k 一个hidden state对应的选中的expert id列表
@@ -538,5 +1440,8 @@ void MOE::forward(int qlen, int k, const uint64_t* expert_ids, const float* weig
 
     int forward_len = std::min(config_.group_max_len, qlen);
     forward_many(forward_len, k, expert_ids, weights, input, output, backend);
+    if (qlen > forward_len) {
+        backend->preempt_point();
+    }
     forward(qlen - forward_len, k, expert_ids + forward_len * k, weights + forward_len * k, (uint8_t*)input + forward_len * config_.hidden_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type), (uint8_t*)output + forward_len * config_.hidden_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type), backend);
 }
\ No newline at end of file
@@ -13,15 +13,20 @@
 #include <cmath>
 #include <cstdio>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "../../cpu_backend/backend.h"
 #include "conversion.h"
+#include "expert_store.h"
 #include "llama.cpp/ggml-impl.h"
 #include "llama.cpp/ggml-quants.h"
 #include "llama.cpp/ggml.h"
 #include "llamafile/sgemm.h"
+#include "repack.h"
 #include "shared_mem_buffer.h"
 
 #ifdef USE_NUMA
@@ -45,6 +50,17 @@ struct MOEConfig {
     ggml_type up_type;
     ggml_type down_type;
     ggml_type hidden_type;
+    bool repack;              // repack supported projections into row panels, see repack.h; not with USE_NUMA
+    std::string repack_path;  // cache file prefix for repacked and sparse-down weights, empty to keep them in memory only
+    bool expert_parallel;     // USE_NUMA only: place whole experts on one node instead of sharding every expert by stride
+    std::string shared_path;  // USE_NUMA only: prefix of per-node weight files shared between processes, unique per layer
+    std::string layout_path;  // USE_NUMA only: file caching the per-node weight copies, not with shared_path
+    float down_sparse_threshold = 0;   // forward_one: skip down_proj channel groups with all |x| <= threshold
+    float down_sparse_keep = 1;        // forward_one: keep at most this fraction of down_proj channel groups
+    float routing_mass_threshold = 1;  // forward_one: keep a token's heaviest experts up to this share of its weight
+    float routing_weight_floor = 0;    // forward_one: drop experts lighter than this, the heaviest is always kept
+    ExpertStore* store = nullptr;      // read experts from the store instead of gate_proj/up_proj/down_proj, forward_one only
+    int store_layer = 0;               // this layer's index in store
 
 #ifdef USE_NUMA
     int e_n_numa_nodes;
@@ -64,8 +80,8 @@ struct MOEConfig {
 
     MOEConfig() {}
 
-    MOEConfig(int expert_num, int routed_expert_num, int hidden_size, int intermediate_size, int stride, int group_min_len, int group_max_len, void* gate_proj, void* up_proj, void* down_proj, ggml_type gate_type, ggml_type up_type, ggml_type down_type, ggml_type hidden_type)
-        : expert_num(expert_num), routed_expert_num(routed_expert_num), hidden_size(hidden_size), intermediate_size(intermediate_size), stride(stride), group_min_len(group_min_len), group_max_len(group_max_len), gate_proj(gate_proj), up_proj(up_proj), down_proj(down_proj), gate_type(gate_type), up_type(up_type), down_type(down_type), hidden_type(hidden_type) {
+    MOEConfig(int expert_num, int routed_expert_num, int hidden_size, int intermediate_size, int stride, int group_min_len, int group_max_len, void* gate_proj, void* up_proj, void* down_proj, ggml_type gate_type, ggml_type up_type, ggml_type down_type, ggml_type hidden_type, bool repack = false, std::string repack_path = "", bool expert_parallel = false)
+        : expert_num(expert_num), routed_expert_num(routed_expert_num), hidden_size(hidden_size), intermediate_size(intermediate_size), stride(stride), group_min_len(group_min_len), group_max_len(group_max_len), gate_proj(gate_proj), up_proj(up_proj), down_proj(down_proj), gate_type(gate_type), up_type(up_type), down_type(down_type), hidden_type(hidden_type), repack(repack), repack_path(repack_path), expert_parallel(expert_parallel) {
 #ifdef USE_NUMA
         e_n_numa_nodes = numa_num_configured_nodes();
         if (e_n_numa_nodes <= 0) {
@@ -182,6 +198,10 @@ class MOE {
     void forward_one(int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend);
     void forward_many(int qlen, int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend);
     void forward(int qlen, int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend);
+    void rebalance_experts();                           // expert_parallel: move experts by recent load, never during a forward
+    std::vector<int> expert_nodes();                    // expert_parallel: owning node of every expert, else empty
+    std::pair<uint64_t, uint64_t> down_sparse_stats();  // active and total down_proj groups since the last call
+    std::vector<uint64_t> expert_skip_stats();          // tokens, tokens with a dropped expert, dropped experts since the last call
 #ifdef USE_NUMA
     static void* numa_alloc_huge_pages(size_t mem_size, int numa_id);
 #endif
@@ -192,12 +212,56 @@ class MOE {
     void* up_proj_;    // [expert_num * intermediate_size * hidden_size ( /32 if quantized)]
     void* down_proj_;  // [expert_num * hidden_size * intermediate_size ( /32 if quantized)]
 
+    std::unique_ptr<RepackedMatrix> gate_packed_;  // nullptr unless config_.repack and the type is supported
+    std::unique_ptr<RepackedMatrix> up_packed_;
+    std::unique_ptr<RepackedMatrix> down_packed_;
+
+    std::unique_ptr<ColumnBlockedMatrix> down_colblocked_;  // <repack_path>.down_sparse, nullptr to read groups from down_proj_
+    int down_group_ = 0;                         // 0 when the sparse path is off
+    std::vector<std::pair<float, int>> s_down_candidates_;  // [intermediate_size / down_group_]
+    std::vector<std::vector<int>> s_down_groups_;  // [routed_expert_num], active groups
+    uint64_t down_groups_kept_ = 0;
+    uint64_t down_groups_total_ = 0;
+
+    std::vector<std::pair<float, uint64_t>> s_routing_;  // [routed_expert_num]
+    uint64_t skip_tokens_ = 0;
+    uint64_t skip_fired_tokens_ = 0;
+    uint64_t skip_experts_ = 0;
+
+    int skip_light_experts_(int k, const uint64_t* expert_ids, const float* weights);
+    void forward_one_down_sparse_(int k, const uint64_t* expert_ids, const float* weights, void* output, Backend* backend);
+
+    std::vector<int> s_store_slots_;  // [routed_expert_num], config_.store slots
+    std::vector<int> s_store_order_;  // [routed_expert_num], resident experts first
+    void forward_one_store_(int k, const uint64_t* expert_ids, const float* weights, const void* gate_input_ptr, const void* up_input_ptr, void* output, Backend* backend);
+
     #ifdef USE_NUMA
     std::vector<void*> gate_proj_numa_;  // [numa_num, expert_num * intermediate_size * hidden_size ( /32 if quantized)]
     std::vector<void*> up_proj_numa_;    // [numa_num, expert_num * intermediate_size * hidden_size ( /32 if quantized)]
     std::vector<void*> down_proj_numa_;  // [numa_num, expert_num * hidden_size * intermediate_size ( /32 if quantized)]
+
+    // expert_parallel placement, the vectors above stay empty
+    std::vector<int> expert_node_;         // [expert_num], owning node
+    std::vector<void*> gate_proj_expert_;  // [expert_num], intermediate_size * hidden_size on expert_node_
+    std::vector<void*> up_proj_expert_;    // [expert_num], intermediate_size * hidden_size on expert_node_
+    std::vector<void*> down_proj_expert_;  // [expert_num], hidden_size * intermediate_size on expert_node_
+    std::vector<uint64_t> expert_load_;    // [expert_num], tokens routed since the last rebalance
+
+    std::vector<std::pair<void*, size_t>> shared_maps_;  // shared_path and layout_path mappings, unmapped instead of numa_free
+
+    std::string shared_file_name_(const char* proj, int numa_id);
+    bool shared_file_valid_(const std::string& file, size_t mem_size, int numa_nodes, uint64_t fingerprint);
+    void* map_shared_(const std::string& file, size_t mem_size, int numa_id, int numa_nodes, uint64_t fingerprint, bool create);
+    std::vector<size_t> numa_region_bytes_(int numa_nodes);  // gate, up, down of node 0, then node 1, ...
+    uint64_t numa_layout_fingerprint_();
+    bool load_numa_layout_(int numa_nodes);
+    void store_numa_layout_(int numa_nodes);
+    void place_expert_(int expert_id, int numa_node_id);
+    void forward_one_expert_parallel_(int k, const uint64_t* expert_ids, const float* weights, const void* gate_input_ptr, const void* up_input_ptr, void* output, Backend* backend);
     #endif
 
+    std::vector<uint64_t> s_expert_ids_;       // [routed_expert_num]
+    std::vector<float> s_weights_;             // [routed_expert_num]
     float* s_input_fp32_;                      // [hidden_size]
     uint8_t* s_gate_input_;                    // [hidden_size * ggml_type_size(ggml_internal_get_type_traits(gate_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(gate_type).vec_dot_type)]
     uint8_t* s_up_input_;                      // [hidden_size * ggml_type_size(ggml_internal_get_type_traits(up_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(up_type).vec_dot_type)]
@@ -0,0 +1,188 @@
+/**
+ * @Description  : MOE experts sharded across hosts
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#include "moe_expert_group.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+MOEExpertGroup::MOEExpertGroup(MOEExpertGroupConfig config, ExpertTransport* transport) {
+    config_ = config;
+    transport_ = transport;
+    hidden_bytes_ = (uint64_t)config_.hidden_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type);
+    int world_size = transport_->world_size();
+    size_t routes = (size_t)config_.max_qlen * config_.routed_expert_num;
+    peer_expert_ids_.resize(world_size);
+    peer_weights_.resize(world_size);
+    for (int i = 0; i < world_size; i++) {
+        peer_expert_ids_[i].resize(routes);
+        peer_weights_[i].resize(routes);
+    }
+    peer_input_.resize(config_.max_qlen * hidden_bytes_);
+    peer_output_.resize(config_.max_qlen * hidden_bytes_);
+    output_fp32_.resize((size_t)config_.max_qlen * config_.hidden_size);
+    partial_fp32_.resize((size_t)config_.max_qlen * config_.hidden_size);
+}
+
+int MOEExpertGroup::add_layer(MOE* moe) {
+    layers_.push_back(moe);
+    return layers_.size() - 1;
+}
+
+void MOEExpertGroup::validate(int layer, int qlen, int k) {
+    if (layer < 0 || layer >= (int)layers_.size()) {
+        throw std::invalid_argument("MOEExpertGroup: rank " + std::to_string(transport_->rank()) + " has no layer " + std::to_string(layer));
+    }
+    if (qlen < 0 || qlen > config_.max_qlen) {
+        throw std::invalid_argument("MOEExpertGroup: qlen " + std::to_string(qlen) + " outside [0, max_qlen " + std::to_string(config_.max_qlen) + "]");
+    }
+    if (k < 0 || k > config_.routed_expert_num) {
+        throw std::invalid_argument("MOEExpertGroup: k " + std::to_string(k) + " outside [0, routed_expert_num " + std::to_string(config_.routed_expert_num) + "]");
+    }
+}
+
+// Reads and drops the payload of a request this rank cannot run, so that
+// the stream stays in step with rank 0.
+void MOEExpertGroup::discard_(uint64_t bytes) {
+    while (bytes > 0) {
+        uint64_t n = std::min<uint64_t>(bytes, peer_input_.size());
+        transport_->recv(0, peer_input_.data(), n);
+        bytes -= n;
+    }
+}
+
+// Routing of rank's experts in rank-local ids; the others get an id no
+// local MOE has and weight 0.
+void MOEExpertGroup::remap_(int rank, int qlen, int k, const uint64_t* expert_ids, const float* weights) {
+    for (int i = 0; i < qlen * k; i++) {
+        if (owner(expert_ids[i]) == rank) {
+            peer_expert_ids_[rank][i] = local_id(expert_ids[i]);
+            peer_weights_[rank][i] = weights[i];
+        } else {
+            peer_expert_ids_[rank][i] = UINT64_MAX;
+            peer_weights_[rank][i] = 0;
+        }
+    }
+}
+
+void MOEExpertGroup::forward(int layer, int qlen, int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend) {
+    // Checked by the caller through validate().
+    assert(transport_->rank() == 0);
+    int world_size = transport_->world_size();
+    // The first error of each peer; the others are still served and
+    // drained so that their streams stay in step.
+    std::vector<std::string> errors(world_size);
+    for (int peer = 1; peer < world_size; peer++) {
+        remap_(peer, qlen, k, expert_ids, weights);
+        int32_t header[3] = {layer, qlen, k};
+        try {
+            transport_->send(peer, header, sizeof(header));
+            transport_->send(peer, peer_expert_ids_[peer].data(), sizeof(uint64_t) * qlen * k);
+            transport_->send(peer, peer_weights_[peer].data(), sizeof(float) * qlen * k);
+            transport_->send(peer, input, hidden_bytes_ * qlen);
+        } catch (const std::runtime_error& e) {
+            errors[peer] = e.what();
+        }
+    }
+
+    // The peers work on their experts meanwhile.
+    remap_(0, qlen, k, expert_ids, weights);
+    layers_[layer]->forward(qlen, k, peer_expert_ids_[0].data(), peer_weights_[0].data(), input, output, backend);
+    if (world_size == 1) {
+        return;
+    }
+
+    int n = qlen * config_.hidden_size;
+    to_float(output, output_fp32_.data(), n, config_.hidden_type);
+    for (int peer = 1; peer < world_size; peer++) {
+        if (!errors[peer].empty()) {
+            continue;
+        }
+        try {
+            int32_t status;
+            transport_->recv(peer, &status, sizeof(status));
+            if (status != 0) {
+                errors[peer] = "rank " + std::to_string(peer) + " failed the request";
+                continue;
+            }
+            transport_->recv(peer, peer_output_.data(), hidden_bytes_ * qlen);
+        } catch (const std::runtime_error& e) {
+            errors[peer] = e.what();
+            continue;
+        }
+        to_float(peer_output_.data(), partial_fp32_.data(), n, config_.hidden_type);
+        for (int i = 0; i < n; i++) {
+            output_fp32_[i] += partial_fp32_[i];
+        }
+    }
+    for (int peer = 1; peer < world_size; peer++) {
+        if (!errors[peer].empty()) {
+            // The output lacks the experts of that peer.
+            throw std::runtime_error("MOEExpertGroup: layer " + std::to_string(layer) + ": " + errors[peer]);
+        }
+    }
+    from_float(output_fp32_.data(), output, n, config_.hidden_type);
+}
+
+void MOEExpertGroup::serve(CPUInfer* cpuinfer) {
+    int rank = transport_->rank();
+    if (rank == 0) {
+        throw std::runtime_error("MOEExpertGroup: rank 0 sends requests and cannot serve them");
+    }
+    while (true) {
+        int32_t header[3];
+        transport_->recv(0, header, sizeof(header));
+        int layer = header[0];
+        int qlen = header[1];
+        int k = header[2];
+        if (layer < 0) {
+            return;
+        }
+        if (qlen < 0 || k < 0) {
+            // Not a header rank 0 sends; the stream is out of step.
+            throw std::runtime_error("MOEExpertGroup: rank " + std::to_string(rank) + " got a corrupt request header");
+        }
+        int32_t status = 0;
+        try {
+            validate(layer, qlen, k);
+        } catch (const std::invalid_argument& e) {
+            printf("%s, failing the request\n", e.what());
+            discard_((sizeof(uint64_t) + sizeof(float)) * (uint64_t)qlen * k + hidden_bytes_ * qlen);
+            status = 1;
+            transport_->send(0, &status, sizeof(status));
+            continue;
+        }
+        transport_->recv(0, peer_expert_ids_[rank].data(), sizeof(uint64_t) * qlen * k);
+        transport_->recv(0, peer_weights_[rank].data(), sizeof(float) * qlen * k);
+        transport_->recv(0, peer_input_.data(), hidden_bytes_ * qlen);
+        cpuinfer->enqueue(&MOE::forward, layers_[layer], qlen, k, (const uint64_t*)peer_expert_ids_[rank].data(), (const float*)peer_weights_[rank].data(),
+                          (const void*)peer_input_.data(), (void*)peer_output_.data());
+        try {
+            cpuinfer->sync();
+        } catch (const std::exception& e) {
+            // e.g. an ExpertStore read error; the next request may succeed
+            printf("MOEExpertGroup: rank %d: %s, failing the request\n", rank, e.what());
+            status = 1;
+            transport_->send(0, &status, sizeof(status));
+            continue;
+        }
+        transport_->send(0, &status, sizeof(status));
+        transport_->send(0, peer_output_.data(), hidden_bytes_ * qlen);
+    }
+}
+
+void MOEExpertGroup::shutdown() {
+    if (transport_->rank() != 0) {
+        throw std::runtime_error("MOEExpertGroup: only rank 0 shuts the group down");
+    }
+    int32_t header[3] = {-1, 0, 0};
+    for (int peer = 1; peer < transport_->world_size(); peer++) {
+        transport_->send(peer, header, sizeof(header));
+    }
+}
@@ -0,0 +1,80 @@
+/**
+ * @Description  : MOE experts sharded across hosts
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_OPERATOR_MOE_EXPERT_GROUP_H
+#define CPUINFER_OPERATOR_MOE_EXPERT_GROUP_H
+
+#include <cstdint>
+#include <vector>
+
+#include "../../cpu_backend/cpuinfer.h"
+#include "expert_transport.h"
+#include "moe.h"
+
+struct MOEExpertGroupConfig {
+    int expert_num;         // over all ranks
+    int routed_expert_num;
+    int hidden_size;
+    ggml_type hidden_type;
+    int max_qlen;           // tokens per forward
+
+    MOEExpertGroupConfig() {}
+
+    MOEExpertGroupConfig(int expert_num, int routed_expert_num, int hidden_size, ggml_type hidden_type, int max_qlen)
+        : expert_num(expert_num), routed_expert_num(routed_expert_num), hidden_size(hidden_size), hidden_type(hidden_type), max_qlen(max_qlen) {}
+};
+
+// Expert e lives on rank e % world_size as local expert e / world_size, so
+// each rank's MOE is built from its slice of the experts only. Rank 0 runs
+// the model and calls forward; the other ranks sit in serve().
+//
+// forward sends every peer the tokens with their routing remapped to the
+// peer's local ids (experts owned elsewhere become ids past the local
+// expert_num, which MOE::forward_one drops), computes the rank 0 experts
+// while the peers compute theirs, then receives and sums the peers'
+// weighted partial outputs.
+//
+// Each peer answers a request with a status before its output. A peer that
+// cannot run a request, e.g. because it registered fewer layers than rank
+// 0, still reads the request, answers with a failure and keeps serving.
+// forward throws std::runtime_error, rethrown by CPUInfer::sync, when a
+// peer failed the request or its connection broke.
+class MOEExpertGroup {
+   public:
+    MOEExpertGroup(MOEExpertGroupConfig, ExpertTransport* transport);
+    // Registers this rank's slice of the next layer. Every rank must add
+    // the same layers in the same order. The MOE must outlive the group.
+    int add_layer(MOE* moe);
+    int owner(uint64_t expert_id) { return expert_id % transport_->world_size(); }
+    uint64_t local_id(uint64_t expert_id) { return expert_id / transport_->world_size(); }
+    // Throws std::invalid_argument unless this rank has the layer and the
+    // request fits max_qlen and routed_expert_num.
+    void validate(int layer, int qlen, int k);
+    // Rank 0 only.
+    void forward(int layer, int qlen, int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend);
+    // Ranks other than 0: serve rank 0's requests until shutdown.
+    void serve(CPUInfer* cpuinfer);
+    // Rank 0 only: ends serve() on every other rank.
+    void shutdown();
+
+   private:
+    MOEExpertGroupConfig config_;
+    ExpertTransport* transport_;
+    std::vector<MOE*> layers_;
+    uint64_t hidden_bytes_;  // one token of hidden_type
+
+    std::vector<std::vector<uint64_t>> peer_expert_ids_;  // [world_size, max_qlen * k]
+    std::vector<std::vector<float>> peer_weights_;        // [world_size, max_qlen * k]
+    std::vector<uint8_t> peer_input_;                     // [max_qlen * hidden_bytes_]
+    std::vector<uint8_t> peer_output_;                    // [max_qlen * hidden_bytes_]
+    std::vector<float> output_fp32_;                      // [max_qlen * hidden_size]
+    std::vector<float> partial_fp32_;                     // [max_qlen * hidden_size]
+
+    void discard_(uint64_t bytes);
+
+    void remap_(int rank, int qlen, int k, const uint64_t* expert_ids, const float* weights);
+};
+
+#endif
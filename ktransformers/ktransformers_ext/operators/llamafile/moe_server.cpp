@@ -0,0 +1,364 @@
+/**
+ * @Description  : Out-of-process MOE executor over a shared-memory ring
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#include "moe_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+static const uint64_t kMOEServerMagic = 0x4b544d4f45535256ULL;  // "KTMOESRV"
+
+static const int kReclaimSweeps = 4096;  // sweeps between checks for dead clients
+
+static uint64_t align64(uint64_t x) {
+    return (x + 63) / 64 * 64;
+}
+
+// Yields until done() or until timeout_ms (negative: never) has passed.
+template <typename F>
+static bool spin_until(F done, int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!done()) {
+        if (timeout_ms >= 0 && std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+MOEServerLayout::MOEServerLayout(int max_qlen, int routed_expert_num, int hidden_size, ggml_type hidden_type) {
+    uint64_t hidden_bytes = (uint64_t)max_qlen * hidden_size * ggml_type_size(hidden_type) / ggml_blck_size(hidden_type);
+    expert_ids_offset = align64(sizeof(MOEServerSlot));
+    weights_offset = align64(expert_ids_offset + sizeof(uint64_t) * max_qlen * routed_expert_num);
+    input_offset = align64(weights_offset + sizeof(float) * max_qlen * routed_expert_num);
+    output_offset = align64(input_offset + hidden_bytes);
+    slot_bytes = align64(output_offset + hidden_bytes);
+}
+
+uint64_t MOEServerLayout::header_bytes() {
+    return align64(sizeof(MOEServerHeader));
+}
+
+MOEServer::MOEServer(MOEServerConfig config) {
+    config_ = config;
+    layout_ = MOEServerLayout(config_.max_qlen, config_.routed_expert_num, config_.hidden_size, config_.hidden_type);
+    bytes_ = MOEServerLayout::header_bytes() + config_.slot_num * layout_.slot_bytes;
+
+    // A segment left by a crashed server is replaced, clients attached to
+    // it keep the old one and have to reconnect.
+    std::string shm_name = "/" + config_.name;
+    shm_unlink(shm_name.c_str());
+    int fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("MOEServer: shm_open " + shm_name + " failed: " + strerror(errno));
+    }
+    if (ftruncate(fd, bytes_) != 0) {
+        std::string error = strerror(errno);
+        close(fd);
+        shm_unlink(shm_name.c_str());
+        throw std::runtime_error("MOEServer: failed to size " + shm_name + ": " + error);
+    }
+    base_ = (uint8_t*)mmap(NULL, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base_ == MAP_FAILED) {
+        std::string error = strerror(errno);
+        shm_unlink(shm_name.c_str());
+        throw std::runtime_error("MOEServer: mmap " + shm_name + " failed: " + error);
+    }
+
+    header_ = new (base_) MOEServerHeader();
+    header_->slot_num = config_.slot_num;
+    header_->max_qlen = config_.max_qlen;
+    header_->routed_expert_num = config_.routed_expert_num;
+    header_->hidden_size = config_.hidden_size;
+    header_->hidden_type = config_.hidden_type;
+    header_->slot_bytes = layout_.slot_bytes;
+    header_->layer_num.store(0, std::memory_order_relaxed);
+    header_->head.store(0, std::memory_order_relaxed);
+    header_->stop.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < config_.slot_num; i++) {
+        MOEServerSlot* slot = new (slot_header_(i)) MOEServerSlot();
+        slot->word.store(MOEServerSlot::pack(MOEServerSlot::FREE, 0, 0), std::memory_order_relaxed);
+    }
+    hidden_bytes_ = (uint64_t)config_.hidden_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type);
+    uint64_t rows = (uint64_t)config_.slot_num * config_.max_qlen;
+    batch_expert_ids_.resize(rows * config_.routed_expert_num);
+    batch_weights_.resize(rows * config_.routed_expert_num);
+    batch_input_.resize(rows * hidden_bytes_);
+    batch_output_.resize(rows * hidden_bytes_);
+    // Published last: clients check the magic before touching anything else.
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic = kMOEServerMagic;
+}
+
+MOEServer::~MOEServer() {
+    munmap(base_, bytes_);
+    shm_unlink(("/" + config_.name).c_str());
+}
+
+int MOEServer::add_layer(MOE* moe) {
+    layers_.push_back(moe);
+    header_->layer_num.store(layers_.size(), std::memory_order_release);
+    return layers_.size() - 1;
+}
+
+void MOEServer::stop() {
+    header_->stop.store(1, std::memory_order_release);
+}
+
+// Frees the CLAIMED and DONE slots of clients that exited without
+// releasing them. The CAS fails if the slot moved on in the meantime.
+void MOEServer::reclaim_() {
+    for (int i = 0; i < config_.slot_num; i++) {
+        MOEServerSlot* slot = slot_header_(i);
+        uint64_t word = slot->word.load(std::memory_order_acquire);
+        uint32_t state = MOEServerSlot::state_of(word);
+        if (state != MOEServerSlot::CLAIMED && state != MOEServerSlot::DONE) {
+            continue;
+        }
+        if (kill(MOEServerSlot::owner_of(word), 0) == 0 || errno != ESRCH) {
+            continue;
+        }
+        if (slot->word.compare_exchange_strong(word, MOEServerSlot::pack(MOEServerSlot::FREE, 0, MOEServerSlot::epoch_of(word)), std::memory_order_acq_rel)) {
+            printf("MOEServer: freed slot %d of exited client %u\n", i, MOEServerSlot::owner_of(word));
+        }
+    }
+}
+
+void MOEServer::run(CPUInfer* cpuinfer) {
+    int k = config_.routed_expert_num;
+    std::vector<int> batch;
+    std::vector<uint64_t> words(config_.slot_num);
+    std::vector<std::vector<int>> layer_slots;  // [layer], the READY slots of this sweep
+    std::vector<std::pair<int, uint64_t>> gathered;  // layers run from the batch buffers, and their first row
+    int idle = 0;
+    int sweeps = 0;
+    while (!header_->stop.load(std::memory_order_acquire)) {
+        if (++sweeps % kReclaimSweeps == 0) {
+            reclaim_();
+        }
+        batch.clear();
+        layer_slots.resize(layers_.size());
+        for (auto& slots : layer_slots) {
+            slots.clear();
+        }
+        for (int i = 0; i < config_.slot_num; i++) {
+            MOEServerSlot* slot = slot_header_(i);
+            uint64_t word = slot->word.load(std::memory_order_acquire);
+            if (MOEServerSlot::state_of(word) != MOEServerSlot::READY) {
+                continue;
+            }
+            words[i] = word;
+            uint32_t owner = MOEServerSlot::owner_of(word);
+            uint32_t epoch = MOEServerSlot::epoch_of(word);
+            slot->word.store(MOEServerSlot::pack(MOEServerSlot::RUNNING, owner, epoch), std::memory_order_relaxed);
+            slot->failed = 0;
+            if (slot->layer < 0 || slot->layer >= (int)layers_.size() || slot->qlen < 0 || slot->qlen > config_.max_qlen) {
+                printf("MOEServer: dropping request for layer %d, qlen %d\n", slot->layer, slot->qlen);
+                slot->failed = 1;
+                slot->word.store(MOEServerSlot::pack(MOEServerSlot::DONE, owner, epoch), std::memory_order_release);
+                continue;
+            }
+            layer_slots[slot->layer].push_back(i);
+            batch.push_back(i);
+        }
+        if (batch.empty()) {
+            // Spin briefly for decode latency, then back off to keep an idle
+            // server off the cores the Backend needs.
+            if (++idle < 1024) {
+                std::this_thread::yield();
+            } else {
+                usleep(50);
+            }
+            continue;
+        }
+        idle = 0;
+
+        // A slot alone on its layer runs in place; several are gathered so
+        // that MOE::forward sees all their tokens at once.
+        gathered.clear();
+        uint64_t row = 0;
+        for (int layer = 0; layer < (int)layers_.size(); layer++) {
+            std::vector<int>& slots = layer_slots[layer];
+            if (slots.size() == 1) {
+                uint8_t* slot_ptr = slot_(slots[0]);
+                cpuinfer->enqueue(&MOE::forward, layers_[layer], (int)slot_header_(slots[0])->qlen, k,
+                                  (const uint64_t*)(slot_ptr + layout_.expert_ids_offset), (const float*)(slot_ptr + layout_.weights_offset),
+                                  (const void*)(slot_ptr + layout_.input_offset), (void*)(slot_ptr + layout_.output_offset));
+                continue;
+            }
+            if (slots.empty()) {
+                continue;
+            }
+            uint64_t first = row;
+            for (int i : slots) {
+                uint8_t* slot_ptr = slot_(i);
+                int qlen = slot_header_(i)->qlen;
+                memcpy(batch_expert_ids_.data() + row * k, slot_ptr + layout_.expert_ids_offset, sizeof(uint64_t) * qlen * k);
+                memcpy(batch_weights_.data() + row * k, slot_ptr + layout_.weights_offset, sizeof(float) * qlen * k);
+                memcpy(batch_input_.data() + row * hidden_bytes_, slot_ptr + layout_.input_offset, hidden_bytes_ * qlen);
+                row += qlen;
+            }
+            cpuinfer->enqueue(&MOE::forward, layers_[layer], (int)(row - first), k,
+                              (const uint64_t*)(batch_expert_ids_.data() + first * k), (const float*)(batch_weights_.data() + first * k),
+                              (const void*)(batch_input_.data() + first * hidden_bytes_), (void*)(batch_output_.data() + first * hidden_bytes_));
+            gathered.push_back({layer, first});
+        }
+        int32_t failed = 0;
+        try {
+            cpuinfer->sync();
+        } catch (const std::exception& e) {
+            // Which request threw is not known, so the whole sweep fails.
+            printf("MOEServer: %s, failing %zu requests\n", e.what(), batch.size());
+            failed = 1;
+        }
+        for (auto& [layer, first] : gathered) {
+            uint64_t row = first;
+            for (int i : layer_slots[layer]) {
+                int qlen = slot_header_(i)->qlen;
+                memcpy(slot_(i) + layout_.output_offset, batch_output_.data() + row * hidden_bytes_, hidden_bytes_ * qlen);
+                row += qlen;
+            }
+        }
+        for (int i : batch) {
+            uint64_t word = words[i];
+            slot_header_(i)->failed = failed;
+            slot_header_(i)->word.store(MOEServerSlot::pack(MOEServerSlot::DONE, MOEServerSlot::owner_of(word), MOEServerSlot::epoch_of(word)), std::memory_order_release);
+        }
+    }
+}
+
+MOEClient::MOEClient(std::string name) {
+    std::string shm_name = "/" + name;
+    int fd = shm_open(shm_name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        throw std::runtime_error("MOEClient: shm_open " + shm_name + " failed: " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < MOEServerLayout::header_bytes()) {
+        close(fd);
+        throw std::runtime_error("MOEClient: " + shm_name + " is not an initialized MOEServer segment");
+    }
+    bytes_ = st.st_size;
+    base_ = (uint8_t*)mmap(NULL, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base_ == MAP_FAILED) {
+        throw std::runtime_error("MOEClient: mmap " + shm_name + " failed: " + strerror(errno));
+    }
+    header_ = (MOEServerHeader*)base_;
+    bool valid = header_->magic == kMOEServerMagic;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (valid) {
+        layout_ = MOEServerLayout(header_->max_qlen, header_->routed_expert_num, header_->hidden_size, (ggml_type)header_->hidden_type);
+        valid = header_->slot_num > 0 && layout_.slot_bytes == header_->slot_bytes &&
+                MOEServerLayout::header_bytes() + header_->slot_num * layout_.slot_bytes <= bytes_;
+    }
+    if (!valid) {
+        munmap(base_, bytes_);
+        throw std::runtime_error("MOEClient: " + shm_name + " is not an initialized MOEServer segment");
+    }
+    pid_ = getpid();
+    claims_.resize(header_->slot_num);
+}
+
+MOEClient::~MOEClient() {
+    munmap(base_, bytes_);
+}
+
+int MOEClient::acquire(int timeout_ms) {
+    int slot = -1;
+    spin_until([&] {
+        uint32_t i = header_->head.fetch_add(1, std::memory_order_relaxed) % header_->slot_num;
+        MOEServerSlot* s = slot_header_(i);
+        uint64_t word = s->word.load(std::memory_order_relaxed);
+        if (MOEServerSlot::state_of(word) != MOEServerSlot::FREE) {
+            return false;
+        }
+        uint64_t claim = MOEServerSlot::pack(MOEServerSlot::CLAIMED, pid_, MOEServerSlot::epoch_of(word) + 1);
+        if (!s->word.compare_exchange_strong(word, claim, std::memory_order_acquire)) {
+            return false;
+        }
+        claims_[i] = claim;
+        slot = i;
+        return true;
+    }, timeout_ms);
+    return slot;
+}
+
+void MOEClient::submit(int slot, int layer, int qlen) {
+    if (qlen < 0 || qlen > header_->max_qlen) {
+        throw std::invalid_argument("MOEClient: qlen " + std::to_string(qlen) + " exceeds max_qlen " + std::to_string(header_->max_qlen));
+    }
+    MOEServerSlot* s = slot_header_(slot);
+    uint64_t claim = claims_[slot];
+    if (s->word.load(std::memory_order_relaxed) != claim) {
+        throw std::invalid_argument("MOEClient: slot " + std::to_string(slot) + " is not claimed by this client");
+    }
+    s->layer = layer;
+    s->qlen = qlen;
+    s->word.store(MOEServerSlot::pack(MOEServerSlot::READY, pid_, MOEServerSlot::epoch_of(claim)), std::memory_order_release);
+}
+
+bool MOEClient::wait(int slot, int timeout_ms) {
+    MOEServerSlot* s = slot_header_(slot);
+    return spin_until([&] {
+        return MOEServerSlot::state_of(s->word.load(std::memory_order_acquire)) == MOEServerSlot::DONE;
+    }, timeout_ms);
+}
+
+void MOEClient::release(int slot) {
+    MOEServerSlot* s = slot_header_(slot);
+    uint64_t word = s->word.load(std::memory_order_relaxed);
+    // Only this client's claim, still CLAIMED or DONE, is released.
+    if (MOEServerSlot::epoch_of(word) == MOEServerSlot::epoch_of(claims_[slot]) && MOEServerSlot::owner_of(word) == pid_ &&
+        (MOEServerSlot::state_of(word) == MOEServerSlot::CLAIMED || MOEServerSlot::state_of(word) == MOEServerSlot::DONE)) {
+        s->word.compare_exchange_strong(word, MOEServerSlot::pack(MOEServerSlot::FREE, 0, MOEServerSlot::epoch_of(word)), std::memory_order_release);
+    }
+}
+
+void MOEClient::forward(int layer, int qlen, const uint64_t* expert_ids, const float* weights, const void* input, void* output, int timeout_ms) {
+    int k = header_->routed_expert_num;
+    uint64_t hidden_bytes = (uint64_t)header_->hidden_size * ggml_type_size((ggml_type)header_->hidden_type) / ggml_blck_size((ggml_type)header_->hidden_type);
+    while (qlen > 0) {
+        int len = std::min(qlen, (int)header_->max_qlen);
+        int slot = acquire(timeout_ms);
+        if (slot < 0) {
+            throw std::runtime_error("MOEClient: no free slot within the timeout");
+        }
+        memcpy(this->expert_ids(slot), expert_ids, sizeof(uint64_t) * len * k);
+        memcpy(this->weights(slot), weights, sizeof(float) * len * k);
+        memcpy(this->input(slot), input, hidden_bytes * len);
+        submit(slot, layer, len);
+        if (!wait(slot, timeout_ms)) {
+            throw std::runtime_error("MOEClient: request not served within the timeout");
+        }
+        if (failed(slot)) {
+            release(slot);
+            throw std::runtime_error("MOEClient: the server failed the request");
+        }
+        memcpy(output, this->output(slot), hidden_bytes * len);
+        release(slot);
+        qlen -= len;
+        expert_ids += len * k;
+        weights += len * k;
+        input = (const uint8_t*)input + hidden_bytes * len;
+        output = (uint8_t*)output + hidden_bytes * len;
+    }
+}
+
+void MOEClient::shutdown() {
+    header_->stop.store(1, std::memory_order_release);
+}
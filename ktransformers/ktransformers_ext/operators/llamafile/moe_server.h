@@ -0,0 +1,162 @@
+/**
+ * @Description  : Out-of-process MOE executor over a shared-memory ring
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_OPERATOR_MOE_SERVER_H
+#define CPUINFER_OPERATOR_MOE_SERVER_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../../cpu_backend/cpuinfer.h"
+#include "moe.h"
+
+// One POSIX shared memory segment, /dev/shm/<name>, holds a header and
+// slot_num request slots. A slot carries one MOE::forward call: expert ids,
+// weights and hidden states in, hidden states out, each sized for max_qlen
+// tokens. Clients write requests in place and read results in place.
+//
+// Slot states, each transition made by one side only:
+//   FREE -(client CAS)-> CLAIMED -(client)-> READY -(server)-> RUNNING
+//   -(server)-> DONE -(client)-> FREE
+// except that the server also frees CLAIMED and DONE slots whose client
+// process has exited, so a client dying mid-request does not leak its
+// slot. Owners are identified by pid, so the server and its clients must
+// share a pid namespace.
+struct MOEServerConfig {
+    std::string name;       // shm name, without the leading '/'
+    int slot_num;
+    int max_qlen;           // tokens per request
+    int routed_expert_num;  // k of every request
+    int hidden_size;
+    ggml_type hidden_type;
+
+    MOEServerConfig() {}
+
+    MOEServerConfig(std::string name, int slot_num, int max_qlen, int routed_expert_num, int hidden_size, ggml_type hidden_type)
+        : name(name), slot_num(slot_num), max_qlen(max_qlen), routed_expert_num(routed_expert_num), hidden_size(hidden_size), hidden_type(hidden_type) {}
+};
+
+struct MOEServerHeader {
+    uint64_t magic;
+    int32_t slot_num;
+    int32_t max_qlen;
+    int32_t routed_expert_num;
+    int32_t hidden_size;
+    int32_t hidden_type;
+    uint64_t slot_bytes;
+    std::atomic<int32_t> layer_num;  // layers registered by the server
+    std::atomic<uint32_t> head;      // next slot a client tries to claim
+    std::atomic<uint32_t> stop;
+};
+
+struct alignas(64) MOEServerSlot {
+    enum { FREE, CLAIMED, READY, RUNNING, DONE };
+    // The state in bits [0, 8), the claiming client's pid in [8, 32) and the
+    // number of times the slot was claimed in [32, 64), updated together so
+    // that freeing a dead client's slot cannot race with a new claim of it.
+    std::atomic<uint64_t> word;
+    int32_t layer;
+    int32_t qlen;
+    int32_t failed;  // set by the server with DONE if the request could not run
+    // followed by expert_ids [max_qlen * k] uint64, weights [max_qlen * k]
+    // float, input and output [max_qlen, hidden_size] of hidden_type
+
+    static uint64_t pack(uint32_t state, uint32_t owner, uint32_t epoch) { return (uint64_t)epoch << 32 | (owner & 0xffffff) << 8 | state; }
+    static uint32_t state_of(uint64_t word) { return word & 0xff; }
+    static uint32_t owner_of(uint64_t word) { return (word >> 8) & 0xffffff; }  // Linux pids are below 2^22
+    static uint32_t epoch_of(uint64_t word) { return word >> 32; }
+};
+
+// Layout shared by server and client, computed from the header fields.
+struct MOEServerLayout {
+    uint64_t expert_ids_offset;
+    uint64_t weights_offset;
+    uint64_t input_offset;
+    uint64_t output_offset;
+    uint64_t slot_bytes;
+
+    MOEServerLayout() {}
+    MOEServerLayout(int max_qlen, int routed_expert_num, int hidden_size, ggml_type hidden_type);
+    static uint64_t header_bytes();
+};
+
+// Owns the segment and the MOE layers. run() serves requests until a
+// client calls shutdown() or stop() is called. Each sweep collects every
+// READY slot; the tokens of slots for the same layer are copied into one
+// batch and run as a single MOE::forward, so that once they reach
+// group_min_len they share the weight reads of forward_many.
+class MOEServer {
+   public:
+    MOEServer(MOEServerConfig);
+    ~MOEServer();
+    // Returns the layer id clients pass to submit. The MOE must outlive the server.
+    int add_layer(MOE* moe);
+    void run(CPUInfer* cpuinfer);
+    void stop();
+
+   private:
+    MOEServerConfig config_;
+    MOEServerLayout layout_;
+    uint8_t* base_;
+    uint64_t bytes_;
+    MOEServerHeader* header_;
+    std::vector<MOE*> layers_;
+    uint64_t hidden_bytes_;  // one token of hidden_type
+    // Tokens of one sweep, [slot_num * max_qlen] rows
+    std::vector<uint64_t> batch_expert_ids_;
+    std::vector<float> batch_weights_;
+    std::vector<uint8_t> batch_input_;
+    std::vector<uint8_t> batch_output_;
+
+    uint8_t* slot_(int slot) { return base_ + MOEServerLayout::header_bytes() + slot * layout_.slot_bytes; }
+    MOEServerSlot* slot_header_(int slot) { return (MOEServerSlot*)slot_(slot); }
+    void reclaim_();
+};
+
+// Attaches to a running server, throwing std::runtime_error if there is
+// none. The zero-copy path is acquire(), writing the request through the
+// expert_ids/weights/input pointers, submit(), wait(), reading output()
+// and release(); forward() does all of it with copies from and to caller
+// buffers. A negative timeout_ms waits forever.
+class MOEClient {
+   public:
+    MOEClient(std::string name);
+    ~MOEClient();
+    // Returns -1 if no slot became free within timeout_ms.
+    int acquire(int timeout_ms = -1);
+    void* expert_ids(int slot) { return slot_(slot) + layout_.expert_ids_offset; }
+    void* weights(int slot) { return slot_(slot) + layout_.weights_offset; }
+    void* input(int slot) { return slot_(slot) + layout_.input_offset; }
+    void* output(int slot) { return slot_(slot) + layout_.output_offset; }
+    void submit(int slot, int layer, int qlen);
+    // Returns false if the request was not done within timeout_ms, e.g.
+    // because the server is gone; the slot then stays claimed.
+    bool wait(int slot, int timeout_ms = -1);
+    // After wait: true if the server could not run the request.
+    bool failed(int slot) { return slot_header_(slot)->failed != 0; }
+    void release(int slot);
+    // Throws std::runtime_error on a timeout or a failed request.
+    void forward(int layer, int qlen, const uint64_t* expert_ids, const float* weights, const void* input, void* output, int timeout_ms = -1);
+    // Asks the server to return from run().
+    void shutdown();
+    int max_qlen() { return header_->max_qlen; }
+    int routed_expert_num() { return header_->routed_expert_num; }
+    int layer_num() { return header_->layer_num.load(std::memory_order_acquire); }
+
+   private:
+    MOEServerLayout layout_;
+    uint8_t* base_;
+    uint64_t bytes_;
+    MOEServerHeader* header_;
+    uint32_t pid_;
+    std::vector<uint64_t> claims_;  // [slot_num], the word of this client's claim of each slot
+
+    uint8_t* slot_(int slot) { return base_ + MOEServerLayout::header_bytes() + slot * layout_.slot_bytes; }
+    MOEServerSlot* slot_header_(int slot) { return (MOEServerSlot*)slot_(slot); }
+};
+
+#endif
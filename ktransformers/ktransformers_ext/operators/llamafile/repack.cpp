@@ -0,0 +1,321 @@
+/**
+ * @Description  : Row-panel repacking of quantized weights for decode GEMV
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#include "repack.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "llamafile/sgemm.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+// compiled regardless of -m flags and picked at runtime from the llamafile kernel level
+#define REPACK_HAVE_AVX2
+#define REPACK_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#endif
+
+namespace {
+
+const size_t kCacheLine = 64;
+const size_t kCacheHeaderBytes = 4096;  // keeps the mapped payload page aligned
+const char kCacheMagic[8] = {'K', 'T', 'R', 'E', 'P', 'A', 'C', 'K'};
+const char kColumnBlockedMagic[8] = {'K', 'T', 'C', 'O', 'L', 'B', 'L', 'K'};
+const uint32_t kCacheVersion = 1;
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t type;
+    int64_t rows;
+    int64_t cols;
+    uint64_t fingerprint;
+    uint64_t bytes;
+};
+
+size_t align_up(size_t x, size_t a) { return (x + a - 1) / a * a; }
+
+#ifdef REPACK_HAVE_AVX2
+REPACK_TARGET_AVX2 inline __m256 dot_q8_0(const int8_t* w, const int8_t* x) {
+    __m256i vw = _mm256_loadu_si256((const __m256i*)w);
+    __m256i vx = _mm256_loadu_si256((const __m256i*)x);
+    __m256i dot16 = _mm256_maddubs_epi16(_mm256_sign_epi8(vw, vw), _mm256_sign_epi8(vx, vw));
+    return _mm256_cvtepi32_ps(_mm256_madd_epi16(dot16, _mm256_set1_epi16(1)));
+}
+
+REPACK_TARGET_AVX2 inline float hsum(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+REPACK_TARGET_AVX2 void gemv_q8_0_avx2(int64_t rows, int64_t cols, const void* w, const block_q8_0* x, float* y, size_t panel_bytes) {
+    int64_t nkb = cols / QK8_0;
+    size_t scale_bytes = align_up(nkb * REPACK_PANEL_ROWS * sizeof(ggml_fp16_t), kCacheLine);
+    for (int64_t p = 0; p < rows / REPACK_PANEL_ROWS; p++) {
+        const uint8_t* panel = (const uint8_t*)w + p * panel_bytes;
+        const ggml_fp16_t* d = (const ggml_fp16_t*)panel;
+        const int8_t* qs = (const int8_t*)(panel + scale_bytes);
+        __m256 acc[REPACK_PANEL_ROWS];
+        for (int r = 0; r < REPACK_PANEL_ROWS; r++) {
+            acc[r] = _mm256_setzero_ps();
+        }
+        for (int64_t kb = 0; kb < nkb; kb++) {
+            float dx = GGML_FP16_TO_FP32(x[kb].d);
+            for (int r = 0; r < REPACK_PANEL_ROWS; r++) {
+                __m256 scale = _mm256_set1_ps(dx * GGML_FP16_TO_FP32(d[kb * REPACK_PANEL_ROWS + r]));
+                acc[r] = _mm256_fmadd_ps(scale, dot_q8_0(qs + (kb * REPACK_PANEL_ROWS + r) * QK8_0, x[kb].qs), acc[r]);
+            }
+        }
+        for (int r = 0; r < REPACK_PANEL_ROWS; r++) {
+            y[p * REPACK_PANEL_ROWS + r] = hsum(acc[r]);
+        }
+    }
+}
+#endif
+
+void gemv_q8_0(int64_t rows, int64_t cols, const void* w, const block_q8_0* x, float* y, size_t panel_bytes) {
+    int64_t nkb = cols / QK8_0;
+    size_t scale_bytes = align_up(nkb * REPACK_PANEL_ROWS * sizeof(ggml_fp16_t), kCacheLine);
+    for (int64_t p = 0; p < rows / REPACK_PANEL_ROWS; p++) {
+        const uint8_t* panel = (const uint8_t*)w + p * panel_bytes;
+        const ggml_fp16_t* d = (const ggml_fp16_t*)panel;
+        const int8_t* qs = (const int8_t*)(panel + scale_bytes);
+        for (int r = 0; r < REPACK_PANEL_ROWS; r++) {
+            float sum = 0;
+            for (int64_t kb = 0; kb < nkb; kb++) {
+                const int8_t* wq = qs + (kb * REPACK_PANEL_ROWS + r) * QK8_0;
+                int isum = 0;
+                for (int j = 0; j < QK8_0; j++) {
+                    isum += wq[j] * x[kb].qs[j];
+                }
+                sum += isum * GGML_FP16_TO_FP32(x[kb].d) * GGML_FP16_TO_FP32(d[kb * REPACK_PANEL_ROWS + r]);
+            }
+            y[p * REPACK_PANEL_ROWS + r] = sum;
+        }
+    }
+}
+
+// Maps a cache file whose header matches `expect`, returning the whole
+// mapping, or nullptr for a missing or stale file.
+void* map_cache(const std::string& path, const CacheHeader& expect, size_t* map_bytes) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    CacheHeader header;
+    bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 memcmp(header.magic, expect.magic, sizeof(header.magic)) == 0 &&
+                 header.version == expect.version && header.type == expect.type &&
+                 header.rows == expect.rows && header.cols == expect.cols &&
+                 header.fingerprint == expect.fingerprint && header.bytes == expect.bytes;
+    struct stat st;
+    valid = valid && fstat(fd, &st) == 0 && (size_t)st.st_size >= kCacheHeaderBytes + expect.bytes;
+    if (!valid) {
+        printf("weights cache %s is stale, rebuilding\n", path.c_str());
+        close(fd);
+        return nullptr;
+    }
+    *map_bytes = kCacheHeaderBytes + expect.bytes;
+    void* map = mmap(NULL, *map_bytes, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    return map == MAP_FAILED ? nullptr : map;
+}
+
+// Writes header + data to a temporary file renamed over `path`.
+bool write_cache(const std::string& path, const CacheHeader& header, const void* data) {
+    std::string tmp_path = path + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    if (f == nullptr) {
+        printf("cannot write weights cache %s\n", tmp_path.c_str());
+        return false;
+    }
+    std::string pad(kCacheHeaderBytes - sizeof(header), '\0');
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(pad.data(), pad.size(), 1, f) == 1 &&
+              fwrite(data, header.bytes, 1, f) == 1;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        printf("failed to write weights cache %s\n", path.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+CacheHeader cache_header(const char* magic, ggml_type type, int64_t rows, int64_t cols, uint64_t fingerprint, size_t bytes) {
+    CacheHeader header;
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = kCacheVersion;
+    header.type = type;
+    header.rows = rows;
+    header.cols = cols;
+    header.fingerprint = fingerprint;
+    header.bytes = bytes;
+    return header;
+}
+
+}  // namespace
+
+uint64_t weights_fingerprint(const void* src, size_t bytes) {
+    uint64_t h = 1469598103934665603ull;
+    const int samples = 1024;
+    for (int i = 0; i < samples; i++) {
+        size_t offset = bytes / samples * i;
+        size_t len = std::min<size_t>(64, bytes - offset);
+        for (size_t j = 0; j < len; j++) {
+            h = (h ^ ((const uint8_t*)src)[offset + j]) * 1099511628211ull;
+        }
+    }
+    return h;
+}
+
+bool RepackedMatrix::supported(ggml_type type, int64_t rows, int64_t cols) {
+    return type == GGML_TYPE_Q8_0 && rows % REPACK_PANEL_ROWS == 0 && cols % QK8_0 == 0;
+}
+
+size_t RepackedMatrix::panel_bytes(ggml_type type, int64_t cols) {
+    int64_t nkb = cols / QK8_0;
+    return align_up(nkb * REPACK_PANEL_ROWS * sizeof(ggml_fp16_t), kCacheLine) + nkb * REPACK_PANEL_ROWS * QK8_0;
+}
+
+RepackedMatrix::RepackedMatrix(ggml_type type, int64_t rows, int64_t cols, const void* src, const std::string& cache_path) {
+    if (!supported(type, rows, cols)) {
+        throw std::invalid_argument("RepackedMatrix: unsupported type " + std::to_string(type) + " or shape [" +
+                                    std::to_string(rows) + ", " + std::to_string(cols) + "]");
+    }
+    type_ = type;
+    rows_ = rows;
+    cols_ = cols;
+    panel_bytes_ = panel_bytes(type, cols);
+    bytes_ = rows / REPACK_PANEL_ROWS * panel_bytes_;
+    data_ = nullptr;
+    map_ = nullptr;
+    map_bytes_ = 0;
+
+    uint64_t fp = weights_fingerprint(src, rows * cols / QK8_0 * sizeof(block_q8_0));
+    if (!cache_path.empty() && load_cache(cache_path, fp)) {
+        return;
+    }
+    data_ = aligned_alloc(kCacheLine, align_up(bytes_, kCacheLine));
+    if (data_ == nullptr) {
+        throw std::runtime_error("RepackedMatrix: failed to allocate " + std::to_string(bytes_) + " bytes");
+    }
+    pack(src);
+    if (!cache_path.empty()) {
+        store_cache(cache_path, fp);
+    }
+}
+
+RepackedMatrix::~RepackedMatrix() {
+    if (map_ != nullptr) {
+        munmap(map_, map_bytes_);
+    } else {
+        free(data_);
+    }
+}
+
+void RepackedMatrix::pack(const void* src) {
+    int64_t nkb = cols_ / QK8_0;
+    size_t scale_bytes = align_up(nkb * REPACK_PANEL_ROWS * sizeof(ggml_fp16_t), kCacheLine);
+    const block_q8_0* blocks = (const block_q8_0*)src;
+    for (int64_t p = 0; p < rows_ / REPACK_PANEL_ROWS; p++) {
+        uint8_t* panel = (uint8_t*)data_ + p * panel_bytes_;
+        ggml_fp16_t* d = (ggml_fp16_t*)panel;
+        int8_t* qs = (int8_t*)(panel + scale_bytes);
+        memset(panel, 0, scale_bytes);
+        for (int r = 0; r < REPACK_PANEL_ROWS; r++) {
+            const block_q8_0* row = blocks + (p * REPACK_PANEL_ROWS + r) * nkb;
+            for (int64_t kb = 0; kb < nkb; kb++) {
+                d[kb * REPACK_PANEL_ROWS + r] = row[kb].d;
+                memcpy(qs + (kb * REPACK_PANEL_ROWS + r) * QK8_0, row[kb].qs, QK8_0);
+            }
+        }
+    }
+}
+
+bool RepackedMatrix::load_cache(const std::string& path, uint64_t fp) {
+    map_ = map_cache(path, cache_header(kCacheMagic, type_, rows_, cols_, fp, bytes_), &map_bytes_);
+    if (map_ == nullptr) {
+        return false;
+    }
+    data_ = (uint8_t*)map_ + kCacheHeaderBytes;
+    return true;
+}
+
+void RepackedMatrix::store_cache(const std::string& path, uint64_t fp) {
+    write_cache(path, cache_header(kCacheMagic, type_, rows_, cols_, fp, bytes_), data_);
+}
+
+void RepackedMatrix::gemv(ggml_type type, int64_t rows, int64_t cols, const void* w, const void* x, float* y) {
+#ifdef REPACK_HAVE_AVX2
+    int isa = llamafile_isa_get();
+    if (isa >= LLAMAFILE_ISA_AVX2 && isa <= LLAMAFILE_ISA_AVX512VNNI) {
+        gemv_q8_0_avx2(rows, cols, w, (const block_q8_0*)x, y, panel_bytes(type, cols));
+        return;
+    }
+#endif
+    gemv_q8_0(rows, cols, w, (const block_q8_0*)x, y, panel_bytes(type, cols));
+}
+
+ColumnBlockedMatrix::ColumnBlockedMatrix(ggml_type type, int64_t experts, int64_t rows, int64_t cols, int64_t group, const void* src, const std::string& cache_path) {
+    if (group <= 0 || cols % group != 0 || group % ggml_blck_size(type) != 0) {
+        throw std::invalid_argument("ColumnBlockedMatrix: group " + std::to_string(group) + " does not divide " +
+                                    std::to_string(cols) + " columns of type " + std::to_string(type));
+    }
+    rows_ = rows;
+    n_groups_ = cols / group;
+    group_bytes_ = group * ggml_type_size(type) / ggml_blck_size(type);
+    size_t row_bytes = n_groups_ * group_bytes_;
+    size_t bytes = experts * rows * row_bytes;
+    // the group size changes the layout but not the source, so it is part
+    // of what the fingerprint identifies
+    CacheHeader header = cache_header(kColumnBlockedMagic, type, experts * rows, cols,
+                                      weights_fingerprint(src, bytes) * 31 + group, bytes);
+    map_ = map_cache(cache_path, header, &map_bytes_);
+    if (map_ != nullptr) {
+        data_ = (uint8_t*)map_ + kCacheHeaderBytes;
+        return;
+    }
+    // built once in anonymous memory, then only kept as the file mapping
+    uint8_t* data = (uint8_t*)aligned_alloc(kCacheLine, align_up(bytes, kCacheLine));
+    if (data == nullptr) {
+        throw std::runtime_error("ColumnBlockedMatrix: failed to allocate " + std::to_string(bytes) + " bytes");
+    }
+    for (int64_t e = 0; e < experts; e++) {
+        for (int64_t g = 0; g < n_groups_; g++) {
+            for (int64_t r = 0; r < rows; r++) {
+                memcpy(data + ((e * n_groups_ + g) * rows + r) * group_bytes_,
+                       (const uint8_t*)src + (e * rows + r) * row_bytes + g * group_bytes_, group_bytes_);
+            }
+        }
+    }
+    if (write_cache(cache_path, header, data)) {
+        map_ = map_cache(cache_path, header, &map_bytes_);
+    }
+    if (map_ == nullptr) {
+        // unwritable cache: keep the anonymous copy
+        data_ = data;
+        return;
+    }
+    free(data);
+    data_ = (uint8_t*)map_ + kCacheHeaderBytes;
+}
+
+ColumnBlockedMatrix::~ColumnBlockedMatrix() {
+    if (map_ != nullptr) {
+        munmap(map_, map_bytes_);
+    } else {
+        free(data_);
+    }
+}
@@ -0,0 +1,88 @@
+/**
+ * @Description  : Row-panel repacking of quantized weights for decode GEMV
+ * @Version      : 1.0.0
+ * @Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_OPERATOR_REPACK_H
+#define CPUINFER_OPERATOR_REPACK_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "llama.cpp/ggml-impl.h"
+#include "llama.cpp/ggml-quants.h"
+#include "llama.cpp/ggml.h"
+
+// Rows are grouped into panels of REPACK_PANEL_ROWS. Within a panel the
+// scales of all rows come first (padded to a cache line), followed by the
+// quants interleaved per block column:
+//   [kb0: row0 qs, row1 qs, row2 qs, row3 qs][kb1: ...]...
+// so a GEMV over a tile streams one contiguous, 64-byte aligned region
+// instead of REPACK_PANEL_ROWS rows with a leading dimension of a full row.
+#define REPACK_PANEL_ROWS 4
+
+// FNV-1a over a sparse sample of the source, enough to notice a different
+// GGUF behind the same cache path without reading the whole tensor.
+uint64_t weights_fingerprint(const void* src, size_t bytes);
+
+class RepackedMatrix {
+   public:
+    // Returns true if weights of this type and shape can be repacked.
+    static bool supported(ggml_type type, int64_t rows, int64_t cols);
+
+    // Repacks `rows` x `cols` weights from GGUF row-major order. With a
+    // non-empty cache_path the result is loaded from (or written to) that file.
+    RepackedMatrix(ggml_type type, int64_t rows, int64_t cols, const void* src, const std::string& cache_path);
+    ~RepackedMatrix();
+
+    // Pointer to the panel containing `row`, which must be a multiple of REPACK_PANEL_ROWS.
+    const void* row_ptr(int64_t row) const { return (const uint8_t*)data_ + row / REPACK_PANEL_ROWS * panel_bytes_; }
+
+    // y[0, rows) = W[rows of the panels at w] . x, with x in the vec_dot_type of `type`.
+    static void gemv(ggml_type type, int64_t rows, int64_t cols, const void* w, const void* x, float* y);
+
+   private:
+    ggml_type type_;
+    int64_t rows_;
+    int64_t cols_;
+    size_t panel_bytes_;
+    size_t bytes_;
+    void* data_;
+    void* map_;  // whole cache file mapping when loaded from disk, else nullptr
+    size_t map_bytes_;
+
+    static size_t panel_bytes(ggml_type type, int64_t cols);
+    void pack(const void* src);
+    bool load_cache(const std::string& path, uint64_t fingerprint);
+    void store_cache(const std::string& path, uint64_t fingerprint);
+};
+
+// [experts, rows, cols] row-major weights regrouped by column groups of
+// `group` columns, [experts, cols / group, rows, group], so that the rows of
+// one group are contiguous. This is a second copy of the weights, so it is
+// only built behind a cache file: the copy lives in that file's page cache,
+// mapped read-only and written once, instead of in anonymous memory (only an
+// unwritable cache path leaves it in anonymous memory).
+class ColumnBlockedMatrix {
+   public:
+    ColumnBlockedMatrix(ggml_type type, int64_t experts, int64_t rows, int64_t cols, int64_t group, const void* src, const std::string& cache_path);
+    ~ColumnBlockedMatrix();
+
+    // The `group` columns of `row` in group `g` of `expert`; the following
+    // rows of the group follow at group_bytes() strides.
+    const void* group_ptr(int64_t expert, int64_t g, int64_t row) const {
+        return (const uint8_t*)data_ + ((expert * n_groups_ + g) * rows_ + row) * group_bytes_;
+    }
+    size_t group_bytes() const { return group_bytes_; }
+
+   private:
+    int64_t rows_;
+    int64_t n_groups_;
+    size_t group_bytes_;
+    void* data_;
+    void* map_;  // whole cache file mapping, nullptr if the cache could not be written
+    size_t map_bytes_;
+};
+
+#endif
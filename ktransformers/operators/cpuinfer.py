@@ -16,7 +16,7 @@ LastEditors  : djw
 LastEditTime : 2024-08-26 23:25:24
 Copyright (c) 2024 by KVCache.AI, All Rights Reserved.
 """
-import sys, os
+import sys, os, warnings
 from typing import Any
 import torch
 sys.path.append(os.path.join(os.path.dirname(__file__), "..", "ktransformers_ext", "build"))
@@ -44,6 +44,12 @@ class CPUInferKVCache:
         max_thread_num: int = 32,
         max_batch_size: int = 4,
         max_block_num: int = 512,
+        k_quant_type: str = "PER_TOKEN",
+        v_quant_type: str = "PER_CHANNEL",
+        sink_block_num: int = 0,
+        window_block_num: int = 0,
+        mla_latent_dim: int = 0,
+        rope_theta: float = 0.0,
     ):
 
         if anchor_type == "FIXED":
@@ -78,6 +84,12 @@ class CPUInferKVCache:
         elif retrieval_type == "SEPARATE":
             retrieval_type = cpuinfer_ext.kvcache.RetrievalType.KVHEAD
 
+        # Quantization axis of Q4_0/Q8_0 caches. PER_CHANNEL keys with
+        # PER_TOKEN values (KIVI) keep outlier key channels accurate at 4 bits.
+        quant_types = {"PER_TOKEN": 0, "PER_CHANNEL": 1}
+        if k_quant_type not in quant_types or v_quant_type not in quant_types:
+            raise ValueError(f"Unknown quant type: {k_quant_type}, {v_quant_type}")
+
         self.config = cpuinfer_ext.kvcache.KVCacheConfig(
             layer_num,
             kv_head_num,
@@ -94,6 +106,12 @@ class CPUInferKVCache:
             max_block_num,
             max_batch_size,
             max_thread_num,
+            quant_types[k_quant_type],
+            quant_types[v_quant_type],
+            sink_block_num,
+            window_block_num,
+            mla_latent_dim,
+            rope_theta,
         )
         self.kvcache = cpuinfer_ext.kvcache.KVCache(self.config)
 
@@ -132,6 +150,50 @@ class CPUInferKVCache:
             tensor_file_path,
         )
 
+    # Like dump_kvcache, but the returned task only captures block_table; the
+    # file is written in the background while the cache keeps being used.
+    # io_priority is the best-effort I/O priority, 0 (highest) to 7 (lowest).
+    def snapshot_kvcache(
+        self,
+        block_table: torch.Tensor,
+        cache_total_len: int,
+        tensor_file_path: str,
+        io_priority: int = 7,
+    ):
+        assert (
+            block_table.dim() == 1
+            and block_table.dtype == torch.int
+            and block_table.is_contiguous()
+            and block_table.device == torch.device("cpu")
+        ), "block_table dim: {}, size: {}, dtype: {}, contiguous: {}, device: {}".format(
+            block_table.dim(),
+            block_table.size(),
+            block_table.dtype,
+            block_table.is_contiguous(),
+            block_table.device,
+        )
+
+        assert (
+            cache_total_len > 0
+            and cache_total_len <= self.config.block_len * block_table.size(0)
+        ), "cache_total_len: {}".format(cache_total_len)
+        assert 0 <= io_priority <= 7, "io_priority: {}".format(io_priority)
+
+        if not os.path.exists(os.path.dirname(tensor_file_path)):
+            os.makedirs(os.path.dirname(tensor_file_path))
+
+        return self.kvcache.snapshot_kvcache(
+            block_table.data_ptr(),
+            cache_total_len,
+            tensor_file_path,
+            io_priority,
+        )
+
+    # Blocks until the last snapshot_kvcache is on disk; raises RuntimeError
+    # if it failed, in which case the previous file is left in place.
+    def wait_snapshot(self):
+        self.kvcache.wait_snapshot()
+
     def update_cache_total_len(self, cache_total_len: int):
         assert cache_total_len > 0, "cache_total_len: {}".format(cache_total_len)
         self.kvcache.update_cache_total_len(cache_total_len)
@@ -581,6 +643,47 @@ class CPUInferKVCache:
             past_len.data_ptr(),
         )
 
+    def gather_kvcache_fp16(
+        self,
+        k_out: torch.Tensor,
+        v_out: torch.Tensor,
+        layer_begin: int,
+        layer_end: int,
+        block_table: torch.Tensor,
+        cache_seqlens: torch.Tensor,
+    ):
+        """Fills k_out/v_out [layer_end - layer_begin, batch_size,
+        max_block_num * block_len, kv_head_num, head_dim] for several layers
+        in one parallel pass. Allocate them with pin_memory=True to copy them
+        to the GPU with non_blocking=True afterwards."""
+        return self.kvcache.gather_kvcache_fp16(
+            k_out.data_ptr(),
+            v_out.data_ptr(),
+            layer_begin,
+            layer_end,
+            block_table.data_ptr(),
+            block_table.size(0),
+            block_table.size(1),
+            cache_seqlens.data_ptr(),
+        )
+
+    def block_view(
+        self, layer_id: int, head_id: int, block_idx: int, is_k: bool = True
+    ) -> torch.Tensor:
+        """Zero-copy [block_len, head_dim] fp16 view of one K or V block
+        (V is stored transposed, so its view is strided). Only valid for
+        kv_type FP16; out-of-range indices raise IndexError.
+
+        The tensor is read-only by contract: torch has no read-only tensors,
+        but writing through it bypasses the copy-on-write of a running
+        snapshot and leaves the anchors stale. It keeps the cache alive and
+        follows later writes to the block (evict, truncate, load)."""
+        view = self.kvcache.block_view(layer_id, head_id, block_idx, is_k)
+        with warnings.catch_warnings():
+            # the binding returns a non-writeable array on purpose
+            warnings.simplefilter("ignore", UserWarning)
+            return torch.from_numpy(view)
+
     def get_and_update_kvcache_fp16(
         self,
         k_cache_cpu: torch.Tensor,
@@ -701,6 +804,92 @@ class CPUInferKVCache:
             local,
         )
 
+    def attn_with_kvcache_varlen(
+        self,
+        q_in: torch.Tensor,
+        k_in: torch.Tensor,
+        v_in: torch.Tensor,
+        output: torch.Tensor,
+        attn_lse: torch.Tensor,
+        layer_idx: int,
+        block_table: torch.Tensor,
+        cache_seqlens: torch.Tensor,
+        cu_seqlens_q: torch.Tensor,
+        tree_mask: torch.Tensor | None = None,
+    ):
+        """Ragged-batch attn_with_kvcache.
+
+        q_in/k_in/v_in/output are packed [total_q, heads, head_dim]; request b
+        owns tokens cu_seqlens_q[b]:cu_seqlens_q[b + 1] (int32, batch_size + 1
+        entries) and may mix decode (1 token) with prefill chunks.
+        tree_mask (uint8, the flattened [q_len, q_len] masks of all requests)
+        replaces the causal mask among the new tokens, e.g. for draft trees.
+        """
+        batch_size = block_table.size(0)
+        max_block_num = block_table.size(1)
+        assert cu_seqlens_q.size(0) == batch_size + 1
+
+        return self.kvcache.attn_with_kvcache_varlen(
+            q_in.data_ptr(),
+            k_in.data_ptr(),
+            v_in.data_ptr(),
+            output.data_ptr(),
+            attn_lse.data_ptr(),
+            layer_idx,
+            batch_size,
+            cu_seqlens_q.data_ptr(),
+            max_block_num,
+            block_table.data_ptr(),
+            cache_seqlens.data_ptr(),
+            0 if tree_mask is None else tree_mask.data_ptr(),
+        )
+
+    def truncate(
+        self,
+        block_table: torch.Tensor | None,
+        cache_seqlens: torch.Tensor | None,
+        batch_id: int,
+        new_len: int,
+    ):
+        """Drops the tokens of sequence batch_id past new_len, e.g. rejected
+        speculative tokens. Without a block_table the single local-chat
+        sequence (cache_total_len) is truncated."""
+        if block_table is None:
+            return self.kvcache.truncate(0, 0, batch_id, 0, new_len)
+        return self.kvcache.truncate(
+            block_table.data_ptr(),
+            cache_seqlens.data_ptr(),
+            batch_id,
+            block_table.size(1),
+            new_len,
+        )
+
+    def evict(
+        self,
+        block_table: torch.Tensor | None,
+        cache_seqlens: torch.Tensor | None,
+        batch_id: int,
+        budget: int,
+        recent_len: int,
+        merge: bool = False,
+    ):
+        """Keeps budget tokens of sequence batch_id: the recent_len newest
+        plus the heaviest older tokens by accumulated importance (H2O).
+        With merge, evicted values are folded into the kept ones."""
+        if block_table is None:
+            return self.kvcache.evict(
+                0, 0, batch_id, 0, budget, recent_len, merge
+            )
+        return self.kvcache.evict(
+            block_table.data_ptr(),
+            cache_seqlens.data_ptr(),
+            batch_id,
+            block_table.size(1),
+            budget,
+            recent_len,
+            merge,
+        )
+
     def get_all_kvcache_one_layer(
         self, k_in: torch.Tensor, v_in: torch.Tensor, layer_id: int
     ):
@@ -728,24 +917,91 @@ class CPUInferKVCache:
 class CPUInfer:
     cpuinfer = None
     cur_backend_thread_num = 0
-    
-    def __init__(self, thread_num):
-        if thread_num > CPUInfer.cur_backend_thread_num:
-            CPUInfer.cur_backend_thread_num = thread_num
-            del CPUInfer.cpuinfer
-            CPUInfer.cpuinfer = cpuinfer_ext.CPUInfer(thread_num)
+    # stream name -> stream id, "default" is stream 0
+    stream_ids = {"default": 0}
+    # stream name -> threads, for every stream but "default"
+    stream_threads = {}
+    # events handed out by create_event so far
+    event_num = 0
+
+    # streams maps a stream name to the number of threads it owns; the
+    # default stream keeps the rest of thread_num. Tasks of different streams
+    # run concurrently, e.g. attention on one stream and MoE on another.
+    #
+    # All CPUInfer objects share one backend. A request for more threads,
+    # a new stream or a larger one rebuilds it with the union of all
+    # requests: existing streams keep their ids, and events keep their ids
+    # too. The old backend is drained with sync() first, so no queued task
+    # is dropped, and every event is set when the new backend takes over.
+    def __init__(self, thread_num, streams: dict = None):
+        streams = streams or {}
+        grown = {
+            name: n
+            for name, n in streams.items()
+            if n > CPUInfer.stream_threads.get(name, 0)
+        }
+        if thread_num <= CPUInfer.cur_backend_thread_num and not grown:
+            return
+        thread_num = max(thread_num, CPUInfer.cur_backend_thread_num)
+        stream_threads = {**CPUInfer.stream_threads, **grown}
+        if thread_num - sum(stream_threads.values()) < 2:
+            raise ValueError(
+                f"streams {stream_threads} leave fewer than 2 of "
+                f"{thread_num} threads for the default stream"
+            )
+        if CPUInfer.cpuinfer is not None:
+            CPUInfer.cpuinfer.sync(-1)
+        cpuinfer = cpuinfer_ext.CPUInfer(thread_num, list(stream_threads.values()))
+        for _ in range(CPUInfer.event_num):
+            cpuinfer.create_event()
+        del CPUInfer.cpuinfer
+        CPUInfer.cpuinfer = cpuinfer
+        CPUInfer.cur_backend_thread_num = thread_num
+        CPUInfer.stream_threads = stream_threads
+        CPUInfer.stream_ids = {"default": 0}
+        for i, name in enumerate(stream_threads):
+            CPUInfer.stream_ids[name] = i + 1
+
+    # Higher priority tasks run first and preempt running lower priority ones
+    # between their chunks, e.g. priority=1 for decode over prefill.
+    def submit(self, task, stream: str = "default", priority: int = 0):
+        CPUInfer.cpuinfer.submit(task, CPUInfer.stream_ids[stream], priority)
+
+    def submit_with_cuda_stream(
+        self, current_cuda_stream, task, stream: str = "default", priority: int = 0
+    ):
+        CPUInfer.cpuinfer.submit_with_cuda_stream(
+            current_cuda_stream, task, CPUInfer.stream_ids[stream], priority
+        )
+
+    # stream None waits for all streams
+    def sync(self, stream: str = None):
+        CPUInfer.cpuinfer.sync(
+            -1 if stream is None else CPUInfer.stream_ids[stream]
+        )
+
+    def sync_with_cuda_stream(self, current_cuda_stream, stream: str = None):
+        CPUInfer.cpuinfer.sync_with_cuda_stream(
+            current_cuda_stream,
+            -1 if stream is None else CPUInfer.stream_ids[stream],
+        )
 
-    def submit(self, task):
-        CPUInfer.cpuinfer.submit(task)
+    def create_event(self) -> int:
+        CPUInfer.event_num += 1
+        return CPUInfer.cpuinfer.create_event()
 
-    def submit_with_cuda_stream(self, current_cuda_stream, task):
-        CPUInfer.cpuinfer.submit_with_cuda_stream(current_cuda_stream, task)
+    # event is set once the tasks submitted to stream so far are done
+    def record_event(self, event: int, stream: str = "default", priority: int = 0):
+        CPUInfer.cpuinfer.record_event(event, CPUInfer.stream_ids[stream], priority)
 
-    def sync(self):
-        CPUInfer.cpuinfer.sync()
+    def query_event(self, event: int) -> bool:
+        return CPUInfer.cpuinfer.query_event(event)
 
-    def sync_with_cuda_stream(self, current_cuda_stream):
-        CPUInfer.cpuinfer.sync_with_cuda_stream(current_cuda_stream)
+    # tasks submitted to stream afterwards wait for the last record of event;
+    # raises ValueError if that record is on the same stream at a lower
+    # priority, since the wait would run first and never return
+    def wait_event(self, event: int, stream: str = "default", priority: int = 0):
+        CPUInfer.cpuinfer.wait_event(event, CPUInfer.stream_ids[stream], priority)
 
 
         
@@ -51,6 +51,8 @@ class DynamicScaledDotProductAttention:
         preselect_block_count: int = 96,
         prefill_chunk_size: int = 20480,
         use_attn_sparsity: bool = False,
+        k_quant_type: str = "PER_TOKEN",
+        v_quant_type: str = "PER_CHANNEL",
     ):
         # assert anchor_num == 1
         # assert anchor_type == "DYNAMIC"
@@ -67,8 +69,11 @@ class DynamicScaledDotProductAttention:
         if kv_type != "FP16" and kv_type != "FP32":
             assert block_size % 32 == 0
 
-        valid_block_selection_modes = ["SHARED", "SEPARATE"]  # individual
+        valid_block_selection_modes = ["SHARED", "SEPARATE", "INDIVIDUAL"]
         assert block_selection_mode in valid_block_selection_modes
+        if block_selection_mode == "INDIVIDUAL":
+            # attention sparsity is only measured for shared/separate selection
+            assert not use_attn_sparsity
 
         self.max_seq_len = max_seq_len
         self.block_num = max_seq_len // block_size
@@ -203,6 +208,8 @@ class DynamicScaledDotProductAttention:
             max_batch_size=1,
             max_block_num=self.block_num,
             max_thread_num=self.threads_num,
+            k_quant_type=k_quant_type,
+            v_quant_type=v_quant_type,
         )
 
         print(
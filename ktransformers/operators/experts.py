@@ -24,9 +24,9 @@ sys.path.append(os.path.join(os.path.dirname(__file__), "..", "ktransformers_ext
 sys.path.append(os.path.join(os.path.dirname(__file__), "..", "ktransformers_ext", "build", "Release"))
 sys.path.append(os.path.join(os.path.dirname(__file__), "..", "ktransformers_ext", "build", "Debug"))
 import cpuinfer_ext
-from cpuinfer_ext.moe import MOEConfig, MOE
+from cpuinfer_ext.moe import MOEConfig, MOE, ExpertStoreConfig, ExpertStore
 import ctypes
-from ktransformers.util.custom_gguf import GGUFLoader
+from ktransformers.util.custom_gguf import GGUFLoader, GGML_TYPES, TORCH_TO_GGML_TYPE
 from ktransformers.util.utils import InferenceState
 from ktransformers.server.config.config import Config
 from transformers.activations import ACT2FN
@@ -118,9 +118,11 @@ class KExpertsCPU(KExpertsBase):
     weights_cpu:Tensor = None
     output_cpu:Tensor = None
     output_gpu_map:dict = {} # Manage output tensor buffer on different gpu
+    expert_stores:dict = {} # (GGUF file, expert sizes) -> (ExpertStore, {key: store_layer}), kept alive for the MOEs using them
     #stream_map:dict = {} # Manage cuda stream on different gpu
     #gguf_loader:GGUFLoader = None
     CPU_INFER = None
+    hidden_type = GGML_TYPES["BF16"] # ggml_type of the MOE input and output, TODO: get from model.dtype
     def __init__(
         self,
         key: str,
@@ -130,6 +132,15 @@ class KExpertsCPU(KExpertsBase):
         orig_module: nn.Module = None,
         device: str = "cpu",
         out_device: str = "cuda", # this device mean which device the output should on. TODO: support cpu.
+        repack: bool = False, # repack Q8_0 experts into row panels for the decode GEMV
+        repack_cache_dir: str | None = None, # persist repacked experts here, reused on later loads
+        expert_parallel: bool = False, # USE_NUMA builds: keep each expert whole on one NUMA node
+        routing_mass_threshold: float = 1.0, # decode: drop trailing experts once this share of routing weight is covered
+        routing_weight_floor: float = 0.0, # decode: drop experts with a smaller routing weight
+        shared_weights_dir: str | None = None, # USE_NUMA builds: share the per-node expert copies with other processes through files here (e.g. on hugetlbfs)
+        numa_layout_cache_dir: str | None = None, # USE_NUMA builds: persist the per-node expert layout here, mapped on later loads
+        expert_store_cache_experts: int | None = None, # read experts from the GGUF on demand, holding this many per store in DRAM
+        expert_store_io_threads: int = 4,
         **kwargs
     ):
         super().__init__(key, gguf_loader, config, orig_module, device, **kwargs)
@@ -141,6 +152,15 @@ class KExpertsCPU(KExpertsBase):
         assert device.lower() == "cpu", "KExpertsCPU can only be loaded on CPU"
         self.n_routed_experts = n_routed_experts
         self.out_device = out_device
+        self.repack = repack
+        self.repack_cache_dir = repack_cache_dir
+        self.expert_parallel = expert_parallel
+        self.routing_mass_threshold = routing_mass_threshold
+        self.routing_weight_floor = routing_weight_floor
+        self.shared_weights_dir = shared_weights_dir
+        self.numa_layout_cache_dir = numa_layout_cache_dir
+        self.expert_store_cache_experts = expert_store_cache_experts
+        self.expert_store_io_threads = expert_store_io_threads
 
     def load(self, w: dict | nn.Parameter | tuple | None = None, device:str|None = None, warmup:bool = False):
         if device:
@@ -163,6 +183,10 @@ class KExpertsCPU(KExpertsBase):
         )
         #print(self.gate_type, self.up_type, self.down_type)
         n_routed_experts = self.n_routed_experts
+        repack_path = ""
+        if self.repack and self.repack_cache_dir is not None:
+            os.makedirs(self.repack_cache_dir, exist_ok=True)
+            repack_path = os.path.join(self.repack_cache_dir, self.key)
         # n_routed_experts = len(self.orig_module)
         moe_config = MOEConfig(
             n_routed_experts,
@@ -178,8 +202,21 @@ class KExpertsCPU(KExpertsBase):
             self.gate_type,
             self.up_type,
             self.down_type,
-            30, # TODO: get from model.dtype
+            self.hidden_type,
+            self.repack,
+            repack_path,
+            self.expert_parallel,
         )
+        moe_config.routing_mass_threshold = self.routing_mass_threshold
+        moe_config.routing_weight_floor = self.routing_weight_floor
+        if self.shared_weights_dir is not None:
+            os.makedirs(self.shared_weights_dir, exist_ok=True)
+            moe_config.shared_path = os.path.join(self.shared_weights_dir, self.key)
+        if self.numa_layout_cache_dir is not None:
+            os.makedirs(self.numa_layout_cache_dir, exist_ok=True)
+            moe_config.layout_path = os.path.join(self.numa_layout_cache_dir, self.key + ".numa")
+        if self.expert_store_cache_experts is not None:
+            moe_config.store, moe_config.store_layer = self.get_expert_store()
         # print(n_routed_experts, hidden_size, moe_intermediate_size)
         num_experts_per_tok = self.config.num_experts_per_tok
         self.moe = MOE(moe_config)
@@ -195,6 +232,39 @@ class KExpertsCPU(KExpertsBase):
             KExpertsCPU.weights_cpu = torch.zeros((num_experts_per_tok), device="cpu", dtype=torch.float32, pin_memory=True)
             KExpertsCPU.output_cpu = torch.zeros((self.config.hidden_size), device="cpu", pin_memory=True, dtype=torch.bfloat16)
             
+    # One ExpertStore serves every MoE layer whose experts sit in the same
+    # GGUF file with the same per-expert sizes, numbered in file order so
+    # that layer l + 1 is prefetched while layer l runs.
+    def get_expert_store(self):
+        loader = self.gguf_loader
+        suffixes = [".ffn_gate_exps.weight", ".ffn_up_exps.weight", ".ffn_down_exps.weight"]
+        if loader.safetensor_loader is not None or self.key + suffixes[0] not in loader.tensor_info:
+            raise ValueError(f"{self.key}: expert_store_cache_experts needs the experts in a GGUF file")
+        def signature(key):
+            sizes = tuple(loader.get_tensor_nbytes(key + suffix) // self.n_routed_experts for suffix in suffixes)
+            return (loader.tensor_file_map[key + suffixes[0]], sizes)
+        store_key = signature(self.key)
+        if store_key not in KExpertsCPU.expert_stores:
+            keys = [name[:-len(suffixes[0])] for name in loader.tensor_info if name.endswith(suffixes[0])]
+            keys = [key for key in keys if all(key + suffix in loader.tensor_info for suffix in suffixes) and signature(key) == store_key]
+            keys.sort(key=lambda key: loader.tensor_info[key + suffixes[0]]["offset"])
+            offsets = [[loader.tensor_info[key + suffix]["offset"] for key in keys] for suffix in suffixes]
+            store = ExpertStore(ExpertStoreConfig(
+                store_key[0], len(keys), self.n_routed_experts, offsets[0], offsets[1], offsets[2],
+                store_key[1][0], store_key[1][1], store_key[1][2],
+                self.expert_store_cache_experts, self.expert_store_io_threads,
+            ))
+            KExpertsCPU.expert_stores[store_key] = (store, {key: i for i, key in enumerate(keys)})
+        store, layers = KExpertsCPU.expert_stores[store_key]
+        return store, layers[self.key]
+
+    # expert_parallel: move experts between NUMA nodes to balance the load
+    # routed to them since the last call. It migrates weights in place, so
+    # no forward may be in flight.
+    def rebalance_experts(self):
+        self.cpu_infer.sync()
+        self.moe.rebalance_experts()
+
     def submit_for_one_decode(self, input_tensor, expert_ids, weights):
         KExpertsCPU.input_tensor_cpu.copy_(input_tensor, non_blocking=True)
         KExpertsCPU.expert_ids_cpu.copy_(expert_ids, non_blocking=True)
@@ -529,10 +599,135 @@ class KExpertsTorch(KExpertsBase):
 
         return final_hidden_states.to(dtype=org_dtype, device=org_device)
 
+class KExpertsHybrid(KExpertsBase):
+    """
+    Split routed experts between two executors: a small set of hot experts is
+    kept dequantized and resident on `hot_device`, the rest stay quantized in
+    host memory and run through the CPU MOE kernel. Hot expert ids are masked
+    to -1 before submission, so the CPU kernel skips them while the device
+    computes them concurrently; the two partial outputs are summed.
+    """
+    def __init__(
+        self,
+        key: str,
+        gguf_loader: GGUFLoader,
+        config: PretrainedConfig,
+        n_routed_experts: int,
+        orig_module: nn.Module = None,
+        device: str = "cpu",
+        out_device: str = "cuda",
+        hot_device: str = "cuda",
+        hot_experts: list[int] | None = None,
+        hot_expert_num: int | None = None,
+        **kwargs
+    ):
+        super().__init__(key, gguf_loader, config, orig_module, device, **kwargs)
+        self.cpu_experts = KExpertsCPU(key, gguf_loader, config, n_routed_experts, orig_module, device="cpu", out_device=out_device, **kwargs)
+        self.n_routed_experts = n_routed_experts
+        self.out_device = out_device
+        self.hot_device = hot_device
+        if hot_expert_num is None:
+            hot_expert_num = len(hot_experts) if hot_experts is not None else max(1, n_routed_experts // 10)
+        assert 0 <= hot_expert_num <= n_routed_experts, f"hot_expert_num {hot_expert_num} out of range"
+        self.hot_expert_num = hot_expert_num
+        self.initial_hot_experts = list(hot_experts) if hot_experts is not None else list(range(hot_expert_num))
+        assert len(self.initial_hot_experts) == hot_expert_num, "hot_experts and hot_expert_num mismatch"
+        self.act_fn = ACT2FN[config.hidden_act]
+        self.elements_per_tensor = config.moe_intermediate_size * config.hidden_size
+        self.dtype = torch.get_default_dtype()
+        # per-expert routing counts since the last rebalance
+        self.expert_counts = torch.zeros((n_routed_experts), dtype=torch.long)
+        # expert id -> slot in the resident hot weights, -1 for cold experts
+        self.hot_slot = torch.full((n_routed_experts,), -1, dtype=torch.long)
+        self.hot_experts = []
+        self.gate = None
+        self.up = None
+        self.down = None
+
+    def load(self, w: dict | nn.Parameter | tuple | None = None, device: str | None = None, warmup: bool = False):
+        self.cpu_experts.load(w, warmup=warmup)
+        self.cpu_infer = self.cpu_experts.cpu_infer
+        self.moe = self.cpu_experts.moe
+        # the CPU half reads and writes the MOE's hidden type
+        self.cpu_dtype = {t: dtype for dtype, t in TORCH_TO_GGML_TYPE.items()}[self.cpu_experts.hidden_type]
+        self.gate = torch.empty((self.hot_expert_num, self.config.moe_intermediate_size, self.config.hidden_size), dtype=self.dtype, device=self.hot_device)
+        self.up = torch.empty((self.hot_expert_num, self.config.moe_intermediate_size, self.config.hidden_size), dtype=self.dtype, device=self.hot_device)
+        self.down = torch.empty((self.hot_expert_num, self.config.hidden_size, self.config.moe_intermediate_size), dtype=self.dtype, device=self.hot_device)
+        self.hot_slot.fill_(-1)
+        self.hot_experts = [-1] * self.hot_expert_num
+        self.set_hot_experts(self.initial_hot_experts)
+
+    def load_hot_expert(self, slot: int, expert_id: int):
+        for name, data, dst in (("gate", self.cpu_experts.gate, self.gate), ("up", self.cpu_experts.up, self.up), ("down", self.cpu_experts.down, self.down)):
+            values = self.gguf_loader.load_expert_tensor(f"{self.key}.ffn_{name}_exps.weight", data, expert_id, self.elements_per_tensor, device=self.hot_device)
+            dst[slot].copy_(values.to(dtype=self.dtype))
+        if self.hot_experts[slot] >= 0:
+            self.hot_slot[self.hot_experts[slot]] = -1
+        self.hot_experts[slot] = expert_id
+        self.hot_slot[expert_id] = slot
+
+    def set_hot_experts(self, expert_ids: list[int]):
+        assert len(expert_ids) == self.hot_expert_num, "hot expert set size is fixed at load time"
+        wanted = set(expert_ids)
+        # keep resident experts that stay hot, refill only the evicted slots
+        free_slots = [slot for slot, e in enumerate(self.hot_experts) if e not in wanted]
+        for expert_id in expert_ids:
+            if self.hot_slot[expert_id] < 0:
+                self.load_hot_expert(free_slots.pop(), expert_id)
+
+    def rebalance(self):
+        """Promote the most frequently routed experts since the last call to the hot set."""
+        if self.hot_expert_num == 0 or self.expert_counts.sum() == 0:
+            return
+        top = torch.topk(self.expert_counts, self.hot_expert_num).indices.tolist()
+        self.set_hot_experts(top)
+        self.expert_counts.zero_()
+
+    def forward(self, input_tensor, expert_ids, weights):
+        org_shape = input_tensor.shape
+        input_tensor = input_tensor.view(-1, org_shape[-1])
+        expert_ids_cpu = expert_ids.view(input_tensor.size(0), -1).contiguous().cpu()
+        weights_cpu = weights.view(input_tensor.size(0), -1).contiguous().to(torch.float32).cpu()
+        self.expert_counts += torch.bincount(expert_ids_cpu.flatten(), minlength=self.n_routed_experts)
+        slots = self.hot_slot[expert_ids_cpu]
+        cold_ids = expert_ids_cpu.masked_fill(slots >= 0, -1)
+
+        # cold experts on CPU, submitted before the device work so both overlap
+        input_cpu = input_tensor.contiguous().to(dtype=self.cpu_dtype, device="cpu")
+        output_cpu = torch.empty_like(input_cpu)
+        qlen, k = cold_ids.shape
+        self.cpu_infer.submit(self.moe.forward(qlen, k, cold_ids.data_ptr(), weights_cpu.data_ptr(), input_cpu.data_ptr(), output_cpu.data_ptr()))
+
+        # hot experts on the resident copies
+        output = torch.zeros((qlen, org_shape[-1]), dtype=self.dtype, device=self.hot_device)
+        hot_slots = torch.unique(slots[slots >= 0]).tolist()
+        if hot_slots:
+            hidden_states = input_tensor.to(device=self.hot_device, dtype=self.dtype)
+            routing_weights = weights_cpu.to(device=self.hot_device, dtype=self.dtype)
+            slots_dev = slots.to(self.hot_device)
+            for slot in hot_slots:
+                top_x, idx = torch.where(slots_dev == slot)
+                current_state = hidden_states[top_x]
+                H = self.act_fn(current_state @ self.gate[slot].T) * (current_state @ self.up[slot].T)
+                output.index_add_(0, top_x, H @ self.down[slot].T * routing_weights[top_x, idx, None])
+
+        self.cpu_infer.sync()
+        output += output_cpu.to(device=self.hot_device, dtype=self.dtype)
+        return output.to(dtype=input_tensor.dtype, device=self.out_device).view(org_shape)
+
+    def unload(self):
+        self.cpu_experts.unload()
+        self.gate = None
+        self.up = None
+        self.down = None
+        self.hot_slot.fill_(-1)
+        self.hot_experts = []
+
 EXPERTS_MAP = {
     "KExpertsCPU": KExpertsCPU,
     "KExpertsTorch": KExpertsTorch,
     "KExpertsMarlin": KExpertsMarlin,
+    "KExpertsHybrid": KExpertsHybrid,
 }
 
 class KTransformersExperts(BaseInjectedModule, KExpertsBase):
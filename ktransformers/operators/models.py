@@ -1002,6 +1002,8 @@ class KLlamaModel(BaseInjectedModule):
             token_step=self.long_context_config["token_step"],
             prefill_chunk_size=self.long_context_config["chunk_size"],
             use_attn_sparsity=False,
+            k_quant_type=self.long_context_config.get("k_quant_type", "PER_TOKEN"),
+            v_quant_type=self.long_context_config.get("v_quant_type", "PER_CHANNEL"),
         )
 
     def get_input_embeddings(self):
@@ -176,6 +176,8 @@ class Config(metaclass=Singleton):
         self.second_select_num = self.long_context_config.get("second_select_num", 32)
         self.anchor_type = self.long_context_config.get("anchor_type", "DYNAMIC")
         self.kv_type = self.long_context_config.get("kv_type", "FP16")
+        self.k_quant_type = self.long_context_config.get("k_quant_type", "PER_TOKEN")
+        self.v_quant_type = self.long_context_config.get("v_quant_type", "PER_CHANNEL")
         self.dense_layer_num = self.long_context_config.get("dense_layer_num", 2)
         self.anchor_num = self.long_context_config.get("anchor_num", 1)
         self.preselect_block = self.long_context_config.get("preselect_block", True)
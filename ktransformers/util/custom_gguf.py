@@ -172,6 +172,11 @@ class GGUFLoader:
     tensor_file_map: dict # {tensor_name: tensor_file_path}
     gguf_file_meta: dict
     safetensor_loader: SafeTensorLoader
+    # native reader settings, see read_tensor_data
+    reader_thread_num: int = 8
+    reader_chunk_size: int = 8 << 20
+    reader_direct_io: bool = False
+    readahead_bytes: int = 1 << 30
     def __init__(self, gguf_path: str):
         # Check dir exist
         if not os.path.exists(gguf_path):
@@ -187,6 +192,10 @@ class GGUFLoader:
         self.file_data_map = {}
         self.gguf_file_meta = {}
         self.tensor_device_map = {}
+        self.readers = {} # {file_name: cpuinfer_ext.gguf.Reader or None}
+        self.readahead_order = {} # {file_name: ([tensor_name], {tensor_name: index})}
+        self.prefetched = {} # {tensor_name: (ticket, buffer)}
+        self.prefetched_bytes = 0
 
         # I know this is ugly, but I don't want to change the original code too much
         # TODO: merge gguf load and other loads.
@@ -300,6 +309,69 @@ class GGUFLoader:
         itemsize = int(np.empty([], dtype = item_type).itemsize)
         return mmap_data[offset : offset + itemsize * item_count]
     
+    def get_tensor_nbytes(self, name):
+        t = self.tensor_info[name]
+        return int(np.empty([], dtype = t["item_type"]).itemsize) * t["item_count"]
+
+    def get_reader(self, file_name):
+        if file_name not in self.readers:
+            try:
+                from ktransformers.operators.cpuinfer import cpuinfer_ext
+                config = cpuinfer_ext.gguf.ReaderConfig(file_name, self.reader_thread_num, self.reader_chunk_size, self.reader_direct_io)
+                self.readers[file_name] = cpuinfer_ext.gguf.Reader(config)
+            except (ImportError, AttributeError, RuntimeError):
+                # no extension, or the file cannot be opened natively: use the memmap
+                self.readers[file_name] = None
+        return self.readers[file_name]
+
+    def get_readahead_order(self, file_name):
+        # Tensors that are dequantized at load time, in file order. Expert
+        # tensors are excluded: they stay mmapped and are consumed in place.
+        if file_name not in self.readahead_order:
+            names = [name for name, f in self.tensor_file_map.items() if f == file_name and "_exps" not in name]
+            names.sort(key=lambda name: self.tensor_info[name]["offset"])
+            self.readahead_order[file_name] = (names, {name: i for i, name in enumerate(names)})
+        return self.readahead_order[file_name]
+
+    def prefetch(self, name):
+        if name in self.prefetched:
+            return
+        reader = self.get_reader(self.tensor_file_map[name])
+        nbytes = self.get_tensor_nbytes(name)
+        # pinned, so uploading the raw bytes to the GPU needs no staging copy
+        buffer = torch.empty(nbytes, dtype=torch.uint8, pin_memory=torch.cuda.is_available())
+        ticket = reader.submit(self.tensor_info[name]["offset"], nbytes, buffer.data_ptr())
+        self.prefetched[name] = (ticket, buffer)
+        self.prefetched_bytes += nbytes
+
+    def take_prefetched(self, name):
+        ticket, buffer = self.prefetched.pop(name)
+        self.get_reader(self.tensor_file_map[name]).wait(ticket)
+        self.prefetched_bytes -= buffer.numel()
+        return buffer
+
+    def read_tensor_data(self, name):
+        """
+        Raw bytes of a tensor. With the native reader available, the tensor and
+        the following ones in file order (up to readahead_bytes) are read with
+        large parallel preads, so I/O for the next tensors overlaps with
+        dequantizing this one; otherwise falls back to the numpy memmap.
+        """
+        file_name = self.tensor_file_map[name]
+        if "_exps" in name or self.get_reader(file_name) is None:
+            return self.get_mmap_tensor(name)
+        names, index = self.get_readahead_order(file_name)
+        pos = index[name]
+        # tensors skipped over by the load order would otherwise pin the window
+        for stale in [n for n in self.prefetched if self.tensor_file_map[n] == file_name and index[n] < pos]:
+            self.take_prefetched(stale)
+        self.prefetch(name)
+        for next_name in names[pos + 1:]:
+            if self.prefetched_bytes >= self.readahead_bytes:
+                break
+            self.prefetch(next_name)
+        return self.take_prefetched(name).numpy()
+
     def get_undequanted_tensor_and_ggml_type(self, name):
         t = self.tensor_info[name]
         data = self.get_mmap_tensor(name)
@@ -325,14 +397,18 @@ class GGUFLoader:
         offset = expert_id * block_size * blocks_per_experts
         data = data[offset: offset + block_size * blocks_per_experts]
         
-        if "cuda" in device.lower():
-            values = GGML_DEQUANTIZE_GPU[ggml_name](data, device, target_dtype)
+        native_values = torch.empty(elements_per_expert, dtype=target_dtype) if device.lower() == "cpu" else None
+        if native_values is not None and dequantize_cpu_native(data, ggml_type, native_values):
+            values = native_values
         else:
-            values = GGML_DEQUANTIZE[ggml_name](data)
-            values = torch.from_numpy(values.copy())
+            if "cuda" in device.lower():
+                values = GGML_DEQUANTIZE_GPU[ggml_name](data, device, target_dtype)
+            else:
+                values = GGML_DEQUANTIZE[ggml_name](data)
+                values = torch.from_numpy(values.copy())
 
-        if ggml_name == "BF16":
-            values = values.view(torch.bfloat16)
+            if ggml_name == "BF16":
+                values = values.view(torch.bfloat16)
         values = values.view(shape[-2::-1])
 
         return values
@@ -352,7 +428,7 @@ class GGUFLoader:
 
         ggml_name = GGML_NAMES[ggml_type]
 
-        data = self.get_mmap_tensor(name)
+        data = self.read_tensor_data(name)
 
         block_size = GGML_BLOCK_SIZES[ggml_name]
         elements_per_block = GGML_ELEMENTS_PER_BLOCK[ggml_name]
@@ -360,7 +436,10 @@ class GGUFLoader:
         num_blocks = num_elements // elements_per_block
         
         blocks_per_iter = 16384
-        if num_blocks > blocks_per_iter: # dequant large tensor
+        native_values = torch.empty(num_elements, dtype=target_dtype) if device.lower() == "cpu" else None
+        if native_values is not None and dequantize_cpu_native(data, ggml_type, native_values):
+            values = native_values
+        elif num_blocks > blocks_per_iter: # dequant large tensor
             values = torch.empty((num_blocks, elements_per_block), dtype=target_dtype, device=device)
             for i in range( (num_blocks + blocks_per_iter - 1) // blocks_per_iter):
                 blocks_begin = i * blocks_per_iter
@@ -381,9 +460,9 @@ class GGUFLoader:
             else:
                 values = GGML_DEQUANTIZE[ggml_name](data)
                 values = torch.from_numpy(values)
-                
-        if ggml_name == "BF16":
-            values = values.view(torch.bfloat16)
+
+            if ggml_name == "BF16":
+                values = values.view(torch.bfloat16)
             
 
         values = values.view(shape[::-1])
@@ -863,6 +942,49 @@ GGML_DEQUANTIZE_GPU = {
     "IQ4_XS": dequantize_iq4_xs_gpu,
 }
 
+TORCH_TO_GGML_TYPE = {
+    torch.float32: GGML_TYPES["F32"],
+    torch.float16: GGML_TYPES["F16"],
+    torch.bfloat16: GGML_TYPES["BF16"],
+}
+
+_cpu_dequant_cache = {}
+_cpu_dequant_infer = None # CPUInfer shared by every dequantize_cpu_native call
+
+def dequantize_cpu_native(data, ggml_type: int, output: torch.Tensor) -> bool:
+    # Dequantize `data` straight into `output` on the cpuinfer_ext thread pool.
+    # Returns False when the extension is unavailable or does not support the
+    # type, so callers can fall back to numpy. Raises ValueError when `data`
+    # holds fewer than output.numel() elements of ggml_type.
+    global _cpu_dequant_infer
+    if output.dtype not in TORCH_TO_GGML_TYPE or not output.is_contiguous():
+        return False
+    try:
+        from ktransformers.operators.cpuinfer import CPUInfer, cpuinfer_ext
+        from ktransformers.server.config.config import Config
+    except ImportError:
+        return False
+    key = (ggml_type, output.dtype)
+    if key not in _cpu_dequant_cache:
+        config = cpuinfer_ext.gguf.DequantConfig(ggml_type, TORCH_TO_GGML_TYPE[output.dtype], 16384)
+        try:
+            _cpu_dequant_cache[key] = cpuinfer_ext.gguf.Dequant(config)
+        except ValueError:
+            # type not handled natively, remember it and use numpy
+            _cpu_dequant_cache[key] = None
+    if _cpu_dequant_cache[key] is None:
+        return False
+    block_size, type_size = GGML_QUANT_SIZES[GGMLQuantizationType(ggml_type)]
+    if output.numel() % block_size != 0 or data.nbytes < output.numel() // block_size * type_size:
+        raise ValueError(
+            f"{data.nbytes} bytes of ggml_type {ggml_type} do not hold {output.numel()} elements"
+        )
+    if _cpu_dequant_infer is None:
+        _cpu_dequant_infer = CPUInfer(Config().cpu_infer)
+    _cpu_dequant_infer.submit(_cpu_dequant_cache[key].forward(output.numel(), data.ctypes.data, output.data_ptr()))
+    _cpu_dequant_infer.sync()
+    return True
+
 
 def translate_name_to_gguf_mixtral(name):
     
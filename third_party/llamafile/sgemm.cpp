@@ -25,19 +25,100 @@
 // #include <cpuid.h>
 // #include <libc/sysv/consts/hwcap.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 // #include <sys/auxv.h>
 #include <cassert>
 // #include "llamafile.h"
 
-static const struct GemmFuncs {
+static const char* const isa_names[LLAMAFILE_ISA_COUNT] = {
+    "unsupported", "avx", "fma", "avx2", "avxvnni", "avx512f", "avx512vnni", "arm80", "arm82",
+};
+
+#if defined(KTRANSFORMERS_CPU_DISPATCH) && (defined(__x86_64__) || defined(_M_X64))
+// Every x86 variant is compiled with its own -m flags (see CMakeLists.txt),
+// the host check decides which of them may run.
+//
+// avx and fma are never offered: tinyblas has no BF16, Q8_0 or K-quant
+// kernels below avx2 and returns NOT_SUPPORTED, which Linear, MLP and MOE
+// do not handle, so those levels would leave their outputs unwritten.
+static bool host_has(int isa) {
+    __builtin_cpu_init();
+    switch (isa) {
+        case LLAMAFILE_ISA_UNSUPPORTED:
+            return true;
+        case LLAMAFILE_ISA_AVX2:
+            return __builtin_cpu_supports("avx") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c") &&
+                   __builtin_cpu_supports("avx2");
+        case LLAMAFILE_ISA_AVXVNNI:
+            return host_has(LLAMAFILE_ISA_AVX2) && __builtin_cpu_supports("avxvnni");
+        case LLAMAFILE_ISA_AVX512F:
+            return host_has(LLAMAFILE_ISA_AVX2) && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+        case LLAMAFILE_ISA_AVX512VNNI:
+            return host_has(LLAMAFILE_ISA_AVX512F) && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq") &&
+                   __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bf16");
+        default:
+            return false;
+    }
+}
+#endif
+
+static struct GemmFuncs {
     bool (*sgemm)(long, long, long, const void*, long, const void*, long, void*, long, int, int, int, int, int, int, int);
     bool (*mixmul)(const struct ggml_compute_params*, const struct ggml_tensor*, const struct ggml_tensor*, const struct ggml_tensor*, struct ggml_tensor*);
     bool (*iqk_mixmul)(long, long, long, int, int, const void*, const void*, float*, long, long, const void*, int, int);
+    int isa;
+    // levels that are compiled into this binary and runnable on this host
+    bool available[LLAMAFILE_ISA_COUNT];
+
+    bool select(int level) {
+        if (level < 0 || level >= LLAMAFILE_ISA_COUNT || !available[level]) {
+            return false;
+        }
+#if defined(KTRANSFORMERS_CPU_DISPATCH) && (defined(__x86_64__) || defined(_M_X64))
+        iqk_mixmul = iqk_mul_mat_moe_unsupported;
+        switch (level) {
+            case LLAMAFILE_ISA_AVX512VNNI:
+                sgemm = llamafile_sgemm_amd_zen4;
+                mixmul = llamafile_mixmul_amd_zen4;
+                iqk_mixmul = iqk_mul_mat_moe_zen4;
+                break;
+            case LLAMAFILE_ISA_AVX512F:
+                sgemm = llamafile_sgemm_amd_avx512f;
+                mixmul = llamafile_mixmul_amd_avx512f;
+                iqk_mixmul = iqk_mul_mat_moe;
+                break;
+            case LLAMAFILE_ISA_AVXVNNI:
+                sgemm = llamafile_sgemm_amd_avxvnni;
+                mixmul = llamafile_mixmul_amd_avxvnni;
+                iqk_mixmul = iqk_mul_mat_moe;
+                break;
+            case LLAMAFILE_ISA_AVX2:
+                sgemm = llamafile_sgemm_amd_avx2;
+                mixmul = llamafile_mixmul_amd_avx2;
+                iqk_mixmul = iqk_mul_mat_moe;
+                break;
+            default:
+                sgemm = llamafile_sgemm_unsupported;
+                mixmul = llamafile_mixmul_unsupported;
+                break;
+        }
+#endif
+        isa = level;
+        return true;
+    }
     // typeof(llamafile_sgemm)* sgemm;
     // typeof(llamafile_mixmul)* mixmul;
     // typeof(llamafile_mixmul_iqk)* iqk_mixmul = iqk_mul_mat_moe_unsupported;
     GemmFuncs() {
-#if defined(__x86_64__) || defined(_M_X64)
+        iqk_mixmul = iqk_mul_mat_moe_unsupported;
+        memset(available, 0, sizeof(available));
+#if defined(KTRANSFORMERS_CPU_DISPATCH) && (defined(__x86_64__) || defined(_M_X64))
+        for (int level = 0; level < LLAMAFILE_ISA_COUNT; level++) {
+            available[level] = host_has(level);
+        }
+        select(llamafile_isa_best());
+#elif defined(__x86_64__) || defined(_M_X64)
         // if (X86_HAVE(AVX)) {
         //     if (X86_HAVE(FMA)) {
         //         if (X86_HAVE(AVX2)) {
@@ -99,22 +180,26 @@ static const struct GemmFuncs {
         sgemm = llamafile_sgemm_amd_zen4;
         mixmul = llamafile_mixmul_amd_zen4;
         iqk_mixmul = iqk_mul_mat_moe_zen4;
+        isa = LLAMAFILE_ISA_AVX512VNNI;
 #else
         // Intel Xeon Skylake+ (2015-)
         sgemm = llamafile_sgemm_amd_avx512f;
         mixmul = llamafile_mixmul_amd_avx512f;
         iqk_mixmul = iqk_mul_mat_moe;
+        isa = LLAMAFILE_ISA_AVX512F;
 #endif
 #elif defined(__AVXVNNI__)
         // Intel Alderlake (2021-)
         sgemm = llamafile_sgemm_amd_avxvnni;
         mixmul = llamafile_mixmul_amd_avxvnni;
         iqk_mixmul = iqk_mul_mat_moe;
+        isa = LLAMAFILE_ISA_AVXVNNI;
 #else
         // Intel Haswell/Broadwell/Skylake (2013-2020)
         // AMD Excavator (2015-2022)
         sgemm = llamafile_sgemm_amd_avx2;
         mixmul = llamafile_mixmul_amd_avx2;
+        isa = LLAMAFILE_ISA_AVX2;
 #if defined(__F16C__)
         iqk_mixmul = iqk_mul_mat_moe;
 #endif
@@ -123,6 +208,7 @@ static const struct GemmFuncs {
         // AMD Piledriver (2011-2014)
         sgemm = llamafile_sgemm_amd_fma;
         mixmul = llamafile_mixmul_amd_fma;
+        isa = LLAMAFILE_ISA_FMA;
 #if defined(__F16C__)
         iqk_mixmul = iqk_mul_mat_moe;
 #endif
@@ -132,13 +218,16 @@ static const struct GemmFuncs {
         // AMD Bulldozer (2011)
         sgemm = llamafile_sgemm_amd_avx;
         mixmul = llamafile_mixmul_amd_avx;
+        isa = LLAMAFILE_ISA_AVX;
 #endif
 #else
         // AMD K8/Barcelona (2003-2010)
         // Intel Core/Nehalem (2006-2009)
         sgemm = llamafile_sgemm_unsupported;
         mixmul = llamafile_mixmul_unsupported;
+        isa = LLAMAFILE_ISA_UNSUPPORTED;
 #endif
+        available[isa] = true;
 
 #elif defined(__aarch64__)
         long hwcap = getauxval(AT_HWCAP);
@@ -149,18 +238,74 @@ static const struct GemmFuncs {
             sgemm = llamafile_sgemm_arm82;
             mixmul = llamafile_mixmul_arm82;
             iqk_mixmul = iqk_mul_mat_moe_arm82;
+            isa = LLAMAFILE_ISA_ARM82;
         } else {
             // ARM64 baseline ISA
             sgemm = llamafile_sgemm_arm80;
             mixmul = llamafile_mixmul_arm80;
+            isa = LLAMAFILE_ISA_ARM80;
         }
+        available[isa] = true;
 #else
         sgemm = llamafile_sgemm_unsupported;
         mixmul = llamafile_mixmul_unsupported;
+        isa = LLAMAFILE_ISA_UNSUPPORTED;
+        available[isa] = true;
 #endif
     }
 } funcs;
 
+const char* llamafile_isa_name(int isa) {
+    return isa >= 0 && isa < LLAMAFILE_ISA_COUNT ? isa_names[isa] : "invalid";
+}
+
+bool llamafile_isa_available(int isa) {
+    return isa >= 0 && isa < LLAMAFILE_ISA_COUNT && funcs.available[isa];
+}
+
+int llamafile_isa_best() {
+    for (int isa = LLAMAFILE_ISA_COUNT - 1; isa > 0; isa--) {
+        if (funcs.available[isa]) {
+            return isa;
+        }
+    }
+    return LLAMAFILE_ISA_UNSUPPORTED;
+}
+
+int llamafile_isa_get() {
+    return funcs.isa;
+}
+
+bool llamafile_isa_set(int isa) {
+    return funcs.select(isa);
+}
+
+/**
+ * Picks the kernel level for this process: the best level the host supports,
+ * or the one named by KTRANSFORMERS_CPU_ISA (e.g. "avx2") when it is
+ * available. Logs the choice and returns it.
+ */
+int llamafile_isa_init() {
+    int isa = llamafile_isa_best();
+    const char* env = getenv("KTRANSFORMERS_CPU_ISA");
+    if (env != NULL && *env != '\0') {
+        int forced = -1;
+        for (int i = 0; i < LLAMAFILE_ISA_COUNT; i++) {
+            if (strcmp(env, isa_names[i]) == 0) {
+                forced = i;
+            }
+        }
+        if (llamafile_isa_available(forced)) {
+            isa = forced;
+        } else {
+            printf("[llamafile] KTRANSFORMERS_CPU_ISA=%s is not available on this host/build, ignored\n", env);
+        }
+    }
+    funcs.select(isa);
+    printf("[llamafile] using %s kernels\n", llamafile_isa_name(funcs.isa));
+    return funcs.isa;
+}
+
 /**
  * Performs optimized matrix multiplication on CPU.
  *
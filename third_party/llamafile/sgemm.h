@@ -27,6 +27,29 @@ bool iqk_mul_mat_moe_zen4(long, long, long, int, int, const void*, const void*,
 bool iqk_mul_mat_moe_arm82(long, long, long, int, int, const void*, const void*, float*, long, long, const void*, int, int);
 bool iqk_mul_mat_moe_unsupported(long, long, long, int, int, const void*, const void*, float*, long, long, const void*, int, int);
 
+// Kernel levels known to the registry in sgemm.cpp, ordered from least to most capable
+// within each architecture. Builds with KTRANSFORMERS_CPU_DISPATCH compile every x86
+// level; other builds only contain the level implied by the compile flags.
+enum llamafile_isa {
+    LLAMAFILE_ISA_UNSUPPORTED,
+    LLAMAFILE_ISA_AVX,
+    LLAMAFILE_ISA_FMA,
+    LLAMAFILE_ISA_AVX2,
+    LLAMAFILE_ISA_AVXVNNI,
+    LLAMAFILE_ISA_AVX512F,
+    LLAMAFILE_ISA_AVX512VNNI,
+    LLAMAFILE_ISA_ARM80,
+    LLAMAFILE_ISA_ARM82,
+    LLAMAFILE_ISA_COUNT,
+};
+
+const char* llamafile_isa_name(int);
+bool llamafile_isa_available(int);
+int llamafile_isa_best(void);
+int llamafile_isa_get(void);
+bool llamafile_isa_set(int);
+int llamafile_isa_init(void);
+
 bool llamafile_sgemm(long, long, long, const void*, long, const void*, long, void*, long, int, int, int, int, int, int, int);
 bool llamafile_mixmul(const struct ggml_compute_params*, const struct ggml_tensor*, const struct ggml_tensor*, const struct ggml_tensor*, struct ggml_tensor*);
 size_t llamafile_mixmul_needs(const struct ggml_tensor*, const struct ggml_tensor*, const struct ggml_tensor*);